@@ -0,0 +1,91 @@
+#include "batch.hpp"
+#include "defaultCommands.hpp"
+#include "input.hpp"
+#include "supervisor.hpp"
+#include "threads.hpp"
+#include <iostream>
+#include <print>
+#include <thread>
+
+static std::string escapeJson(std::string_view str) {
+    std::string escaped{};
+    escaped.reserve(str.size());
+    for (char c : str) {
+        switch (c) {
+            case '"':
+                escaped += "\\\"";
+                break;
+            case '\\':
+                escaped += "\\\\";
+                break;
+            case '\n':
+                escaped += "\\n";
+                break;
+            case '\t':
+                escaped += "\\t";
+                break;
+            default:
+                if ((unsigned char)c < 0x20) {
+                    escaped += std::format("\\u{:04x}", (int)c); // e.g. the escape codes `playlist find` uses
+                } else {
+                    escaped += c;
+                }
+                break;
+        }
+    }
+    return escaped;
+}
+
+// Returns whether every command on the line succeeded
+static bool runLine(std::string_view line, bool json) {
+    int errorsBefore{Threads::errorCount};
+    if (json) {
+        std::string output{executeCaptured(line)};
+        if (output.ends_with('\n')) {
+            output.pop_back();
+        }
+        std::println(R"({{"command":"{}","ok":{},"output":"{}"}})", escapeJson(line),
+                     Threads::errorCount == errorsBefore, escapeJson(output));
+    } else {
+        try {
+            executeCmds(parseString(line));
+        } catch (const std::exception& e) {
+            printError("Error: {}", e.what());
+        }
+    }
+    Threads::helpMode = false; // there's no prompt to return to, so don't get stuck in help mode
+    return Threads::errorCount == errorsBefore;
+}
+
+int runBatch(const std::vector<std::string>& commands, bool json) {
+    if (Threads::autoAnswer == Answer::Ask) {
+        // Any prompt would otherwise read the next command from stdin as its answer
+        Threads::autoAnswer = Answer::Default;
+    }
+    // So playlists carry on to the next song during `wait`
+    std::thread supervisor{supervisorThread};
+    std::size_t failures{0};
+    if (!commands.empty()) {
+        for (const auto& line : commands) {
+            failures += !runLine(line, json);
+            if (!Threads::running) {
+                break; // `exit` ends the batch early
+            }
+        }
+    } else {
+        std::string line{};
+        while (Threads::running && std::getline(std::cin, line)) {
+            if (line.ends_with('\r')) {
+                line.pop_back();
+            }
+            if (line.empty() || line.starts_with("#")) {
+                continue; // same as scripts
+            }
+            failures += !runLine(line, json);
+        }
+    }
+    Threads::running = false;
+    stopSupervisor();
+    supervisor.join();
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+#include <string>
+#include <vector>
+int runBatch(const std::vector<std::string>& commands, bool json);
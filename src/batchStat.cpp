@@ -0,0 +1,242 @@
+#include "batchStat.hpp"
+#include "threadPool.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <mutex>
+#include <optional>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+static constexpr unsigned int ringEntries{128}; // statx calls in flight at once
+static constexpr std::size_t threadCount{16};   // they spend their time waiting, not on the CPU
+static constexpr std::size_t pathsPerJob{256};
+
+static PathType classify(int result, const struct statx& info) {
+    if (result == -ENOENT || result == -ENOTDIR) {
+        return PathType::Missing;
+    }
+    if (result < 0) {
+        return PathType::Unknown;
+    }
+    switch (info.stx_mode & S_IFMT) {
+        case S_IFREG:
+            return PathType::File;
+        case S_IFDIR:
+            return PathType::Directory;
+        default:
+            return PathType::Other;
+    }
+}
+
+static PathType statOne(const fs::path& path) {
+    struct statx info{};
+    int result{statx(AT_FDCWD, path.c_str(), 0, STATX_TYPE, &info)};
+    return classify(result == 0 ? 0 : -errno, info);
+}
+
+// An io_uring set up by hand, since all it's used for is statx. Only one batch uses it at a time.
+class StatRing {
+public:
+    StatRing() = default;
+    StatRing(const StatRing&) = delete;
+    StatRing& operator=(const StatRing&) = delete;
+    ~StatRing();
+    bool setUp();
+    // false if the ring stopped working partway, in which case it mustn't be used again since statx calls
+    // still in flight could write to it at any time. The paths it didn't get to are left as they were.
+    bool check(const std::vector<fs::path>& paths, std::vector<PathType>& types);
+
+private:
+    bool supportsStatx() const;
+    unsigned int* sqField(std::uint32_t offset) const { return (unsigned int*)((char*)mSqMap + offset); }
+    unsigned int* cqField(std::uint32_t offset) const { return (unsigned int*)((char*)mCqMap + offset); }
+
+    int mFd{-1};
+    io_uring_params mParams{};
+    void* mSqMap{MAP_FAILED};
+    std::size_t mSqMapSize{0};
+    void* mCqMap{MAP_FAILED};
+    std::size_t mCqMapSize{0};
+    io_uring_sqe* mSqes{(io_uring_sqe*)MAP_FAILED};
+    std::size_t mSqesSize{0};
+    std::vector<struct statx> mResults{}; // each statx in flight has a slot to write to
+};
+
+StatRing::~StatRing() {
+    if (mSqes != MAP_FAILED) {
+        munmap(mSqes, mSqesSize);
+    }
+    if (mCqMap != MAP_FAILED && mCqMap != mSqMap) {
+        munmap(mCqMap, mCqMapSize);
+    }
+    if (mSqMap != MAP_FAILED) {
+        munmap(mSqMap, mSqMapSize);
+    }
+    if (mFd != -1) {
+        close(mFd);
+    }
+}
+
+bool StatRing::setUp() {
+    mFd = (int)syscall(__NR_io_uring_setup, ringEntries, &mParams);
+    if (mFd == -1) {
+        return false; // too old a kernel, or turned off with kernel.io_uring_disabled
+    }
+    mSqMapSize = mParams.sq_off.array + mParams.sq_entries * sizeof(unsigned int);
+    mCqMapSize = mParams.cq_off.cqes + mParams.cq_entries * sizeof(io_uring_cqe);
+    bool single{(mParams.features & IORING_FEAT_SINGLE_MMAP) != 0};
+    if (single) {
+        mSqMapSize = mCqMapSize = std::max(mSqMapSize, mCqMapSize);
+    }
+    mSqMap =
+        mmap(nullptr, mSqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_SQ_RING);
+    if (mSqMap == MAP_FAILED) {
+        return false;
+    }
+    mCqMap = single ? mSqMap
+                    : mmap(nullptr, mCqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFd,
+                           IORING_OFF_CQ_RING);
+    mSqesSize = mParams.sq_entries * sizeof(io_uring_sqe);
+    mSqes = (io_uring_sqe*)mmap(nullptr, mSqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFd,
+                                IORING_OFF_SQES);
+    return mCqMap != MAP_FAILED && mSqes != MAP_FAILED && supportsStatx();
+}
+
+// statx arrived in 5.6, a little after io_uring itself
+bool StatRing::supportsStatx() const {
+    constexpr unsigned int ops{IORING_OP_STATX + 1};
+    alignas(io_uring_probe) unsigned char buffer[sizeof(io_uring_probe) + ops * sizeof(io_uring_probe_op)]{};
+    auto* probe{(io_uring_probe*)buffer};
+    if (syscall(__NR_io_uring_register, mFd, IORING_REGISTER_PROBE, probe, ops) == -1) {
+        return false;
+    }
+    return probe->last_op >= IORING_OP_STATX && (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED);
+}
+
+bool StatRing::check(const std::vector<fs::path>& paths, std::vector<PathType>& types) {
+    std::atomic_ref sqTail{*sqField(mParams.sq_off.tail)};
+    std::atomic_ref cqHead{*cqField(mParams.cq_off.head)};
+    std::atomic_ref cqTail{*cqField(mParams.cq_off.tail)};
+    unsigned int sqMask{*sqField(mParams.sq_off.ring_mask)};
+    unsigned int cqMask{*cqField(mParams.cq_off.ring_mask)};
+    unsigned int* sqArray{sqField(mParams.sq_off.array)};
+    auto* cqes{(io_uring_cqe*)((char*)mCqMap + mParams.cq_off.cqes)};
+    unsigned int slots{mParams.sq_entries};
+    mResults.resize(slots);
+    std::vector<std::size_t> owners(slots); // which path each slot is for
+    std::vector<unsigned int> freeSlots(slots);
+    for (unsigned int i{0}; i < slots; ++i) {
+        freeSlots[i] = slots - 1 - i;
+    }
+    std::size_t next{0};
+    std::size_t inFlight{0};
+    unsigned int unsubmitted{0};
+    while (next < paths.size() || inFlight > 0) {
+        unsigned int tail{sqTail.load(std::memory_order_relaxed)};
+        unsigned int queued{0};
+        for (; next < paths.size() && !freeSlots.empty(); ++next, ++queued) {
+            unsigned int slot{freeSlots.back()};
+            freeSlots.pop_back();
+            owners[slot] = next;
+            unsigned int index{(tail + queued) & sqMask};
+            io_uring_sqe& sqe{mSqes[index]};
+            sqe = {};
+            sqe.opcode = IORING_OP_STATX;
+            sqe.fd = AT_FDCWD;
+            sqe.addr = (std::uint64_t)paths[next].c_str();
+            sqe.len = STATX_TYPE;
+            sqe.off = (std::uint64_t)&mResults[slot];
+            sqe.user_data = slot;
+            sqArray[index] = index;
+        }
+        sqTail.store(tail + queued, std::memory_order_release);
+        inFlight += queued;
+        unsubmitted += queued;
+        // Hand over the new ones and wait for at least one to finish, so whichever comes back first has its
+        // slot refilled straight away
+        long submitted{syscall(__NR_io_uring_enter, mFd, unsubmitted, 1, IORING_ENTER_GETEVENTS, nullptr, 0)};
+        if (submitted >= 0) {
+            unsubmitted -= (unsigned int)submitted;
+        } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            return false;
+        }
+        unsigned int head{cqHead.load(std::memory_order_relaxed)};
+        unsigned int end{cqTail.load(std::memory_order_acquire)};
+        for (; head != end; ++head) {
+            const io_uring_cqe& cqe{cqes[head & cqMask]};
+            auto slot{(unsigned int)cqe.user_data};
+            types[owners[slot]] = classify(cqe.res, mResults[slot]);
+            freeSlots.push_back(slot);
+            --inFlight;
+        }
+        cqHead.store(head, std::memory_order_release);
+    }
+    return true;
+}
+
+static std::mutex ringMutex{};
+static std::optional<StatRing> ring{}; // set up the first time it's needed, empty after that if it can't be
+static bool ringBroken{false};         // kept around rather than reset, see StatRing::check
+
+static StatRing* getRing() {
+    static bool tried{false};
+    if (!std::exchange(tried, true)) {
+        ring.emplace();
+        if (!ring->setUp()) {
+            ring.reset();
+        }
+    }
+    return ring && !ringBroken ? &*ring : nullptr;
+}
+
+static void checkWithThreads(const std::vector<fs::path>& paths, std::vector<PathType>& types) {
+    std::size_t jobs{(paths.size() + pathsPerJob - 1) / pathsPerJob};
+    ThreadPool pool{std::clamp<std::size_t>(jobs, 1, threadCount)};
+    for (std::size_t first{0}; first < paths.size(); first += pathsPerJob) {
+        pool.submit([&paths, &types, first] {
+            std::size_t last{std::min(first + pathsPerJob, paths.size())};
+            for (std::size_t i{first}; i < last; ++i) {
+                types[i] = statOne(paths[i]);
+            }
+        });
+    }
+    pool.wait();
+}
+
+namespace BatchStat {
+    std::vector<PathType> check(const std::vector<fs::path>& paths, StatMethod method) {
+        std::vector<PathType> types(paths.size(), PathType::Unknown);
+        if (method == StatMethod::Best) {
+            // One job's worth would all go to one thread anyway
+            method = paths.size() <= pathsPerJob ? StatMethod::Serial : StatMethod::Threads;
+        }
+        if (method == StatMethod::Ring) {
+            std::lock_guard lock{ringMutex};
+            if (StatRing* statRing{getRing()}; statRing != nullptr) {
+                if (statRing->check(paths, types)) {
+                    return types;
+                }
+                ringBroken = true;
+            }
+            return types;
+        }
+        if (method == StatMethod::Threads) {
+            checkWithThreads(paths, types);
+        } else {
+            std::transform(paths.begin(), paths.end(), types.begin(), statOne);
+        }
+        return types;
+    }
+
+    bool ringAvailable() {
+        std::lock_guard lock{ringMutex};
+        return getRing() != nullptr;
+    }
+} // namespace BatchStat
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <filesystem>
+#include <vector>
+
+enum class PathType : unsigned char {
+    Missing,
+    File,
+    Directory,
+    Other,
+    Unknown, // couldn't be checked, e.g. a share that isn't responding or a directory we can't read
+};
+
+enum class StatMethod {
+    Best,    // threads, or one at a time for a handful of paths
+    Ring,    // statx submitted in batches through io_uring, for statbench to compare against
+    Threads, // statx spread over a few threads
+    Serial,  // one statx after another, like calling fs::exists on each
+};
+
+// Finds out what's at a lot of paths at once. On a network share each statx is a round trip to the server,
+// so rather than wait for them one at a time they're split between threads. io_uring can submit them all
+// together too, but with a cold cache it measured slower than even one at a time (statbench), as the kernel
+// hands each statx off to a worker thread of its own, so it's only used when asked for. Symlinks are
+// followed, as with fs::exists and fs::is_regular_file.
+namespace BatchStat {
+    // In the same order as paths
+    std::vector<PathType> check(const std::vector<std::filesystem::path>& paths,
+                                StatMethod method = StatMethod::Best);
+    bool ringAvailable();
+} // namespace BatchStat
@@ -0,0 +1,673 @@
+#include "bufferedMusic.hpp"
+#include "seekIndex.hpp"
+#include <algorithm>
+#include <cmath>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <utility>
+
+static constexpr long sampleMin{std::numeric_limits<std::int16_t>::min()};
+static constexpr long sampleMax{std::numeric_limits<std::int16_t>::max()};
+
+void BlockRing::resize(std::size_t numBlocks, std::size_t samplesPerBlock) {
+    mSamplesPerBlock = samplesPerBlock;
+    mSamples.assign(numBlocks * samplesPerBlock, 0);
+    mBlocks.assign(numBlocks, Block{});
+    for (std::size_t i{0}; i < numBlocks; ++i) {
+        mBlocks[i].samples = mSamples.data() + i * samplesPerBlock;
+    }
+    clear();
+}
+
+std::size_t BlockRing::samplesPerBlock() const { return mSamplesPerBlock; }
+
+std::size_t BlockRing::capacity() const { return mBlocks.size(); }
+
+std::size_t BlockRing::size() const {
+    return mWrite.load(std::memory_order_acquire) - mRead.load(std::memory_order_acquire);
+}
+
+BlockRing::Block* BlockRing::beginWrite() {
+    std::size_t write{mWrite.load(std::memory_order_relaxed)};
+    if (mBlocks.empty() || write - mRead.load(std::memory_order_acquire) == mBlocks.size()) {
+        return nullptr;
+    }
+    return &mBlocks[write % mBlocks.size()];
+}
+
+void BlockRing::endWrite() { mWrite.fetch_add(1, std::memory_order_release); }
+
+BlockRing::Block* BlockRing::front() {
+    std::size_t read{mRead.load(std::memory_order_relaxed)};
+    if (read == mWrite.load(std::memory_order_acquire)) {
+        return nullptr;
+    }
+    return &mBlocks[read % mBlocks.size()];
+}
+
+void BlockRing::pop() { mRead.fetch_add(1, std::memory_order_release); }
+
+void BlockRing::clear() {
+    mRead.store(0, std::memory_order_relaxed);
+    mWrite.store(0, std::memory_order_release);
+}
+
+void PlayedBlocks::clear() {
+    std::uint32_t sequence{mSequence.load(std::memory_order_relaxed)};
+    mSequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    mCount.store(0, std::memory_order_relaxed);
+    mSequence.store(sequence + 2, std::memory_order_release);
+}
+
+void PlayedBlocks::add(std::uint64_t streamOffset, std::uint64_t trackOffset, float speed) {
+    std::uint32_t sequence{mSequence.load(std::memory_order_relaxed)};
+    mSequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    std::size_t count{mCount.load(std::memory_order_relaxed)};
+    Entry& entry{mEntries[count % mEntries.size()]};
+    entry.streamOffset.store(streamOffset, std::memory_order_relaxed);
+    entry.trackOffset.store(trackOffset, std::memory_order_relaxed);
+    entry.speed.store(speed, std::memory_order_relaxed);
+    mCount.store(count + 1, std::memory_order_relaxed);
+    mSequence.store(sequence + 2, std::memory_order_release);
+}
+
+std::optional<std::uint64_t> PlayedBlocks::trackOffset(std::uint64_t streamOffset) const {
+    while (true) {
+        std::uint32_t sequence{mSequence.load(std::memory_order_acquire)};
+        if (sequence % 2 != 0) {
+            std::this_thread::yield();
+            continue;
+        }
+        std::size_t count{std::min(mCount.load(std::memory_order_relaxed), mEntries.size())};
+        // The latest block starting at or before streamOffset, or failing that the earliest one we know of
+        std::optional<std::size_t> latest{};
+        std::optional<std::size_t> earliest{};
+        for (std::size_t i{0}; i < count; ++i) {
+            std::uint64_t start{mEntries[i].streamOffset.load(std::memory_order_relaxed)};
+            if (start <= streamOffset &&
+                (!latest || start > mEntries[*latest].streamOffset.load(std::memory_order_relaxed))) {
+                latest = i;
+            }
+            if (!earliest || start < mEntries[*earliest].streamOffset.load(std::memory_order_relaxed)) {
+                earliest = i;
+            }
+        }
+        std::optional<std::uint64_t> result{};
+        if (std::optional<std::size_t> index{latest ? latest : earliest}) {
+            const Entry& entry{mEntries[*index]};
+            auto start{(double)entry.streamOffset.load(std::memory_order_relaxed)};
+            double track{(double)entry.trackOffset.load(std::memory_order_relaxed) +
+                         ((double)streamOffset - start) * entry.speed.load(std::memory_order_relaxed)};
+            result = (std::uint64_t)std::max(0.0, track);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (mSequence.load(std::memory_order_relaxed) == sequence) {
+            return result;
+        }
+    }
+}
+
+BufferedMusic::BufferedMusic() : mEndEvent{eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)} {}
+
+BufferedMusic::~BufferedMusic() {
+    setOutput(AudioOutput::Device, 0); // stops the null output's thread if it's running
+    stop();
+    stopDecoding();
+    if (mEndEvent != -1) {
+        close(mEndEvent);
+    }
+}
+
+bool BufferedMusic::openFromFile(const std::filesystem::path& path) {
+    stop();
+    stopDecoding();
+    {
+        // Under the lock so getOutputClock can't see the frames counted in both
+        std::lock_guard lock{mOutputMutex};
+        if (unsigned int rate{mStreamRate}; rate != 0) {
+            mClockBase += (std::int64_t)(mClockFrames * 1'000'000'000 / rate);
+        }
+        mClockFrames = 0;
+    }
+    mFile.close();
+    if (!mStream.open(path) || !mFile.openFromStream(mStream)) {
+        mEndOfFile = true; // make sure the previous song can't be resumed from a half-empty ring
+        signalEnd();       // so a playlist moves on past it
+        return false;
+    }
+    ReadAhead::follow(mStream.file());
+    SeekIndex::prepare(path);
+    mPath = path;
+    unsigned int channels{mFile.getChannelCount()};
+    unsigned int sampleRate{mFile.getSampleRate()};
+    auto framesPerBlock{std::max<std::size_t>(1, (std::size_t)(mLatency.asSeconds() * (float)sampleRate))};
+    auto numBlocks{std::max<std::size_t>(2, (std::size_t)(mDepth / mLatency))};
+    mRing.resize(numBlocks, framesPerBlock * channels);
+    mSilence.assign(framesPerBlock * channels, 0);
+    mStretchInput.assign(framesPerBlock * channels, 0);
+    mStretcher.reset(channels, sampleRate, mSpeed, 0);
+    mPlayed.clear();
+    mStreamPosition = 0;
+    mTrackEnd = 0;
+    mDuration = mFile.getDuration();
+    mHoldingBlock = false;
+    mAtLoopPoint = false;
+    mWrapped = false;
+    mLoopStart = 0;
+    mLoopEnd = 0;
+    mLoopRegion.reset();
+    mRepeats = 0;
+    mEnded = false;
+    mEndOfFile = false;
+    mStopDecoding = false;
+    if (mOutput == AudioOutput::Device) {
+        initialize(channels, sampleRate, mFile.getChannelMap());
+    }
+    mStreamRate = sampleRate;
+    mStreamChannels = channels;
+    sf::SoundStream::setLooping(true);
+    mDecoder = std::thread{&BufferedMusic::decode, this};
+    return true;
+}
+
+sf::Time BufferedMusic::getDuration() const { return mDuration; }
+
+void BufferedMusic::setBuffering(sf::Time latency, sf::Time depth) {
+    mLatency = latency;
+    mDepth = std::max(depth, latency);
+}
+
+sf::Time BufferedMusic::getLatency() const { return mLatency; }
+
+sf::Time BufferedMusic::getBufferDepth() const { return mDepth; }
+
+float BufferedMusic::getBufferFill() const {
+    if (mRing.capacity() == 0) {
+        return 0;
+    }
+    return (float)mRing.size() / (float)mRing.capacity();
+}
+
+std::size_t BufferedMusic::getUnderruns() const { return mUnderruns; }
+
+void BufferedMusic::setGain(float gain) { mGain = gain; }
+
+float BufferedMusic::getGain() const { return mGain; }
+
+unsigned int BufferedMusic::getStreamRate() const { return mStreamRate; }
+
+void BufferedMusic::setSpeed(float speed) {
+    mSpeed = speed;
+    if (getStatus() != Status::Stopped) {
+        // Throw away what's already decoded at the old speed, seeking restarts the stretcher at the new one
+        setPlayingOffset(getPlayingOffset());
+    }
+}
+
+float BufferedMusic::getSpeed() const { return mSpeed; }
+
+sf::Time BufferedMusic::getPlayingOffset() const {
+    sf::Time played{streamOffset()};
+    unsigned int channels{mStreamChannels};
+    unsigned int sampleRate{mStreamRate};
+    if (channels == 0 || sampleRate == 0) {
+        return played;
+    }
+    std::uint64_t stream{(std::uint64_t)played.asMicroseconds() * sampleRate / 1'000'000 * channels};
+    std::optional<std::uint64_t> track{mPlayed.trackOffset(stream)};
+    if (!track) {
+        return played;
+    }
+    return sf::microseconds((std::int64_t)(*track / channels * 1'000'000 / sampleRate));
+}
+
+void BufferedMusic::setOutput(AudioOutput output, double clockRate) {
+    stop();
+    if (output != mOutput && mOutput == AudioOutput::Null) {
+        {
+            std::lock_guard lock{mOutputMutex};
+            mStopOutput = true;
+        }
+        mWakeOutput.notify_all();
+        mOutputThread.join();
+    }
+    mClockRate = clockRate;
+    if (output == AudioOutput::Null && clockRate == 0) {
+        holdClockAt(getOutputClock());
+    } else {
+        holdClockAt(std::nullopt);
+    }
+    if (output != mOutput && output == AudioOutput::Null) {
+        mStopOutput = false;
+        mOutputThread = std::thread{&BufferedMusic::runNullOutput, this};
+    }
+    mOutput = output;
+}
+
+AudioOutput BufferedMusic::getOutput() const { return mOutput; }
+
+double BufferedMusic::getClockRate() const { return mClockRate; }
+
+sf::Time BufferedMusic::getOutputClock() const {
+    std::lock_guard lock{mOutputMutex};
+    std::int64_t nanoseconds{mClockBase};
+    if (unsigned int rate{mStreamRate}; rate != 0) {
+        nanoseconds += (std::int64_t)(mClockFrames * 1'000'000'000 / rate);
+    }
+    return sf::microseconds(nanoseconds / 1000);
+}
+
+void BufferedMusic::holdClockAt(std::optional<sf::Time> limit) {
+    {
+        std::lock_guard lock{mOutputMutex};
+        mClockLimit = limit ? limit->asMicroseconds() * 1000 : std::numeric_limits<std::int64_t>::max();
+    }
+    mWakeOutput.notify_all();
+}
+
+// How much more of the song the null output can take before its clock reaches the limit, rounded up
+std::uint64_t BufferedMusic::framesBeforeLimit() const {
+    std::int64_t limit{mClockLimit};
+    unsigned int rate{mStreamRate};
+    if (limit == std::numeric_limits<std::int64_t>::max() || rate == 0) {
+        return std::numeric_limits<std::uint64_t>::max();
+    }
+    std::int64_t left{limit - mClockBase};
+    std::uint64_t frames{mClockFrames};
+    if (left <= 0) {
+        return 0;
+    }
+    auto seconds{(std::uint64_t)left / 1'000'000'000};
+    auto nanoseconds{(std::uint64_t)left % 1'000'000'000};
+    std::uint64_t allowed{seconds * rate + (nanoseconds * rate + 999'999'999) / 1'000'000'000};
+    return allowed > frames ? allowed - frames : 0;
+}
+
+void BufferedMusic::play() {
+    if (mOutput == AudioOutput::Device) {
+        sf::SoundStream::play();
+        wakeDecoder();
+        return;
+    }
+    {
+        std::lock_guard lock{mOutputMutex};
+        if (mStreamChannels == 0) {
+            return; // nothing's been opened
+        }
+        if (mOutputStatus == Status::Playing) {
+            onSeek(sf::Time::Zero); // like SFML, playing again starts the song over
+            mOutputPosition = 0;
+            mHeldSamples = 0;
+        }
+        mOutputStatus = Status::Playing;
+    }
+    mWakeOutput.notify_all();
+    wakeDecoder();
+}
+
+void BufferedMusic::pause() {
+    if (mOutput == AudioOutput::Device) {
+        sf::SoundStream::pause();
+        return;
+    }
+    std::lock_guard lock{mOutputMutex};
+    if (mOutputStatus == Status::Playing) {
+        mOutputStatus = Status::Paused;
+    }
+}
+
+void BufferedMusic::stop() {
+    if (mOutput == AudioOutput::Device) {
+        sf::SoundStream::stop();
+        return;
+    }
+    std::lock_guard lock{mOutputMutex};
+    if (mOutputStatus != Status::Stopped) {
+        onSeek(sf::Time::Zero);
+    }
+    mOutputStatus = Status::Stopped;
+    mOutputPosition = 0;
+    mHeldSamples = 0;
+}
+
+sf::SoundSource::Status BufferedMusic::getStatus() const {
+    if (mEnded) {
+        // Every sample of the song has gone to the output by the time the audio thread ends the stream, so
+        // it's as good as stopped, even if SFML is still on its way there
+        return Status::Stopped;
+    }
+    return mOutput == AudioOutput::Device ? sf::SoundStream::getStatus() : mOutputStatus.load();
+}
+
+void BufferedMusic::setPlayingOffset(sf::Time offset) {
+    if (mOutput == AudioOutput::Device) {
+        sf::SoundStream::setPlayingOffset(offset);
+        return;
+    }
+    std::lock_guard lock{mOutputMutex};
+    onSeek(offset);
+    mOutputPosition = (std::uint64_t)offset.asMicroseconds() * mStreamRate / 1'000'000 * mStreamChannels;
+    mHeldSamples = 0;
+}
+
+// SFML's count of samples played, or the null output's
+sf::Time BufferedMusic::streamOffset() const {
+    if (mOutput == AudioOutput::Device) {
+        return sf::SoundStream::getPlayingOffset();
+    }
+    unsigned int channels{mStreamChannels};
+    unsigned int rate{mStreamRate};
+    if (channels == 0 || rate == 0) {
+        return sf::Time::Zero;
+    }
+    return sf::microseconds((std::int64_t)(mOutputPosition / channels * 1'000'000 / rate));
+}
+
+// Does what SFML's audio thread would, except that it only waits for the decoder rather than a sound card
+void BufferedMusic::runNullOutput() {
+    using Clock = std::chrono::steady_clock;
+    std::unique_lock lock{mOutputMutex};
+    Clock::time_point paceStart{Clock::now()};
+    double paced{0}; // seconds of audio since paceStart
+    while (!mStopOutput) {
+        if (mOutputStatus != Status::Playing) {
+            mWakeOutput.wait(lock);
+            paceStart = Clock::now();
+            paced = 0;
+            continue;
+        }
+        std::uint64_t allowed{framesBeforeLimit()};
+        if (allowed == 0) {
+            mWakeOutput.wait(lock); // until the limit moves
+            continue;
+        }
+        unsigned int channels{mStreamChannels};
+        if (mHeldSamples != 0) {
+            auto frames{(std::size_t)std::min<std::uint64_t>(mHeldSamples / channels, allowed)};
+            std::size_t taken{frames * channels};
+            mHeldSamples -= taken;
+            mClockFrames += taken / channels;
+            mOutputPosition += taken;
+            continue;
+        }
+        if (mRing.size() <= (mHoldingBlock ? 1u : 0u) && !mEndOfFile) {
+            // Wait for the decoder rather than play silence, so the clock only counts the songs themselves
+            mWakeOutput.wait_for(lock, std::chrono::microseconds{100});
+            continue;
+        }
+        Chunk chunk{};
+        if (onGetData(chunk)) {
+            // onGetData counts all of it on the clock, take back whatever's past the limit until it moves
+            auto frames{(std::size_t)std::min<std::uint64_t>(chunk.sampleCount / channels, allowed)};
+            std::size_t taken{frames * channels};
+            mHeldSamples = chunk.sampleCount - taken;
+            mClockFrames -= mHeldSamples / channels;
+            mOutputPosition += taken;
+            wakeDecoder(); // there's room in the ring, and the decoder only polls for SFML
+            if (double rate{mClockRate}; rate > 0) {
+                paced += (double)taken / channels / mStreamRate;
+                auto due{paceStart + std::chrono::duration_cast<Clock::duration>(
+                                         std::chrono::duration<double>{paced / rate})};
+                mWakeOutput.wait_until(lock, due,
+                                       [this] { return mStopOutput || mOutputStatus != Status::Playing; });
+            }
+        } else if (std::optional<std::uint64_t> target{onLoop()}) {
+            mOutputPosition = *target;
+        } else {
+            mOutputStatus = Status::Stopped;
+            mOutputPosition = 0;
+        }
+    }
+}
+
+void BufferedMusic::setLooping(bool looping) {
+    mLooping = looping;
+    wakeDecoder(); // it may have decoded the end already and be waiting
+}
+
+bool BufferedMusic::isLooping() const { return mLooping; }
+
+void BufferedMusic::setLoopRegion(sf::Time start, sf::Time end) {
+    auto toSample{[this](sf::Time time) {
+        return (std::uint64_t)time.asMicroseconds() * mStreamRate / 1'000'000 * mStreamChannels;
+    }};
+    {
+        std::lock_guard lock{mFileMutex};
+        mLoopStart = toSample(start);
+        mLoopEnd = toSample(end);
+    }
+    mLoopRegion = {start, end};
+    // Seek even if we're already inside the region, the decoder may have got past the end of it
+    sf::Time offset{getPlayingOffset()};
+    setPlayingOffset(offset >= start && offset < end ? offset : start);
+}
+
+void BufferedMusic::clearLoopRegion() {
+    std::lock_guard lock{mFileMutex};
+    mLoopStart = 0;
+    mLoopEnd = 0;
+    mLoopRegion.reset();
+}
+
+std::optional<std::pair<sf::Time, sf::Time>> BufferedMusic::getLoopRegion() const { return mLoopRegion; }
+
+void BufferedMusic::setRepeats(int repeats) {
+    mRepeats = repeats;
+    wakeDecoder();
+}
+
+int BufferedMusic::getRepeats() const { return mRepeats; }
+
+int BufferedMusic::getEndEvent() const { return mEndEvent; }
+
+std::chrono::steady_clock::time_point BufferedMusic::getEndTime() const {
+    return std::chrono::steady_clock::time_point{std::chrono::steady_clock::duration{mEndTime}};
+}
+
+void BufferedMusic::decode() {
+    std::unique_lock lock{mFileMutex};
+    while (!mStopDecoding) {
+        BlockRing::Block* block{mEndOfFile ? nullptr : mRing.beginWrite()};
+        if (block == nullptr && mEndOfFile && wrapAround()) {
+            continue; // looping was turned on after we'd decoded the end
+        }
+        if (block == nullptr) {
+            if (!mEndOfFile && mOutput == AudioOutput::Device && getStatus() == Status::Playing) {
+                // SFML's audio thread never signals us since that would mean a syscall in the audio callback,
+                // so check back about once per block while it plays instead
+                mWakeDecoder.wait_for(lock, std::chrono::microseconds{mLatency.asMicroseconds()});
+            } else {
+                // Nothing to do until a seek, play, stop or change to looping or repeats, which all wake us,
+                // as does the null output whenever it takes a block
+                mWakeDecoder.wait(lock);
+            }
+            continue;
+        }
+        if (!(mStretcher.isStretching() ? stretchInto(*block) : readInto(*block))) {
+            if (!wrapAround()) {
+                mEndOfFile = true;
+            }
+            continue;
+        }
+        block->startsLoop = std::exchange(mWrapped, false);
+        float gain{mGain};
+        if (gain != 1) {
+            for (std::size_t i{0}; i < block->sampleCount; ++i) {
+                long sample{std::lround((float)block->samples[i] * gain)};
+                block->samples[i] = (std::int16_t)std::clamp(sample, sampleMin, sampleMax);
+            }
+        }
+        mRing.endWrite();
+    }
+}
+
+bool BufferedMusic::readInto(BlockRing::Block& block) {
+    std::uint64_t offset{mFile.getSampleOffset()};
+    std::uint64_t count{mRing.samplesPerBlock()};
+    if (mLoopEnd != 0 && offset <= mLoopEnd) {
+        count = std::min(count, mLoopEnd - offset); // stop exactly at the end of the loop
+    }
+    block.sampleOffset = offset;
+    block.speed = 1;
+    block.sampleCount = count == 0 ? 0 : (std::size_t)mFile.read(block.samples, count);
+    return block.sampleCount != 0;
+}
+
+// Feeds the stretcher until it's made a block's worth, or drained what's left at the end of the song or loop
+bool BufferedMusic::stretchInto(BlockRing::Block& block) {
+    unsigned int channels{mFile.getChannelCount()};
+    std::size_t frames{mRing.samplesPerBlock() / channels};
+    block.sampleOffset = mStretcher.trackFrame() * channels;
+    block.speed = (float)mStretcher.speed();
+    std::size_t made{0};
+    while (true) {
+        made += mStretcher.pull(block.samples + made * channels, frames - made);
+        if (made == frames || mStretcher.drained()) {
+            break;
+        }
+        std::uint64_t offset{mFile.getSampleOffset()};
+        std::uint64_t count{mStretchInput.size()};
+        if (mLoopEnd != 0 && offset <= mLoopEnd) {
+            count = std::min(count, mLoopEnd - offset);
+        }
+        std::uint64_t read{count == 0 ? 0 : mFile.read(mStretchInput.data(), count)};
+        if (read == 0) {
+            mStretcher.finish();
+        } else {
+            mStretcher.push(mStretchInput.data(), (std::size_t)read / channels);
+        }
+    }
+    block.sampleCount = made * channels;
+    return made != 0;
+}
+
+// Carries straight on from the start of the song or loop if it's meant to play again, instead of letting the
+// stream run dry and restarting it
+bool BufferedMusic::wrapAround() {
+    if (mEnded || mFile.getSampleCount() == 0) {
+        return false;
+    }
+    if (!mLooping && mLoopEnd == 0) {
+        int repeats{mRepeats};
+        do {
+            if (repeats <= 0) {
+                return false;
+            }
+        } while (!mRepeats.compare_exchange_weak(repeats, repeats - 1));
+    }
+    mFile.seek(mLoopStart);
+    mStretcher.restart(mLoopStart / mFile.getChannelCount());
+    mWrapped = true;
+    mEndOfFile = false;
+    return true;
+}
+
+// Takes the decoder's lock first, so it can't miss this between seeing there's nothing to do and waiting
+void BufferedMusic::wakeDecoder() {
+    {
+        std::lock_guard lock{mFileMutex};
+    }
+    mWakeDecoder.notify_all();
+}
+
+void BufferedMusic::signalEnd() {
+    mEndTime = std::chrono::steady_clock::now().time_since_epoch().count();
+    if (mEndEvent != -1) {
+        eventfd_write(mEndEvent, 1);
+    }
+}
+
+void BufferedMusic::stopDecoding() {
+    {
+        std::lock_guard lock{mFileMutex};
+        mStopDecoding = true;
+    }
+    mWakeDecoder.notify_all();
+    if (mDecoder.joinable()) {
+        mDecoder.join();
+    }
+}
+
+bool BufferedMusic::onGetData(Chunk& data) {
+    std::unique_lock lock{mSeekMutex, std::try_to_lock};
+    if (!lock.owns_lock()) {
+        // A seek is swapping out the ring, play a moment of silence rather than block the audio thread
+        mClockFrames += mSilence.size() / mStreamChannels;
+        data.samples = mSilence.data();
+        data.sampleCount = mSilence.size();
+        return true;
+    }
+    if (mHoldingBlock) {
+        mRing.pop(); // SFML is done with the block we handed out last time
+        mHoldingBlock = false;
+    }
+    BlockRing::Block* block{mRing.front()};
+    if (block == nullptr && mEndOfFile) {
+        // Check again in case the decoder queued the last block between the two checks
+        block = mRing.front();
+        if (block == nullptr) {
+            return false;
+        }
+    }
+    if (block != nullptr && block->startsLoop) {
+        // Stop short of the loop so SFML calls onLoop and starts counting the playing offset from 0 again
+        block->startsLoop = false;
+        mAtLoopPoint = true;
+        mLoopTarget = block->sampleOffset;
+        mPlayed.clear();
+        mStreamPosition = mLoopTarget;
+        mTrackEnd = mLoopTarget;
+        return false;
+    }
+    if (block == nullptr) {
+        ++mUnderruns;
+        mPlayed.add(mStreamPosition, mTrackEnd, 0);
+        mStreamPosition += mSilence.size();
+        mClockFrames += mSilence.size() / mStreamChannels;
+        data.samples = mSilence.data();
+        data.sampleCount = mSilence.size();
+        return true;
+    }
+    mPlayed.add(mStreamPosition, block->sampleOffset, block->speed);
+    mStreamPosition += block->sampleCount;
+    mClockFrames += block->sampleCount / mStreamChannels;
+    mTrackEnd = block->sampleOffset + (std::uint64_t)std::llround((double)block->sampleCount * block->speed);
+    mHoldingBlock = true;
+    data.samples = block->samples;
+    data.sampleCount = block->sampleCount;
+    return true;
+}
+
+void BufferedMusic::onSeek(sf::Time timeOffset) {
+    // Load the landing point before taking the locks, so the audio thread keeps playing from the ring
+    std::shared_ptr<MappedFile> file{mStream.file()};
+    if (std::shared_ptr<const SeekTable> table{SeekIndex::get(mPath)}; table != nullptr && file != nullptr) {
+        SeekIndex::prefetch(*file, *table, timeOffset);
+    }
+    std::scoped_lock lock{mSeekMutex, mFileMutex};
+    mFile.seek(timeOffset);
+    std::uint64_t offset{mFile.getSampleOffset()};
+    unsigned int channels{mFile.getChannelCount()};
+    mStretcher.reset(channels, mFile.getSampleRate(), mSpeed, offset / channels);
+    mPlayed.clear();
+    mStreamPosition = offset;
+    mTrackEnd = offset;
+    mRing.clear();
+    mHoldingBlock = false;
+    mWrapped = false;
+    mEnded = false;
+    mEndOfFile = false;
+    mWakeDecoder.notify_one();
+}
+
+std::optional<std::uint64_t> BufferedMusic::onLoop() {
+    if (std::exchange(mAtLoopPoint, false)) {
+        return mLoopTarget; // the decoder is already there, so there's nothing to seek
+    }
+    // The song is over. This is the only syscall the audio thread makes, and only once per song.
+    mEnded = true;
+    signalEnd();
+    return std::nullopt;
+}
@@ -0,0 +1,205 @@
+#pragma once
+
+#include "readAhead.hpp"
+#include "timeStretch.hpp"
+#include <SFML/Audio/InputSoundFile.hpp>
+#include <SFML/Audio/SoundStream.hpp>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Fixed-size single-producer single-consumer queue of PCM blocks. The decode thread writes blocks and the
+// audio thread reads them, and neither ever has to wait for the other.
+class BlockRing {
+public:
+    struct Block {
+        std::int16_t* samples{nullptr};
+        std::size_t sampleCount{0};
+        std::uint64_t sampleOffset{0}; // where the block starts in the file
+        bool startsLoop{false};        // the song went back to the start for this block
+        float speed{1};                // how much of the song each sample of the block covers
+    };
+    void resize(std::size_t numBlocks, std::size_t samplesPerBlock);
+    std::size_t samplesPerBlock() const;
+    std::size_t capacity() const;
+    std::size_t size() const;
+    // Producer side. beginWrite returns nullptr while the ring is full.
+    Block* beginWrite();
+    void endWrite();
+    // Consumer side. front returns nullptr while the ring is empty.
+    Block* front();
+    void pop();
+    // Only safe while neither side is touching the ring
+    void clear();
+
+private:
+    std::vector<std::int16_t> mSamples{};
+    std::vector<Block> mBlocks{};
+    std::size_t mSamplesPerBlock{0};
+    alignas(64) std::atomic<std::size_t> mRead{0};
+    alignas(64) std::atomic<std::size_t> mWrite{0};
+};
+
+// Where in the song the last few blocks handed to SFML came from, so the offset SFML counts in samples played
+// can be turned back into a position in the song when it isn't playing at normal speed. Written by the audio
+// thread and read from any, each update bracketed by a sequence number so readers never see half of one.
+class PlayedBlocks {
+public:
+    void clear();
+    // speed 0 for silence, which doesn't move through the song at all
+    void add(std::uint64_t streamOffset, std::uint64_t trackOffset, float speed);
+    // Both in samples. nullopt if nothing has been played since the last clear.
+    std::optional<std::uint64_t> trackOffset(std::uint64_t streamOffset) const;
+
+private:
+    struct Entry {
+        std::atomic<std::uint64_t> streamOffset{0};
+        std::atomic<std::uint64_t> trackOffset{0};
+        std::atomic<float> speed{1};
+    };
+    std::array<Entry, 16> mEntries{};
+    std::atomic<std::size_t> mCount{0};
+    std::atomic<std::uint32_t> mSequence{0}; // odd while an update is in progress
+};
+
+// Where BufferedMusic's audio goes. Device plays it through SFML. Null never touches the sound card: a thread
+// of BufferedMusic's own takes each block as soon as it's decoded, or at a multiple of real time, and counts
+// it on a virtual clock, so playback can be driven and timed on a machine without audio.
+enum class AudioOutput { Device, Null };
+
+// Drop-in replacement for sf::Music that decodes on its own thread into a BlockRing, so how far ahead we
+// decode doesn't depend on SFML's internal streaming and a busy CPU doesn't immediately cause an underrun.
+// Loops and repeats are decoded straight through too, so going back to the start leaves no gap.
+class BufferedMusic : public sf::SoundStream {
+public:
+    BufferedMusic();
+    ~BufferedMusic() override;
+    BufferedMusic(const BufferedMusic&) = delete;
+    BufferedMusic& operator=(const BufferedMusic&) = delete;
+
+    [[nodiscard]] bool openFromFile(const std::filesystem::path& path);
+    sf::Time getDuration() const;
+    // Latency is how much audio each block holds, depth is how much audio is decoded ahead in total. Both
+    // take effect from the next file opened.
+    void setBuffering(sf::Time latency, sf::Time depth);
+    sf::Time getLatency() const;
+    sf::Time getBufferDepth() const;
+    float getBufferFill() const;
+    std::size_t getUnderruns() const;
+    // Linear gain applied while decoding, so it takes effect once the blocks already queued have played
+    void setGain(float gain);
+    float getGain() const;
+    // Hide SoundStream's looping, which stays on so SFML asks onLoop what to do at the end of every song
+    void setLooping(bool looping);
+    bool isLooping() const;
+    // Loops between two points of the current song until it's cleared or another song is opened, whether
+    // setLooping is on or not. Jumps to the start unless the song is already between them.
+    void setLoopRegion(sf::Time start, sf::Time end);
+    void clearLoopRegion();
+    std::optional<std::pair<sf::Time, sf::Time>> getLoopRegion() const;
+    // How many more times the song plays after this one. Opening a song resets it.
+    void setRepeats(int repeats);
+    int getRepeats() const;
+    // Becomes readable when a song finishes without looping or fails to open, until it's read
+    int getEndEvent() const;
+    std::chrono::steady_clock::time_point getEndTime() const;
+    // Unlike getSampleRate, safe to call from any thread, e.g. one reading from an effect processor
+    unsigned int getStreamRate() const;
+    // Changes tempo without changing pitch, from the current position on. 1 is normal speed.
+    void setSpeed(float speed);
+    float getSpeed() const;
+    // Hides SoundStream's, which counts samples played rather than how far through the song they came from
+    sf::Time getPlayingOffset() const;
+    // Stops anything playing. clockRate is how many times faster than real time the null output runs, 0 for
+    // as fast as songs can be decoded, in which case its clock stays where it is until told to run with
+    // holdClockAt. Meant to be chosen once, before anything else uses the player.
+    void setOutput(AudioOutput output, double clockRate);
+    AudioOutput getOutput() const;
+    double getClockRate() const;
+    // How much audio has been handed to the output since startup, which is the null output's virtual clock
+    sf::Time getOutputClock() const;
+    // The null output stops taking audio once its clock reaches limit, partway through a block if need be,
+    // and carries on when it's moved. No limit lets it run freely.
+    void holdClockAt(std::optional<sf::Time> limit);
+    // These go to the null output instead of SFML when it's in use
+    void play() override;
+    void pause() override;
+    void stop() override;
+    // Stopped from the moment the audio thread hands over the end of the song and the end event fires
+    Status getStatus() const override;
+    void setPlayingOffset(sf::Time offset);
+
+protected:
+    bool onGetData(Chunk& data) override;
+    void onSeek(sf::Time timeOffset) override;
+    std::optional<std::uint64_t> onLoop() override;
+
+private:
+    void decode();
+    bool readInto(BlockRing::Block& block);
+    bool stretchInto(BlockRing::Block& block);
+    bool wrapAround();
+    void signalEnd();
+    void wakeDecoder();
+    void stopDecoding();
+    void runNullOutput();
+    sf::Time streamOffset() const;
+    std::uint64_t framesBeforeLimit() const;
+
+    MappedFileStream mStream{}; // must outlive mFile, which reads from it
+    sf::InputSoundFile mFile{};
+    BlockRing mRing{};
+    std::vector<std::int16_t> mSilence{};
+    std::vector<std::int16_t> mStretchInput{}; // decoder only
+    TimeStretcher mStretcher{};                // guarded by mFileMutex
+    PlayedBlocks mPlayed{};
+    std::thread mDecoder{};
+    std::mutex mFileMutex{};  // held by the decoder while it reads from mFile
+    std::mutex mSeekMutex{};  // held by onSeek while it swaps out the ring, the audio thread only tries it
+    std::condition_variable mWakeDecoder{};
+    std::atomic<bool> mStopDecoding{false};
+    std::atomic<bool> mEndOfFile{true};
+    std::atomic<std::size_t> mUnderruns{0};
+    std::atomic<float> mGain{1};
+    std::atomic<float> mSpeed{1};
+    std::atomic<bool> mLooping{false};
+    std::atomic<int> mRepeats{0};
+    std::atomic<bool> mEnded{false}; // the audio thread has let the stream stop, too late to loop
+    std::atomic<std::chrono::steady_clock::rep> mEndTime{0};
+    std::atomic<unsigned int> mStreamRate{0};
+    std::atomic<unsigned int> mStreamChannels{0};
+    int mEndEvent{-1};
+    bool mWrapped{false};         // guarded by mFileMutex, the next block decoded starts a loop
+    std::uint64_t mLoopStart{0};  // guarded by mFileMutex, in samples like InputSoundFile::seek
+    std::uint64_t mLoopEnd{0};    // guarded by mFileMutex, 0 when looping the whole song
+    std::uint64_t mLoopTarget{0}; // audio thread only, where the loop onGetData stopped at starts
+    std::optional<std::pair<sf::Time, sf::Time>> mLoopRegion{};
+    bool mHoldingBlock{false};    // whether the audio thread still has the front block
+    bool mAtLoopPoint{false};     // audio thread only, onGetData stopped at the start of a loop
+    std::uint64_t mStreamPosition{0}; // audio thread only, where SFML's count of samples played has got to
+    std::uint64_t mTrackEnd{0};       // audio thread only, where in the song the last block handed out ended
+    std::filesystem::path mPath{};
+    sf::Time mDuration{};
+    sf::Time mLatency{sf::milliseconds(50)};
+    sf::Time mDepth{sf::seconds(2)};
+    AudioOutput mOutput{AudioOutput::Device};
+    std::atomic<double> mClockRate{0};
+    std::thread mOutputThread{};
+    mutable std::mutex mOutputMutex{};        // held by the null output while it takes a block
+    std::condition_variable mWakeOutput{};
+    bool mStopOutput{false};                  // guarded by mOutputMutex
+    std::atomic<Status> mOutputStatus{Status::Stopped};
+    std::atomic<std::uint64_t> mOutputPosition{0}; // in samples, the null output's version of SFML's count
+    std::atomic<std::uint64_t> mClockFrames{0};    // handed out since the song was opened
+    std::atomic<std::int64_t> mClockBase{0};       // nanoseconds before that, folded in under mOutputMutex
+    std::atomic<std::int64_t> mClockLimit{std::numeric_limits<std::int64_t>::max()}; // in nanoseconds
+    std::size_t mHeldSamples{0}; // guarded by mOutputMutex, what the limit held back of the last block
+};
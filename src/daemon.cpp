@@ -0,0 +1,427 @@
+#include "daemon.hpp"
+#include "input.hpp"
+#include "music.hpp"
+#include "statMusic.hpp"
+#include "supervisor.hpp"
+#include "threads.hpp"
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <poll.h>
+#include <print>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+
+// Protocol: clients send one command line per request, exactly as they would type it at the prompt
+// (so `;` still separates commands). Every request gets exactly one response line containing whatever
+// the commands printed, with backslashes and newlines escaped. Requests can be pipelined; responses
+// always come back in order.
+
+namespace fs = std::filesystem;
+static constexpr int maxEvents{64};
+static constexpr std::size_t maxPendingOutput{1 << 20};
+// Once this much output is waiting on a slow client, stop reading its requests until it catches up
+static constexpr std::size_t maxRequestLength{1 << 16};
+static constexpr int benchmarkClients{8};
+
+struct Client {
+    std::string input{};
+    std::string output{};
+    std::size_t outputSent{0};
+    std::uint32_t events{0};
+    bool finishedSending{false};
+};
+
+static std::string escapeResponse(std::string_view output) {
+    if (output.ends_with('\n')) {
+        output.remove_suffix(1); // the response terminator takes the place of println's newline
+    }
+    std::string escaped{};
+    escaped.reserve(output.size() + 1);
+    for (char c : output) {
+        if (c == '\\') {
+            escaped += "\\\\";
+        } else if (c == '\n') {
+            escaped += "\\n";
+        } else {
+            escaped += c;
+        }
+    }
+    escaped += '\n';
+    return escaped;
+}
+
+static std::string unescapeResponse(std::string_view response) {
+    std::string output{};
+    output.reserve(response.size());
+    for (std::size_t i{0}; i < response.size(); ++i) {
+        if (response[i] == '\\' && i + 1 < response.size()) {
+            ++i;
+            output += response[i] == 'n' ? '\n' : response[i];
+        } else {
+            output += response[i];
+        }
+    }
+    return output;
+}
+
+static bool socketAddress(sockaddr_un& address) {
+    const std::string& path{Music::socketPath.native()};
+    if (path.size() >= sizeof(address.sun_path)) {
+        std::println("Error: socket path {} is too long.", path);
+        return false;
+    }
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    return true;
+}
+
+static int openListener() {
+    sockaddr_un address{};
+    if (!socketAddress(address)) {
+        return -1;
+    }
+    int probe{socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)};
+    bool inUse{connect(probe, (sockaddr*)&address, sizeof(address)) == 0};
+    close(probe);
+    if (inUse) {
+        std::println("Error: another Cleo daemon is already listening on {}.", Music::socketPath.string());
+        return -1;
+    }
+    std::error_code ec{};
+    fs::remove(Music::socketPath, ec); // left behind if a previous daemon didn't exit cleanly
+    fs::create_directories(Music::socketPath.parent_path(), ec);
+    int fd{socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)};
+    mode_t oldMask{umask(0077)}; // only the user running the daemon should be able to control it
+    int bound{bind(fd, (sockaddr*)&address, sizeof(address))};
+    umask(oldMask);
+    if (bound == -1 || listen(fd, SOMAXCONN) == -1) {
+        std::println("Error: could not listen on {}: {}", Music::socketPath.string(), std::strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void acceptClients(int epollFd, int listener, std::unordered_map<int, Client>& clients) {
+    int fd{};
+    while ((fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.fd = fd;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+        clients[fd].events = event.events;
+    }
+}
+
+// Returns false if the connection is broken and the client should be dropped
+static bool readRequests(int fd, Client& client) {
+    char buf[4096];
+    while (true) {
+        ssize_t size{recv(fd, buf, sizeof(buf), 0)};
+        if (size > 0) {
+            client.input.append(buf, (std::size_t)size);
+            continue;
+        }
+        if (size == 0) {
+            // The client may have only shut down its side, so still answer what it already sent
+            client.finishedSending = true;
+            if (!client.input.empty() && !client.input.ends_with('\n')) {
+                client.input += '\n';
+            }
+            return true;
+        }
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+}
+
+static void executeRequests(Client& client) {
+    std::size_t start{0};
+    std::size_t end{};
+    while (client.output.size() - client.outputSent < maxPendingOutput &&
+           (end = client.input.find('\n', start)) != std::string::npos) {
+        std::string_view request{client.input.data() + start, end - start};
+        if (request.ends_with('\r')) {
+            request.remove_suffix(1);
+        }
+        client.output += escapeResponse(executeCaptured(request));
+        Threads::helpMode = false; // help mode only makes sense at an interactive prompt
+        start = end + 1;
+    }
+    client.input.erase(0, start);
+}
+
+static bool sendResponses(int fd, Client& client) {
+    while (client.outputSent < client.output.size()) {
+        ssize_t written{send(fd, client.output.data() + client.outputSent,
+                             client.output.size() - client.outputSent, MSG_NOSIGNAL)};
+        if (written == -1) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+        client.outputSent += (std::size_t)written;
+    }
+    client.output.clear();
+    client.outputSent = 0;
+    return true;
+}
+
+static void updateInterest(int epollFd, int fd, Client& client) {
+    std::size_t pending{client.output.size() - client.outputSent};
+    std::uint32_t events{0};
+    if (pending < maxPendingOutput && !client.finishedSending) {
+        events |= EPOLLIN | EPOLLRDHUP;
+    }
+    if (pending > 0) {
+        events |= EPOLLOUT;
+    }
+    if (events == client.events) {
+        return;
+    }
+    epoll_event event{};
+    event.events = events;
+    event.data.fd = fd;
+    epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &event);
+    client.events = events;
+}
+
+static void serveClient(int epollFd, int fd, std::uint32_t events, std::unordered_map<int, Client>& clients) {
+    Client& client{clients.at(fd)};
+    bool alive{(events & EPOLLERR) == 0};
+    if (alive && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))) {
+        alive = readRequests(fd, client);
+    }
+    if (alive) {
+        executeRequests(client);
+        alive = sendResponses(fd, client);
+    }
+    if (client.input.size() > maxRequestLength && client.input.find('\n') == std::string::npos) {
+        alive = false; // nobody types a command this long
+    }
+    bool finished{client.finishedSending && client.output.empty() &&
+                  client.input.find('\n') == std::string::npos};
+    if (!alive || finished) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        clients.erase(fd);
+        return;
+    }
+    updateInterest(epollFd, fd, client);
+}
+
+void runDaemon() {
+    if (Threads::autoAnswer == Answer::Ask) {
+        // Nobody is around to answer prompts, so anything that asks for confirmation gets its default answer
+        Threads::autoAnswer = Answer::Default;
+    }
+    sigset_t signals{};
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    // Blocked before any threads start so they inherit the mask and the signals only arrive through signalFd
+    int signalFd{signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC)};
+    int listener{openListener()};
+    if (listener == -1) {
+        close(signalFd);
+        return;
+    }
+    int epollFd{epoll_create1(EPOLL_CLOEXEC)};
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = listener;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, listener, &event);
+    event.data.fd = signalFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, signalFd, &event);
+    std::println("Listening on {}.", Music::socketPath.string());
+    std::fflush(stdout);
+
+    std::thread statThreadObj{monitorChanges};
+    std::thread supervisorThreadObj{supervisorThread}; // so a slow request doesn't hold up the playlist
+    std::unordered_map<int, Client> clients{};
+    epoll_event events[maxEvents];
+    while (Threads::running) {
+        int ready{epoll_wait(epollFd, events, maxEvents, -1)};
+        for (int i{0}; i < ready; ++i) {
+            int fd{events[i].data.fd};
+            if (fd == listener) {
+                acceptClients(epollFd, listener, clients);
+            } else if (fd == signalFd) {
+                Threads::running = false;
+            } else {
+                serveClient(epollFd, fd, events[i].events, clients);
+            }
+        }
+    }
+
+    for (auto& [fd, client] : clients) {
+        sendResponses(fd, client); // best effort, mainly so whoever sent `exit` gets a reply
+        close(fd);
+    }
+    close(listener);
+    close(signalFd);
+    close(epollFd);
+    std::error_code ec{};
+    fs::remove(Music::socketPath, ec);
+    statThreadObj.join();
+    stopSupervisor();
+    supervisorThreadObj.join();
+}
+
+static int connectToDaemon() {
+    sockaddr_un address{};
+    if (!socketAddress(address)) {
+        return -1;
+    }
+    int fd{socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)};
+    if (connect(fd, (sockaddr*)&address, sizeof(address)) == -1) {
+        std::println("Error: could not connect to a Cleo daemon at {}.", Music::socketPath.string());
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Sends all requests without waiting for responses, reading responses as they arrive so neither side's
+// socket buffer can fill up and deadlock the other
+static bool exchange(int fd, std::string_view requests, std::size_t expected,
+                     const std::function<void(std::string_view)>& onResponse) {
+    std::size_t sent{0};
+    std::size_t received{0};
+    std::string pending{};
+    char buf[65536];
+    while (received < expected) {
+        pollfd pfd{};
+        pfd.fd = fd;
+        pfd.events = sent < requests.size() ? (short)(POLLIN | POLLOUT) : (short)POLLIN;
+        if (poll(&pfd, 1, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (pfd.revents & POLLOUT) {
+            ssize_t written{
+                send(fd, requests.data() + sent, requests.size() - sent, MSG_NOSIGNAL | MSG_DONTWAIT)};
+            if (written == -1 && errno != EAGAIN) {
+                return false;
+            }
+            sent += written > 0 ? (std::size_t)written : 0;
+        }
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t size{recv(fd, buf, sizeof(buf), MSG_DONTWAIT)};
+            if (size == 0 || (size == -1 && errno != EAGAIN)) {
+                return false; // daemon went away
+            }
+            if (size > 0) {
+                pending.append(buf, (std::size_t)size);
+            }
+            std::size_t start{0};
+            std::size_t end{};
+            while ((end = pending.find('\n', start)) != std::string::npos) {
+                onResponse(std::string_view{pending.data() + start, end - start});
+                ++received;
+                start = end + 1;
+            }
+            pending.erase(0, start);
+        }
+    }
+    return true;
+}
+
+static void printResponse(std::string_view response) {
+    if (!response.empty()) {
+        std::println("{}", unescapeResponse(response));
+    }
+}
+
+int runClient(const std::vector<std::string>& commands) {
+    int fd{connectToDaemon()};
+    if (fd == -1) {
+        return 1;
+    }
+    bool succeeded{true};
+    if (!commands.empty()) {
+        std::string requests{};
+        for (const auto& command : commands) {
+            requests += command;
+            requests += '\n';
+        }
+        succeeded = exchange(fd, requests, commands.size(), printResponse);
+    } else {
+        std::string line{};
+        while (succeeded && std::getline(std::cin, line)) {
+            line += '\n';
+            succeeded = exchange(fd, line, 1, printResponse);
+            std::fflush(stdout);
+        }
+    }
+    close(fd);
+    if (!succeeded) {
+        std::println("Error: lost connection to the Cleo daemon.");
+        return 1;
+    }
+    return 0;
+}
+
+static double benchmarkClientsAt(int numCommands, int numClients) {
+    // Uses `volume` since it is cheap and doesn't change anything
+    std::vector<int> fds{};
+    for (int i{0}; i < numClients; ++i) {
+        int fd{connectToDaemon()};
+        if (fd == -1) {
+            for (int open : fds) {
+                close(open);
+            }
+            return -1;
+        }
+        fds.push_back(fd);
+    }
+    std::vector<std::thread> threads{};
+    std::vector<char> succeeded(fds.size(), 0);
+    auto start{std::chrono::steady_clock::now()};
+    for (std::size_t i{0}; i < fds.size(); ++i) {
+        std::size_t share{(std::size_t)numCommands / fds.size() +
+                          (i < (std::size_t)numCommands % fds.size())};
+        threads.emplace_back([&, i, share] {
+            std::string requests{};
+            for (std::size_t j{0}; j < share; ++j) {
+                requests += "volume\n";
+            }
+            succeeded[i] = exchange(fds[i], requests, share, [](std::string_view) {});
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    std::chrono::duration<double> elapsed{std::chrono::steady_clock::now() - start};
+    for (int fd : fds) {
+        close(fd);
+    }
+    if (std::find(succeeded.begin(), succeeded.end(), 0) != succeeded.end()) {
+        return -1;
+    }
+    return elapsed.count();
+}
+
+int runBenchmark(int numCommands) {
+    for (int numClients : {1, benchmarkClients}) {
+        double elapsed{benchmarkClientsAt(numCommands, numClients)};
+        if (elapsed < 0) {
+            std::println("Error: benchmark failed, is a Cleo daemon running at {}?",
+                         Music::socketPath.string());
+            return 1;
+        }
+        std::println("{} client{}: {} commands in {:.1f} ms ({:.0f} commands/sec)", numClients,
+                     numClients == 1 ? "" : "s", numCommands, elapsed * 1000, numCommands / elapsed);
+    }
+    return 0;
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <string>
+#include <vector>
+void runDaemon();
+int runClient(const std::vector<std::string>& commands);
+int runBenchmark(int numCommands);
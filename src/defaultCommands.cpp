@@ -1,18 +1,35 @@
 #include "defaultCommands.hpp"
 #include "autocomplete.hpp"
+#include "batchStat.hpp"
 #include "command.hpp"
+#include "dspChain.hpp"
+#include "dupes.hpp"
 #include "input.hpp"
+#include "jobs.hpp"
+#include "listing.hpp"
+#include "loudness.hpp"
+#include "metadata.hpp"
 #include "music.hpp"
+#include "playStats.hpp"
 #include "playlistCommands.hpp"
+#include "playlistFile.hpp"
+#include "readAhead.hpp"
+#include "seekIndex.hpp"
+#include "sharedIndex.hpp"
+#include "supervisor.hpp"
 #include "threads.hpp"
+#include "visualizer.hpp"
 #include <SFML/Audio/Music.hpp>
 #include <SFML/System/Time.hpp>
+#include <charconv>
 #include <cmath>
 #include <fstream>
+#include <iostream>
 #include <print>
 #include <random>
+#include <thread>
+#include <unistd.h>
 #include <readline/tilde.h>
-#include <regex>
 #include <wordexp.h>
 using CommandDefinition = std::flat_map<std::string, std::string>;
 using CommandMap = std::flat_map<std::string, std::function<void(Command&)>>;
@@ -41,22 +58,66 @@ const CommandMap Cleo::commands{
     {"rewind", Cleo::rewind},
     {"find", Cleo::find},
     {"set-music", Cleo::setMusicDir},
+    {"add-music", Cleo::addMusicDir},
+    {"remove-music", Cleo::removeMusicDir},
     {"set-playlist", Cleo::setPlaylistDir},
     {"set-prompt", Cleo::setPrompt},
     {"run", Cleo::run},
     {"random", Cleo::random},
+    {"plays", Cleo::plays},
+    {"buffer", Cleo::buffer},
+    {"loudness", Cleo::loudness},
+    {"normalize", Cleo::normalize},
+    {"dupes", Cleo::dupes},
+    {"readahead", Cleo::readahead},
+    {"tags", Cleo::tags},
+    {"seekbench", Cleo::seekbench},
+    {"statbench", Cleo::statbench},
+    {"pager", Cleo::pager},
+    {"visualize", Cleo::visualize},
+    {"eq", Cleo::eq},
+    {"speed", Cleo::speed},
+    {"wait", Cleo::wait},
+};
+// Commands that can take a while run on a worker thread without holding up playback, after any earlier
+// command they conflict with, and take StateLock themselves for the moments they change what other threads
+// use. Everything else is quick and counts as touching everything.
+const std::flat_map<std::string, JobTraits> Cleo::slowCommands{
+    {"rename", {Library | Playlists, Library | Playlists}},
+    {"delete", {Library | Playlists, Library | Playlists}},
+    {"run", {AllResources, AllResources}},
+    {"dupes", {Library, NoResource}},
+    {"loudness", {Library, NoResource}},
+    {"seekbench", {Library, NoResource}},
+    {"statbench", {Library, NoResource}},
+    {"wait", {Playback, NoResource}},
+    {"playlist load", {Library | Playlists, Playlists | Playback}},
+    {"playlist import", {Library | Playlists, Playlists | Playback}},
+    {"playlist union", {Library | Playlists, Playlists | Playback}},
+    {"playlist intersect", {Library | Playlists, Playlists | Playback}},
+    {"playlist diff", {Library | Playlists, Playlists | Playback}},
 };
 const std::vector<std::string> Cleo::commandList{
-    "delete",    "exit",         "find",       "forward", "help",   "list",   "loop", "pause",
-    "play",      "playlist",     "random",     "rename",  "repeat", "rewind", "run",  "seek",
-    "set-music", "set-playlist", "set-prompt", "stop",    "time",   "volume",
+    "add-music", "buffer", "delete",    "dupes",     "eq",           "exit",       "find",   "forward",
+    "help",      "list",   "loop",      "loudness",  "normalize",    "pager",      "pause",  "play",
+    "playlist",  "plays",  "random",    "readahead", "remove-music", "rename",     "repeat", "rewind",
+    "run",       "seek",   "seekbench", "set-music", "set-playlist", "set-prompt", "speed",  "statbench",
+    "stop",      "tags",   "time",      "visualize", "volume",       "wait",
 };
 const CommandDefinition Cleo::commandHelp{
     {"play",
      R"(Usage: play <song>
 Looks for a song in the music directory (default ~/music) and tries to play it.
 You can also type the first part of the song and Cleo will try to autocomplete it.)"},
-    {"list", "Lists all songs in the music directory."},
+    {"list", R"(Usage: list [filters] [offset:N] [limit:N]
+Lists all songs in the music directory. `offset` skips that many songs and `limit` stops after that many,
+and with `pager on`, long listings stop after each screenful. Filters narrow the songs down using their
+tags, and a song has to match all of them to be listed. The fields are artist, album, title and genre,
+which match any part of the tag ignoring case, and track and year, which can be compared with <, >, <=,
+>= or =.
+A filter without a field matches any part of the file name. For example:
+list artist:bach year:<1750
+lists everything by Bach from before 1750.)"},
     {"stop", "Stops the currently playing song."},
     {"pause", "Toggles whether the music should be paused or not."},
     {"exit", "Exits Cleo."},
@@ -66,7 +127,10 @@ it is between 0 and 100. A leading '+' or '-' increments/decrements the volume i
     {"help", "Shows how commands work and how you can use Cleo."},
     {"commands", join(Cleo::commandList, "\n")},
     {"time", "Shows the current song's elapsed time and remaining time."},
-    {"loop", "Toggles whether songs should loop when they reach the end."},
+    {"loop", R"(Usage: loop [start end]
+With no arguments, toggles whether songs should loop when they reach the end.
+Otherwise, plays the part of the current song between two timestamps over and over, until `loop` is
+used again or another song starts. Timestamps can be down to the millisecond, see `help timestamps`.)"},
     {"repeat", R"(Usage: repeat [numRepeats]
 By default, repeats the song once.
 Otherwise, repeats the song the given number of times provided it is at least 0.)"},
@@ -77,6 +141,11 @@ or it will fail. The new song will have the same extension as the original, so d
 add an extension yourself. If you want to rename multiple songs, it works like this:
 rename old1 new1 old2 new2 ...
 THIS COMMAND DOES NOT CHECK IF A SONG WILL BE OVERWRITTEN.)"},
+    {"timestamps", R"(Durations and timestamps can be given in any of these formats:
+ss       a number of seconds, e.g. 90
+mm:ss    e.g. 1:30
+hh:mm:ss e.g. 1:01:30
+Any of these can end in up to three decimal places for fractions of a second, e.g. 1:02.350)"},
     {"formats", R"(Supported formats:
 mp3
 ogg
@@ -91,13 +160,13 @@ characters as long as it doesn't match anything else, e.g. `l` doesn't work beca
 matches both `list` and `loop`. `li` works because it only matches list.)"},
     {"playlist", R"(Usage: playlist [subcommand] [argument]
 This allows you to interact with the playlist in various ways.
-If no subcommand is specified, it will show all songs in the playlist.
+If no subcommand is specified, it will show all songs in the playlist, which can be narrowed down with
+`offset:N` and `limit:N` like `list`.
 Do `playlist commands` to see all subcommands or `playlist <subcommand>` to see more
 specific help. Note: you can also use the alias `queue` to make autocompletion easier.)"},
     {"seek", R"(Usage: seek <duration/timestamp>
 Seeks to the specified duration or timestamp, only works if there is currently a song playing.
-Accepts either a positive whole amount in seconds or a timestamp in one of these formats:
-hh:mm:ss or mm:ss
+Accepts either an amount in seconds or a timestamp (see `help timestamps`).
 Seeking past the end of the song goes straight to the end and stops playback.)"},
     {"forward", R"(Usage: forward <duration/timestamp>
 Like seek, but takes current time elapsed into account and adds the given duration.)"},
@@ -106,9 +175,17 @@ Like seek, but takes current time elapsed into account and subtracts the given d
     {"find", R"(Usage: find <searches>
 For each search term given, lists all songs that start with the specified search term.)"},
     {"set-music", R"(Usage: set-music [directory]
-Instructs Cleo to search in this directory for songs, provided the directory exists.
-To make this change permanent, put this command into ~/.config/cleo/startup
-(see `run` for more))"},
+Instructs Cleo to search in this directory for songs, provided the directory exists. With no arguments,
+shows the music directory and any added with `add-music`. To make this change permanent, put this
+command into ~/.config/cleo/startup (see `run` for more))"},
+    {"add-music", R"(Usage: add-music <directory> [name]
+Looks for songs in another directory as well as the music directory, e.g. a network share. Its songs
+are known as name/song, where the name defaults to the directory's own name, so they don't clash with
+songs of the same name elsewhere. If nothing else matches, they can also be played by the song's name
+alone. If the directory goes offline, its songs disappear until it's back, without losing anything
+Cleo has cached about them. Like `set-music`, put this into ~/.config/cleo/startup to make it permanent.)"},
+    {"remove-music", R"(Usage: remove-music <name>
+Stops looking for songs in a directory added with `add-music`. Nothing is deleted.)"},
     {"set-playlist", R"(Usage: set-playlist [directory]
 Like `set-music`, but controls where to look for playlists.)"},
     {"run", R"(Usage: run <scripts>
@@ -117,7 +194,7 @@ Cleo commands. Lines beginning with a `#` are treated as comments and ignored.
 Scripts are located in ~/.config/cleo
 In particular, ~/.config/cleo/startup is automatically executed when Cleo starts,
 so any changes you want to make permanent should go in there. However, scripts
-cannot run other scripts.)"},
+cannot run other scripts. Press Ctrl-C to stop a script partway through.)"},
     {"set-prompt", R"(Usage: set-prompt <prompt>
 Changes the prompt that appears at the beginning of each line. This does not apply
 to the prompt used in help mode. It is highly recommended to use quotes if you want
@@ -131,15 +208,101 @@ playlists: ~/Music/playlists
 These can be changed with `set-music` and `set-playlist` respectively.
 When the initial setup is run, Cleo places commands to set these defaults in ~/.config/cleo/startup.
 For more information about these files, see `run`.)"},
+    {"pager", R"(Usage: pager [on|off]
+With the pager on, listings longer than the terminal stop after each screenful until you press Enter,
+or q to stop there. With no arguments, shows whether it's on.)"},
+    {"visualize", R"(Usage: visualize [on|off]
+Shows a spectrum and peak meters for whatever's playing on the top lines of the terminal, with the prompt
+and everything else carrying on underneath. With no arguments, shows whether it's on and how much CPU time
+it's taking.)"},
+    {"eq", R"(Usage: eq [on|off|reset|bench]
+       eq band <frequency> <gain> [q] [peak|lowshelf|highshelf]
+       eq remove <frequency>
+       eq preamp <gain>
+       eq limiter <on|off>
+Shapes the sound with up to 10 bands, each turning up or down (gain, in dB) the sound around a frequency
+in Hz, which can also be written like 1.5k. A peak band (the default) only affects frequencies near its
+own, more narrowly the higher q is (1 by default), while a shelf affects everything below or above it.
+A band at the same frequency as another replaces it. The preamp turns everything up or down first, which
+leaves room for boosts, and the limiter (on by default) stops anything that still goes over full scale
+from clipping harshly. `off` bypasses the EQ without forgetting the bands, and `reset` forgets them.
+With no arguments, shows the current settings. `bench` shows how long processing a block of audio takes.
+Settings aren't saved, so put the commands in your startup script to keep them (see `run`).)"},
+    {"speed", R"(Usage: speed [factor]
+Plays faster or slower without changing the pitch, which is handy for practising along with a song or
+getting through a podcast. The factor can be between 0.5 and 2, with or without an x after it, and 1 is
+normal speed. Times shown by `time`, `seek` and playlists stay in terms of the song itself. With no
+arguments, shows the current speed.)"},
     {"random", R"(Usage: random [prefix]
-If a prefix is given, plays a random song with that prefix, otherwise selects a song from your library.)"},
+If a prefix is given, plays a random song with that prefix, otherwise selects a song from your library.
+Songs you've played less often are more likely to come up, and the last 32 songs played are avoided
+where possible.)"},
+    {"plays", R"(Usage: plays [songs]
+Shows how many times each song has been played and skipped, how much of it is heard on average and when it
+was last played. A song stopped before it's halfway through counts as skipped. With no songs, shows the 10
+most played.)"},
+    {"wait", R"(Usage: wait [duration]
+Waits until nothing is playing and the playlist has finished, or until the given amount of audio has
+played, then lets the next command run. Meant for scripts and batch mode, especially with the null
+audio output (`cleo --null-audio`), which plays songs to a virtual clock that `buffer` shows. Unless
+it's given a speed, that clock only moves while waiting, as fast as songs decode, and stops exactly when
+the duration is up. Press Ctrl-C to stop waiting.)"},
+    {"buffer", R"(Usage: buffer [latency depth]
+With no arguments, shows how playback is being buffered, how many underruns (gaps caused by decoding
+falling behind) there have been, how long playlists take to start the next song and how much audio has
+been played in total. Otherwise, sets how
+many milliseconds of audio are handed to the sound card at a time (latency) and how many are decoded
+ahead in total (depth). Changes take effect from the next song. If playback stutters when your computer
+is busy, try a larger depth.)"},
+    {"loudness", R"(Usage: loudness [songs]
+Cleo measures how loud each song in your library is in the background, using the EBU R128 standard.
+With no arguments, shows how far along this is. Otherwise, shows each song's loudness, its true peak,
+and the gain `normalize track` would apply to it.)"},
+    {"normalize", R"(Usage: normalize [off|track|album]
+Adjusts the volume of each song so they all sound about as loud as each other (-18 LUFS) without
+clipping. `track` sets the gain of each song on its own, while `album` uses one gain for the whole
+playlist, so quiet songs stay quiet compared to the rest. Outside of a playlist, `album` behaves like
+`track`. Songs that haven't been measured yet are played as they are. With no arguments, shows the
+current mode. Changes take effect from the next song.)"},
+    {"dupes", R"(Usage: dupes [audio]
+Finds songs in your music directory that are copies of each other, even if they have different names.
+With `audio`, also finds the same recording saved in different formats by comparing how the songs
+sound. This has to decode songs of similar length, so it is much slower. Press Ctrl-C to cancel.)"},
+    {"readahead", R"(Usage: readahead [megabytes]
+Cleo loads the song that's playing well ahead of where it's up to, and warms up the next few songs in
+the playlist, so a slow disk or network share doesn't cause stuttering. With no arguments, shows how
+much is loaded and how long playback has had to wait on the disk. Otherwise, sets how much memory
+read-ahead may use (default 128).)"},
+    {"tags", R"(Usage: tags [songs]
+With no arguments, shows how many songs have had their tags read and how long it took, and how often
+the song index shared between instances of Cleo on this computer saved scanning a directory. Otherwise,
+shows the artist, album, title, genre, track number and year of each song. To search by tag, see
+`list`.)"},
+    {"seekbench", R"(Usage: seekbench <song> [seeks]
+Seeking in a long song stored on a slow disk or network share can take a while, since the decoder
+reads from wherever it lands a piece at a time. Songs too big to be loaded ahead in full get a seek
+index the first time they're played, which Cleo uses to load the right part of the song in one go
+before seeking. This seeks to random points in the song (10 by default), once with the index and once
+without, dropping the song from memory before each seek, and shows how long each took.)"},
+    {"statbench", R"(Usage: statbench [--drop-caches] [directory] [one|ring|threads]
+Loading a playlist or rescanning a directory checks that lots of files are there at once, which Cleo
+splits between threads, so that on a network share they don't each wait for a round trip to the server.
+This checks every file under the given directory, or every song in your library, one at a time, with
+io_uring and with threads, and shows how long each took. Only the first to run sees a cold cache, so
+give one way to run at a time and drop the cache in between. As root, --drop-caches does that before
+each one, but be warned that it empties the kernel's cache of file names and inodes for the whole
+system, not just for Cleo, which slows down everything else running until it fills up again.)"},
 };
 
 static constexpr int VOLUME_TOO_LOW{-1};
 static constexpr int VOLUME_TOO_HIGH{-2};
 static constexpr int REPEATS_TOO_LOW{-3};
+static constexpr int BUFFER_TOO_SMALL{-4};
+static constexpr int BUDGET_TOO_SMALL{-5};
+static constexpr int SEEKS_TOO_FEW{-6};
 
-std::string stem(std::string_view filename) { return fs::path{filename}.stem(); }
+// Keeps the root a song is in, e.g. nas/song.mp3 -> nas/song
+std::string stem(std::string_view filename) { return std::string{displayName(filename)}; }
 
 std::vector<std::string> transformStem(const std::vector<std::string>& input) {
     std::vector<std::string> output(input.size());
@@ -152,79 +315,135 @@ void findHelp(const CommandDefinition& domain, const std::string& topic) {
         if (Threads::helpMode) {
             Threads::helpMode = false;
         } else {
-            std::println("No help found for 'quit'.");
+            std::println(Threads::output, "No help found for 'quit'.");
         }
         return;
     }
     if (domain.contains(topic)) {
-        std::println("{}", domain.at(topic));
+        std::println(Threads::output, "{}", domain.at(topic));
         return;
     }
     AutoMatch match{domain.keys(), topic};
     switch (match.matchType) {
         case Match::NoMatch:
-            std::println("No help found for '{}'.", topic);
+            std::println(Threads::output, "No help found for '{}'.", topic);
             break;
         case Match::ExactMatch:
-            std::println("{}", domain.at(match.exactMatch()));
+            std::println(Threads::output, "{}", domain.at(match.exactMatch()));
             break;
         case Match::MultipleMatch:
-            std::println("Multiple matches found, could be one of {}.", join(match.matches, ", "));
+            std::println(Threads::output, "Multiple matches found, could be one of {}.",
+                         join(match.matches, ", "));
+            break;
+    }
+}
+
+void showUsage(const CommandDefinition& domain, const std::string& topic) {
+    // Only called when a command was given the wrong arguments, so this counts as a failure
+    ++Threads::errorCount;
+    findHelp(domain, topic);
+}
+
+bool confirm(std::string_view question, bool defaultAnswer) {
+    switch (Threads::autoAnswer) {
+        case Answer::Yes:
+            return true;
+        case Answer::No:
+            return false;
+        case Answer::Default:
+            return defaultAnswer;
+        case Answer::Ask:
             break;
     }
+    StateUnlock unlock{};
+    std::string answer{};
+    std::print(Threads::output, "{} [{}] ", question, defaultAnswer ? "Y/n" : "y/N");
+    std::fflush(Threads::output);
+    if (!std::getline(std::cin, answer)) {
+        std::println(Threads::output);
+        return defaultAnswer;
+    }
+    if (answer == "y" || answer == "Y") {
+        return true;
+    } else if (answer == "n" || answer == "N") {
+        return false;
+    }
+    return defaultAnswer;
 }
 
 void Cleo::play(Command& cmd) {
     if (cmd.argCount() != 1) {
-        findHelp(Cleo::commandHelp, "play");
+        showUsage(Cleo::commandHelp, "play");
         return;
     }
     std::string song{cmd.nextArg()};
-    fs::path songPath{Music::musicDir / song};
-    if (fs::exists(songPath)) {
-        if (Music::music.openFromFile(songPath)) {
+    fs::path path{songPath(song)};
+    if (fs::exists(path)) {
+        applyNormalization(song);
+        PlayStats::interrupted();
+        if (Music::music.openFromFile(path)) {
             Music::curSong = song;
             Music::music.play();
+            PlayStats::started(song);
         } else {
-            std::println("The file is in an unsupported format.");
+            printError("The file is in an unsupported format.");
         }
         return;
     }
-    AutoMatch match{Music::songs, song};
+    AutoMatch match{matchSong(song)};
     std::string matchedSong{};
     switch (match.matchType) {
         case Match::NoMatch:
-            std::println("Song not found.");
+            printError("Song not found.");
             return;
         case Match::ExactMatch:
             matchedSong = match.exactMatch();
             break;
         case Match::MultipleMatch:
             std::vector<std::string> baseSongNames{transformStem(match.matches)};
-            std::println("Multiple matches found, could be one of {}.", join(baseSongNames, ", "));
+            printError("Multiple matches found, could be one of {}.", join(baseSongNames, ", "));
             return;
     }
-    if (!Music::music.openFromFile(Music::musicDir / matchedSong)) {
-        std::println("A match was found, but the file is in an unsupported format.");
+    applyNormalization(matchedSong);
+    PlayStats::interrupted();
+    if (!Music::music.openFromFile(songPath(matchedSong))) {
+        printError("A match was found, but the file is in an unsupported format.");
         return;
     }
     Music::curSong = stem(matchedSong);
-    Music::repeats = 0;
     Music::music.play();
+    PlayStats::started(matchedSong);
 }
 
-void Cleo::list(Command&) {
-    std::vector<std::string> directorySorted{transformStem(Music::songs)};
-    std::println("{}", join(directorySorted, ", "));
+void Cleo::list(Command& cmd) {
+    std::vector<std::string> filters{cmd.arguments()};
+    std::optional<ListRange> range{Listing::takeRange(filters)};
+    if (!range) {
+        return;
+    }
+    if (filters.empty()) {
+        Listing::printSongs(Music::songs, *range);
+        return;
+    }
+    std::optional<std::vector<std::string>> matches{Metadata::query(filters)};
+    if (!matches) {
+        return;
+    }
+    if (matches->empty()) {
+        std::println(Threads::output, "No songs match.");
+        return;
+    }
+    Listing::printSongs(*matches, *range);
 }
 
 void Cleo::stop(Command&) {
     if (Music::music.getStatus() == sf::Music::Status::Playing) {
         Music::inPlaylistMode = false;
+        PlayStats::interrupted();
         Music::music.stop();
         Music::curSong = "";
     } else {
-        std::println("Nothing playing.");
+        std::println(Threads::output, "Nothing playing.");
     }
 }
 
@@ -232,7 +451,7 @@ void Cleo::exit(Command&) { Threads::running = false; }
 
 static void getVolume() {
     float curVolume{Music::music.getVolume()};
-    std::println("Volume: {:.1f}%", curVolume);
+    std::println(Threads::output, "Volume: {:.1f}%", curVolume);
 }
 
 static void setVolume(const std::string& volume, bool additive = false) {
@@ -251,13 +470,13 @@ static void setVolume(const std::string& volume, bool additive = false) {
             Music::music.setVolume(newVolume);
         }
     } catch (const std::exception&) {
-        std::println("Value given was not a number.");
+        printError("Value given was not a number.");
         return;
     } catch (const int x) {
         if (x == VOLUME_TOO_LOW) {
-            std::println("Volume cannot be below 0.");
+            printError("Volume cannot be below 0.");
         } else if (x == VOLUME_TOO_HIGH) {
-            std::println("Volume cannot be above 100.");
+            printError("Volume cannot be above 100.");
         }
         return;
     }
@@ -267,7 +486,7 @@ void Cleo::volume(Command& cmd) {
     if (cmd.argCount() == 0) {
         getVolume();
     } else if (cmd.argCount() != 1) {
-        findHelp(Cleo::commandHelp, "volume");
+        showUsage(Cleo::commandHelp, "volume");
     } else {
         std::string volume{cmd.nextArg()};
         if (volume[0] == '+' || volume[0] == '-') {
@@ -289,7 +508,7 @@ void Cleo::pause(Command&) {
             Music::music.play();
             break;
         case Status::Stopped:
-            std::println("Cannot pause or unpause while music is stopped.");
+            std::println(Threads::output, "Cannot pause or unpause while music is stopped.");
             break;
     }
 }
@@ -308,26 +527,11 @@ std::string join(const std::vector<std::string>& vec, std::string_view delim) {
     return joined;
 }
 
-static std::vector<std::string> split(const std::string& str, std::string_view delim) {
-    std::size_t curPos{0};
-    std::size_t endPos{0};
-    std::size_t delimLen{delim.length()};
-    std::string curToken{};
-    std::vector<std::string> ret{};
-    while ((endPos = str.find(delim, curPos)) != std::string::npos) {
-        curToken = str.substr(curPos, endPos - curPos);
-        curPos = endPos + delimLen;
-        ret.push_back(curToken);
-    }
-    ret.push_back(str.substr(curPos));
-    return ret;
-}
-
 void Cleo::help(Command& cmd) {
     if (cmd.argCount() == 0 && !Threads::helpMode) {
-        std::println("Welcome to Cleo's interactive help utility.");
-        std::println("Type `commands` to see the list of commands.");
-        std::println("Type `quit` or CTRL-D to return to Cleo.");
+        std::println(Threads::output, "Welcome to Cleo's interactive help utility.");
+        std::println(Threads::output, "Type `commands` to see the list of commands.");
+        std::println(Threads::output, "Type `quit` or CTRL-D to return to Cleo.");
         Threads::helpMode = true;
         return;
     }
@@ -346,7 +550,7 @@ void Cleo::help(Command& cmd) {
     AutoMatch match{domain.keys(), search};
     switch (match.matchType) {
         case Match::NoMatch:
-            std::println("No help found for '{}'.", search);
+            std::println(Threads::output, "No help found for '{}'.", search);
             return;
         case Match::ExactMatch:
             if (match.exactMatch() == "playlist" && cmd.argCount() >= 1) {
@@ -357,7 +561,8 @@ void Cleo::help(Command& cmd) {
             args.append_range(cmd.arguments());
             break;
         case Match::MultipleMatch:
-            std::println("Multiple matches found, could be one of {}.", join(match.matches, ", "));
+            std::println(Threads::output, "Multiple matches found, could be one of {}.",
+                         join(match.matches, ", "));
             return;
     }
     std::string topic{join(args, " ")};
@@ -376,19 +581,113 @@ std::string numAsTimestamp(int time) {
 
 void Cleo::time(Command&) {
     if (Music::music.getStatus() == sf::Music::Status::Stopped) {
-        std::println("Nothing playing.");
+        std::println(Threads::output, "Nothing playing.");
     } else {
         int timeElapsed{(int)Music::music.getPlayingOffset().asSeconds()};
         std::string elapsedTimestamp{numAsTimestamp(timeElapsed)};
         std::string remainingTimestamp{
             numAsTimestamp((int)Music::music.getDuration().asSeconds() - timeElapsed)};
-        std::println("{} elapsed, {} remaining.", elapsedTimestamp, remainingTimestamp);
+        float speed{Music::music.getSpeed()};
+        if (speed != 1) {
+            std::println(Threads::output, "{} elapsed, {} remaining, playing at {:g}x speed.",
+                         elapsedTimestamp, remainingTimestamp, speed);
+        } else {
+            std::println(Threads::output, "{} elapsed, {} remaining.", elapsedTimestamp, remainingTimestamp);
+        }
+    }
+}
+
+// Whole number made only of digits, with between minDigits and maxDigits of them
+static std::optional<std::uint64_t> parseDigits(std::string_view text, std::size_t minDigits,
+                                                std::size_t maxDigits) {
+    std::uint64_t value{};
+    if (text.size() < minDigits || text.size() > maxDigits) {
+        return std::nullopt;
+    }
+    auto [end, error]{std::from_chars(text.data(), text.data() + text.size(), value)};
+    if (error != std::errc{} || end != text.data() + text.size()) {
+        return std::nullopt;
     }
+    return value;
 }
 
-void Cleo::loop(Command&) {
-    Music::music.setLooping(!Music::music.isLooping());
-    std::println("Looping: {}.", Music::music.isLooping() ? "enabled" : "disabled");
+// A number of seconds or hh:mm:ss/mm:ss, either of which can end in up to three decimal places
+static std::optional<sf::Time> parseTimestamp(std::string_view timestamp) {
+    static constexpr std::uint64_t millisPerDigit[]{0, 100, 10, 1};
+    std::uint64_t millis{0};
+    if (std::size_t point{timestamp.find('.')}; point != std::string_view::npos) {
+        std::string_view fraction{timestamp.substr(point + 1)};
+        std::optional<std::uint64_t> digits{parseDigits(fraction, 1, 3)};
+        if (!digits) {
+            return std::nullopt;
+        }
+        millis = *digits * millisPerDigit[fraction.size()];
+        timestamp = timestamp.substr(0, point);
+    }
+    std::uint64_t seconds{0};
+    std::size_t colon{timestamp.rfind(':')};
+    if (colon == std::string_view::npos) {
+        std::optional<std::uint64_t> whole{parseDigits(timestamp, 1, 9)};
+        if (!whole) {
+            return std::nullopt;
+        }
+        seconds = *whole;
+    } else {
+        std::optional<std::uint64_t> secs{parseDigits(timestamp.substr(colon + 1), 2, 2)};
+        timestamp = timestamp.substr(0, colon);
+        colon = timestamp.rfind(':');
+        std::optional<std::uint64_t> hours{0};
+        if (colon != std::string_view::npos) {
+            hours = parseDigits(timestamp.substr(0, colon), 1, 2);
+            timestamp = timestamp.substr(colon + 1);
+        }
+        std::optional<std::uint64_t> mins{parseDigits(timestamp, 1, 2)};
+        if (!secs || !mins || !hours || *secs >= 60 || *mins >= 60) {
+            return std::nullopt;
+        }
+        seconds = (*hours * 60 + *mins) * 60 + *secs;
+    }
+    return sf::microseconds((std::int64_t)(seconds * 1000 + millis) * 1000);
+}
+
+static std::optional<sf::Time> getTime(Command& cmd) { return parseTimestamp(cmd.nextArg()); }
+
+// Like numAsTimestamp, but down to the millisecond
+static std::string preciseTimestamp(sf::Time time) {
+    auto [seconds, millis]{std::div(time.asMilliseconds(), 1000)};
+    return std::format("{}.{:03}", numAsTimestamp(seconds), millis);
+}
+
+void Cleo::loop(Command& cmd) {
+    if (cmd.argCount() == 0) {
+        if (Music::music.getLoopRegion()) {
+            Music::music.clearLoopRegion(); // back to looping the whole song or not, as it was before
+        } else {
+            Music::music.setLooping(!Music::music.isLooping());
+        }
+        std::println(Threads::output, "Looping: {}.", Music::music.isLooping() ? "enabled" : "disabled");
+        return;
+    }
+    if (cmd.argCount() != 2) {
+        showUsage(Cleo::commandHelp, "loop");
+        return;
+    }
+    if (Music::music.getStatus() == sf::Music::Status::Stopped) {
+        std::println(Threads::output, "Nothing playing.");
+        return;
+    }
+    std::optional<sf::Time> start{getTime(cmd)};
+    std::optional<sf::Time> end{getTime(cmd)};
+    if (!start || !end) {
+        printError("Invalid duration or timestamp given. See 'help timestamps' for more.");
+        return;
+    }
+    if (*start >= *end || *end > Music::music.getDuration()) {
+        printError("The loop has to start before it ends, and can't end past the end of the song.");
+        return;
+    }
+    Music::music.setLoopRegion(*start, *end);
+    std::println(Threads::output, "Looping from {} to {}.", preciseTimestamp(*start), preciseTimestamp(*end));
 }
 
 static bool setRepeats(const std::string& repeats) {
@@ -398,15 +697,15 @@ static bool setRepeats(const std::string& repeats) {
         if (newRepeats < 0) {
             throw REPEATS_TOO_LOW;
         }
-        Music::repeats = newRepeats;
+        Music::music.setRepeats(newRepeats);
         return true;
     } catch (const std::exception&) {
-        std::println("Repeats must be a number.");
-        Music::repeats = 0;
+        printError("Repeats must be a number.");
+        Music::music.setRepeats(0);
         return false;
     } catch (const int) {
-        std::println("Repeats must be at least 0.");
-        Music::repeats = 0;
+        printError("Repeats must be at least 0.");
+        Music::music.setRepeats(0);
         return false;
     }
 }
@@ -414,89 +713,80 @@ static bool setRepeats(const std::string& repeats) {
 void Cleo::repeat(Command& cmd) {
     bool successful{true};
     if (Music::curSong == "") {
-        std::println("Nothing playing.");
+        std::println(Threads::output, "Nothing playing.");
         return;
     }
     if (cmd.argCount() == 0) {
-        Music::repeats = 1;
+        Music::music.setRepeats(1);
     } else {
         successful = setRepeats(cmd.nextArg());
     }
-    if (successful) {
-        std::println("{} will be repeated {} time{}.", Music::curSong, Music::repeats,
-                     Music::repeats == 1 ? "" : "s");
-    }
-}
-
-static bool playlistFromCsv(const fs::path& playlistPath, std::vector<std::string>& playlist) {
-    std::ifstream file{playlistPath};
-    std::string curItem{};
-    while (std::getline(file, curItem, ',')) {
-        if (file.eof()) {
-            // Account for dos and unix line endings. This is mainly for compatibility with smp.
-            if (curItem.ends_with("\r\n")) {
-                curItem.erase(curItem.length() - 2, 2);
-            } else if (curItem.ends_with("\n")) {
-                curItem.erase(curItem.length() - 1, 1);
-            } else {
-                std::println("Unknown line ending encountered when parsing playlist.");
-                return false;
-            }
-        }
-        playlist.push_back(curItem);
-    }
-    file.close();
-    return true;
-}
-
-static void renameInPlaylist(const fs::path& playlistPath, std::string_view song, std::string_view newName) {
-    std::vector<std::string> playlist{};
-    if (!playlistFromCsv(playlistPath, playlist)) {
+    if (!successful) {
         return;
     }
-    std::ofstream file;
-    std::replace(playlist.begin(), playlist.end(), song, newName);
-    file.open(playlistPath);
-    file << join(playlist, ",") << '\n';
-    file.close();
+    int repeats{Music::music.getRepeats()};
+    std::println(Threads::output, "{} will be repeated {} time{}.", Music::curSong, repeats,
+                 repeats == 1 ? "" : "s");
+    if (repeats > 0 && Music::music.getStatus() == sf::Music::Status::Stopped) {
+        // The song has already finished, so start the first repeat now
+        Music::music.setRepeats(repeats - 1);
+        Music::music.setPlayingOffset(sf::Time::Zero);
+        Music::music.play();
+    }
 }
 
 static void renameSongInPlaylists(std::string_view song, std::string_view newName) {
     for (const auto& playlist : fs::directory_iterator{Music::playlistDir}) {
-        renameInPlaylist(playlist.path(), song, newName);
+        if (PlaylistFile::isPlaylist(playlist.path())) {
+            PlaylistFile::renameSong(playlist.path(), song, newName);
+        }
     }
 }
 
+// Keep the library in sync straight away rather than waiting for the directory monitor, so a batch of
+// renames can refer to songs renamed earlier in the same batch
+static void replaceSong(const std::string& song, const std::string& newName) {
+    removeFromLibrary(song);
+    addToLibrary(newName); // already there if the rename overwrote an existing song
+}
+
 static void renamePair(std::string_view oldName, const std::string& newName) {
-    AutoMatch match{Music::songs, oldName};
+    StateLock lock{}; // the library is shared with playback and the directory monitor
+    AutoMatch match{matchSong(oldName)};
     fs::path songToRename;
     switch (match.matchType) {
         case Match::NoMatch:
-            std::println("Song not found.");
+            printError("Song not found.");
             break;
         case Match::ExactMatch: {
-            songToRename = Music::musicDir / match.exactMatch();
-            fs::path renamedSong{newName + songToRename.extension().string()};
-            fs::rename(songToRename, Music::musicDir / renamedSong);
-            renameSongInPlaylists(match.exactMatch(), renamedSong.string());
+            songToRename = songPath(match.exactMatch());
+            // Stays in the same root
+            fs::path renamedSong{fs::path{match.exactMatch()}.parent_path() /
+                                 (newName + songToRename.extension().string())};
+            fs::rename(songToRename, songToRename.parent_path() / renamedSong.filename());
+            replaceSong(match.exactMatch(), renamedSong.string());
             std::replace(Music::curPlaylist.begin(), Music::curPlaylist.end(), match.exactMatch(),
                          renamedSong.string());
             std::replace(Music::shuffledPlaylist.begin(), Music::shuffledPlaylist.end(), match.exactMatch(),
                          renamedSong.string());
+            {
+                StateUnlock unlock{}; // rewriting every playlist can take a while
+                renameSongInPlaylists(match.exactMatch(), renamedSong.string());
+            }
             std::string baseOldName{songToRename.stem()};
-            std::println("Renamed {} -> {}.", baseOldName, newName);
+            std::println(Threads::output, "Renamed {} -> {}.", baseOldName, newName);
             break;
         }
         case Match::MultipleMatch:
             std::vector<std::string> baseNames{transformStem(match.matches)};
-            std::println("Multiple matches found, could be one of {}.", join(baseNames, ", "));
+            printError("Multiple matches found, could be one of {}.", join(baseNames, ", "));
             break;
     }
 }
 
 void Cleo::rename(Command& cmd) {
     if (cmd.argCount() & 1 || cmd.argCount() < 2) {
-        findHelp(Cleo::commandHelp, "rename");
+        showUsage(Cleo::commandHelp, "rename");
         return;
     }
     while (cmd.argCount() >= 2) {
@@ -504,141 +794,104 @@ void Cleo::rename(Command& cmd) {
     }
 }
 
-static void removeFromPlaylist(const fs::path& playlistPath, std::string_view song) {
-    std::vector<std::string> playlist{};
-    if (!playlistFromCsv(playlistPath, playlist)) {
-        return;
-    }
-    std::ofstream outfile;
-    if (std::erase(playlist, song)) {
-        outfile.open(playlistPath);
-        outfile << join(playlist, ",") << '\n';
-    }
-    outfile.close();
-}
-
 static void removeSongFromPlaylists(std::string_view song) {
     for (const auto& playlist : fs::directory_iterator{Music::playlistDir}) {
-        removeFromPlaylist(playlist.path(), song);
+        if (PlaylistFile::isPlaylist(playlist.path())) {
+            PlaylistFile::removeSong(playlist.path(), song);
+        }
     }
 }
 
 static void removeSong(std::string_view song) {
-    AutoMatch match{Music::songs, song};
-    fs::path songPath;
+    StateLock lock{}; // the library is shared with playback and the directory monitor
+    AutoMatch match{matchSong(song)};
     switch (match.matchType) {
         case Match::NoMatch:
-            std::println("Song not found.");
+            printError("Song not found.");
             break;
         case Match::ExactMatch: {
-            fs::remove(Music::musicDir / match.exactMatch());
-            std::erase(Music::curPlaylist, match.exactMatch());
-            std::erase(Music::shuffledPlaylist, match.exactMatch());
-            removeSongFromPlaylists(match.exactMatch());
+            fs::remove(songPath(match.exactMatch()));
+            removeFromLibrary(match.exactMatch());
+            removeFromPlaylist({match.exactMatch()});
+            {
+                StateUnlock unlock{}; // rewriting every playlist can take a while
+                removeSongFromPlaylists(match.exactMatch());
+            }
             std::string baseDelName{stem(match.exactMatch())};
-            std::println("Deleted {}.", baseDelName);
+            std::println(Threads::output, "Deleted {}.", baseDelName);
             break;
         }
         case Match::MultipleMatch:
             std::vector<std::string> baseNames{transformStem(match.matches)};
-            std::println("Multiple matches found, could be one of {}.", join(baseNames, ", "));
+            printError("Multiple matches found, could be one of {}.", join(baseNames, ", "));
             break;
     }
 }
 
 void Cleo::del(Command& cmd) {
     if (cmd.argCount() == 0) {
-        findHelp(Cleo::commandHelp, "delete");
+        showUsage(Cleo::commandHelp, "delete");
         return;
     }
-    while (cmd.argCount() > 0) {
+    while (cmd.argCount() > 0 && !Jobs::cancelled()) {
         removeSong(cmd.nextArg());
     }
 }
 
 void Cleo::playlist(Command& cmd) {
-    if (cmd.argCount() == 0) {
-        const std::vector<std::string>& playlist{getPlaylist()};
-        std::vector<std::string> humanizedSongs{transformStem(playlist)};
-        std::println("{}", join(humanizedSongs, ", "));
+    if (cmd.argCount() == 0 || Listing::isRangeArg(cmd.arguments().front())) {
+        std::vector<std::string> args{cmd.arguments()};
+        std::optional<ListRange> range{Listing::takeRange(args)};
+        if (!range) {
+            return;
+        } else if (!args.empty()) {
+            showUsage(Cleo::commandHelp, "playlist");
+            return;
+        }
+        Listing::printSongs(getPlaylist(), *range);
         return;
     }
     cmd.nextArg();
     parseCmd(cmd, Playlist::commands);
 }
 
-static int timestampAsNum(const std::string& timestamp) {
-    static const std::regex timestampFormat{R"(^([0-9]?[1-9]:)?[0-5]?[0-9]:[0-5][0-9]$)"};
-    int duration{};
-    std::vector<std::string> timestampComponents{};
-    constexpr int numTimestampComponents{3};
-    if (std::regex_match(timestamp, timestampFormat)) {
-        timestampComponents = split(timestamp, ":");
-    } else {
-        return -1;
-    }
-    std::reverse(timestampComponents.begin(), timestampComponents.end());
-    timestampComponents.resize(numTimestampComponents); // 3 integers representing hours, minutes, and seconds
-    for (std::size_t i{0}; i < numTimestampComponents; ++i) {
-        if (!timestampComponents[i].empty()) {
-            duration += std::stoi(timestampComponents[i]) * (int)std::pow(60, i);
-        }
-    }
-    return duration;
-}
-
-static sf::Time getTime(Command& cmd) {
-    std::size_t length{};
-    std::string time{cmd.nextArg()};
-    int timestamp{};
-    try {
-        timestamp = std::stoi(time, &length);
-        if (length != time.length()) {
-            throw std::exception{};
-        }
-    } catch (const std::exception&) {
-        timestamp = timestampAsNum(time);
-    }
-    return sf::seconds((float)timestamp);
-}
-
 static void seekRelative(Command& cmd, bool forward) {
     if (cmd.argCount() != 1) {
-        findHelp(Cleo::commandHelp, forward ? "forward" : "rewind");
+        showUsage(Cleo::commandHelp, forward ? "forward" : "rewind");
         return;
     }
-    sf::Time duration{getTime(cmd)};
-    if (duration.asSeconds() < 0) {
-        std::println("Invalid duration or timestamp given. See 'help timestamp' for more.");
+    std::optional<sf::Time> duration{getTime(cmd)};
+    if (!duration) {
+        printError("Invalid duration or timestamp given. See 'help timestamps' for more.");
         return;
     }
     sf::Time curOffset{Music::music.getPlayingOffset()};
     if (forward) {
-        Music::music.setPlayingOffset(curOffset + duration);
+        Music::music.setPlayingOffset(curOffset + *duration);
     } else {
-        if ((curOffset - duration).asSeconds() < 0) {
+        if ((curOffset - *duration).asSeconds() < 0) {
             Music::music.setPlayingOffset(sf::Time::Zero);
         } else {
-            Music::music.setPlayingOffset(curOffset - duration);
+            Music::music.setPlayingOffset(curOffset - *duration);
         }
     }
 }
 
 void Cleo::seek(Command& cmd) {
     if (cmd.argCount() != 1) {
-        findHelp(Cleo::commandHelp, "seek");
+        showUsage(Cleo::commandHelp, "seek");
         return;
     }
     if (Music::music.getStatus() == sf::Music::Status::Stopped) {
-        std::println("Nothing playing.");
+        std::println(Threads::output, "Nothing playing.");
         return;
     }
-    sf::Time offset{getTime(cmd)};
-    if (offset.asSeconds() < 0) {
-        std::println("Invalid duration or timestamp given. See 'help timestamp' for more.");
+    std::optional<sf::Time> offset{getTime(cmd)};
+    if (!offset) {
+        printError("Invalid duration or timestamp given. See 'help timestamps' for more.");
         return;
     }
-    Music::music.setPlayingOffset(offset);
+    Music::music.setPlayingOffset(*offset);
 }
 
 void Cleo::forward(Command& cmd) { seekRelative(cmd, true); }
@@ -646,18 +899,17 @@ void Cleo::forward(Command& cmd) { seekRelative(cmd, true); }
 void Cleo::rewind(Command& cmd) { seekRelative(cmd, false); }
 
 static void findSong(std::string_view substr) {
-    std::vector<std::string> matches{};
-    std::for_each(Music::songs.begin(), Music::songs.end(), [&](std::string song) {
-        if (song.starts_with(substr)) {
-            matches.push_back(stem(song));
-        }
-    });
-    std::println("{}: {}", substr, join(matches, ", "));
+    auto [first, last]{Music::songs.withPrefix(substr)};
+    std::string matches{};
+    for (auto it{first}; it != last; ++it) {
+        matches.append(it == first ? "" : ", ").append(Music::songs.displayNameAt(it.index()));
+    }
+    std::println(Threads::output, "{}: {}", substr, matches);
 }
 
 void Cleo::find(Command& cmd) {
     if (cmd.argCount() == 0) {
-        findHelp(Cleo::commandHelp, "find");
+        showUsage(Cleo::commandHelp, "find");
         return;
     }
     while (cmd.argCount() > 0) {
@@ -667,32 +919,88 @@ void Cleo::find(Command& cmd) {
 
 void Cleo::setMusicDir(Command& cmd) {
     if (cmd.argCount() != 1) {
-        std::println("Music directory: {}", Music::musicDir.string());
+        std::println(Threads::output, "Music directory: {}", Music::musicDir.string());
+        std::vector<MusicRoot> offline{offlineRoots()};
+        for (const auto& root : Music::extraRoots) {
+            bool isOffline{std::ranges::any_of(offline, [&root](const MusicRoot& other) {
+                return other.name == root.name;
+            })};
+            std::println(Threads::output, "{}: {}{}", root.name, root.path.string(),
+                         isOffline ? " (offline)" : "");
+        }
         return;
     }
     fs::path newMusicDir{tilde_expand(cmd.nextArg().data())};
     if (!fs::exists(newMusicDir)) {
-        std::println("Music directory {} does not exist.", newMusicDir.string());
+        printError("Music directory {} does not exist.", newMusicDir.string());
         return;
     } else if (!fs::is_directory(newMusicDir)) {
-        std::println("Given path is not a directory.");
+        printError("Given path is not a directory.");
         return;
     }
     Music::musicDir = newMusicDir;
-    updateSongs();
+    updateSongs({"", Music::musicDir}); // the other roots haven't changed
+    analyseLibrary();
+}
+
+void Cleo::addMusicDir(Command& cmd) {
+    if (cmd.argCount() != 1 && cmd.argCount() != 2) {
+        showUsage(Cleo::commandHelp, "add-music");
+        return;
+    }
+    fs::path dir{tilde_expand(cmd.nextArg().data())};
+    if (!fs::is_directory(dir)) {
+        printError("{} is not a directory.", dir.string());
+        return;
+    }
+    dir = fs::weakly_canonical(dir);
+    std::string name{cmd.argCount() == 1 ? std::string{cmd.nextArg()} : dir.filename().string()};
+    if (name.empty() || name.find('/') != std::string::npos) {
+        printError("The name can't be empty or contain `/`.");
+        return;
+    }
+    if (dir == fs::weakly_canonical(Music::musicDir)) {
+        printError("That's already the music directory.");
+        return;
+    }
+    for (const auto& root : Music::extraRoots) {
+        if (root.path == dir) {
+            std::println(Threads::output, "{} was already added as {}.", dir.string(), root.name);
+            return;
+        } else if (root.name == name) {
+            printError("There's already a directory called {}, try giving this one another name.", name);
+            return;
+        }
+    }
+    Music::extraRoots.push_back({name, dir});
+    updateSongs(Music::extraRoots.back());
+    analyseLibrary();
+}
+
+void Cleo::removeMusicDir(Command& cmd) {
+    if (cmd.argCount() != 1) {
+        showUsage(Cleo::commandHelp, "remove-music");
+        return;
+    }
+    std::string name{cmd.nextArg()};
+    if (std::erase_if(Music::extraRoots, [&name](const MusicRoot& root) { return root.name == name; }) == 0) {
+        printError("No directory called {} was added.", name);
+        return;
+    }
+    dropRoot(name);
 }
 
 void Cleo::setPlaylistDir(Command& cmd) {
     if (cmd.argCount() != 1) {
-        std::println("Playlist directory: {}", Music::playlistDir.string());
+        std::println(Threads::output, "Playlist directory: {}", Music::playlistDir.string());
         return;
     }
     fs::path newPlaylistDir{tilde_expand(cmd.nextArg().data())};
     if (!fs::exists(newPlaylistDir)) {
-        std::println("Playlist directory {} does not exist.", newPlaylistDir.string());
+        printError("Playlist directory {} does not exist.", newPlaylistDir.string());
         return;
     } else if (!fs::is_directory(newPlaylistDir)) {
-        std::println("Given path is not a directory.");
+        printError("Given path is not a directory.");
         return;
     }
 
@@ -702,7 +1010,7 @@ void Cleo::setPlaylistDir(Command& cmd) {
 
 void Cleo::setPrompt(Command& cmd) {
     if (cmd.argCount() != 1) {
-        findHelp(Cleo::commandHelp, "set-prompt");
+        showUsage(Cleo::commandHelp, "set-prompt");
         return;
     }
     Music::prompt = cmd.nextArg();
@@ -714,14 +1022,14 @@ static void runScript(std::string&& script) {
         AutoMatch match{Music::scripts, script};
         switch (match.matchType) {
             case Match::NoMatch:
-                std::println("Script not found.");
+                printError("Script not found.");
                 return;
             case Match::ExactMatch:
                 script = match.exactMatch();
                 scriptPath.open(Music::scriptDir / script);
                 break;
             case Match::MultipleMatch:
-                std::println("Multiple matches found, could be one of {}.", join(match.matches, ", "));
+                printError("Multiple matches found, could be one of {}.", join(match.matches, ", "));
                 return;
         }
     } else {
@@ -729,7 +1037,7 @@ static void runScript(std::string&& script) {
     }
     Music::isExecutingScript = true;
     std::string line{};
-    while (std::getline(scriptPath, line)) {
+    while (!Jobs::cancelled() && std::getline(scriptPath, line)) {
         if (!line.starts_with("#")) {
             executeCmds(parseString(line));
         }
@@ -739,11 +1047,11 @@ static void runScript(std::string&& script) {
 
 void Cleo::run(Command& cmd) {
     if (cmd.argCount() == 0) {
-        findHelp(Cleo::commandHelp, "run");
+        showUsage(Cleo::commandHelp, "run");
         return;
     }
     if (Music::isExecutingScript) {
-        std::println("Cannot run a script while executing another script.");
+        printError("Cannot run a script while executing another script.");
         return;
     }
     while (cmd.argCount() > 0) {
@@ -752,27 +1060,718 @@ void Cleo::run(Command& cmd) {
 }
 
 void Cleo::random(Command& cmd) {
-    static std::random_device random_device{};
-    static std::mt19937 engine{random_device()};
-    std::string random_song{};
+    std::string prefix{cmd.argCount() == 0 ? "" : cmd.nextArg()};
+    std::optional<std::string> random_song{PlayStats::pickRandom(prefix)};
+    if (!random_song) {
+        printError("No songs found that begin with `{}`", prefix);
+        return;
+    }
+    Command song{"", *random_song};
+    Cleo::play(song);
+}
+
+static void printPlays(std::string_view song, const SongPlays& plays) {
+    auto now{std::chrono::system_clock::now().time_since_epoch()};
+    std::int64_t days{(std::chrono::duration_cast<std::chrono::seconds>(now).count() - plays.lastPlayed) /
+                      (24 * 60 * 60)};
+    std::string when{days == 0 ? "today" : days == 1 ? "yesterday" : std::format("{} days ago", days)};
+    double heard{plays.heard / std::max(1u, plays.plays + plays.skips)};
+    std::println(Threads::output, "{}: played {}, skipped {}, {:.0f}% heard on average, last played {}.",
+                 stem(song), plays.plays, plays.skips, heard * 100, when);
+}
+
+void Cleo::plays(Command& cmd) {
+    if (cmd.argCount() == 0) {
+        std::vector<std::pair<std::string, SongPlays>> top{PlayStats::mostPlayed(10)};
+        if (top.empty()) {
+            std::println(Threads::output, "Nothing has been played yet.");
+        }
+        for (const auto& [song, plays] : top) {
+            printPlays(song, plays);
+        }
+        return;
+    }
+    while (cmd.argCount() > 0) {
+        AutoMatch match{matchSong(cmd.nextArg())};
+        switch (match.matchType) {
+            case Match::NoMatch:
+                printError("Song not found.");
+                break;
+            case Match::ExactMatch:
+                if (std::optional<SongPlays> plays{PlayStats::get(match.exactMatch())}) {
+                    printPlays(match.exactMatch(), *plays);
+                } else {
+                    std::println(Threads::output, "{} hasn't been played yet.", stem(match.exactMatch()));
+                }
+                break;
+            case Match::MultipleMatch:
+                std::vector<std::string> baseNames{transformStem(match.matches)};
+                printError("Multiple matches found, could be one of {}.", join(baseNames, ", "));
+                break;
+        }
+    }
+}
+
+void Cleo::buffer(Command& cmd) {
     if (cmd.argCount() == 0) {
-        std::uniform_int_distribution<size_t> dist{0, Music::songs.size() - 1};
-        random_song = Music::songs[dist(engine)];
+        std::size_t underruns{Music::music.getUnderruns()};
+        std::println(Threads::output, "Latency: {} ms, depth: {} ms.",
+                     Music::music.getLatency().asMilliseconds(),
+                     Music::music.getBufferDepth().asMilliseconds());
+        std::println(Threads::output, "Buffer {:.0f}% full, {} underrun{} so far.",
+                     Music::music.getBufferFill() * 100, underruns, underruns == 1 ? "" : "s");
+        SupervisorStats stats{supervisorStats()};
+        using Ms = std::chrono::duration<double, std::milli>;
+        if (stats.transitions > 0) {
+            std::println(Threads::output,
+                         "Next song started {:.1f} ms after the last (jitter {:.1f} ms, worst {:.1f} ms).",
+                         Ms{stats.meanDelay}.count(), Ms{stats.jitter}.count(), Ms{stats.maxDelay}.count());
+        }
+        std::println(Threads::output, "Playback supervisor woke {} time{} and used {:.1f} ms of CPU.",
+                     stats.wakeups, stats.wakeups == 1 ? "" : "s", Ms{stats.cpuTime}.count());
+        std::string clock{preciseTimestamp(Music::music.getOutputClock())};
+        if (Music::music.getOutput() == AudioOutput::Device) {
+            std::println(Threads::output, "{} of audio handed to the sound card so far.", clock);
+        } else if (double rate{Music::music.getClockRate()}; rate > 0) {
+            std::println(Threads::output, "Null output at {:g}x real time, its clock is at {}.", rate, clock);
+        } else {
+            std::println(Threads::output,
+                         "Null output running as fast as songs decode while waiting, its clock is at {}.",
+                         clock);
+        }
+        return;
+    }
+    if (cmd.argCount() != 2) {
+        showUsage(Cleo::commandHelp, "buffer");
+        return;
+    }
+    int latency{};
+    int depth{};
+    try {
+        latency = std::stoi(cmd.nextArg());
+        depth = std::stoi(cmd.nextArg());
+        if (latency <= 0 || depth < latency) {
+            throw BUFFER_TOO_SMALL;
+        }
+    } catch (const std::exception&) {
+        printError("Latency and depth must be numbers.");
+        return;
+    } catch (const int) {
+        printError("Latency must be above 0 and depth must be at least the latency.");
+        return;
+    }
+    Music::music.setBuffering(sf::milliseconds(latency), sf::milliseconds(depth));
+    std::println(Threads::output, "Buffering will change from the next song.");
+}
+
+// A song is playing, or one has just ended and the playlist is about to move on
+static bool stillPlaying() {
+    StateLock lock{};
+    sf::Music::Status status{Music::music.getStatus()};
+    if (status != sf::Music::Status::Stopped) {
+        return status == sf::Music::Status::Playing;
+    }
+    return Music::inPlaylistMode && Music::playlistIdx != 0 &&
+           (Music::playlistIdx < Music::curPlaylist.size() || Music::isPlaylistLooping);
+}
+
+void Cleo::wait(Command& cmd) {
+    if (cmd.argCount() > 1) {
+        showUsage(Cleo::commandHelp, "wait");
+        return;
+    }
+    std::optional<sf::Time> duration{};
+    if (cmd.argCount() == 1) {
+        duration = getTime(cmd);
+        if (!duration) {
+            printError("Invalid duration or timestamp given. See 'help timestamps' for more.");
+            return;
+        }
+    }
+    sf::Time until{Music::music.getOutputClock() + duration.value_or(sf::Time::Zero)};
+    // A null output running flat out only moves while something waits on it, so it stops exactly on time
+    bool held{Music::music.getOutput() == AudioOutput::Null && Music::music.getClockRate() == 0};
+    if (held) {
+        Music::music.holdClockAt(duration ? std::optional{until} : std::nullopt);
+    }
+    while (stillPlaying() && (!duration || Music::music.getOutputClock() < until)) {
+        if (Jobs::cancelled()) {
+            std::println(Threads::output, "Cancelled.");
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds{1});
+    }
+    if (held) {
+        Music::music.holdClockAt(Music::music.getOutputClock());
+    }
+}
+
+// The song the user meant, or nothing once the reason it couldn't be picked out has been printed
+static std::optional<std::string> resolveSong(const std::string& song) {
+    AutoMatch match{matchSong(song)};
+    switch (match.matchType) {
+        case Match::NoMatch:
+            printError("Song `{}` not found.", song);
+            break;
+        case Match::ExactMatch:
+            return match.exactMatch();
+        case Match::MultipleMatch:
+            printError("Multiple matches found for `{}`, could be one of {}.", song,
+                       join(transformStem(match.matches), ", "));
+            break;
+    }
+    return std::nullopt;
+}
+
+static void printLoudness(const std::string& song) {
+    std::optional<std::string> matched{resolveSong(song)};
+    if (!matched) {
+        return;
+    }
+    const std::string& matchedSong{*matched};
+    std::optional<TrackLoudness> loudness{getLoudness(matchedSong)};
+    if (!loudness) {
+        std::println(Threads::output, "{} hasn't been measured yet.", stem(matchedSong));
+        return;
+    }
+    std::println(Threads::output, "{}: {:.1f} LUFS, true peak {:.1f} dBTP, gain {:+.1f} dB.",
+                 stem(matchedSong), loudness->integrated, loudness->truePeak, gainFor(*loudness));
+}
+
+void Cleo::loudness(Command& cmd) {
+    if (cmd.argCount() == 0) {
+        AnalysisProgress progress{getAnalysisProgress()};
+        if (progress.remaining == 0) {
+            std::println(Threads::output, "{} songs measured.", progress.analysed);
+        } else {
+            std::println(Threads::output, "{} songs measured, {} to go at {:.1f} songs/sec.",
+                         progress.analysed, progress.remaining, progress.tracksPerSecond);
+        }
+        return;
+    }
+    while (cmd.argCount() > 0 && !Jobs::cancelled()) {
+        printLoudness(cmd.nextArg());
+    }
+}
+
+static std::string_view normalizationName(Normalization mode) {
+    switch (mode) {
+        case Normalization::Off:
+            return "off";
+        case Normalization::Track:
+            return "track";
+        case Normalization::Album:
+            return "album";
+    }
+    return "off";
+}
+
+void Cleo::normalize(Command& cmd) {
+    if (cmd.argCount() == 0) {
+        std::println(Threads::output, "Normalization is {}.", normalizationName(Music::normalization));
+        return;
+    }
+    if (cmd.argCount() != 1) {
+        showUsage(Cleo::commandHelp, "normalize");
+        return;
+    }
+    std::string mode{cmd.nextArg()};
+    if (mode == "off") {
+        Music::normalization = Normalization::Off;
+    } else if (mode == "track") {
+        Music::normalization = Normalization::Track;
+    } else if (mode == "album") {
+        Music::normalization = Normalization::Album;
     } else {
-        std::string prefix{cmd.nextArg()};
-        std::vector<std::string> matchingSongs{};
-        for (const auto& song : Music::songs) {
-            if (song.starts_with(prefix)) {
-                matchingSongs.push_back(song);
+        showUsage(Cleo::commandHelp, "normalize");
+        return;
+    }
+    std::println(Threads::output, "Normalization is {}, this will take effect from the next song.", mode);
+}
+
+void Cleo::pager(Command& cmd) {
+    if (cmd.argCount() == 0) {
+        std::println(Threads::output, "The pager is {}.", Music::usePager ? "on" : "off");
+        return;
+    }
+    std::string mode{cmd.nextArg()};
+    if (cmd.argCount() != 0 || (mode != "on" && mode != "off")) {
+        showUsage(Cleo::commandHelp, "pager");
+        return;
+    }
+    Music::usePager = mode == "on";
+    std::println(Threads::output, "The pager is {}.", mode);
+}
+
+void Cleo::visualize(Command& cmd) {
+    if (cmd.argCount() == 0) {
+        if (!Visualizer::isRunning()) {
+            std::println(Threads::output, "The visualizer is off.");
+            return;
+        }
+        VisualizerStats stats{Visualizer::stats()};
+        using Seconds = std::chrono::duration<double>;
+        double running{Seconds{stats.running}.count()};
+        std::println(Threads::output,
+                     "The visualizer is on, {:.1f}% of a core, {:.0f} redraws a second, {:.0f} bytes each.",
+                     running > 0 ? Seconds{stats.cpuTime}.count() / running * 100 : 0,
+                     running > 0 ? (double)stats.frames / running : 0,
+                     stats.frames > 0 ? (double)stats.bytesWritten / (double)stats.frames : 0);
+        return;
+    }
+    std::string mode{cmd.nextArg()};
+    if (cmd.argCount() != 0 || (mode != "on" && mode != "off")) {
+        showUsage(Cleo::commandHelp, "visualize");
+        return;
+    }
+    if (mode == "off") {
+        Visualizer::stop();
+    } else if (!Visualizer::start()) {
+        printError("The visualizer needs a terminal with room for it.");
+        return;
+    }
+    std::println(Threads::output, "The visualizer is {}.", mode);
+}
+
+static std::optional<float> parseNumber(std::string_view text, float min, float max) {
+    float value{};
+    float scale{1};
+    if (text.ends_with('k')) {
+        text.remove_suffix(1);
+        scale = 1000;
+    }
+    if (text.starts_with('+')) {
+        text.remove_prefix(1);
+    }
+    auto [end, error]{std::from_chars(text.data(), text.data() + text.size(), value)};
+    value *= scale;
+    if (error != std::errc{} || end != text.data() + text.size() || value < min || value > max) {
+        return std::nullopt;
+    }
+    return value;
+}
+
+static constexpr float maxEqGain{24};
+
+static std::string_view filterName(FilterType type) {
+    switch (type) {
+        case FilterType::LowShelf:
+            return "lowshelf";
+        case FilterType::HighShelf:
+            return "highshelf";
+        default:
+            return "peak";
+    }
+}
+
+static void printEq(const DspSettings& settings) {
+    std::println(Threads::output, "EQ {}, preamp {:+.1f} dB, limiter {}.", settings.enabled ? "on" : "off",
+                 settings.preamp, settings.limiter ? "on" : "off");
+    if (settings.bands.empty()) {
+        std::println(Threads::output, "No bands.");
+    }
+    for (const EqBand& band : settings.bands) {
+        std::println(Threads::output, "{:>9} {:>7.0f} Hz {:+5.1f} dB  q {:.2f}", filterName(band.type),
+                     band.frequency, band.gain, band.q);
+    }
+}
+
+// false if the arguments don't make sense, having said why
+static bool addBand(Command& cmd, DspSettings& settings) {
+    if (cmd.argCount() < 2 || cmd.argCount() > 4) {
+        showUsage(Cleo::commandHelp, "eq");
+        return false;
+    }
+    EqBand band{};
+    std::optional<float> frequency{parseNumber(cmd.nextArg(), 20, 20'000)};
+    std::optional<float> gain{parseNumber(cmd.nextArg(), -maxEqGain, maxEqGain)};
+    if (!frequency) {
+        printError("The frequency must be between 20 and 20000 Hz.");
+        return false;
+    }
+    if (!gain) {
+        printError("The gain must be between -{0} and {0} dB.", maxEqGain);
+        return false;
+    }
+    band.frequency = *frequency;
+    band.gain = *gain;
+    while (cmd.argCount() > 0) {
+        std::string arg{cmd.nextArg()};
+        if (arg == "peak") {
+            band.type = FilterType::Peak;
+        } else if (arg == "lowshelf") {
+            band.type = FilterType::LowShelf;
+        } else if (arg == "highshelf") {
+            band.type = FilterType::HighShelf;
+        } else if (std::optional<float> q{parseNumber(arg, 0.1f, 10)}) {
+            band.q = *q;
+        } else {
+            printError("Q must be between 0.1 and 10.");
+            return false;
+        }
+    }
+    auto same{std::ranges::find(settings.bands, band.frequency, &EqBand::frequency)};
+    if (same != settings.bands.end()) {
+        *same = band;
+    } else if (settings.bands.size() == DspChain::maxBands) {
+        printError("There can only be {} bands, remove one first.", DspChain::maxBands);
+        return false;
+    } else {
+        settings.bands.push_back(band);
+    }
+    return true;
+}
+
+static void benchmarkEq() {
+    static constexpr std::size_t framesPerBlock{512};
+    static constexpr std::size_t blocks{20'000};
+    DspBenchmark result{DspChain::benchmark(framesPerBlock, 2, blocks)};
+    using Micros = std::chrono::duration<double, std::micro>;
+    std::println(Threads::output,
+                 "{} band{}, {}-frame stereo blocks: {:.2f} µs each, {:.3f}% of the time they take to play.",
+                 result.bands, result.bands == 1 ? "" : "s", framesPerBlock, Micros{result.perBlock}.count(),
+                 result.realTimeShare * 100);
+}
+
+void Cleo::eq(Command& cmd) {
+    DspSettings settings{DspChain::settings()};
+    if (cmd.argCount() == 0) {
+        printEq(settings);
+        return;
+    }
+    std::string action{cmd.nextArg()};
+    if (action == "band") {
+        if (!addBand(cmd, settings)) {
+            return;
+        }
+    } else if (cmd.argCount() == 0 && (action == "on" || action == "off")) {
+        settings.enabled = action == "on";
+    } else if (cmd.argCount() == 0 && action == "reset") {
+        settings = {};
+    } else if (cmd.argCount() == 0 && action == "bench") {
+        benchmarkEq();
+        return;
+    } else if (cmd.argCount() == 1 && action == "remove") {
+        std::optional<float> frequency{parseNumber(cmd.nextArg(), 20, 20'000)};
+        std::size_t removed{0};
+        if (frequency) {
+            removed = std::erase_if(settings.bands,
+                                    [&](const EqBand& band) { return band.frequency == *frequency; });
+        }
+        if (removed == 0) {
+            printError("There's no band at that frequency.");
+            return;
+        }
+    } else if (cmd.argCount() == 1 && action == "preamp") {
+        std::optional<float> gain{parseNumber(cmd.nextArg(), -maxEqGain, maxEqGain)};
+        if (!gain) {
+            printError("The preamp must be between -{0} and {0} dB.", maxEqGain);
+            return;
+        }
+        settings.preamp = *gain;
+    } else if (cmd.argCount() == 1 && action == "limiter") {
+        std::string mode{cmd.nextArg()};
+        if (mode != "on" && mode != "off") {
+            showUsage(Cleo::commandHelp, "eq");
+            return;
+        }
+        settings.limiter = mode == "on";
+    } else {
+        showUsage(Cleo::commandHelp, "eq");
+        return;
+    }
+    DspChain::apply(settings);
+    printEq(DspChain::settings());
+}
+
+static constexpr float minSpeed{0.5};
+static constexpr float maxSpeed{2};
+
+void Cleo::speed(Command& cmd) {
+    if (cmd.argCount() == 0) {
+        std::println(Threads::output, "Playing at {:g}x speed.", Music::music.getSpeed());
+        return;
+    }
+    if (cmd.argCount() != 1) {
+        showUsage(Cleo::commandHelp, "speed");
+        return;
+    }
+    std::string text{cmd.nextArg()};
+    if (text.ends_with('x')) {
+        text.pop_back();
+    }
+    std::optional<float> speed{parseNumber(text, minSpeed, maxSpeed)};
+    if (!speed) {
+        printError("Speed must be between {}x and {}x.", minSpeed, maxSpeed);
+        return;
+    }
+    Music::music.setSpeed(*speed);
+    std::println(Threads::output, "Playing at {:g}x speed.", *speed);
+}
+
+void Cleo::dupes(Command& cmd) {
+    bool compareAudio{false};
+    if (cmd.argCount() == 1) {
+        std::string mode{cmd.nextArg()};
+        if (mode != "audio") {
+            showUsage(Cleo::commandHelp, "dupes");
+            return;
+        }
+        compareAudio = true;
+    } else if (cmd.argCount() != 0) {
+        showUsage(Cleo::commandHelp, "dupes");
+        return;
+    }
+    std::vector<std::vector<std::string>> duplicates{findDuplicates(compareAudio)};
+    if (Jobs::cancelled()) {
+        std::println(Threads::output, "Cancelled.");
+        return;
+    }
+    if (duplicates.empty()) {
+        std::println(Threads::output, "No duplicates found.");
+        return;
+    }
+    for (const auto& group : duplicates) {
+        std::println(Threads::output, "{}", join(group, ", "));
+    }
+    std::println(Threads::output, "{} group{} of duplicates found.", duplicates.size(),
+                 duplicates.size() == 1 ? "" : "s");
+}
+
+void Cleo::readahead(Command& cmd) {
+    constexpr double mebibyte{1 << 20};
+    if (cmd.argCount() == 0) {
+        IoStats stats{ReadAhead::getStats()};
+        std::println(Threads::output,
+                     "Read-ahead budget: {:.0f} MiB, {:.1f} MiB of the current song loaded ahead.",
+                     (double)ReadAhead::getBudget() / mebibyte, (double)stats.bytesAhead / mebibyte);
+        if (stats.stalls == 0) {
+            std::println(Threads::output, "Playback hasn't had to wait on the disk.");
+        } else {
+            using Milliseconds = std::chrono::duration<double, std::milli>;
+            std::println(Threads::output,
+                         "Playback has waited on the disk for {:.1f} ms over {} read{}, {:.1f} ms at most.",
+                         Milliseconds{stats.blocked}.count(), stats.stalls, stats.stalls == 1 ? "" : "s",
+                         Milliseconds{stats.longestStall}.count());
+        }
+        return;
+    }
+    if (cmd.argCount() != 1) {
+        showUsage(Cleo::commandHelp, "readahead");
+        return;
+    }
+    int megabytes{};
+    try {
+        megabytes = std::stoi(cmd.nextArg());
+        if (megabytes <= 0) {
+            throw BUDGET_TOO_SMALL;
+        }
+    } catch (const std::exception&) {
+        printError("Budget must be a number.");
+        return;
+    } catch (const int) {
+        printError("Budget must be above 0.");
+        return;
+    }
+    ReadAhead::setBudget((std::size_t)megabytes << 20);
+}
+
+static void printTags(const std::string& song) {
+    std::optional<std::string> matched{resolveSong(song)};
+    if (!matched) {
+        return;
+    }
+    const std::string& matchedSong{*matched};
+    SongTags tags{Metadata::get(matchedSong).value_or(SongTags{})};
+    std::println(Threads::output, "{}:", stem(matchedSong));
+    bool hasTags{false};
+    for (const auto& [field, value] : {std::pair{"artist", tags.artist}, std::pair{"album", tags.album},
+                                       std::pair{"title", tags.title}, std::pair{"genre", tags.genre}}) {
+        if (!value.empty()) {
+            std::println(Threads::output, "  {}: {}", field, value);
+            hasTags = true;
+        }
+    }
+    for (const auto& [field, value] : {std::pair{"track", tags.track}, std::pair{"year", tags.year}}) {
+        if (value != 0) {
+            std::println(Threads::output, "  {}: {}", field, value);
+            hasTags = true;
+        }
+    }
+    if (!hasTags) {
+        std::println(Threads::output, "  No tags.");
+    }
+}
+
+void Cleo::tags(Command& cmd) {
+    if (cmd.argCount() == 0) {
+        using Milliseconds = std::chrono::duration<double, std::milli>;
+        MetadataStats stats{Metadata::getStats()};
+        double seconds{std::chrono::duration<double>{stats.scanTime}.count()};
+        std::println(Threads::output,
+                     "{} songs indexed. The last scan read tags from {} of them in {:.1f} ms "
+                     "({:.0f} songs/sec).",
+                     stats.songs, stats.parsed, Milliseconds{stats.scanTime}.count(),
+                     seconds > 0 ? (double)stats.parsed / seconds : 0);
+        std::println(Threads::output, "The last search took {:.3f} ms.",
+                     Milliseconds{stats.lastQueryTime}.count());
+        SharedIndexStats shared{SharedIndex::stats()};
+        std::println(Threads::output,
+                     "Building the shared song index for {} director{}, reading another instance's for {}. "
+                     "It saved {} of {} scans.",
+                     shared.leading, shared.leading == 1 ? "y" : "ies", shared.mapped, shared.hits,
+                     shared.hits + shared.misses);
+        return;
+    }
+    while (cmd.argCount() > 0) {
+        printTags(cmd.nextArg());
+    }
+}
+
+static void printSeekTimes(std::string_view label, const std::vector<std::chrono::nanoseconds>& times) {
+    using Milliseconds = std::chrono::duration<double, std::milli>;
+    std::vector<std::chrono::nanoseconds> sorted{times};
+    std::sort(sorted.begin(), sorted.end());
+    std::chrono::nanoseconds total{};
+    for (auto time : sorted) {
+        total += time;
+    }
+    std::println(Threads::output, "  {}: mean {:.2f} ms, median {:.2f} ms, max {:.2f} ms", label,
+                 Milliseconds{total}.count() / (double)sorted.size(),
+                 Milliseconds{sorted[sorted.size() / 2]}.count(), Milliseconds{sorted.back()}.count());
+}
+
+// So the next lookups have to go to the filesystem, as they would the first time. This is for the whole
+// system, so it's only done when asked for with --drop-caches, and only root can.
+static bool dropPathCache() {
+    sync();
+    std::ofstream dropCaches{"/proc/sys/vm/drop_caches"};
+    dropCaches << "2\n";
+    dropCaches.flush();
+    return dropCaches.good();
+}
+
+void Cleo::statbench(Command& cmd) {
+    if (cmd.argCount() > 3) {
+        showUsage(Cleo::commandHelp, "statbench");
+        return;
+    }
+    static const std::map<std::string, StatMethod, std::less<>> methodNames{
+        {"one", StatMethod::Serial}, {"ring", StatMethod::Ring}, {"threads", StatMethod::Threads}};
+    std::optional<StatMethod> only{};
+    std::optional<fs::path> dir{};
+    bool cold{false};
+    while (cmd.argCount() > 0) {
+        std::string arg{cmd.nextArg()};
+        if (arg == "--drop-caches") {
+            cold = true;
+        } else if (auto method{methodNames.find(arg)}; method != methodNames.end()) {
+            only = method->second;
+        } else if (!dir) {
+            dir = tilde_expand(arg.c_str());
+        } else {
+            showUsage(Cleo::commandHelp, "statbench");
+            return;
+        }
+    }
+    std::vector<fs::path> paths{};
+    if (dir) {
+        std::error_code err{};
+        auto options{fs::directory_options::skip_permission_denied};
+        for (fs::recursive_directory_iterator it{*dir, options, err}, end{}; !err && it != end;
+             it.increment(err)) {
+            if (it->is_regular_file(err)) {
+                paths.push_back(it->path());
             }
         }
-        if (matchingSongs.size() == 0) {
-            std::println("No songs found that begin with `{}`", prefix);
+        if (err) {
+            printError("Couldn't read {}: {}", dir->string(), err.message());
             return;
         }
-        std::uniform_int_distribution<size_t> dist{0, matchingSongs.size() - 1};
-        random_song = matchingSongs[dist(engine)];
+    } else {
+        StateLock lock{};
+        for (const auto& song : Music::songs) {
+            paths.push_back(songPath(song));
+        }
     }
-    Command song{"", random_song};
-    Cleo::play(song);
+    if (paths.empty()) {
+        printError("There are no files to check.");
+        return;
+    }
+    std::size_t count{paths.size()};
+    if (cold && geteuid() != 0) {
+        printError("Only root can drop the caches.");
+        return;
+    }
+    std::println(Threads::output, "Checking {} file{} with a {} cache:", count, count == 1 ? "" : "s",
+                 cold ? "cold" : "warm");
+    using Milliseconds = std::chrono::duration<double, std::milli>;
+    using Microseconds = std::chrono::duration<double, std::micro>;
+    for (auto [label, method] : {std::pair{"one at a time", StatMethod::Serial},
+                                 std::pair{"io_uring     ", StatMethod::Ring},
+                                 std::pair{"threads      ", StatMethod::Threads}}) {
+        if (only && method != *only) {
+            continue;
+        }
+        if (Jobs::cancelled()) {
+            std::println(Threads::output, "Cancelled.");
+            return;
+        }
+        if (method == StatMethod::Ring && !BatchStat::ringAvailable()) {
+            std::println(Threads::output, "  {}: not available on this system", label);
+            continue;
+        }
+        if (cold && !dropPathCache()) {
+            printError("Couldn't drop the cache, so this and the rest are warm.");
+            cold = false;
+        }
+        auto start{std::chrono::steady_clock::now()};
+        std::vector<PathType> types{BatchStat::check(paths, method)};
+        auto elapsed{std::chrono::steady_clock::now() - start};
+        auto found{std::ranges::count(types, PathType::File)};
+        std::println(Threads::output, "  {}: {:.1f} ms, {:.2f} µs a path, {} found", label,
+                     Milliseconds{elapsed}.count(), Microseconds{elapsed}.count() / (double)count, found);
+    }
+}
+
+void Cleo::seekbench(Command& cmd) {
+    if (cmd.argCount() < 1 || cmd.argCount() > 2) {
+        showUsage(Cleo::commandHelp, "seekbench");
+        return;
+    }
+    std::string song{cmd.nextArg()};
+    int seeks{10};
+    if (cmd.argCount() == 1) {
+        try {
+            seeks = std::stoi(cmd.nextArg());
+            if (seeks <= 0) {
+                throw SEEKS_TOO_FEW;
+            }
+        } catch (const std::exception&) {
+            printError("Number of seeks must be a number.");
+            return;
+        } catch (const int) {
+            printError("Number of seeks must be above 0.");
+            return;
+        }
+    }
+    std::optional<std::string> matched{resolveSong(song)};
+    if (!matched) {
+        return;
+    }
+    const std::string& matchedSong{*matched};
+    std::optional<SeekBenchmark> result{SeekIndex::benchmark(songPath(matchedSong), (std::size_t)seeks)};
+    if (Jobs::cancelled()) {
+        std::println(Threads::output, "Cancelled.");
+        return;
+    }
+    if (!result) {
+        printError("Couldn't build a seek index for `{}`. Only MP3s and FLACs with a seek table have one.",
+                   stem(matchedSong));
+        return;
+    }
+    std::println(Threads::output, "Seeking {} time{} in {}:", seeks, seeks == 1 ? "" : "s",
+                 stem(matchedSong));
+    printSeekTimes("without the index", result->cold);
+    printSeekTimes("with the index   ", result->prefetched);
 }
@@ -1,7 +1,10 @@
 #pragma once
 
 #include "command.hpp"
+#include "jobs.hpp"
+#include "threads.hpp"
 #include <flat_map>
+#include <print>
 #include <string>
 #include <string_view>
 #include <vector>
@@ -10,6 +13,15 @@ std::string numAsTimestamp(int time);
 std::string stem(std::string_view filename);
 std::vector<std::string> transformStem(const std::vector<std::string>& input);
 void findHelp(const std::flat_map<std::string, std::string>& domain, const std::string& topic);
+void showUsage(const std::flat_map<std::string, std::string>& domain, const std::string& topic);
+bool confirm(std::string_view question, bool defaultAnswer);
+
+// Use instead of std::println for messages saying a command failed, so batch mode can report it
+template <typename... Args>
+void printError(std::format_string<Args...> fmt, Args&&... args) {
+    ++Threads::errorCount;
+    std::println(Threads::output, fmt, std::forward<Args>(args)...);
+}
 
 namespace Cleo {
     void help(Command&);
@@ -30,11 +42,28 @@ namespace Cleo {
     void rewind(Command&);
     void find(Command&);
     void setMusicDir(Command&);
+    void addMusicDir(Command&);
+    void removeMusicDir(Command&);
     void setPlaylistDir(Command&);
     void setPrompt(Command&);
     void run(Command&);
     void random(Command&);
+    void plays(Command&);
+    void buffer(Command&);
+    void loudness(Command&);
+    void normalize(Command&);
+    void dupes(Command&);
+    void readahead(Command&);
+    void tags(Command&);
+    void seekbench(Command&);
+    void statbench(Command&);
+    void pager(Command&);
+    void visualize(Command&);
+    void eq(Command&);
+    void speed(Command&);
+    void wait(Command&);
     const extern std::flat_map<std::string, std::function<void(Command&)>> commands;
     const extern std::flat_map<std::string, std::string> commandHelp;
+    const extern std::flat_map<std::string, JobTraits> slowCommands;
     const extern std::vector<std::string> commandList;
 } // namespace Cleo
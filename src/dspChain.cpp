@@ -0,0 +1,305 @@
+#include "dspChain.hpp"
+#include "music.hpp"
+#include "simd.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <numbers>
+#include <random>
+#include <thread>
+
+using Clock = std::chrono::steady_clock;
+
+// Up to four channels are filtered side by side, one per lane, and gains are applied four samples at a time
+static constexpr std::size_t maxGroups{2}; // 8 channels, any more are left alone
+
+static constexpr float limiterKnee{0.891f}; // -1 dBFS
+static constexpr unsigned int benchmarkRate{44'100};
+
+struct Biquad {
+    float b0{1}, b1{}, b2{}, a1{}, a2{};
+};
+
+// What the audio thread reads, with gains already linear
+struct Slot {
+    std::array<EqBand, DspChain::maxBands> bands{};
+    std::size_t bandCount{0};
+    float preamp{1};
+    bool limiter{true};
+    bool active{false};
+    std::uint64_t generation{0};
+};
+
+class ChainState {
+public:
+    void configure(const Slot& slot, unsigned int rate);
+    bool isCurrent(const Slot& slot, unsigned int rate) const {
+        return slot.generation == mGeneration && rate == mRate;
+    }
+    void process(float* samples, std::size_t frames, std::size_t channels);
+
+private:
+    std::array<Biquad, DspChain::maxBands> mCoefficients{};
+    std::array<std::array<std::array<Vec4, 2>, maxGroups>, DspChain::maxBands> mState{};
+    std::size_t mBandCount{0};
+    float mPreamp{1};
+    bool mLimiter{false};
+    bool mActive{false};
+    std::uint64_t mGeneration{~std::uint64_t{0}};
+    unsigned int mRate{0};
+};
+
+static std::array<Slot, 2> slots{};
+static std::atomic<int> published{0};
+static std::atomic<int> reading{-1}; // the slot the audio thread is copying from, if any
+static std::atomic<DspChain::Tap> tap{nullptr};
+static ChainState audioState{}; // audio thread only
+// Guarded by StateLock, like the rest of what commands change
+static DspSettings current{};
+static std::uint64_t generation{0};
+static bool installed{false};
+
+// RBJ's audio EQ cookbook
+static Biquad design(const EqBand& band, unsigned int rate) {
+    double a{std::pow(10.0, band.gain / 40.0)};
+    double w0{2 * std::numbers::pi * std::min<double>(band.frequency, rate * 0.45) / rate};
+    double cosW0{std::cos(w0)};
+    double alpha{std::sin(w0) / (2 * band.q)};
+    double twoRootAAlpha{2 * std::sqrt(a) * alpha};
+    double b0{}, b1{}, b2{}, a0{}, a1{}, a2{};
+    switch (band.type) {
+        case FilterType::Peak:
+            b0 = 1 + alpha * a;
+            b1 = -2 * cosW0;
+            b2 = 1 - alpha * a;
+            a0 = 1 + alpha / a;
+            a1 = -2 * cosW0;
+            a2 = 1 - alpha / a;
+            break;
+        case FilterType::LowShelf:
+            b0 = a * ((a + 1) - (a - 1) * cosW0 + twoRootAAlpha);
+            b1 = 2 * a * ((a - 1) - (a + 1) * cosW0);
+            b2 = a * ((a + 1) - (a - 1) * cosW0 - twoRootAAlpha);
+            a0 = (a + 1) + (a - 1) * cosW0 + twoRootAAlpha;
+            a1 = -2 * ((a - 1) + (a + 1) * cosW0);
+            a2 = (a + 1) + (a - 1) * cosW0 - twoRootAAlpha;
+            break;
+        case FilterType::HighShelf:
+            b0 = a * ((a + 1) + (a - 1) * cosW0 + twoRootAAlpha);
+            b1 = -2 * a * ((a - 1) + (a + 1) * cosW0);
+            b2 = a * ((a + 1) + (a - 1) * cosW0 - twoRootAAlpha);
+            a0 = (a + 1) - (a - 1) * cosW0 + twoRootAAlpha;
+            a1 = 2 * ((a - 1) - (a + 1) * cosW0);
+            a2 = (a + 1) - (a - 1) * cosW0 - twoRootAAlpha;
+            break;
+    }
+    return {(float)(b0 / a0), (float)(b1 / a0), (float)(b2 / a0), (float)(a1 / a0), (float)(a2 / a0)};
+}
+
+void ChainState::configure(const Slot& slot, unsigned int rate) {
+    if (slot.bandCount != mBandCount || rate != mRate) {
+        mState = {}; // the old filter memory doesn't belong to any of the new bands
+    }
+    mBandCount = slot.bandCount;
+    for (std::size_t band{0}; band < mBandCount; ++band) {
+        mCoefficients[band] = design(slot.bands[band], rate);
+    }
+    mPreamp = slot.preamp;
+    mLimiter = slot.limiter;
+    mActive = slot.active;
+    mGeneration = slot.generation;
+    mRate = rate;
+}
+
+// Leaves everything under the knee alone and bends the rest smoothly towards full scale, with a rational
+// approximation of tanh that reaches 1 at 3
+static Vec4 softLimit(Vec4 x) {
+    Mask4 sign{(Mask4)x & (std::int32_t)0x80000000};
+    Vec4 magnitude{(Vec4)((Mask4)x & 0x7fffffff)};
+    Vec4 over{vecMin(vecMax(magnitude - limiterKnee, Vec4{}) * (1 / (1 - limiterKnee)), Vec4{} + 3)};
+    Vec4 bent{limiterKnee + (1 - limiterKnee) * over * (27 + over * over) / (27 + 9 * over * over)};
+    Mask4 isOver{magnitude > limiterKnee};
+    Vec4 limited{(Vec4)(((Mask4)bent & isOver) | ((Mask4)magnitude & ~isOver))};
+    return (Vec4)((Mask4)limited | sign);
+}
+
+// Most blocks never get near the knee, and checking is a lot cheaper than limiting
+static float peakOf(const float* samples, std::size_t count) {
+    Vec4 peak{};
+    std::size_t whole{count - count % lanes};
+    for (std::size_t i{0}; i < whole; i += lanes) {
+        peak = vecMax(peak, (Vec4)((Mask4)load(samples + i) & 0x7fffffff));
+    }
+    float loudest{std::max(std::max(peak[0], peak[1]), std::max(peak[2], peak[3]))};
+    for (std::size_t i{whole}; i < count; ++i) {
+        loudest = std::max(loudest, std::abs(samples[i]));
+    }
+    return loudest;
+}
+
+void ChainState::process(float* samples, std::size_t frames, std::size_t channels) {
+    if (!mActive) {
+        return;
+    }
+    std::size_t total{frames * channels};
+    std::size_t whole{total - total % lanes};
+    if (mPreamp != 1) {
+        for (std::size_t i{0}; i < whole; i += lanes) {
+            store(samples + i, load(samples + i) * mPreamp);
+        }
+        for (std::size_t i{whole}; i < total; ++i) {
+            samples[i] *= mPreamp;
+        }
+    }
+    for (std::size_t group{0}; group < maxGroups && group * lanes < channels; ++group) {
+        std::size_t first{group * lanes};
+        std::size_t count{std::min(lanes, channels - first)};
+        // Local copies, which the compiler knows the samples can't overlap
+        std::array<Biquad, DspChain::maxBands> coefficients{mCoefficients};
+        std::array<std::array<Vec4, 2>, DspChain::maxBands> state{};
+        std::size_t bandCount{mBandCount};
+        for (std::size_t band{0}; band < bandCount; ++band) {
+            state[band] = mState[band][group];
+        }
+        for (std::size_t frame{0}; frame < frames; ++frame) {
+            float* in{samples + frame * channels + first};
+            // Built from lanes rather than copied in, which would stall waiting on the copy
+            Vec4 x{};
+            if (count == 2) {
+                x = Vec4{in[0], in[1]};
+            } else {
+                for (std::size_t c{0}; c < count; ++c) {
+                    x[c] = in[c];
+                }
+            }
+            // Transposed direct form II, one band after another
+            for (std::size_t band{0}; band < bandCount; ++band) {
+                const Biquad& k{coefficients[band]};
+                Vec4 y{k.b0 * x + state[band][0]};
+                state[band][0] = k.b1 * x - k.a1 * y + state[band][1];
+                state[band][1] = k.b2 * x - k.a2 * y;
+                x = y;
+            }
+            for (std::size_t c{0}; c < count; ++c) {
+                in[c] = x[c];
+            }
+        }
+        for (std::size_t band{0}; band < bandCount; ++band) {
+            mState[band][group] = state[band];
+        }
+    }
+    if (mLimiter && peakOf(samples, total) > limiterKnee) {
+        for (std::size_t i{0}; i < whole; i += lanes) {
+            store(samples + i, softLimit(load(samples + i)));
+        }
+        if (whole < total) {
+            Vec4 rest{};
+            std::memcpy(&rest, samples + whole, (total - whole) * sizeof(float));
+            rest = softLimit(rest);
+            std::memcpy(samples + whole, &rest, (total - whole) * sizeof(float));
+        }
+    }
+}
+
+// Runs on the audio thread, so it mustn't lock or allocate
+static void processBlock(const float* inputFrames, unsigned int& inputFrameCount, float* outputFrames,
+                         unsigned int& outputFrameCount, unsigned int frameChannelCount) {
+    unsigned int count{std::min(inputFrameCount, outputFrameCount)};
+    std::copy_n(inputFrames, (std::size_t)count * frameChannelCount, outputFrames);
+    inputFrameCount = count;
+    outputFrameCount = count;
+    int slot{};
+    do {
+        slot = published.load();
+        reading.store(slot);
+    } while (published.load() != slot);
+    unsigned int rate{Music::music.getStreamRate()};
+    if (!audioState.isCurrent(slots[(std::size_t)slot], rate)) {
+        audioState.configure(slots[(std::size_t)slot], rate);
+    }
+    reading.store(-1);
+    audioState.process(outputFrames, count, frameChannelCount);
+    if (DspChain::Tap listener{tap.load(std::memory_order_relaxed)}) {
+        listener(outputFrames, count, frameChannelCount);
+    }
+}
+
+static bool isActive(const DspSettings& settings) {
+    return settings.enabled && (!settings.bands.empty() || settings.preamp != 0);
+}
+
+static Slot slotFor(const DspSettings& settings) {
+    Slot slot{};
+    slot.bandCount = std::min(settings.bands.size(), DspChain::maxBands);
+    std::copy_n(settings.bands.begin(), slot.bandCount, slot.bands.begin());
+    slot.preamp = std::pow(10.0f, settings.preamp / 20);
+    slot.limiter = settings.limiter;
+    slot.active = isActive(settings);
+    return slot;
+}
+
+// The effect processor only stays on while there's something for it to do, so plain playback doesn't pay
+// for it
+static void updateProcessor() {
+    bool needed{isActive(current) || tap.load() != nullptr};
+    if (needed != installed) {
+        Music::music.setEffectProcessor(needed ? processBlock : nullptr);
+        installed = needed;
+    }
+}
+
+namespace DspChain {
+    void apply(const DspSettings& settings) {
+        current = settings;
+        std::ranges::sort(current.bands, {}, &EqBand::frequency);
+        Slot slot{slotFor(current)};
+        slot.generation = ++generation;
+        int next{1 - published.load()};
+        while (reading.load() == next) {
+            std::this_thread::yield(); // it's just about done with the old settings
+        }
+        slots[(std::size_t)next] = slot;
+        published.store(next);
+        updateProcessor();
+    }
+
+    const DspSettings& settings() { return current; }
+
+    void setTap(Tap listener) {
+        tap = listener;
+        updateProcessor();
+    }
+
+    DspBenchmark benchmark(std::size_t framesPerBlock, std::size_t channels, std::size_t blocks) {
+        DspSettings settings{current};
+        settings.enabled = true;
+        if (settings.bands.empty()) {
+            for (float frequency{31.25f}; frequency < 20'000; frequency *= 2) {
+                settings.bands.push_back({FilterType::Peak, frequency, 3, 1});
+            }
+        }
+        ChainState state{};
+        state.configure(slotFor(settings), benchmarkRate);
+        std::vector<float> input(framesPerBlock * channels);
+        std::mt19937 engine{1};
+        std::uniform_real_distribution<float> noise{-0.5f, 0.5f};
+        std::ranges::generate(input, [&] { return noise(engine); });
+        std::vector<float> output(input.size());
+        auto run{[&](std::size_t count) {
+            for (std::size_t block{0}; block < count; ++block) {
+                std::ranges::copy(input, output.begin());
+                state.process(output.data(), framesPerBlock, channels);
+            }
+        }};
+        run(std::max<std::size_t>(1, blocks / 10)); // warm up the caches and the filters
+        Clock::time_point start{Clock::now()};
+        run(blocks);
+        auto perBlock{(Clock::now() - start) / std::max<std::size_t>(1, blocks)};
+        std::chrono::duration<double> blockLength{(double)framesPerBlock / benchmarkRate};
+        return {std::min(settings.bands.size(), maxBands), perBlock,
+                std::chrono::duration<double>{perBlock} / blockLength};
+    }
+} // namespace DspChain
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <vector>
+
+enum class FilterType { Peak, LowShelf, HighShelf };
+
+struct EqBand {
+    FilterType type{FilterType::Peak};
+    float frequency{1000}; // Hz, the centre of a peak or the middle of a shelf's slope
+    float gain{0};         // dB
+    float q{1};
+};
+
+struct DspSettings {
+    std::vector<EqBand> bands{}; // in order of frequency
+    float preamp{0};             // dB, applied before the bands
+    bool limiter{true};          // eases peaks over -1 dBFS back under 0 rather than letting them clip
+    bool enabled{true};
+};
+
+struct DspBenchmark {
+    std::size_t bands{};
+    std::chrono::nanoseconds perBlock{};
+    double realTimeShare{}; // of the time the block takes to play
+};
+
+// Preamp, parametric EQ and limiter, run on each block of audio by an effect processor on Music::music.
+// Settings go to the audio thread through a pair of slots it never has to wait for: the one it isn't reading
+// is filled in and then published. Up to four channels are filtered side by side, one per lane.
+namespace DspChain {
+    inline constexpr std::size_t maxBands{10};
+    // Takes effect from the next block played
+    void apply(const DspSettings& settings);
+    const DspSettings& settings();
+    // Called on the audio thread with every block once it's been processed, so it mustn't lock or allocate
+    using Tap = void (*)(const float* frames, unsigned int frameCount, unsigned int channels);
+    void setTap(Tap tap);
+    // Runs blocks of noise through the current settings, or ten bands if there aren't any, on this thread
+    DspBenchmark benchmark(std::size_t framesPerBlock, std::size_t channels, std::size_t blocks);
+} // namespace DspChain
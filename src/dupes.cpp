@@ -0,0 +1,368 @@
+#include "dupes.hpp"
+#include "jobs.hpp"
+#include "loudness.hpp"
+#include "music.hpp"
+#include "threadPool.hpp"
+#include <SFML/Audio/InputSoundFile.hpp>
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <fcntl.h>
+#include <format>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace fs = std::filesystem;
+
+struct FileHash {
+    std::uintmax_t size{};
+    std::int64_t modified{};
+    std::uint64_t hash{};
+};
+
+static std::mutex hashMutex{};
+static std::unordered_map<std::string, FileHash> hashCache{};
+
+static constexpr float envelopeStep{0.1f};   // seconds of audio per envelope value
+static constexpr float durationTolerance{1}; // seconds
+static constexpr float loudnessTolerance{0.5f};
+static constexpr float silenceFloor{-60};
+static constexpr float maxEnvelopeDifference{1.5f}; // dB, on average
+static constexpr int maxEnvelopeShift{3};           // encoders add a little padding at the start
+
+static constexpr std::uint64_t prime1{11400714785074694791ull};
+static constexpr std::uint64_t prime2{14029467366897019727ull};
+static constexpr std::uint64_t prime3{1609587929392839161ull};
+static constexpr std::uint64_t prime4{9650029242287828579ull};
+static constexpr std::uint64_t prime5{2870177450012600261ull};
+
+template <typename T> static T readUnaligned(const unsigned char* data) {
+    T value{};
+    std::memcpy(&value, data, sizeof(T));
+    return value;
+}
+
+static std::uint64_t xxhRound(std::uint64_t acc, std::uint64_t input) {
+    acc += input * prime2;
+    return std::rotl(acc, 31) * prime1;
+}
+
+static std::uint64_t xxhMerge(std::uint64_t acc, std::uint64_t value) {
+    acc ^= xxhRound(0, value);
+    return acc * prime1 + prime4;
+}
+
+// XXH64, fast enough that hashing is limited by how quickly the file can be read
+std::uint64_t xxh64(const unsigned char* data, std::size_t size, std::uint64_t seed) {
+    const unsigned char* end{data + size};
+    std::uint64_t hash{};
+    if (size >= 32) {
+        std::uint64_t acc[4]{seed + prime1 + prime2, seed + prime2, seed, seed - prime1};
+        for (; end - data >= 32; data += 32) {
+            for (int lane{0}; lane < 4; ++lane) {
+                acc[lane] = xxhRound(acc[lane], readUnaligned<std::uint64_t>(data + lane * 8));
+            }
+        }
+        hash = std::rotl(acc[0], 1) + std::rotl(acc[1], 7) + std::rotl(acc[2], 12) + std::rotl(acc[3], 18);
+        for (std::uint64_t lane : acc) {
+            hash = xxhMerge(hash, lane);
+        }
+    } else {
+        hash = seed + prime5;
+    }
+    hash += size;
+    for (; end - data >= 8; data += 8) {
+        hash ^= xxhRound(0, readUnaligned<std::uint64_t>(data));
+        hash = std::rotl(hash, 27) * prime1 + prime4;
+    }
+    if (end - data >= 4) {
+        hash ^= readUnaligned<std::uint32_t>(data) * prime1;
+        hash = std::rotl(hash, 23) * prime2 + prime3;
+        data += 4;
+    }
+    for (; data < end; ++data) {
+        hash ^= *data * prime5;
+        hash = std::rotl(hash, 11) * prime1;
+    }
+    hash ^= hash >> 33;
+    hash *= prime2;
+    hash ^= hash >> 29;
+    hash *= prime3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+static std::optional<std::uint64_t> hashFile(const fs::path& path) {
+    int fd{open(path.c_str(), O_RDONLY | O_CLOEXEC)};
+    if (fd == -1) {
+        return std::nullopt;
+    }
+    struct stat info{};
+    if (fstat(fd, &info) == -1) {
+        close(fd);
+        return std::nullopt;
+    }
+    auto size{(std::size_t)info.st_size};
+    if (size == 0) {
+        close(fd);
+        return xxh64(nullptr, 0);
+    }
+    void* data{mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0)};
+    close(fd);
+    if (data == MAP_FAILED) {
+        return std::nullopt;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+    std::uint64_t hash{xxh64((const unsigned char*)data, size)};
+    munmap(data, size);
+    return hash;
+}
+
+// Loudness of the song every envelopeStep seconds, in dB. Lossy encoders change the samples but not this.
+static std::vector<float> loudnessEnvelope(const fs::path& path) {
+    sf::InputSoundFile file{};
+    if (!file.openFromFile(path) || file.getChannelCount() == 0) {
+        return {};
+    }
+    auto samplesPerStep{(std::size_t)(envelopeStep * (float)file.getSampleRate()) * file.getChannelCount()};
+    std::vector<std::int16_t> samples(samplesPerStep);
+    std::vector<float> envelope{};
+    std::uint64_t numSamples{};
+    while ((numSamples = file.read(samples.data(), samples.size())) > 0) {
+        double energy{0};
+        for (std::uint64_t i{0}; i < numSamples; ++i) {
+            double sample{samples[i] / 32768.0};
+            energy += sample * sample;
+        }
+        envelope.push_back((float)(10 * std::log10(energy / (double)numSamples + 1e-10)));
+    }
+    return envelope;
+}
+
+static bool soundsTheSame(const std::vector<float>& first, const std::vector<float>& second) {
+    for (int shift{-maxEnvelopeShift}; shift <= maxEnvelopeShift; ++shift) {
+        double difference{0};
+        std::size_t compared{0};
+        for (std::size_t i{0}; i < first.size(); ++i) {
+            std::ptrdiff_t j{(std::ptrdiff_t)i + shift};
+            if (j < 0 || j >= (std::ptrdiff_t)second.size()) {
+                continue;
+            }
+            if (first[i] < silenceFloor && second[j] < silenceFloor) {
+                continue; // the noise floor of silence depends on the encoder
+            }
+            difference += std::abs(first[i] - second[j]);
+            ++compared;
+        }
+        if (compared > 0 && difference / (double)compared < maxEnvelopeDifference) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static std::size_t findRoot(std::vector<std::size_t>& parents, std::size_t song) {
+    while (parents[song] != song) {
+        parents[song] = parents[parents[song]];
+        song = parents[song];
+    }
+    return song;
+}
+
+static void unite(std::vector<std::size_t>& parents, std::size_t first, std::size_t second) {
+    parents[findRoot(parents, first)] = findRoot(parents, second);
+}
+
+// Joins songs with identical contents. Only files that share a size can match, so the rest never get read.
+// Runs job on the pool for each index and waits for them all. Once the user cancels, the rest are skipped.
+static void forEach(ThreadPool& pool, const std::vector<std::size_t>& indices,
+                    const std::function<void(std::size_t)>& job) {
+    std::atomic<std::size_t> done{0};
+    for (std::size_t i : indices) {
+        pool.submit([&indices, &job, &done, i] {
+            if (!Jobs::cancelled()) {
+                job(i);
+            }
+            Jobs::reportProgress(++done, indices.size());
+        });
+    }
+    pool.wait();
+}
+
+static void joinIdenticalFiles(const std::vector<std::string>& songs, std::vector<std::size_t>& parents,
+                               ThreadPool& pool) {
+    std::vector<FileHash> files(songs.size());
+    std::unordered_map<std::uintmax_t, std::vector<std::size_t>> bySize{};
+    for (std::size_t i{0}; i < songs.size(); ++i) {
+        std::error_code err{};
+        fs::path path{songPath(songs[i])};
+        files[i].size = fs::file_size(path, err);
+        if (err || files[i].size == 0) {
+            continue;
+        }
+        files[i].modified = fs::last_write_time(path, err).time_since_epoch().count();
+        if (!err) {
+            bySize[files[i].size].push_back(i);
+        }
+    }
+    std::vector<std::size_t> toHash{};
+    for (const auto& [size, group] : bySize) {
+        if (group.size() >= 2) {
+            toHash.insert(toHash.end(), group.begin(), group.end());
+        }
+    }
+    std::vector<bool> hashed(songs.size(), false);
+    forEach(pool, toHash, [&songs, &files, &hashed](std::size_t i) {
+        {
+            std::lock_guard lock{hashMutex};
+            auto cached{hashCache.find(songs[i])};
+            if (cached != hashCache.end() && cached->second.size == files[i].size &&
+                cached->second.modified == files[i].modified) {
+                files[i].hash = cached->second.hash;
+                hashed[i] = true;
+                return;
+            }
+        }
+        std::optional<std::uint64_t> hash{hashFile(songPath(songs[i]))};
+        std::lock_guard lock{hashMutex};
+        if (hash) {
+            files[i].hash = *hash;
+            hashed[i] = true;
+            hashCache[songs[i]] = files[i];
+        }
+    });
+    for (const auto& [size, group] : bySize) {
+        std::unordered_map<std::uint64_t, std::size_t> firstWithHash{};
+        for (std::size_t i : group) {
+            if (!hashed[i]) {
+                continue;
+            }
+            auto [it, inserted]{firstWithHash.try_emplace(files[i].hash, i)};
+            if (!inserted) {
+                unite(parents, it->second, i);
+            }
+        }
+    }
+}
+
+// Joins songs that sound the same. Comparing every pair would take forever, so only songs of about the same
+// length and loudness get decoded and compared.
+static void joinMatchingAudio(const std::vector<std::string>& songs, std::vector<std::size_t>& parents,
+                              ThreadPool& pool) {
+    std::vector<float> durations(songs.size(), -1);
+    std::vector<std::size_t> byDuration(songs.size());
+    std::iota(byDuration.begin(), byDuration.end(), 0);
+    forEach(pool, byDuration, [&songs, &durations](std::size_t i) {
+        sf::InputSoundFile file{};
+        if (file.openFromFile(songPath(songs[i]))) {
+            durations[i] = file.getDuration().asSeconds();
+        }
+    });
+    std::erase_if(byDuration, [&durations](std::size_t i) { return durations[i] < 0; });
+    std::ranges::sort(byDuration, {}, [&durations](std::size_t i) { return durations[i]; });
+    std::vector<std::pair<std::size_t, std::size_t>> candidates{};
+    std::vector<bool> needsEnvelope(songs.size(), false);
+    for (std::size_t a{0}; a < byDuration.size(); ++a) {
+        std::size_t first{byDuration[a]};
+        std::optional<TrackLoudness> firstLoudness{getLoudness(songs[first])};
+        for (std::size_t b{a + 1}; b < byDuration.size(); ++b) {
+            std::size_t second{byDuration[b]};
+            if (durations[second] - durations[first] > durationTolerance) {
+                break;
+            }
+            if (findRoot(parents, first) == findRoot(parents, second)) {
+                continue;
+            }
+            std::optional<TrackLoudness> secondLoudness{getLoudness(songs[second])};
+            if (firstLoudness && secondLoudness &&
+                std::abs(firstLoudness->integrated - secondLoudness->integrated) > loudnessTolerance) {
+                continue;
+            }
+            candidates.emplace_back(first, second);
+            needsEnvelope[first] = needsEnvelope[second] = true;
+        }
+    }
+    std::vector<std::size_t> toDecode{};
+    for (std::size_t i{0}; i < songs.size(); ++i) {
+        if (needsEnvelope[i]) {
+            toDecode.push_back(i);
+        }
+    }
+    std::vector<std::vector<float>> envelopes(songs.size());
+    forEach(pool, toDecode,
+            [&songs, &envelopes](std::size_t i) { envelopes[i] = loudnessEnvelope(songPath(songs[i])); });
+    for (const auto& [first, second] : candidates) {
+        if (soundsTheSame(envelopes[first], envelopes[second])) {
+            unite(parents, first, second);
+        }
+    }
+}
+
+std::vector<std::vector<std::string>> findDuplicates(bool compareAudio) {
+    std::vector<std::string> songs{Music::songs.toVector()};
+    std::vector<std::size_t> parents(songs.size());
+    std::iota(parents.begin(), parents.end(), 0);
+    ThreadPool pool{std::max(1u, std::thread::hardware_concurrency())};
+    joinIdenticalFiles(songs, parents, pool);
+    if (compareAudio) {
+        joinMatchingAudio(songs, parents, pool);
+    }
+    std::unordered_map<std::size_t, std::vector<std::string>> groups{};
+    for (std::size_t i{0}; i < songs.size(); ++i) {
+        groups[findRoot(parents, i)].push_back(songs[i]);
+    }
+    std::vector<std::vector<std::string>> duplicates{};
+    for (auto& [root, group] : groups) {
+        if (group.size() > 1) {
+            duplicates.push_back(std::move(group));
+        }
+    }
+    std::ranges::sort(duplicates);
+    return duplicates;
+}
+
+void readHashCache(const fs::path& path) {
+    std::ifstream inp{path};
+    std::string line{};
+    std::lock_guard lock{hashMutex};
+    while (std::getline(inp, line)) {
+        // Lines are song:size:modified:hash, split from the right since song names can contain colons
+        std::size_t hashPos{line.rfind(':')};
+        std::size_t modifiedPos{hashPos == std::string::npos || hashPos == 0 ? std::string::npos
+                                                                            : line.rfind(':', hashPos - 1)};
+        std::size_t sizePos{modifiedPos == std::string::npos || modifiedPos == 0
+                                ? std::string::npos
+                                : line.rfind(':', modifiedPos - 1)};
+        if (sizePos == std::string::npos) {
+            continue;
+        }
+        try {
+            hashCache.try_emplace(line.substr(0, sizePos),
+                                  FileHash{
+                                      std::stoull(line.substr(sizePos + 1, modifiedPos - sizePos - 1)),
+                                      std::stoll(line.substr(modifiedPos + 1, hashPos - modifiedPos - 1)),
+                                      std::stoull(line.substr(hashPos + 1), nullptr, 16),
+                                  });
+        } catch (const std::exception&) {
+            continue;
+        }
+    }
+}
+
+void writeHashCache(const fs::path& path) {
+    std::ofstream cache{path};
+    std::lock_guard lock{hashMutex};
+    for (const auto& [song, file] : hashCache) {
+        cache << std::format("{}:{}:{}:{:016x}\n", song, file.size, file.modified, file.hash);
+    }
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+std::uint64_t xxh64(const unsigned char* data, std::size_t size, std::uint64_t seed = 0);
+// Each group holds two or more songs that are copies of each other. With compareAudio, songs that
+// sound the same but are stored in different formats count as copies too.
+std::vector<std::vector<std::string>> findDuplicates(bool compareAudio);
+void readHashCache(const std::filesystem::path& path);
+void writeHashCache(const std::filesystem::path& path);
@@ -0,0 +1,183 @@
+#include "history.hpp"
+#include "readAhead.hpp"
+#include "threadPool.hpp"
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <readline/history.h>
+#include <string_view>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// Enough for years of use, readline still searches this many lines without any noticeable delay
+static constexpr std::size_t maxEntries{100'000};
+static constexpr std::size_t minCompactLines{1'000}; // small logs aren't worth rewriting
+
+static fs::path logPath{};
+// The log as it was at startup. It's only ever appended to or replaced, so it stays mapped for good and
+// the lines loaded from it don't need a copy for their keys.
+static MappedFileStream startupLog{};
+// Keys point into startupLog or the entries' own lines
+static std::unordered_map<std::string_view, HIST_ENTRY*> entries{};
+static std::unique_ptr<ThreadPool> pool{};
+static std::mutex logMutex{}; // guards everything below
+static int logFd{-1};
+static std::size_t logLines{0};
+static bool compacting{false};
+static std::vector<std::string> pending{}; // lines added while compacting, which the new log needs too
+
+static void appendLine(int fd, std::string_view line) {
+    std::string buffer{line};
+    buffer += '\n';
+    (void)!write(fd, buffer.data(), buffer.size());
+}
+
+static void compact(const std::vector<std::string>& snapshot) {
+    fs::path temp{logPath};
+    temp += ".tmp";
+    std::ofstream out{temp, std::ios::trunc};
+    for (const auto& line : snapshot) {
+        out << line << '\n';
+    }
+    out.close();
+    std::lock_guard lock{logMutex};
+    int fd{out ? ::open(temp.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC) : -1};
+    if (fd != -1) {
+        for (const auto& line : pending) {
+            appendLine(fd, line);
+        }
+    }
+    std::error_code ec{};
+    if (fd != -1) {
+        fs::rename(temp, logPath, ec);
+    }
+    if (fd != -1 && !ec) {
+        close(logFd);
+        logFd = fd;
+        logLines = snapshot.size() + pending.size();
+    } else {
+        if (fd != -1) {
+            close(fd);
+        }
+        fs::remove(temp, ec); // keep appending to the old log and try again after the next line
+    }
+    pending.clear();
+    compacting = false;
+}
+
+// Called with logMutex held
+static void compactIfNeeded() {
+    if (compacting || logFd == -1 || logLines < minCompactLines || logLines <= 2 * entries.size()) {
+        return;
+    }
+    std::vector<std::string> snapshot{};
+    snapshot.reserve((std::size_t)history_length);
+    for (HIST_ENTRY** entry{history_list()}; entry != nullptr && *entry != nullptr; ++entry) {
+        snapshot.emplace_back((*entry)->line);
+    }
+    compacting = true;
+    if (pool == nullptr) {
+        pool = std::make_unique<ThreadPool>(1, true);
+    }
+    pool->submit([snapshot{std::move(snapshot)}] { compact(snapshot); });
+}
+
+static void remember() {
+    HIST_ENTRY* entry{history_list()[history_length - 1]};
+    entries.emplace(entry->line, entry);
+}
+
+static void forget(int index) {
+    HIST_ENTRY* entry{remove_history(index)};
+    entries.erase(entry->line);
+    free_history_entry(entry);
+}
+
+namespace History {
+    void setPath(const fs::path& path) { logPath = path; }
+
+    void load() {
+        std::vector<std::string_view> lines{};
+        if (startupLog.open(logPath) && startupLog.file()->size > 0) {
+            auto data{(const char*)startupLog.file()->data};
+            std::size_t size{startupLog.file()->size};
+            for (std::size_t start{0}; start < size;) {
+                auto newline{(const char*)std::memchr(data + start, '\n', size - start)};
+                std::size_t end{newline == nullptr ? size : (std::size_t)(newline - data)};
+                if (end > start) {
+                    lines.emplace_back(data + start, end - start);
+                }
+                start = end + 1;
+            }
+        }
+        // Walk back from the end so the most recent copy of each line is the one kept
+        std::vector<std::string_view> kept{};
+        entries.reserve(std::min(lines.size(), maxEntries));
+        for (auto line{lines.rbegin()}; line != lines.rend() && kept.size() < maxEntries; ++line) {
+            if (entries.emplace(*line, nullptr).second) {
+                kept.push_back(*line);
+            }
+        }
+        std::string line{};
+        for (auto it{kept.rbegin()}; it != kept.rend(); ++it) {
+            line = *it;
+            add_history(line.c_str());
+            entries[*it] = history_list()[history_length - 1];
+        }
+        std::lock_guard lock{logMutex};
+        logFd = ::open(logPath.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+        if (logFd == -1) {
+            return; // history just won't be saved this time
+        }
+        std::shared_ptr<MappedFile> log{startupLog.file()};
+        if (log != nullptr && log->size > 0 && log->data[log->size - 1] != '\n') {
+            (void)!write(logFd, "\n", 1); // the last line was cut off, don't run the next one into it
+        }
+        logLines = lines.size();
+        compactIfNeeded();
+    }
+
+    void add(const std::string& line) {
+        if (auto found{entries.find(line)}; found != entries.end()) {
+            HIST_ENTRY* entry{found->second};
+            entries.erase(found);
+            // Usually a recent line, so it's quickest to look from the end
+            HIST_ENTRY** list{history_list()};
+            for (int i{history_length - 1}; i >= 0; --i) {
+                if (list[i] == entry) {
+                    free_history_entry(remove_history(i));
+                    break;
+                }
+            }
+        }
+        add_history(line.c_str());
+        remember();
+        if ((std::size_t)history_length > maxEntries) {
+            forget(0);
+        }
+        std::lock_guard lock{logMutex};
+        if (logFd == -1) {
+            return;
+        }
+        appendLine(logFd, line);
+        ++logLines;
+        if (compacting) {
+            pending.push_back(line);
+        }
+        compactIfNeeded();
+    }
+
+    void stop() {
+        pool.reset();
+        std::lock_guard lock{logMutex};
+        if (logFd != -1) {
+            close(logFd);
+            logFd = -1;
+        }
+    }
+} // namespace History
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+
+// Command history that survives restarts. Lines are appended to a log as they're entered, and once the log
+// holds twice as many lines as the history it's rewritten without the duplicates in the background.
+namespace History {
+    void setPath(const std::filesystem::path& path);
+    // Fills readline's history from the log, keeping the most recent copy of each line
+    void load();
+    // Entering a line that's already in the history moves it to the end, so the oldest lines are the ones
+    // that drop off once the history is full
+    void add(const std::string& line);
+    // Waits for any compaction to finish
+    void stop();
+} // namespace History
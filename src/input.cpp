@@ -2,13 +2,15 @@
 #include "autocomplete.hpp"
 #include "command.hpp"
 #include "defaultCommands.hpp"
+#include "history.hpp"
+#include "jobs.hpp"
 #include "music.hpp"
 #include "playlistCommands.hpp"
 #include "threads.hpp"
 #include <SFML/Audio/Music.hpp>
 #include <iostream>
+#include <optional>
 #include <print>
-#include <readline/history.h>
 #include <readline/readline.h>
 #include <thread>
 
@@ -57,83 +59,88 @@ std::vector<Command> parseString(std::string_view input) {
     if (!current.str().empty()) {
         thisCommand.push_back(current.str());
     }
-    assert(!thisCommand.empty() && "Bug encountered while parsing input");
-    commands.emplace_back(thisCommand);
+    if (!thisCommand.empty()) {
+        // Blank input or a trailing `;` leaves nothing to run, which matters now that input can come from
+        // a socket rather than just the prompt
+        commands.emplace_back(thisCommand);
+    }
     return commands;
 }
 
 static bool checkInput() { return !Threads::userInput.empty(); }
 
-void parseCmd(Command& cmd, const CommandMap& commands) {
-    std::string match{};
+// The full name of the command, or nothing if it's unknown or ambiguous
+static std::optional<std::string> resolveCmd(const Command& cmd, const CommandMap& commands) {
     if (commands.contains(cmd.function())) {
-        commands.at(cmd.function())(cmd);
-    } else {
-        AutoMatch match{commands.keys(), cmd.function()};
-        switch (match.matchType) {
-            case Match::NoMatch:
-                std::println("Command '{}' not found.", cmd.function());
-                break;
-            case Match::ExactMatch:
-                commands.at(match.exactMatch())(cmd);
-                return;
-            case Match::MultipleMatch:
-                std::println("Multiple possible commands found, could be one of {}.",
-                             join(match.matches, ", "));
-                break;
-        }
+        return cmd.function();
     }
+    AutoMatch match{commands.keys(), cmd.function()};
+    switch (match.matchType) {
+        case Match::NoMatch:
+            printError("Command '{}' not found.", cmd.function());
+            break;
+        case Match::ExactMatch:
+            return match.exactMatch();
+        case Match::MultipleMatch:
+            printError("Multiple possible commands found, could be one of {}.", join(match.matches, ", "));
+            break;
+    }
+    return std::nullopt;
 }
 
-void executeCmds(const std::vector<Command>& commands) {
-    for (auto cmd : commands) {
-        if (Threads::helpMode) {
-            // Note that this can change between commands, so some commands may be executed in
-            // help mode and others normally
-            Cleo::help(cmd);
-        } else {
-            parseCmd(cmd, Cleo::commands);
-        }
+void parseCmd(Command& cmd, const CommandMap& commands) {
+    if (std::optional<std::string> name{resolveCmd(cmd, commands)}) {
+        commands.at(*name)(cmd);
     }
 }
 
-static bool existsInHistory(HIST_ENTRY** history, const char* str) {
-    if (history == NULL) {
-        return false;
+// Slow playlist subcommands are listed on their own, as e.g. `playlist load`, since the rest are quick
+static std::string jobName(const std::string& name, const Command& cmd) {
+    if (name != "playlist" || cmd.arguments().empty()) {
+        return name;
     }
-
-    for (size_t i{0}; history[i] != NULL; ++i) {
-        if (strcmp(history[i]->line, str) == 0) {
-            return true;
-        }
+    const std::string& subcommand{cmd.arguments().front()};
+    if (Cleo::Playlist::commands.contains(subcommand)) {
+        return std::format("{} {}", name, subcommand);
     }
-    return false;
+    AutoMatch match{Cleo::Playlist::commands.keys(), subcommand};
+    return match.matchType == Match::ExactMatch ? std::format("{} {}", name, match.exactMatch()) : name;
 }
 
-static bool shouldRepeat() {
-    if (Music::music.isLooping()) {
-        return false;
-    }
-    if (Music::music.getStatus() != sf::Music::Status::Playing) {
-        if (Music::repeats > 0) {
-            return true;
+void executeCmds(const std::vector<Command>& commands) {
+    for (auto cmd : commands) {
+        if (Threads::helpMode) {
+            // Note that this can change between commands, so some commands may be executed in
+            // help mode and others normally
+            Cleo::help(cmd);
+        } else if (std::optional<std::string> name{resolveCmd(cmd, Cleo::commands)}) {
+            Jobs::run(jobName(*name, cmd), cmd, Cleo::commands.at(*name));
         }
     }
-    return false;
 }
 
-static bool shouldAdvance() {
-    if (Music::playlistIdx == 0 || !Music::inPlaylistMode ||
-        Music::music.getStatus() != sf::Music::Status::Stopped || Music::music.isLooping()) {
-        // Note the looping check is redundant, but we put it in to indicate looping takes
-        // precedence over advancing the playlist
-        return false;
-    } else if (Music::playlistIdx < Music::curPlaylist.size() || Music::isPlaylistLooping) {
-        return true;
-    } else {
-        Music::inPlaylistMode = false;
-        return false;
+std::string executeCaptured(std::string_view input) {
+    // Commands print to Threads::output, so pointing it at an in-memory stream for the duration catches
+    // everything they print without anything having to be rewritten to return its output. It's only this
+    // thread's, so the supervisor and monitor can keep printing to the terminal in the meantime.
+    char* buffer{nullptr};
+    std::size_t size{0};
+    FILE* capture{open_memstream(&buffer, &size)};
+    if (capture == nullptr) {
+        return "Error: could not capture command output.\n";
     }
+    FILE* previous{std::exchange(Threads::output, capture)};
+    try {
+        executeCmds(parseString(input));
+    } catch (const std::exception& e) {
+        // A bad command from a client shouldn't be able to take the whole process down
+        printError("Error: {}", e.what());
+    }
+    Threads::output = previous;
+    std::fclose(capture);
+    std::string output{buffer, size};
+    std::free(buffer);
+    return output;
 }
 
 void inputThread() {
@@ -160,8 +167,7 @@ void inputThread() {
         Threads::userInput = input;
         std::free((void*)input);
         if (Threads::userInput.length() > 0) {
-            if (!existsInHistory(history_list(), Threads::userInput.c_str()))
-                add_history(Threads::userInput.c_str());
+            History::add(Threads::userInput);
         } else {
             Threads::readyForInput = true;
         }
@@ -170,23 +176,14 @@ void inputThread() {
 
 void backgroundThread() {
     using namespace std::chrono_literals;
-    Command _;
     while (Threads::running) {
-        if (shouldRepeat()) {
-            --Music::repeats;
-            Music::music.play();
-        }
-        if (shouldAdvance()) {
-            Cleo::Playlist::play(_);
-            // This function doesn't need arguments, but the signature is required, so we pass
-            // an empty command to satisfy it
-        }
         if (!checkInput()) [[likely]] {
             std::this_thread::sleep_for(10ms);
             continue;
         }
         std::vector<Command> commands{parseString(Threads::userInput)};
         executeCmds(commands);
+        Jobs::waitAll(); // the prompt comes back once the whole line is done, so output doesn't mix with it
         Threads::userInput.clear();
         Threads::readyForInput = true;
     }
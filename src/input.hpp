@@ -8,3 +8,4 @@ void parseCmd(Command& cmd,
               const std::flat_map<std::string, std::function<void(Command&)>>& programCommands);
 std::vector<Command> parseString(std::string_view input);
 void executeCmds(const std::vector<Command>& commands);
+std::string executeCaptured(std::string_view input);
@@ -0,0 +1,201 @@
+#include "jobs.hpp"
+#include "defaultCommands.hpp"
+#include "threadPool.hpp"
+#include "threads.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <print>
+#include <readline/readline.h>
+#include <unistd.h>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+static constexpr auto progressDelay{std::chrono::milliseconds{500}}; // quick jobs never show progress
+static constexpr auto progressInterval{std::chrono::milliseconds{200}};
+
+struct RunningJob {
+    std::size_t id{};
+    JobTraits traits{};
+};
+
+static std::unique_ptr<ThreadPool> pool{};
+static std::mutex jobsMutex{};
+static std::condition_variable jobFinished{};
+static std::vector<RunningJob> running{};
+static std::size_t nextId{0};
+static std::atomic<std::size_t> jobsRunning{0}; // for the signal handler, which can't take jobsMutex
+static std::atomic<bool> cancelRequested{false};
+static thread_local bool insideJob{false};
+
+static std::mutex progressMutex{};
+static Clock::time_point progressStarted{};
+static Clock::time_point progressShown{};
+static bool showingProgress{false};
+
+static bool conflicts(const JobTraits& a, const JobTraits& b) {
+    return (a.writes & (b.reads | b.writes)) != 0 || (a.reads & b.writes) != 0;
+}
+
+// Waits until nothing running conflicts with the job, then registers it so later jobs wait for it in turn
+static std::size_t admit(const JobTraits& traits) {
+    std::unique_lock lock{jobsMutex};
+    jobFinished.wait(lock, [&traits] {
+        return std::none_of(running.begin(), running.end(),
+                            [&traits](const RunningJob& job) { return conflicts(job.traits, traits); });
+    });
+    running.push_back({nextId, traits});
+    ++jobsRunning;
+    return nextId++;
+}
+
+static void finish(std::size_t id) {
+    {
+        std::lock_guard lock{jobsMutex};
+        std::erase_if(running, [id](const RunningJob& job) { return job.id == id; });
+        --jobsRunning;
+    }
+    jobFinished.notify_all();
+}
+
+// Slow commands don't hold the state lock, so a long one can't hold up playback. Whatever they run themselves
+// skips the queue, since they were admitted together.
+static void execute(bool slow, Command& cmd, const std::function<void(Command&)>& function) {
+    if (!slow) {
+        StateLock lock{};
+        function(cmd);
+        return;
+    }
+    bool outer{insideJob};
+    insideJob = true;
+    try {
+        function(cmd);
+    } catch (...) {
+        insideJob = outer;
+        throw;
+    }
+    insideJob = outer;
+}
+
+static int interruptPipe[2]{-1, -1};
+
+static void onInterrupt(int) {
+    if (jobsRunning > 0) {
+        cancelRequested = true;
+    } else {
+        (void)!write(interruptPipe[1], "", 1); // let watchInterrupts quit, it isn't safe to do from here
+    }
+}
+
+namespace Jobs {
+    void start(std::size_t numThreads) { pool = std::make_unique<ThreadPool>(numThreads); }
+
+    void stop() {
+        cancel();
+        pool.reset();
+    }
+
+    void run(const std::string& name, Command& cmd, const std::function<void(Command&)>& function) {
+        auto found{Cleo::slowCommands.find(name)};
+        bool slow{found != Cleo::slowCommands.end()};
+        if (insideJob) {
+            execute(slow, cmd, function); // part of a job that was already admitted, e.g. a line of a script
+            return;
+        }
+        std::size_t id{admit(slow ? found->second : JobTraits{})};
+        if (pool == nullptr || !slow) {
+            try {
+                execute(slow, cmd, function);
+            } catch (...) {
+                finish(id);
+                throw;
+            }
+            finish(id);
+            return;
+        }
+        pool->submit([id, cmd, function]() mutable {
+            try {
+                execute(true, cmd, function);
+            } catch (const std::exception& e) {
+                printError("Error: {}", e.what());
+            }
+            finish(id);
+        });
+    }
+
+    void waitAll() {
+        std::unique_lock lock{jobsMutex};
+        bool announced{false};
+        while (!running.empty()) {
+            jobFinished.wait_for(lock, progressInterval);
+            if (cancelRequested && !announced && !running.empty()) {
+                std::println(stderr, "\nCancelling...");
+                announced = true;
+            }
+        }
+        cancelRequested = false;
+    }
+
+    void catchInterrupts() {
+        if (pipe2(interruptPipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+            return; // Ctrl-C keeps quitting straight away
+        }
+        rl_catch_signals = 0; // readline would otherwise take SIGINT for itself while it waits at the prompt
+        struct sigaction action{};
+        action.sa_handler = onInterrupt;
+        action.sa_flags = SA_RESTART; // don't break a confirmation prompt that's waiting for an answer
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGINT, &action, nullptr);
+    }
+
+    void watchInterrupts() {
+        if (interruptPipe[0] == -1) {
+            return;
+        }
+        pollfd pfd{interruptPipe[0], POLLIN, 0};
+        while (Threads::running) {
+            if (poll(&pfd, 1, 100) <= 0) {
+                continue;
+            }
+            // Nothing was running, so quit like we always have, without leaving the terminal in raw mode
+            rl_free_line_state();
+            rl_cleanup_after_signal();
+            std::signal(SIGINT, SIG_DFL);
+            std::raise(SIGINT);
+        }
+    }
+
+    void cancel() { cancelRequested = true; }
+
+    bool cancelled() { return cancelRequested; }
+
+    void reportProgress(std::size_t done, std::size_t total) {
+        std::lock_guard lock{progressMutex};
+        Clock::time_point now{Clock::now()};
+        if (done == 0 || progressStarted == Clock::time_point{}) {
+            progressStarted = now;
+        }
+        if (done >= total) {
+            if (showingProgress) {
+                std::print(stderr, "\r\033[K"); // the command is about to print its results
+                showingProgress = false;
+            }
+            progressStarted = {};
+            return;
+        }
+        if (now - progressStarted < progressDelay ||
+            (showingProgress && now - progressShown < progressInterval)) {
+            return;
+        }
+        std::print(stderr, "\r\033[K{}/{} ({:.0f}%)", done, total, 100.0 * (double)done / (double)total);
+        progressShown = now;
+        showingProgress = true;
+    }
+} // namespace Jobs
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "command.hpp"
+#include <cstddef>
+#include <functional>
+
+// What a command reads or changes. Commands only wait for earlier ones that change something they use, or
+// use something they change.
+enum Resource : unsigned {
+    NoResource = 0,
+    Library = 1 << 0,
+    Playlists = 1 << 1,
+    Playback = 1 << 2,
+    AllResources = Library | Playlists | Playback,
+};
+
+struct JobTraits {
+    unsigned reads{AllResources};
+    unsigned writes{AllResources};
+};
+
+namespace Jobs {
+    // Without workers, which is the case for batch and daemon mode, every command runs inline
+    void start(std::size_t numThreads);
+    void stop();
+    // Slow commands go to a worker thread, everything else runs straight away with the player state locked.
+    // Either way, the command first waits for any earlier job it conflicts with.
+    // name is what Cleo::slowCommands lists it as, so a subcommand can be slow on its own.
+    void run(const std::string& name, Command& cmd, const std::function<void(Command&)>& function);
+    // Blocks until every job has finished
+    void waitAll();
+    // Ctrl-C cancels the running jobs instead of quitting, if there are any
+    void catchInterrupts();
+    // Quits on Ctrl-C when there's nothing to cancel. Runs as its own thread until Threads::running is false.
+    void watchInterrupts();
+    void cancel();
+    bool cancelled();
+    // Shows how far along a slow command is once it has taken long enough to be worth it
+    void reportProgress(std::size_t done, std::size_t total);
+} // namespace Jobs
@@ -0,0 +1,146 @@
+#include "listing.hpp"
+#include "defaultCommands.hpp"
+#include "music.hpp"
+#include "threads.hpp"
+#include "visualizer.hpp"
+#include <algorithm>
+#include <charconv>
+#include <cstdio>
+#include <iostream>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+static constexpr std::size_t flushAt{64 * 1024};
+static constexpr std::size_t defaultWidth{80};
+static constexpr std::size_t columnGap{2};
+
+// Counts characters rather than bytes, so names that aren't plain ASCII still line up
+static std::size_t displayWidth(std::string_view text) {
+    return (std::size_t)std::ranges::count_if(text, [](char c) { return ((unsigned char)c & 0xC0) != 0x80; });
+}
+
+// Collects output into a buffer and writes it out in large chunks
+class ListWriter {
+public:
+    ListWriter() { mBuffer.reserve(flushAt); }
+    ~ListWriter() { flush(); }
+    ListWriter(const ListWriter&) = delete;
+    ListWriter& operator=(const ListWriter&) = delete;
+
+    void write(std::string_view text) {
+        mBuffer.append(text);
+        if (mBuffer.size() >= flushAt) {
+            flush();
+        }
+    }
+    void pad(std::size_t count) { mBuffer.append(count, ' '); }
+    void flush() {
+        std::fwrite(mBuffer.data(), 1, mBuffer.size(), Threads::output);
+        mBuffer.clear();
+    }
+
+private:
+    std::string mBuffer{};
+};
+
+// 0 for rows if the output isn't going to a terminal, so there's nowhere to page. Rows the visualizer is
+// drawing on don't count.
+static std::pair<std::size_t, std::size_t> terminalSize() {
+    winsize size{};
+    int fd{fileno(Threads::output)};
+    if (fd == -1 || !isatty(fd) || ioctl(fd, TIOCGWINSZ, &size) == -1 || size.ws_col == 0) {
+        return {defaultWidth, 0};
+    }
+    std::size_t reserved{Visualizer::reservedRows()};
+    return {size.ws_col, size.ws_row > reserved ? size.ws_row - reserved : 0};
+}
+
+// false if the user wants to stop
+static bool waitForMore(std::size_t shown, std::size_t total) {
+    std::print(Threads::output, "-- {}/{}, Enter for more, q to stop -- ", shown, total);
+    std::fflush(Threads::output);
+    std::string answer{};
+    {
+        StateUnlock unlock{}; // playback carries on while the user reads
+        if (!std::getline(std::cin, answer)) {
+            std::println(Threads::output);
+            return false;
+        }
+    }
+    std::print(Threads::output, "\033[1A\r\033[K"); // the listing carries on where the prompt was
+    return answer != "q" && answer != "Q";
+}
+
+template <typename Songs, typename NameAt>
+static void printColumns(const Songs& songs, ListRange range, NameAt nameAt) {
+    std::size_t begin{std::min(range.offset, songs.size())};
+    std::size_t end{begin + std::min(range.limit, songs.size() - begin)};
+    std::size_t widest{0};
+    for (std::size_t i{begin}; i < end; ++i) {
+        widest = std::max(widest, displayWidth(nameAt(i)));
+    }
+    auto [width, height]{terminalSize()};
+    std::size_t columns{std::max<std::size_t>(1, (width + columnGap) / (widest + columnGap))};
+    bool paging{Music::usePager && height > 1 && isatty(STDIN_FILENO)};
+    std::size_t rowsShown{0};
+    ListWriter out{};
+    for (std::size_t row{begin}; row < end; row += columns) {
+        if (paging && rowsShown == height - 1) {
+            out.flush();
+            if (!waitForMore(row - begin, end - begin)) {
+                return;
+            }
+            rowsShown = 0;
+            end = std::min(end, songs.size()); // it may have changed while we waited
+            if (row >= end) {
+                break;
+            }
+        }
+        std::size_t rowEnd{std::min(row + columns, end)};
+        for (std::size_t i{row}; i < rowEnd; ++i) {
+            std::string_view name{nameAt(i)};
+            out.write(name);
+            if (i + 1 < rowEnd) {
+                out.pad(widest + columnGap - displayWidth(name));
+            }
+        }
+        out.write("\n");
+        ++rowsShown;
+    }
+}
+
+namespace Listing {
+    bool isRangeArg(std::string_view arg) { return arg.starts_with("offset:") || arg.starts_with("limit:"); }
+
+    std::optional<ListRange> takeRange(std::vector<std::string>& args) {
+        ListRange range{};
+        bool valid{true};
+        std::erase_if(args, [&range, &valid](const std::string& arg) {
+            if (!isRangeArg(arg)) {
+                return false;
+            }
+            std::string_view value{std::string_view{arg}.substr(arg.find(':') + 1)};
+            std::size_t number{};
+            auto [end, err]{std::from_chars(value.data(), value.data() + value.size(), number)};
+            if (err != std::errc{} || end != value.data() + value.size()) {
+                valid = false;
+            } else {
+                (arg.starts_with("offset:") ? range.offset : range.limit) = number;
+            }
+            return true;
+        });
+        if (!valid) {
+            printError("The offset and limit must be whole numbers, e.g. `offset:100 limit:50`.");
+            return std::nullopt;
+        }
+        return range;
+    }
+
+    void printSongs(const std::vector<std::string>& songs, ListRange range) {
+        printColumns(songs, range, [&songs](std::size_t i) { return displayName(songs[i]); });
+    }
+
+    void printSongs(const SongList& songs, ListRange range) {
+        printColumns(songs, range, [&songs](std::size_t i) { return songs.displayNameAt(i); });
+    }
+} // namespace Listing
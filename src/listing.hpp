@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <limits>
+#include "songList.hpp"
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Which part of a listing to show
+struct ListRange {
+    std::size_t offset{0};
+    std::size_t limit{std::numeric_limits<std::size_t>::max()};
+};
+
+namespace Listing {
+    // Takes `offset:N` and `limit:N` out of the arguments, leaving anything else. Prints an error and
+    // returns nullopt if either isn't a whole number.
+    std::optional<ListRange> takeRange(std::vector<std::string>& args);
+    bool isRangeArg(std::string_view arg);
+    // Writes songs without their extensions in columns that fit the terminal, straight from the vector as
+    // it goes rather than building the whole listing first. With the pager on and a terminal to answer it,
+    // stops after each screenful until Enter is pressed.
+    void printSongs(const std::vector<std::string>& songs, ListRange range);
+    void printSongs(const SongList& songs, ListRange range);
+} // namespace Listing
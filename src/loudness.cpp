@@ -0,0 +1,373 @@
+#include "loudness.hpp"
+#include "music.hpp"
+#include "simd.hpp"
+#include "threadPool.hpp"
+#include <SFML/Audio/InputSoundFile.hpp>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <numbers>
+#include <unordered_set>
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+static constexpr std::size_t oversampling{4};
+static constexpr std::size_t tapsPerPhase{12};
+static constexpr std::size_t framesPerRead{4096};
+static constexpr double absoluteGate{-70};
+static constexpr double relativeGate{-10};
+
+struct Biquad {
+    float b0{}, b1{}, b2{}, a1{}, a2{};
+};
+
+struct ChannelGroup {
+    std::size_t first{};
+    std::size_t count{};
+    Vec4 weight{};
+    Vec4 state[2][2]{};
+    Vec4 history[2 * tapsPerPhase]{}; // stored twice so the filter window never wraps
+    std::size_t historyPos{0};
+    Vec4 energy{};
+    Vec4 peak{};
+};
+
+static std::mutex resultsMutex{};
+static std::map<std::string, TrackLoudness> results{};
+static std::unordered_set<std::string> queued{}; // also holds songs that couldn't be decoded, not to retry
+static std::unique_ptr<ThreadPool> pool{};
+static std::atomic<bool> stopping{false};
+static std::size_t queuedThisRun{0};
+static std::size_t analysedThisRun{0};
+static Clock::time_point runStarted{};
+static Clock::time_point lastFinished{};
+
+// Polyphase 4x oversampling filter for true peak measurement (BS.1770-4 Annex 2), a Hann windowed sinc
+static const std::array<std::array<float, tapsPerPhase>, oversampling> truePeakFilter{[] {
+    std::array<std::array<float, tapsPerPhase>, oversampling> phases{};
+    constexpr std::size_t numTaps{oversampling * tapsPerPhase};
+    for (std::size_t n{0}; n < numTaps; ++n) {
+        double t{((double)n - (double)(numTaps - 1) / 2) / oversampling};
+        double sinc{std::sin(std::numbers::pi * t) / (std::numbers::pi * t)};
+        double window{0.5 - 0.5 * std::cos(2 * std::numbers::pi * ((double)n + 0.5) / numTaps)};
+        phases[n % oversampling][n / oversampling] = (float)(sinc * window);
+    }
+    return phases;
+}()};
+
+// The two stages of the K-weighting filter, a high shelf then a high pass, for any sample rate
+static std::array<Biquad, 2> kWeighting(double sampleRate) {
+    std::array<Biquad, 2> stages{};
+    double k{std::tan(std::numbers::pi * 1681.974450955533 / sampleRate)};
+    double q{0.7071752369554196};
+    double vh{std::pow(10.0, 3.999843853973347 / 20)};
+    double vb{std::pow(vh, 0.4996667741545416)};
+    double a0{1 + k / q + k * k};
+    stages[0] = {(float)((vh + vb * k / q + k * k) / a0), (float)(2 * (k * k - vh) / a0),
+                 (float)((vh - vb * k / q + k * k) / a0), (float)(2 * (k * k - 1) / a0),
+                 (float)((1 - k / q + k * k) / a0)};
+    k = std::tan(std::numbers::pi * 38.13547087602444 / sampleRate);
+    q = 0.5003270373238773;
+    a0 = 1 + k / q + k * k;
+    stages[1] = {1, -2, 1, (float)(2 * (k * k - 1) / a0), (float)((1 - k / q + k * k) / a0)};
+    return stages;
+}
+
+static float channelWeight(sf::SoundChannel channel) {
+    switch (channel) {
+        case sf::SoundChannel::LowFrequencyEffects:
+            return 0;
+        case sf::SoundChannel::SideLeft:
+        case sf::SoundChannel::SideRight:
+        case sf::SoundChannel::BackLeft:
+        case sf::SoundChannel::BackRight:
+            return 1.41f;
+        default:
+            return 1;
+    }
+}
+
+static void processFrames(ChannelGroup& group, const std::int16_t* samples, std::size_t numFrames,
+                          std::size_t numChannels, const std::array<Biquad, 2>& stages) {
+    for (std::size_t frame{0}; frame < numFrames; ++frame) {
+        const std::int16_t* in{samples + frame * numChannels + group.first};
+        Vec4 x{};
+        for (std::size_t c{0}; c < group.count; ++c) {
+            x[c] = (float)in[c] / 32768;
+        }
+        // K-weighting, transposed direct form II
+        Vec4 y{x};
+        for (std::size_t s{0}; s < stages.size(); ++s) {
+            const Biquad& stage{stages[s]};
+            Vec4 out{stage.b0 * y + group.state[s][0]};
+            group.state[s][0] = stage.b1 * y - stage.a1 * out + group.state[s][1];
+            group.state[s][1] = stage.b2 * y - stage.a2 * out;
+            y = out;
+        }
+        group.energy += y * y;
+        // True peak, each phase of the oversampling filter gives one of the in-between samples
+        group.historyPos = group.historyPos == 0 ? tapsPerPhase - 1 : group.historyPos - 1;
+        group.history[group.historyPos] = group.history[group.historyPos + tapsPerPhase] = x;
+        const Vec4* window{group.history + group.historyPos};
+        Vec4 peak{vecMax(group.peak, vecAbs(x))};
+        for (const auto& phase : truePeakFilter) {
+            Vec4 sum{};
+            for (std::size_t k{0}; k < tapsPerPhase; ++k) {
+                sum += phase[k] * window[k];
+            }
+            peak = vecMax(peak, vecAbs(sum));
+        }
+        group.peak = peak;
+    }
+}
+
+static double blockLoudness(double energy) { return -0.691 + 10 * std::log10(energy); }
+
+static float integratedLoudness(const std::vector<double>& steps, std::size_t framesPerStep) {
+    // Gating blocks are 400 ms long and start every 100 ms
+    std::vector<double> blocks{};
+    for (std::size_t i{0}; i + 4 <= steps.size(); ++i) {
+        double energy{steps[i] + steps[i + 1] + steps[i + 2] + steps[i + 3]};
+        blocks.push_back(energy / (double)(4 * framesPerStep));
+    }
+    double total{0};
+    std::size_t count{0};
+    for (double block : blocks) {
+        if (blockLoudness(block) > absoluteGate) {
+            total += block;
+            ++count;
+        }
+    }
+    if (count == 0) {
+        return -INFINITY;
+    }
+    double threshold{blockLoudness(total / (double)count) + relativeGate};
+    total = 0;
+    count = 0;
+    for (double block : blocks) {
+        double loudness{blockLoudness(block)};
+        if (loudness > absoluteGate && loudness > threshold) {
+            total += block;
+            ++count;
+        }
+    }
+    return (float)blockLoudness(total / (double)count);
+}
+
+std::optional<TrackLoudness> measureLoudness(const fs::path& path) {
+    sf::InputSoundFile file{};
+    if (!file.openFromFile(path) || file.getChannelCount() == 0) {
+        return std::nullopt;
+    }
+    std::size_t numChannels{file.getChannelCount()};
+    std::size_t framesPerStep{file.getSampleRate() / 10};
+    std::array<Biquad, 2> stages{kWeighting(file.getSampleRate())};
+    const std::vector<sf::SoundChannel>& channelMap{file.getChannelMap()};
+    std::vector<ChannelGroup> groups{};
+    for (std::size_t first{0}; first < numChannels; first += lanes) {
+        ChannelGroup group{};
+        group.first = first;
+        group.count = std::min(lanes, numChannels - first);
+        for (std::size_t c{0}; c < group.count; ++c) {
+            group.weight[c] = first + c < channelMap.size() ? channelWeight(channelMap[first + c]) : 1;
+        }
+        groups.push_back(group);
+    }
+    std::vector<std::int16_t> samples(framesPerRead * numChannels);
+    std::vector<double> steps{};
+    std::size_t framesInStep{0};
+    std::uint64_t numSamples{};
+    while ((numSamples = file.read(samples.data(), samples.size())) > 0) {
+        if (stopping) {
+            return std::nullopt;
+        }
+        std::size_t numFrames{(std::size_t)numSamples / numChannels};
+        const std::int16_t* frames{samples.data()};
+        while (numFrames > 0) {
+            std::size_t chunk{std::min(numFrames, framesPerStep - framesInStep)};
+            for (auto& group : groups) {
+                processFrames(group, frames, chunk, numChannels, stages);
+            }
+            frames += chunk * numChannels;
+            numFrames -= chunk;
+            framesInStep += chunk;
+            if (framesInStep == framesPerStep) {
+                double energy{0};
+                for (auto& group : groups) {
+                    Vec4 weighted{group.weight * group.energy};
+                    energy += (double)weighted[0] + weighted[1] + weighted[2] + weighted[3];
+                    group.energy = Vec4{};
+                }
+                steps.push_back(energy);
+                framesInStep = 0;
+            }
+        }
+    }
+    float peak{0};
+    for (const auto& group : groups) {
+        for (std::size_t c{0}; c < lanes; ++c) {
+            peak = std::max(peak, group.peak[c]);
+        }
+    }
+    return TrackLoudness{integratedLoudness(steps, framesPerStep), 20 * std::log10(peak)};
+}
+
+std::optional<TrackLoudness> getLoudness(const std::string& song) {
+    std::lock_guard lock{resultsMutex};
+    auto it{results.find(song)};
+    if (it == results.end()) {
+        return std::nullopt;
+    }
+    return it->second;
+}
+
+// In dB
+float gainFor(const TrackLoudness& loudness) {
+    if (!std::isfinite(loudness.integrated)) {
+        return 0; // silence, don't try to boost it
+    }
+    float gain{targetLoudness - loudness.integrated};
+    if (std::isfinite(loudness.truePeak)) {
+        gain = std::min(gain, maxTruePeak - loudness.truePeak);
+    }
+    return gain;
+}
+
+AnalysisProgress getAnalysisProgress() {
+    std::lock_guard lock{resultsMutex};
+    AnalysisProgress progress{};
+    progress.analysed = results.size();
+    progress.remaining = queuedThisRun - analysedThisRun;
+    Clock::time_point end{progress.remaining > 0 ? Clock::now() : lastFinished};
+    std::chrono::duration<double> elapsed{end - runStarted};
+    if (elapsed.count() > 0) {
+        progress.tracksPerSecond = (double)analysedThisRun / elapsed.count();
+    }
+    return progress;
+}
+
+void readLoudnessCache(const fs::path& path) {
+    std::ifstream inp{path};
+    std::string line{};
+    std::lock_guard lock{resultsMutex};
+    while (std::getline(inp, line)) {
+        // Lines are song:loudness:peak, split from the right since song names can contain colons
+        std::size_t peakPos{line.rfind(':')};
+        if (peakPos == std::string::npos || peakPos == 0) {
+            continue;
+        }
+        std::size_t loudnessPos{line.rfind(':', peakPos - 1)};
+        if (loudnessPos == std::string::npos) {
+            continue;
+        }
+        try {
+            results.try_emplace(line.substr(0, loudnessPos),
+                                TrackLoudness{
+                                    std::stof(line.substr(loudnessPos + 1, peakPos - loudnessPos - 1)),
+                                    std::stof(line.substr(peakPos + 1)),
+                                });
+        } catch (const std::exception&) {
+            continue; // corrupt line, the song will just be analysed again
+        }
+    }
+}
+
+void writeLoudnessCache(const fs::path& path) {
+    // Unlike durations, loudness is expensive to measure, so every entry is kept
+    std::ofstream cache{path};
+    std::lock_guard lock{resultsMutex};
+    for (const auto& [song, loudness] : results) {
+        cache << song << ':' << loudness.integrated << ':' << loudness.truePeak << '\n';
+    }
+}
+
+void analyseLibrary() {
+    std::vector<std::string> songs{};
+    {
+        std::lock_guard lock{resultsMutex};
+        for (std::string_view name : Music::songs) {
+            std::string song{name};
+            if (!results.contains(song) && !queued.contains(song)) {
+                queued.insert(song);
+                songs.push_back(song);
+            }
+        }
+        if (songs.empty() || stopping) {
+            return;
+        }
+        if (pool == nullptr) {
+            // Leave a core free for playback
+            pool = std::make_unique<ThreadPool>(std::max(2u, std::thread::hardware_concurrency()) - 1, true);
+        }
+        if (queuedThisRun == analysedThisRun) {
+            runStarted = Clock::now();
+            queuedThisRun = 0;
+            analysedThisRun = 0;
+        }
+        queuedThisRun += songs.size();
+    }
+    for (auto& song : songs) {
+        fs::path path{songPath(song)};
+        pool->submit([song = std::move(song), path = std::move(path)] {
+            std::optional<TrackLoudness> loudness{measureLoudness(path)};
+            std::lock_guard lock{resultsMutex};
+            if (loudness) {
+                results[song] = *loudness;
+            }
+            ++analysedThisRun;
+            lastFinished = Clock::now();
+        });
+    }
+}
+
+void stopLoudnessAnalysis() {
+    stopping = true;
+    if (pool != nullptr) {
+        pool->cancel();
+        pool.reset();
+    }
+}
+
+static float albumGain(const std::vector<std::string>& playlist) {
+    // Average the energy rather than the loudness, weighted by length, as if the playlist were one track
+    double energy{0};
+    double totalWeight{0};
+    float peak{-INFINITY};
+    for (const auto& song : playlist) {
+        auto it{results.find(song)};
+        if (it == results.end() || !std::isfinite(it->second.integrated)) {
+            continue;
+        }
+        auto duration{Music::songDurations.find(song)};
+        double weight{duration == Music::songDurations.end() ? 1 : (double)duration->second};
+        energy += weight * std::pow(10.0, it->second.integrated / 10);
+        totalWeight += weight;
+        peak = std::max(peak, it->second.truePeak);
+    }
+    if (totalWeight == 0) {
+        return 0;
+    }
+    return gainFor({(float)(10 * std::log10(energy / totalWeight)), peak});
+}
+
+void applyNormalization(const std::string& song) {
+    float gain{0};
+    {
+        std::lock_guard lock{resultsMutex};
+        if (Music::normalization == Normalization::Album && Music::inPlaylistMode) {
+            gain = albumGain(getPlaylist());
+        } else if (Music::normalization != Normalization::Off) {
+            auto it{results.find(song)};
+            if (it != results.end()) {
+                gain = gainFor(it->second);
+            }
+        }
+    }
+    Music::music.setGain(std::pow(10.0f, gain / 20));
+}
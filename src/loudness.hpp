@@ -0,0 +1,30 @@
+#pragma once
+
+#include <filesystem>
+#include <optional>
+#include <string>
+
+// Loudness of a track as measured by EBU R128 / ITU-R BS.1770
+struct TrackLoudness {
+    float integrated{}; // LUFS
+    float truePeak{};   // dBTP
+};
+
+struct AnalysisProgress {
+    std::size_t analysed{};
+    std::size_t remaining{};
+    double tracksPerSecond{};
+};
+
+constexpr float targetLoudness{-18}; // LUFS, same reference level as ReplayGain 2.0
+constexpr float maxTruePeak{-1};     // dBTP, headroom left after applying gain
+
+std::optional<TrackLoudness> measureLoudness(const std::filesystem::path& path);
+std::optional<TrackLoudness> getLoudness(const std::string& song);
+float gainFor(const TrackLoudness& loudness);
+AnalysisProgress getAnalysisProgress();
+void readLoudnessCache(const std::filesystem::path& path);
+void writeLoudnessCache(const std::filesystem::path& path);
+void analyseLibrary();
+void stopLoudnessAnalysis();
+void applyNormalization(const std::string& song);
@@ -1,7 +1,13 @@
+#include "batch.hpp"
 #include "command.hpp"
+#include "daemon.hpp"
 #include "defaultCommands.hpp"
+#include "loudness.hpp"
 #include "music.hpp"
+#include "readAhead.hpp"
+#include "seekIndex.hpp"
 #include "threads.hpp"
+#include "visualizer.hpp"
 #include <SFML/Audio/Music.hpp>
 #include <SFML/System.hpp>
 #include <getopt.h>
@@ -12,6 +18,12 @@
 namespace fs = std::filesystem;
 
 static int wizard_flag{0};
+static int daemon_flag{0};
+static int client_flag{0};
+static int benchmark_count{0};
+static int batch_flag{0};
+static int json_flag{0};
+static std::vector<std::string> batch_commands{};
 static const struct option long_options[] = {
     {"prompt", required_argument, nullptr, 'p'},
     {"music-dir", required_argument, nullptr, 'm'},
@@ -19,6 +31,16 @@ static const struct option long_options[] = {
     {"help", no_argument, &wizard_flag, 'h'},
     {"wizard", no_argument, nullptr, 'w'},
     {"version", no_argument, nullptr, 'v'},
+    {"daemon", no_argument, nullptr, 'd'},
+    {"client", no_argument, nullptr, 'C'},
+    {"socket", required_argument, nullptr, 'S'},
+    {"benchmark", required_argument, nullptr, 'B'},
+    {"batch", no_argument, nullptr, 'b'},
+    {"command", required_argument, nullptr, 'c'},
+    {"yes", no_argument, nullptr, 'y'},
+    {"no", no_argument, nullptr, 'n'},
+    {"json", no_argument, nullptr, 'j'},
+    {"null-audio", optional_argument, nullptr, 'N'},
     {0, 0, 0, 0},
 };
 
@@ -34,6 +56,8 @@ bool setDirectory(const char* path, fs::path& directory) {
 
 void printUsage() {
     std::println("Usage: cleo [OPTIONS] [SCRIPTS]");
+    std::println("       cleo --client [OPTIONS] [COMMANDS]");
+    std::println("       cleo --batch [OPTIONS] [-c COMMANDS]... < COMMANDS");
     std::println("A simple command-line music player for playing locally stored music and playlists.");
     std::println("A script can be either a full path or the name of a script inside ~/.config/cleo.");
     std::println("Type `help` inside cleo to learn more.");
@@ -44,6 +68,27 @@ void printUsage() {
     std::println("\tSet the prompt to STR");
     std::println("  -P, --playlist-dir=DIR");
     std::println("\tSet the playlist directory to DIR");
+    std::println("  -d, --daemon");
+    std::println("\tRun without a prompt, taking commands from clients over a Unix socket");
+    std::println("  -C, --client");
+    std::println("\tSend each of COMMANDS (or each line of stdin) to a running daemon and print the output");
+    std::println("  -S, --socket=PATH");
+    std::println("\tUse PATH as the daemon's socket instead of ~/.cache/cleo/socket");
+    std::println("  -B, --benchmark=N");
+    std::println("\tSend N commands to a running daemon and report how many it handles per second");
+    std::println("  -b, --batch");
+    std::println("\tRun commands from stdin without a prompt, then exit with status 1 if any of them failed");
+    std::println("  -c, --command=COMMANDS");
+    std::println("\tRun COMMANDS in batch mode instead of reading stdin, can be given more than once");
+    std::println("  -y, --yes");
+    std::println("\tAnswer yes to every confirmation, e.g. when overwriting a playlist");
+    std::println("  -n, --no");
+    std::println("\tAnswer no to every confirmation");
+    std::println("  -j, --json");
+    std::println("\tIn batch mode, print each command line's output and success as a line of JSON");
+    std::println("  -N, --null-audio[=SPEED]");
+    std::println("\tPlay to a virtual clock instead of the sound card, SPEED times faster than real time.");
+    std::println("\tIf SPEED is 0 or left out, the clock only moves during `wait`, as fast as songs decode");
     std::println("  -w, --wizard");
     std::println("\tRun the setup wizard, overriding any previous configuration");
     std::println("  -h, --help");
@@ -55,7 +100,7 @@ void printUsage() {
 
 void handleArgs(int argc, char** const argv) {
     int val;
-    while ((val = getopt_long(argc, argv, ":hvwm:p:P:", long_options, nullptr)) != -1) {
+    while ((val = getopt_long(argc, argv, ":hvwdCbynjN::m:p:P:S:B:c:", long_options, nullptr)) != -1) {
         switch (val) {
             case 'h':
                 printUsage();
@@ -82,6 +127,56 @@ void handleArgs(int argc, char** const argv) {
             case 'w':
                 runWizard();
                 break;
+            case 'd':
+                daemon_flag = 1;
+                break;
+            case 'C':
+                client_flag = 1;
+                break;
+            case 'S':
+                Music::socketPath = tilde_expand(optarg);
+                break;
+            case 'B':
+                try {
+                    benchmark_count = std::stoi(optarg);
+                } catch (const std::exception&) {
+                    benchmark_count = 0;
+                }
+                if (benchmark_count <= 0) {
+                    std::println("Error: number of benchmark commands must be a positive number.");
+                    exit(1);
+                }
+                break;
+            case 'b':
+                batch_flag = 1;
+                break;
+            case 'c':
+                batch_flag = 1;
+                batch_commands.push_back(optarg);
+                break;
+            case 'y':
+                Threads::autoAnswer = Answer::Yes;
+                break;
+            case 'n':
+                Threads::autoAnswer = Answer::No;
+                break;
+            case 'j':
+                json_flag = 1;
+                break;
+            case 'N': {
+                double clockRate{0};
+                try {
+                    clockRate = optarg == nullptr ? 0 : std::stod(optarg);
+                } catch (const std::exception&) {
+                    clockRate = -1;
+                }
+                if (clockRate < 0) {
+                    std::println("Error: null audio speed must be a number, at least 0.");
+                    exit(1);
+                }
+                Music::music.setOutput(AudioOutput::Null, clockRate);
+                break;
+            }
             case 'v':
                 std::println("Cleo version: {}\nSFML version: {}.{}.{}", CLEO_VERSION, SFML_VERSION_MAJOR,
                              SFML_VERSION_MINOR, SFML_VERSION_PATCH);
@@ -96,29 +191,55 @@ void handleArgs(int argc, char** const argv) {
                 break;
         }
     }
-    std::println("Cleo " CLEO_VERSION ", powered by SFML.");
-    if (optind == argc) {
-        return; // no scripts to run
-    }
     std::vector<std::string> args{};
     for (int i{optind}; i < argc; ++i) {
         args.push_back(argv[i]);
     }
+    if (client_flag) {
+        exit(runClient(args));
+    }
+    if (benchmark_count > 0) {
+        exit(runBenchmark(benchmark_count));
+    }
+    if (!batch_flag) {
+        std::println("Cleo " CLEO_VERSION ", powered by SFML.");
+    }
+    if (args.empty()) {
+        return; // no scripts to run
+    }
     Command cmd{"_", args};
     Cleo::run(cmd);
 }
 
 int main(int argc, char** const argv) {
     sf::err().rdbuf(nullptr); // Silence SFML errors, we provide our own.
+    readCache(); // before the startup script, whose set-music and add-music scan using it
     updateScripts();
     handleArgs(argc, argv);
-    if (shouldRunWizard(wizard_flag)) {
+    if (daemon_flag || batch_flag) {
+        // Nobody is around to answer the wizard, so just make sure the default directories exist
+        fs::create_directories(Music::musicDir);
+        fs::create_directories(Music::playlistDir);
+    } else if (shouldRunWizard(wizard_flag)) {
         runWizard();
     }
     updateSongs();
     updatePlaylists();
-    readCache();
-    runThreads();
+    int status{0};
+    ReadAhead::start();
+    if (batch_flag) {
+        status = runBatch(batch_commands, json_flag);
+    } else if (daemon_flag) {
+        analyseLibrary();
+        runDaemon();
+    } else {
+        analyseLibrary();
+        runThreads();
+    }
+    Visualizer::stop();
+    ReadAhead::stop();
+    SeekIndex::stop();
+    stopLoudnessAnalysis();
     writeCache();
-    return 0;
+    return status;
 }
@@ -0,0 +1,384 @@
+#include "metadata.hpp"
+#include "defaultCommands.hpp"
+#include "music.hpp"
+#include "threadPool.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <shared_mutex>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+static constexpr std::string_view cacheMagic{"CLEOTAGS"};
+static constexpr std::uint32_t cacheVersion{1};
+
+enum TextColumn { Artist, Album, Title, Genre, NumTextColumns };
+static constexpr std::array<std::string_view, NumTextColumns> textFields{"artist", "album", "title", "genre"};
+
+// Each distinct string is stored once and columns hold its id, so filtering on a string compares it once
+// rather than once per song
+class StringPool {
+public:
+    std::uint32_t intern(std::string_view text) {
+        auto it{mIds.find(text)};
+        if (it != mIds.end()) {
+            return it->second;
+        }
+        auto id{(std::uint32_t)mStrings.size()};
+        mIds.emplace(mStrings.emplace_back(text), id);
+        return id;
+    }
+    const std::string& operator[](std::uint32_t id) const { return mStrings[id]; }
+    std::size_t size() const { return mStrings.size(); }
+
+private:
+    std::deque<std::string> mStrings{""}; // a deque so the views in mIds stay valid as it grows
+    std::unordered_map<std::string_view, std::uint32_t> mIds{{"", 0}};
+};
+
+// One row per song, one vector per field
+struct Columns {
+    StringPool strings{};
+    std::vector<std::string> songs{};
+    std::vector<std::uintmax_t> sizes{};
+    std::vector<std::int64_t> modified{};
+    std::array<std::vector<std::uint32_t>, NumTextColumns> text{};
+    std::vector<std::int32_t> tracks{};
+    std::vector<std::int32_t> years{};
+    // Songs in a root that's offline are kept so their tags don't have to be read again when it's back, but
+    // they aren't in the library in the meantime
+    std::vector<std::uint8_t> present{};
+    std::unordered_map<std::string, std::size_t> rows{};
+
+    void append(const std::string& song, std::uintmax_t size, std::int64_t modifiedTime, const SongTags& tags,
+                bool isPresent) {
+        rows.emplace(song, songs.size());
+        songs.push_back(song);
+        present.push_back((std::uint8_t)isPresent);
+        sizes.push_back(size);
+        modified.push_back(modifiedTime);
+        text[Artist].push_back(strings.intern(tags.artist));
+        text[Album].push_back(strings.intern(tags.album));
+        text[Title].push_back(strings.intern(tags.title));
+        text[Genre].push_back(strings.intern(tags.genre));
+        tracks.push_back(tags.track);
+        years.push_back(tags.year);
+    }
+
+    SongTags tagsAt(std::size_t row) const {
+        return {strings[text[Artist][row]], strings[text[Album][row]], strings[text[Title][row]],
+                strings[text[Genre][row]],  tracks[row],                years[row]};
+    }
+};
+
+static std::mutex updateMutex{};           // only one scan at a time
+static std::shared_mutex columnsMutex{};   // queries share, swapping in a new scan is exclusive
+static Columns columns{};
+static MetadataStats stats{};
+static std::atomic<std::int64_t> lastQueryNs{0};
+
+std::vector<std::string> Metadata::update() {
+    std::lock_guard updating{updateMutex};
+    Clock::time_point start{Clock::now()};
+    std::vector<std::string> songs{Music::songs.toVector()};
+    std::vector<std::uintmax_t> sizes(songs.size());
+    std::vector<std::int64_t> modified(songs.size());
+    std::vector<std::optional<SongTags>> tags(songs.size());
+    std::vector<std::size_t> toParse{};
+    {
+        std::shared_lock lock{columnsMutex};
+        for (std::size_t i{0}; i < songs.size(); ++i) {
+            std::error_code err{};
+            fs::path path{songPath(songs[i])};
+            sizes[i] = fs::file_size(path, err);
+            modified[i] = fs::last_write_time(path, err).time_since_epoch().count();
+            auto row{columns.rows.find(songs[i])};
+            if (row != columns.rows.end() && columns.sizes[row->second] == sizes[i] &&
+                columns.modified[row->second] == modified[i]) {
+                tags[i] = columns.tagsAt(row->second);
+            } else {
+                toParse.push_back(i);
+            }
+        }
+    }
+    if (!toParse.empty()) {
+        unsigned int cores{std::max(1u, std::thread::hardware_concurrency())};
+        ThreadPool pool{std::min<std::size_t>(toParse.size(), cores)};
+        for (std::size_t i : toParse) {
+            pool.submit([&songs, &tags, i] { tags[i] = parseTags(songPath(songs[i])); });
+        }
+        pool.wait();
+    }
+    Columns next{};
+    for (std::size_t i{0}; i < songs.size(); ++i) {
+        next.append(songs[i], sizes[i], modified[i], tags[i].value_or(SongTags{}), true);
+    }
+    std::unique_lock lock{columnsMutex};
+    for (std::size_t row{0}; row < columns.songs.size(); ++row) {
+        if (!next.rows.contains(columns.songs[row]) && isSongOffline(columns.songs[row])) {
+            next.append(columns.songs[row], columns.sizes[row], columns.modified[row], columns.tagsAt(row),
+                        false);
+        }
+    }
+    columns = std::move(next);
+    stats.songs = songs.size();
+    stats.parsed = toParse.size();
+    stats.scanTime = Clock::now() - start;
+    std::vector<std::string> parsed{};
+    parsed.reserve(toParse.size());
+    for (std::size_t i : toParse) {
+        parsed.push_back(std::move(songs[i]));
+    }
+    return parsed;
+}
+
+static void lower(std::string& str) {
+    std::ranges::transform(str, str.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+}
+
+static bool containsIgnoreCase(std::string_view text, std::string_view lowerNeedle) {
+    auto match{std::ranges::search(text, lowerNeedle, [](char a, char b) {
+        return std::tolower((unsigned char)a) == b;
+    })};
+    return !match.empty() || lowerNeedle.empty();
+}
+
+// Kept branch-free so the compiler can vectorize it
+template <typename Compare>
+static void filterNumbers(const std::vector<std::int32_t>& column, std::vector<std::uint8_t>& keep,
+                          Compare compare) {
+    for (std::size_t i{0}; i < column.size(); ++i) {
+        keep[i] &= (std::uint8_t)((column[i] != 0) & compare(column[i]));
+    }
+}
+
+static bool filterNumberColumn(const std::vector<std::int32_t>& column, std::vector<std::uint8_t>& keep,
+                               std::string_view field, std::string_view value) {
+    std::string_view op{};
+    for (std::string_view candidate : {"<=", ">=", "<", ">", "="}) {
+        if (value.starts_with(candidate)) {
+            op = candidate;
+            break;
+        }
+    }
+    value.remove_prefix(op.size());
+    std::int32_t number{};
+    auto [end, err]{std::from_chars(value.data(), value.data() + value.size(), number)};
+    if (err != std::errc{} || end != value.data() + value.size()) {
+        printError("The {} must be a whole number, optionally after <, >, <=, >= or =.", field);
+        return false;
+    }
+    if (op == "<=") {
+        filterNumbers(column, keep, [number](std::int32_t x) { return x <= number; });
+    } else if (op == ">=") {
+        filterNumbers(column, keep, [number](std::int32_t x) { return x >= number; });
+    } else if (op == "<") {
+        filterNumbers(column, keep, [number](std::int32_t x) { return x < number; });
+    } else if (op == ">") {
+        filterNumbers(column, keep, [number](std::int32_t x) { return x > number; });
+    } else {
+        filterNumbers(column, keep, [number](std::int32_t x) { return x == number; });
+    }
+    return true;
+}
+
+std::optional<std::vector<std::string>> Metadata::query(const std::vector<std::string>& filters) {
+    Clock::time_point start{Clock::now()};
+    std::shared_lock lock{columnsMutex};
+    std::vector<std::uint8_t> keep{columns.present};
+    for (const auto& filter : filters) {
+        std::size_t colon{filter.find(':')};
+        std::string field{colon == std::string::npos ? "" : filter.substr(0, colon)};
+        std::string value{colon == std::string::npos ? filter : filter.substr(colon + 1)};
+        lower(field);
+        if (field.empty()) {
+            // No field, so match anywhere in the file name
+            lower(value);
+            for (std::size_t i{0}; i < columns.songs.size(); ++i) {
+                keep[i] &= (std::uint8_t)containsIgnoreCase(columns.songs[i], value);
+            }
+        } else if (auto textField{std::ranges::find(textFields, field)}; textField != textFields.end()) {
+            lower(value);
+            std::vector<std::uint8_t> matches(columns.strings.size());
+            for (std::uint32_t id{1}; id < columns.strings.size(); ++id) {
+                matches[id] = (std::uint8_t)containsIgnoreCase(columns.strings[id], value);
+            }
+            const auto& column{columns.text[(std::size_t)(textField - textFields.begin())]};
+            for (std::size_t i{0}; i < column.size(); ++i) {
+                keep[i] &= matches[column[i]];
+            }
+        } else if (field == "year") {
+            if (!filterNumberColumn(columns.years, keep, field, value)) {
+                return std::nullopt;
+            }
+        } else if (field == "track") {
+            if (!filterNumberColumn(columns.tracks, keep, field, value)) {
+                return std::nullopt;
+            }
+        } else {
+            printError("Unknown field `{}`, expected artist, album, title, genre, track or year.", field);
+            return std::nullopt;
+        }
+    }
+    std::vector<std::string> matches{};
+    for (std::size_t i{0}; i < keep.size(); ++i) {
+        if (keep[i]) {
+            matches.push_back(columns.songs[i]);
+        }
+    }
+    lastQueryNs = std::chrono::nanoseconds{Clock::now() - start}.count();
+    return matches;
+}
+
+std::optional<SongTags> Metadata::get(const std::string& song) {
+    std::shared_lock lock{columnsMutex};
+    auto row{columns.rows.find(song)};
+    if (row == columns.rows.end() || !columns.present[row->second]) {
+        return std::nullopt;
+    }
+    return columns.tagsAt(row->second);
+}
+
+MetadataStats Metadata::getStats() {
+    std::shared_lock lock{columnsMutex};
+    MetadataStats current{stats};
+    current.lastQueryTime = std::chrono::nanoseconds{lastQueryNs.load()};
+    return current;
+}
+
+template <typename T> static bool readValues(std::istream& inp, std::vector<T>& values, std::size_t count) {
+    values.resize(count);
+    return (bool)inp.read((char*)values.data(), (std::streamsize)(count * sizeof(T)));
+}
+
+template <typename T> static void writeValues(std::ostream& out, const std::vector<T>& values) {
+    out.write((const char*)values.data(), (std::streamsize)(values.size() * sizeof(T)));
+}
+
+// left is how much of the file is still unread, so a corrupt length can't make us allocate more than that
+static bool readString(std::istream& inp, std::string& text, std::uint64_t& left) {
+    std::uint32_t length{};
+    if (left < sizeof(length) || !inp.read((char*)&length, sizeof(length))) {
+        return false;
+    }
+    left -= sizeof(length);
+    if (length > left) {
+        return false;
+    }
+    left -= length;
+    text.resize(length);
+    return (bool)inp.read(text.data(), length);
+}
+
+static void writeString(std::ostream& out, std::string_view text) {
+    auto length{(std::uint32_t)text.size()};
+    out.write((const char*)&length, sizeof(length));
+    out.write(text.data(), length);
+}
+
+// The cache is the columns written out as they are: the string pool, the song names, then each column. Songs
+// already indexed are kept as they are.
+void Metadata::readCache(const fs::path& path) {
+    std::ifstream inp{path, std::ios::binary};
+    std::string magic(cacheMagic.size(), '\0');
+    std::uint32_t version{};
+    std::uint64_t numStrings{};
+    std::uint64_t numRows{};
+    if (!inp.read(magic.data(), (std::streamsize)magic.size()) || magic != cacheMagic ||
+        !inp.read((char*)&version, sizeof(version)) || version != cacheVersion ||
+        !inp.read((char*)&numStrings, sizeof(numStrings)) || !inp.read((char*)&numRows, sizeof(numRows))) {
+        return; // missing, or from a different version, we'll just scan everything again
+    }
+    // A truncated or corrupt cache is thrown away like an old one, rather than trusting its counts enough to
+    // allocate for them. Every string takes at least its length, and every row its song name and columns.
+    constexpr std::uint64_t rowSize{sizeof(std::uint32_t) + sizeof(std::uintmax_t) + sizeof(std::int64_t) +
+                                    NumTextColumns * sizeof(std::uint32_t) + 2 * sizeof(std::int32_t)};
+    std::error_code ec{};
+    std::uint64_t left{fs::file_size(path, ec)};
+    std::uint64_t headerSize{cacheMagic.size() + sizeof(version) + sizeof(numStrings) + sizeof(numRows)};
+    if (ec || left < headerSize) {
+        return;
+    }
+    left -= headerSize;
+    if (numStrings > left / sizeof(std::uint32_t) ||
+        numRows > (left - numStrings * sizeof(std::uint32_t)) / rowSize) {
+        return;
+    }
+    std::vector<std::string> strings(numStrings);
+    for (auto& text : strings) {
+        if (!readString(inp, text, left)) {
+            return;
+        }
+    }
+    std::vector<std::string> songs(numRows);
+    for (auto& song : songs) {
+        if (!readString(inp, song, left)) {
+            return;
+        }
+    }
+    std::vector<std::uintmax_t> sizes{};
+    std::vector<std::int64_t> modified{};
+    std::array<std::vector<std::uint32_t>, NumTextColumns> text{};
+    std::vector<std::int32_t> tracks{};
+    std::vector<std::int32_t> years{};
+    bool ok{readValues(inp, sizes, numRows) && readValues(inp, modified, numRows)};
+    for (auto& column : text) {
+        ok = ok && readValues(inp, column, numRows);
+    }
+    ok = ok && readValues(inp, tracks, numRows) && readValues(inp, years, numRows);
+    if (!ok) {
+        return;
+    }
+    Columns cached{};
+    for (std::size_t row{0}; row < numRows; ++row) {
+        auto at{[&strings](std::uint32_t id) { return id < strings.size() ? strings[id] : std::string{}; }};
+        SongTags tags{at(text[Artist][row]), at(text[Album][row]), at(text[Title][row]),
+                      at(text[Genre][row]),  tracks[row],         years[row]};
+        cached.append(songs[row], sizes[row], modified[row], tags, false); // until the roots are scanned
+    }
+    std::unique_lock lock{columnsMutex};
+    if (columns.songs.empty()) {
+        columns = std::move(cached);
+        return;
+    }
+    // Merging in what another instance wrote, where the rows we already have are the more recent
+    for (std::size_t row{0}; row < cached.songs.size(); ++row) {
+        if (!columns.rows.contains(cached.songs[row])) {
+            columns.append(cached.songs[row], cached.sizes[row], cached.modified[row], cached.tagsAt(row),
+                           false);
+        }
+    }
+}
+
+void Metadata::writeCache(const fs::path& path) {
+    std::ofstream out{path, std::ios::binary};
+    std::shared_lock lock{columnsMutex};
+    auto numStrings{(std::uint64_t)columns.strings.size()};
+    auto numRows{(std::uint64_t)columns.songs.size()};
+    out.write(cacheMagic.data(), (std::streamsize)cacheMagic.size());
+    out.write((const char*)&cacheVersion, sizeof(cacheVersion));
+    out.write((const char*)&numStrings, sizeof(numStrings));
+    out.write((const char*)&numRows, sizeof(numRows));
+    for (std::uint32_t id{0}; id < numStrings; ++id) {
+        writeString(out, columns.strings[id]);
+    }
+    for (const auto& song : columns.songs) {
+        writeString(out, song);
+    }
+    writeValues(out, columns.sizes);
+    writeValues(out, columns.modified);
+    for (const auto& column : columns.text) {
+        writeValues(out, column);
+    }
+    writeValues(out, columns.tracks);
+    writeValues(out, columns.years);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "tags.hpp"
+#include <chrono>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <vector>
+
+struct MetadataStats {
+    std::size_t songs{};
+    std::size_t parsed{}; // songs whose tags were read in the last scan, the rest came from the cache
+    std::chrono::nanoseconds scanTime{};
+    std::chrono::nanoseconds lastQueryTime{};
+};
+
+namespace Metadata {
+    // Brings the index in line with Music::songs, reading the tags of new or changed songs in parallel.
+    // Returns the songs whose tags were read.
+    std::vector<std::string> update();
+    // Songs matching every filter, e.g. `artist:Bach year:<1750`. Prints an error and returns nullopt if a
+    // filter doesn't make sense.
+    std::optional<std::vector<std::string>> query(const std::vector<std::string>& filters);
+    std::optional<SongTags> get(const std::string& song);
+    MetadataStats getStats();
+    // Only adds songs that aren't indexed yet, so reading it again merges in what other instances wrote
+    void readCache(const std::filesystem::path& path);
+    void writeCache(const std::filesystem::path& path);
+} // namespace Metadata
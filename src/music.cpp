@@ -1,20 +1,48 @@
 #include "music.hpp"
+#include "batchStat.hpp"
 #include "command.hpp"
 #include "defaultCommands.hpp"
+#include "dupes.hpp"
+#include "history.hpp"
+#include "loudness.hpp"
+#include "metadata.hpp"
+#include "playStats.hpp"
+#include "playlistFile.hpp"
+#include "seekIndex.hpp"
+#include "sharedIndex.hpp"
+#include "smartPlaylists.hpp"
 #include <SFML/Audio/Music.hpp>
 #include <SFML/System/Time.hpp>
+#include <charconv>
+#include <dirent.h>
+#include <fcntl.h>
 #include <fstream>
 #include <iostream>
+#include <mutex>
 #include <print>
+#include <queue>
 #include <readline/readline.h>
+#include <set>
+#include <unordered_set>
+#include <sys/file.h>
+#include <unistd.h>
 #include <wordexp.h>
 
 namespace fs = std::filesystem;
 fs::path getHome() { return std::getenv("HOME"); }
 static const fs::path cacheDir{getHome() / ".cache" / "cleo"};
 static const fs::path cachePath{cacheDir / "cache"};
+static const fs::path cacheLockPath{cacheDir / "lock"};
+static const fs::path loudnessCachePath{cacheDir / "loudness"};
+static const fs::path hashCachePath{cacheDir / "hashes"};
+static const fs::path metadataCachePath{cacheDir / "metadata"};
+static const fs::path seekCacheDir{cacheDir / "seek"};
+static const fs::path historyPath{cacheDir / "history"};
+static const fs::path playsPath{cacheDir / "plays"};
 static const fs::path firstTimeCheck{cacheDir / "no-wizard"};
 static constexpr int cacheSize{1000};
+// Dropped from the cache, so merging doesn't bring them back
+static std::set<std::string, std::less<>> missingSongs{};
 
 bool isValidDirectory(const char* path) {
     fs::path newPath{tilde_expand(path)};
@@ -113,56 +141,106 @@ void runWizard() {
     path.close();
 }
 
-void readCache() {
-    if (!fs::exists(cachePath)) {
-        fs::create_directories(cacheDir);
-        std::ofstream{cachePath}.flush();
-    }
-    std::map<fs::path, int> cache{};
+// Entries already in memory are kept, so reading the caches again just before writing them merges in what
+// other instances have written since
+static void mergeCaches() {
     std::ifstream inp{cachePath};
     std::string line{};
-    std::filesystem::path path{};
+    std::string path{};
     int duration{};
     while (std::getline(inp, line)) {
-        std::size_t pos{line.find(':')};
+        // Another instance may have written it, so a line that doesn't parse is skipped rather than stopping
+        // the cache from being written at exit. Song names can have colons in them, the duration can't.
+        std::size_t pos{line.rfind(':')};
+        if (pos == std::string::npos || pos == 0) {
+            continue;
+        }
+        const char* end{line.data() + line.size()};
+        auto [parsed, err]{std::from_chars(line.data() + pos + 1, end, duration)};
+        if (err != std::errc{} || parsed != end) {
+            continue;
+        }
         path = line.substr(0, pos);
-        duration = std::stoi(line.substr(pos + 1));
-        Music::songDurations.insert({path, duration});
+        if (!missingSongs.contains(path)) {
+            Music::songDurations.insert({path, duration});
+        }
         // It might seem like we should insert the music directory here, but if the user changes it, the whole
         // cache would get invalidated
     }
+    readLoudnessCache(loudnessCachePath);
+    readHashCache(hashCachePath);
+    Metadata::readCache(metadataCachePath);
 }
 
-void writeCache() {
-    std::ofstream cache{cachePath};
+// Written alongside and renamed over the old one, so an instance reading it never sees half a file
+static void replaceFile(const fs::path& path, void (*write)(const fs::path&)) {
+    fs::path temp{path};
+    temp += std::format(".{}", getpid());
+    write(temp);
+    std::error_code err{};
+    fs::rename(temp, path, err);
+}
+
+static void writeDurations(const fs::path& path) {
+    std::ofstream cache{path};
     int linesWritten{0};
-    for (const auto& [path, duration] : Music::songDurations) {
-        cache << path.filename().string() << ":" << duration << "\n";
+    for (const auto& [song, duration] : Music::songDurations) {
+        cache << song << ":" << duration << "\n";
         ++linesWritten;
         if (linesWritten == cacheSize) {
             break;
         }
     }
-    cache.close();
+}
+
+void readCache() {
+    if (!fs::exists(cachePath)) {
+        fs::create_directories(cacheDir);
+        std::ofstream{cachePath}.flush();
+    }
+    mergeCaches();
+    SeekIndex::setCacheDir(seekCacheDir); // one file per song, read when it's first played
+    History::setPath(historyPath);         // only read in interactive mode
+    PlayStats::load(playsPath);
+}
+
+// Several instances can share a cache directory, so rather than the last one to exit overwriting what the
+// others learnt, each merges in what's there under a lock before writing
+void writeCache() {
+    std::error_code err{};
+    fs::create_directories(cacheDir, err);
+    int lock{::open(cacheLockPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600)};
+    if (lock != -1) {
+        flock(lock, LOCK_EX);
+    }
+    mergeCaches();
+    replaceFile(cachePath, writeDurations);
+    replaceFile(loudnessCachePath, writeLoudnessCache);
+    replaceFile(hashCachePath, writeHashCache);
+    replaceFile(metadataCachePath, Metadata::writeCache);
+    if (lock != -1) {
+        ::close(lock); // releases the lock
+    }
 }
 
 namespace Music {
-    sf::Music music{};
+    BufferedMusic music{};
     fs::path musicDir{getHome() / "Music"};
+    std::vector<MusicRoot> extraRoots{};
     fs::path playlistDir{musicDir / "playlists"};
     fs::path scriptDir{getHome() / ".config" / "cleo"};
+    fs::path socketPath{cacheDir / "socket"};
     // Taken from the list of formats that SFML supports. Some of the more obscure ones were
     // left out
     const std::unordered_set<std::string> supportedExtensions{
         ".mp3", ".ogg", ".flac", ".wav", ".aiff",
     };
-    std::vector<std::string> songs{};
+    SongList songs{};
     std::vector<std::string> scripts{};
     std::vector<std::string> playlists{};
     std::vector<std::string> curPlaylist{};
     std::vector<std::string> shuffledPlaylist{};
-    std::map<fs::path, int> songDurations{};
-    int repeats{};
+    std::map<std::string, int, std::less<>> songDurations{};
     std::string curSong{};
     std::string playlistCurName{};
     std::size_t playlistIdx{};
@@ -171,34 +249,367 @@ namespace Music {
     bool isPlaylistLooping{false};
     bool isExecutingScript{false};
     std::string prompt{"> "};
+    Normalization normalization{Normalization::Off};
+    bool usePager{false};
 } // namespace Music
 
+struct RootScan {
+    fs::path path{};
+    SongList songs{}; // already prefixed with the root's name
+    bool online{true};
+};
+
+static std::mutex scanMutex{};
+static std::map<std::string, RootScan, std::less<>> scans{}; // by root name, the music directory's is ""
+
+// What a directory scan would take for a song, which names from the shared index are held to as well
+static bool isSongName(const std::string& name) {
+    if (name.empty() || name == "." || name == ".." || name.contains('/') || name.contains('\0')) {
+        return false;
+    }
+    return Music::supportedExtensions.contains(fs::path{name}.extension());
+}
+
+static RootScan scanRoot(const MusicRoot& root) {
+    RootScan scan{};
+    scan.path = root.path;
+    DIR* dir{opendir(root.path.c_str())};
+    if (dir == nullptr) {
+        scan.online = false;
+        return scan;
+    }
+    std::string prefix{root.name.empty() ? "" : root.name + "/"};
+    std::vector<std::string> songs{};
+    std::vector<fs::path> unsure{}; // symlinks, and entries the filesystem didn't give a type for
+    SharedLookup shared{SharedIndex::lookup(root.path)};
+    if (shared.files) {
+        // Another instance has already scanned it since it last changed. The names still go through the
+        // same checks as the scan's own, and are all stat'd in the batch below, so a stale or tampered
+        // listing can't add anything that isn't a song file in this directory.
+        unsure.reserve(shared.files->size());
+        for (const auto& file : *shared.files) {
+            if (isSongName(file)) {
+                unsure.push_back(root.path / file);
+            }
+        }
+    }
+    for (errno = 0; dirent* entry{shared.files ? nullptr : readdir(dir)}; errno = 0) {
+        fs::path file{entry->d_name};
+        if (!isSongName(entry->d_name)) {
+            continue;
+        }
+        if (entry->d_type == DT_REG) {
+            songs.emplace_back(prefix + file.string());
+        } else if (entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) {
+            unsure.push_back(root.path / file);
+        }
+    }
+    scan.online = errno == 0; // it went away partway through
+    closedir(dir);
+    // Rather than stat them one at a time, which on a network share is a round trip each
+    std::vector<PathType> types{BatchStat::check(unsure)};
+    for (std::size_t i{0}; i < unsure.size(); ++i) {
+        if (types[i] == PathType::File) {
+            songs.emplace_back(prefix + unsure[i].filename().string());
+        }
+    }
+    std::sort(songs.begin(), songs.end());
+    std::size_t bytes{0};
+    for (const auto& song : songs) {
+        bytes += song.size();
+    }
+    if (shared.leading && !shared.files && scan.online) {
+        SharedIndex::publish(root.path, shared.version, songs, prefix.size());
+    }
+    scan.songs.reserve(songs.size(), bytes);
+    for (const auto& song : songs) {
+        scan.songs.append(song);
+    }
+    return scan;
+}
+
+// Each root is already sorted, so the library only needs merging rather than sorting again
+static void mergeRoots() {
+    using Iter = SongList::Iterator;
+    using Range = std::pair<Iter, Iter>;
+    auto later{[](const Range& a, const Range& b) { return *a.first > *b.first; }};
+    std::priority_queue<Range, std::vector<Range>, decltype(later)> heads{later};
+    std::size_t total{0};
+    std::size_t bytes{0};
+    for (const auto& [name, scan] : scans) {
+        if (!scan.songs.empty()) {
+            heads.emplace(scan.songs.begin(), scan.songs.end());
+            total += scan.songs.size();
+            bytes += scan.songs.bytes();
+        }
+    }
+    SongList merged{};
+    merged.reserve(total, bytes);
+    while (!heads.empty()) {
+        Range head{heads.top()};
+        heads.pop();
+        merged.append(*head.first);
+        if (++head.first != head.second) {
+            heads.push(head);
+        }
+    }
+    Music::songs = std::move(merged);
+}
+
+// Adds the songs only in before or only in after to the delta, going through both in order
+static void diffSongs(const SongList& before, const SongList& after, LibraryDelta& delta) {
+    SongList::Iterator old{before.begin()};
+    SongList::Iterator now{after.begin()};
+    while (old != before.end() || now != after.end()) {
+        if (now == after.end() || (old != before.end() && *old < *now)) {
+            delta.removed.emplace_back(*old++);
+        } else if (old == before.end() || *now < *old) {
+            delta.added.emplace_back(*now++);
+        } else {
+            ++old;
+            ++now;
+        }
+    }
+}
+
+// Metadata has to be up to date first, so smart playlists see the tags of songs that were just added
+// Reads how long new songs are before smart playlists see them, so a length filter can match them and
+// `playlist status` can add them up once they join the current playlist. The files are opened without the
+// state lock, since on a network share that's a round trip or more each.
+static void probeDurations(const std::vector<std::string>& songs) {
+    std::vector<std::string> unknown{};
+    {
+        StateLock lock{};
+        for (const auto& song : songs) {
+            if (!Music::songDurations.contains(song)) {
+                unknown.push_back(song);
+            }
+        }
+    }
+    std::vector<std::pair<std::string, int>> durations{};
+    {
+        StateUnlock unlock{};
+        sf::Music load{};
+        for (auto& song : unknown) {
+            if (load.openFromFile(songPath(song))) {
+                durations.emplace_back(std::move(song), (int)load.getDuration().asSeconds());
+            }
+        }
+    }
+    StateLock lock{};
+    for (auto& [song, duration] : durations) {
+        Music::songDurations.try_emplace(std::move(song), duration);
+    }
+}
+
+static void finishUpdate(LibraryDelta& delta) {
+    delta.retagged = Metadata::update();
+    if (SmartPlaylists::isTracking()) {
+        probeDurations(delta.added);
+        SmartPlaylists::apply(delta);
+    }
+}
+
+// Forgets how long songs that have been deleted were. Songs in the library are known to be there, and songs
+// in a root that's offline can't be checked, so only the rest need looking for.
+static void dropMissingDurations() {
+    std::vector<std::string> songs{};
+    std::vector<fs::path> paths{};
+    for (const auto& [song, duration] : Music::songDurations) {
+        if (!Music::songs.contains(song) && !isSongOffline(song)) {
+            songs.push_back(song);
+            paths.push_back(songPath(song));
+        }
+    }
+    std::vector<PathType> types{BatchStat::check(paths)};
+    for (std::size_t i{0}; i < songs.size(); ++i) {
+        if (types[i] == PathType::Missing) {
+            Music::songDurations.erase(songs[i]);
+            missingSongs.insert(std::move(songs[i]));
+        }
+    }
+}
+
 void updateSongs() {
-    std::string filename{};
-    std::vector<std::string> newSongs{};
-    sf::Music load{};
-    for (const auto& dirEntry : fs::directory_iterator{Music::musicDir}) {
-        if (!dirEntry.is_regular_file() ||
-            !Music::supportedExtensions.contains(dirEntry.path().extension())) {
+    std::map<std::string, RootScan, std::less<>> fresh{};
+    fresh.emplace("", scanRoot({"", Music::musicDir}));
+    for (const auto& root : Music::extraRoots) {
+        fresh.emplace(root.name, scanRoot(root));
+    }
+    LibraryDelta delta{};
+    {
+        StateLock state{}; // commands read the library with only this held
+        std::lock_guard lock{scanMutex};
+        if (SmartPlaylists::isTracking()) {
+            static const SongList none{};
+            for (const auto& [name, scan] : scans) {
+                auto next{fresh.find(name)};
+                diffSongs(scan.songs, next == fresh.end() ? none : next->second.songs, delta);
+            }
+            for (const auto& [name, scan] : fresh) {
+                if (!scans.contains(name)) {
+                    diffSongs(none, scan.songs, delta);
+                }
+            }
+        }
+        scans = std::move(fresh);
+        mergeRoots();
+    }
+    dropMissingDurations();
+    finishUpdate(delta);
+}
+
+void updateSongs(const MusicRoot& root) {
+    RootScan scan{scanRoot(root)};
+    LibraryDelta delta{};
+    {
+        StateLock state{};
+        std::lock_guard lock{scanMutex};
+        RootScan& current{scans[root.name]};
+        if (SmartPlaylists::isTracking()) {
+            diffSongs(current.songs, scan.songs, delta);
+        }
+        current = std::move(scan);
+        mergeRoots();
+    }
+    finishUpdate(delta);
+}
+
+void dropRoot(std::string_view name) {
+    LibraryDelta delta{};
+    {
+        StateLock state{};
+        std::lock_guard lock{scanMutex};
+        auto scan{scans.find(name)};
+        if (scan == scans.end()) {
+            return;
+        }
+        if (SmartPlaylists::isTracking()) {
+            diffSongs(scan->second.songs, {}, delta);
+        }
+        scans.erase(scan);
+        mergeRoots();
+    }
+    finishUpdate(delta);
+}
+
+// The root's name and the song's file name within it
+static std::pair<std::string_view, std::string_view> splitSong(std::string_view song) {
+    std::size_t slash{song.find('/')};
+    if (slash == std::string_view::npos) {
+        return {"", song};
+    }
+    return {song.substr(0, slash), song.substr(slash + 1)};
+}
+
+void addToLibrary(std::string_view song) {
+    {
+        std::lock_guard lock{scanMutex};
+        auto scan{scans.find(splitSong(song).first)};
+        if (scan != scans.end() && !scan->second.songs.contains(song)) {
+            scan->second.songs.insert(song);
+        }
+        if (!Music::songs.contains(song)) {
+            Music::songs.insert(song);
+        }
+    }
+    if (SmartPlaylists::isTracking()) {
+        LibraryDelta delta{};
+        delta.added.emplace_back(song);
+        probeDurations(delta.added);
+        SmartPlaylists::apply(delta);
+    }
+}
+
+void removeFromLibrary(std::string_view song) {
+    {
+        std::lock_guard lock{scanMutex};
+        auto scan{scans.find(splitSong(song).first)};
+        if (scan != scans.end()) {
+            scan->second.songs.erase(song);
+        }
+        Music::songs.erase(song);
+    }
+    if (SmartPlaylists::isTracking()) {
+        LibraryDelta delta{};
+        delta.removed.emplace_back(song);
+        SmartPlaylists::apply(delta);
+    }
+}
+
+fs::path songPath(std::string_view song) {
+    auto [name, filename]{splitSong(song)};
+    std::lock_guard lock{scanMutex};
+    auto scan{scans.find(name)};
+    if (scan == scans.end()) {
+        return Music::musicDir / song;
+    }
+    return scan->second.path / filename;
+}
+
+bool isSongOffline(std::string_view song) {
+    std::lock_guard lock{scanMutex};
+    auto scan{scans.find(splitSong(song).first)};
+    return scan != scans.end() && !scan->second.online;
+}
+
+std::vector<MusicRoot> offlineRoots() {
+    std::lock_guard lock{scanMutex};
+    std::vector<MusicRoot> offline{};
+    for (const auto& [name, scan] : scans) {
+        if (!scan.online) {
+            offline.push_back({name, scan.path});
+        }
+    }
+    return offline;
+}
+
+std::optional<std::string> songAtPath(const fs::path& path) {
+    std::error_code err{};
+    fs::path dir{fs::weakly_canonical(path, err).parent_path()};
+    std::string filename{path.filename().string()};
+    std::lock_guard lock{scanMutex};
+    for (const auto& [name, scan] : scans) {
+        if (fs::weakly_canonical(scan.path, err) != dir) {
             continue;
         }
-        filename = dirEntry.path().filename();
-        newSongs.push_back(filename);
+        std::string song{name.empty() ? filename : std::format("{}/{}", name, filename)};
+        if (Music::songs.contains(song)) {
+            return song;
+        }
     }
-    Music::songs = newSongs;
-    std::sort(Music::songs.begin(), Music::songs.end());
+    return std::nullopt;
+}
+
+AutoMatch matchSong(std::string_view song) {
+    auto [first, last]{Music::songs.withPrefix(song)};
+    AutoMatch match{std::vector<std::string>(first, last), ""};
+    if (match.matchType != Match::NoMatch || song.find('/') != std::string_view::npos) {
+        return match;
+    }
+    // Songs in the music directory win, so a song elsewhere with the same name needs its root given
+    std::vector<std::string> byFilename{};
+    for (std::string_view candidate : Music::songs) {
+        auto [name, filename]{splitSong(candidate)};
+        if (!name.empty() && filename.starts_with(song)) {
+            byFilename.emplace_back(candidate);
+        }
+    }
+    return AutoMatch{byFilename, ""};
 }
 
 void updatePlaylists() {
     std::string playlist{};
     std::vector<std::string> newPlaylists{};
     for (const auto& dirEntry : fs::directory_iterator{Music::playlistDir}) {
-        if (!dirEntry.is_regular_file() || !(dirEntry.path().extension() == ".csv")) {
+        if (!dirEntry.is_regular_file() ||
+            !(PlaylistFile::isPlaylist(dirEntry.path()) || SmartPlaylists::isSmart(dirEntry.path()))) {
             continue;
         }
         playlist = dirEntry.path().filename();
         newPlaylists.push_back(playlist);
     }
+    StateLock lock{};
     Music::playlists = newPlaylists;
 }
 
@@ -220,3 +631,15 @@ void updateScripts() {
 const std::vector<std::string>& getPlaylist() {
     return Music::isShuffled ? Music::shuffledPlaylist : Music::curPlaylist;
 }
+
+void removeFromPlaylist(const std::vector<std::string>& songs) {
+    std::unordered_set<std::string_view> removed{songs.begin(), songs.end()};
+    auto isRemoved{[&removed](const std::string& song) { return removed.contains(song); }};
+    // The index counts the songs before the next one in whichever order is playing
+    const std::vector<std::string>& playing{getPlaylist()};
+    std::size_t before{std::min(Music::playlistIdx, playing.size())};
+    auto removedBefore{std::count_if(playing.begin(), playing.begin() + (std::ptrdiff_t)before, isRemoved)};
+    Music::playlistIdx = before - (std::size_t)removedBefore;
+    std::erase_if(Music::curPlaylist, isRemoved);
+    std::erase_if(Music::shuffledPlaylist, isRemoved);
+}
@@ -1,24 +1,37 @@
 #pragma once
 
-#include "SFML/Audio/Music.hpp"
+#include "autocomplete.hpp"
+#include "bufferedMusic.hpp"
+#include "songList.hpp"
 #include <filesystem>
 #include <map>
+#include <optional>
 #include <string>
 #include <unordered_set>
 
+enum class Normalization { Off, Track, Album };
+
+// A directory searched for songs as well as the music directory. Its songs are known as `name/filename`, so
+// they can't clash with songs of the same name elsewhere.
+struct MusicRoot {
+    std::string name{};
+    std::filesystem::path path{};
+};
+
 namespace Music {
-    extern sf::Music music;
+    extern BufferedMusic music;
     extern std::filesystem::path musicDir;
+    extern std::vector<MusicRoot> extraRoots;
     extern std::filesystem::path playlistDir;
     extern std::filesystem::path scriptDir;
+    extern std::filesystem::path socketPath;
     extern const std::unordered_set<std::string> supportedExtensions;
-    extern std::vector<std::string> songs;
+    extern SongList songs;
     extern std::vector<std::string> scripts;
     extern std::vector<std::string> playlists;
     extern std::vector<std::string> curPlaylist;
     extern std::vector<std::string> shuffledPlaylist;
-    extern std::map<std::filesystem::path, int> songDurations;
-    extern int repeats;
+    extern std::map<std::string, int, std::less<>> songDurations; // looked up without copying the name
     extern std::string curSong;
     extern std::string playlistCurName;
     extern std::size_t playlistIdx;
@@ -27,14 +40,36 @@ namespace Music {
     extern bool isPlaylistLooping;
     extern bool isExecutingScript;
     extern std::string prompt;
+    extern Normalization normalization;
+    extern bool usePager;
 } // namespace Music
 
 bool shouldRunWizard(int wizard_flag);
 void runWizard();
+// Rescans every root, or just the given one, and merges them into Music::songs
 void updateSongs();
+void updateSongs(const MusicRoot& root);
+// Takes a root's songs out of the library after it's been removed from Music::extraRoots
+void dropRoot(std::string_view name);
+// For changes Cleo makes itself, so the library is up to date straight away rather than once the directory
+// monitor has noticed
+void addToLibrary(std::string_view song);
+void removeFromLibrary(std::string_view song);
+// Where a song from Music::songs lives on disk
+std::filesystem::path songPath(std::string_view song);
+// The song's root couldn't be read last time it was scanned, e.g. a network share that isn't mounted
+bool isSongOffline(std::string_view song);
+std::vector<MusicRoot> offlineRoots();
+// The ID of the song at path, if it's in one of the library's roots
+std::optional<std::string> songAtPath(const std::filesystem::path& path);
+// Like AutoMatch on Music::songs, but a song in another root can also be found by its file name alone
+AutoMatch matchSong(std::string_view song);
 void readCache();
 void writeCache();
 void updatePlaylists();
 void updateScripts();
 bool isValidDirectory(const char* path);
 const std::vector<std::string>& getPlaylist();
+// Takes songs out of the current playlist, both orders of it, keeping Music::playlistIdx on the song that was
+// going to play next
+void removeFromPlaylist(const std::vector<std::string>& songs);
@@ -0,0 +1,285 @@
+#include "playStats.hpp"
+#include "music.hpp"
+#include "readAhead.hpp"
+#include "weightedSampler.hpp"
+#include <SFML/Audio/Music.hpp>
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <format>
+#include <fstream>
+#include <mutex>
+#include <random>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+static constexpr std::size_t minCompactLines{1'000}; // small logs aren't worth rewriting
+static constexpr std::size_t recentPlays{32};        // random avoids these
+static constexpr int maxRedraws{8};                  // before giving up on avoiding a recent song
+static constexpr double skippedBelow{0.5};
+
+struct StringHash {
+    using is_transparent = void;
+    std::size_t operator()(std::string_view text) const { return std::hash<std::string_view>{}(text); }
+};
+
+static std::mutex statsMutex{}; // guards everything below
+static fs::path logPath{};
+static int logFd{-1};
+static std::size_t logLines{0};
+static std::unordered_map<std::string, SongPlays, StringHash, std::equal_to<>> playCounts{};
+static std::deque<std::string> recent{};
+static std::string current{}; // the song playing, until it's been logged
+static Clock::time_point currentStart{};
+// Indexed like Music::songs, and only touched by pickRandom, since that's the only place it's safe to read
+// Music::songs. Plays logged in the meantime are applied there.
+static WeightedSampler sampler{};
+static std::uint64_t samplerVersion{0};
+static std::vector<std::string> reweigh{};
+static std::mt19937 engine{std::random_device{}()};
+
+static std::int64_t now() {
+    return std::chrono::duration_cast<std::chrono::seconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+// Songs that have been heard a lot are picked less often
+static double weightOf(const SongPlays& plays) { return 1.0 / (1 + plays.plays + plays.skips); }
+
+static std::string_view takeField(std::string_view& line) {
+    std::size_t space{line.find(' ')};
+    std::string_view field{line.substr(0, space)};
+    line.remove_prefix(space == std::string_view::npos ? line.size() : space + 1);
+    return field;
+}
+
+template <typename T> static bool takeNumber(std::string_view& line, T& number) {
+    std::string_view field{takeField(line)};
+    auto [end, err]{std::from_chars(field.data(), field.data() + field.size(), number)};
+    return err == std::errc{} && end == field.data() + field.size();
+}
+
+// `p <time> <permille heard> <song>` for a play, `s ...` for a skip, and after compaction
+// `= <plays> <skips> <last played> <permille heard> <song>` for everything so far
+static void readLine(std::string_view line) {
+    std::string_view kind{takeField(line)};
+    if (kind == "p" || kind == "s") {
+        std::int64_t time{};
+        std::int64_t heard{};
+        if (!takeNumber(line, time) || !takeNumber(line, heard) || line.empty()) {
+            return;
+        }
+        SongPlays& plays{playCounts[std::string{line}]};
+        ++(kind == "p" ? plays.plays : plays.skips);
+        plays.lastPlayed = std::max(plays.lastPlayed, time);
+        plays.heard += (double)heard / 1000;
+    } else if (kind == "=") {
+        SongPlays plays{};
+        std::int64_t heard{};
+        if (!takeNumber(line, plays.plays) || !takeNumber(line, plays.skips) ||
+            !takeNumber(line, plays.lastPlayed) || !takeNumber(line, heard) || line.empty()) {
+            return;
+        }
+        plays.heard = (double)heard / 1000;
+        playCounts.insert_or_assign(std::string{line}, plays);
+    }
+}
+
+static void appendLine(int fd, std::string_view line) {
+    std::string buffer{line};
+    buffer += '\n';
+    (void)!write(fd, buffer.data(), buffer.size());
+}
+
+// Called with statsMutex held. Plays are rare enough that this doesn't need a thread of its own.
+static void compactIfNeeded() {
+    if (logFd == -1 || logLines < minCompactLines || logLines <= 2 * playCounts.size()) {
+        return;
+    }
+    fs::path temp{logPath};
+    temp += ".tmp";
+    {
+        std::ofstream out{temp, std::ios::trunc};
+        for (const auto& [song, plays] : playCounts) {
+            out << std::format("= {} {} {} {} {}\n", plays.plays, plays.skips, plays.lastPlayed,
+                               std::llround(plays.heard * 1000), song);
+        }
+        if (!out.flush()) {
+            std::error_code ec{};
+            fs::remove(temp, ec);
+            return; // keep appending to the old log and try again after the next play
+        }
+    }
+    int fd{::open(temp.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC)};
+    std::error_code ec{};
+    if (fd != -1) {
+        fs::rename(temp, logPath, ec);
+    }
+    if (fd == -1 || ec) {
+        if (fd != -1) {
+            close(fd);
+        }
+        fs::remove(temp, ec);
+        return;
+    }
+    close(logFd);
+    logFd = fd;
+    logLines = playCounts.size();
+}
+
+// Called with statsMutex held
+static void record(double heard) {
+    heard = std::clamp(heard, 0.0, 1.0);
+    bool skipped{heard < skippedBelow};
+    SongPlays& plays{playCounts[current]};
+    ++(skipped ? plays.skips : plays.plays);
+    plays.lastPlayed = now();
+    plays.heard += heard;
+    if (logFd != -1) {
+        appendLine(logFd, std::format("{} {} {} {}", skipped ? 's' : 'p', plays.lastPlayed,
+                                      std::llround(heard * 1000), current));
+        ++logLines;
+        compactIfNeeded();
+    }
+    std::erase(recent, current);
+    recent.push_back(current);
+    if (recent.size() > recentPlays) {
+        recent.pop_front();
+    }
+    reweigh.push_back(std::move(current));
+    current.clear();
+}
+
+// Called with statsMutex held
+static void updateSampler() {
+    if (samplerVersion != Music::songs.version()) {
+        std::vector<double> weights(Music::songs.size(), 1.0);
+        for (std::size_t i{0}; i < Music::songs.size(); ++i) {
+            auto plays{playCounts.find(Music::songs[i])};
+            if (plays != playCounts.end()) {
+                weights[i] = weightOf(plays->second);
+            }
+        }
+        sampler.assign(std::move(weights));
+        samplerVersion = Music::songs.version();
+    } else {
+        for (const auto& song : reweigh) {
+            auto [first, last]{
+                std::equal_range(Music::songs.begin(), Music::songs.end(), std::string_view{song})};
+            if (first != last) {
+                sampler.setWeight(first.index(), weightOf(playCounts[song]));
+            }
+        }
+    }
+    reweigh.clear();
+}
+
+namespace PlayStats {
+    void load(const fs::path& path) {
+        std::lock_guard lock{statsMutex};
+        logPath = path;
+        MappedFileStream log{};
+        if (log.open(path) && log.file()->size > 0) {
+            auto data{(const char*)log.file()->data};
+            std::size_t size{log.file()->size};
+            for (std::size_t start{0}; start < size;) {
+                auto newline{(const char*)std::memchr(data + start, '\n', size - start)};
+                if (newline == nullptr) {
+                    break; // cut off while it was being written
+                }
+                std::size_t end{(std::size_t)(newline - data)};
+                readLine({data + start, end - start});
+                ++logLines;
+                start = end + 1;
+            }
+        }
+        std::vector<std::pair<std::int64_t, std::string_view>> byTime{};
+        for (const auto& [song, plays] : playCounts) {
+            byTime.emplace_back(plays.lastPlayed, song);
+        }
+        std::size_t kept{std::min(recentPlays, byTime.size())};
+        std::ranges::partial_sort(byTime, byTime.begin() + (std::ptrdiff_t)kept, std::greater{});
+        for (std::size_t i{kept}; i-- > 0;) {
+            recent.emplace_back(byTime[i].second);
+        }
+        logFd = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+        std::shared_ptr<MappedFile> file{log.file()};
+        if (logFd != -1 && file != nullptr && file->size > 0 && file->data[file->size - 1] != '\n') {
+            (void)!write(logFd, "\n", 1); // the last line was cut off, don't run the next one into it
+        }
+        compactIfNeeded();
+    }
+
+    void started(std::string_view song) {
+        std::lock_guard lock{statsMutex};
+        current = song;
+        currentStart = Clock::now();
+    }
+
+    void interrupted() {
+        std::lock_guard lock{statsMutex};
+        if (current.empty()) {
+            return;
+        }
+        if (Music::music.getStatus() == sf::Music::Status::Stopped) {
+            record(1); // it got to the end before the supervisor noticed
+            return;
+        }
+        float duration{Music::music.getDuration().asSeconds()};
+        record(duration > 0 ? Music::music.getPlayingOffset().asSeconds() / duration : 0);
+    }
+
+    void ended() {
+        std::lock_guard lock{statsMutex};
+        // The song that ended may have been replaced since, in which case it's been logged already
+        if (!current.empty() && Music::music.getEndTime() >= currentStart) {
+            record(1);
+        }
+    }
+
+    std::optional<SongPlays> get(std::string_view song) {
+        std::lock_guard lock{statsMutex};
+        auto plays{playCounts.find(song)};
+        if (plays == playCounts.end()) {
+            return std::nullopt;
+        }
+        return plays->second;
+    }
+
+    std::vector<std::pair<std::string, SongPlays>> mostPlayed(std::size_t count) {
+        std::lock_guard lock{statsMutex};
+        std::vector<std::pair<std::string, SongPlays>> all(playCounts.begin(), playCounts.end());
+        auto more{[](const auto& a, const auto& b) {
+            return std::tie(a.second.plays, b.first) > std::tie(b.second.plays, a.first);
+        }};
+        count = std::min(count, all.size());
+        std::ranges::partial_sort(all, all.begin() + (std::ptrdiff_t)count, more);
+        all.resize(count);
+        return all;
+    }
+
+    std::optional<std::string> pickRandom(std::string_view prefix) {
+        std::lock_guard lock{statsMutex};
+        auto [first, last]{Music::songs.withPrefix(prefix)};
+        if (first == last) {
+            return std::nullopt;
+        }
+        updateSampler();
+        std::string_view song{};
+        for (int draw{0}; draw <= maxRedraws; ++draw) {
+            song = Music::songs[sampler.sample(first.index(), last.index(), engine)];
+            if (song != current && std::ranges::find(recent, song) == recent.end()) {
+                break;
+            }
+        }
+        return std::string{song};
+    }
+} // namespace PlayStats
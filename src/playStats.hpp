@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+struct SongPlays {
+    std::uint32_t plays{};
+    std::uint32_t skips{};     // stopped or replaced before it was halfway through
+    std::int64_t lastPlayed{}; // seconds since the epoch
+    double heard{};            // the fractions of the song heard each time, added up
+};
+
+// Each time a song stops playing, how much of it was heard is appended to a log. Once the log holds twice as
+// many lines as there are songs in it, it's rewritten with one line per song.
+namespace PlayStats {
+    void load(const std::filesystem::path& path);
+    // Call when a song starts, and before it's stopped or another song replaces it
+    void started(std::string_view song);
+    void interrupted();
+    // The song played to the end
+    void ended();
+    std::optional<SongPlays> get(std::string_view song);
+    std::vector<std::pair<std::string, SongPlays>> mostPlayed(std::size_t count);
+    // A random song starting with prefix, favouring songs that haven't been played much and avoiding the
+    // ones played most recently. Each pick takes constant time however many songs match.
+    std::optional<std::string> pickRandom(std::string_view prefix);
+} // namespace PlayStats
@@ -1,13 +1,21 @@
 #include "playlistCommands.hpp"
 #include "autocomplete.hpp"
+#include "batchStat.hpp"
 #include "command.hpp"
 #include "defaultCommands.hpp"
+#include "loudness.hpp"
 #include "music.hpp"
+#include "playStats.hpp"
+#include "playlistFile.hpp"
+#include "smartPlaylists.hpp"
+#include "readAhead.hpp"
 #include <SFML/Audio/Music.hpp>
 #include <fstream>
 #include <iostream>
+#include <numeric>
 #include <print>
 #include <random>
+#include <readline/tilde.h>
 #include <regex>
 
 using CommandDefinition = std::flat_map<std::string, std::string>;
@@ -16,16 +24,20 @@ using namespace Cleo;
 namespace fs = std::filesystem;
 static std::random_device rd{std::random_device{}};
 static std::default_random_engine rng{std::default_random_engine{rd()}};
+static constexpr std::size_t songsToPrefetch{3};
 const std::vector<std::string> Playlist::commandList{
-    "add",  "clear",    "delete", "find", "load",    "loop", "next",
-    "play", "previous", "remove", "save", "shuffle", "skip", "status",
+    "add",  "clear", "delete", "diff",  "export",   "find",   "import", "intersect",
+    "load", "loop",  "next",   "play",  "previous", "remove", "save",   "shuffle",
+    "skip", "smart", "status", "union",
 };
 const CommandMap Playlist::commands{
     {"load", Playlist::load},  {"play", Playlist::play},     {"add", Playlist::add},
     {"save", Playlist::save},  {"status", Playlist::status}, {"shuffle", Playlist::shuffle},
     {"find", Playlist::find},  {"next", Playlist::next},     {"previous", Playlist::previous},
     {"loop", Playlist::loop},  {"clear", Playlist::clear},   {"remove", Playlist::remove},
-    {"delete", Playlist::del}, {"skip", Playlist::skip},
+    {"delete", Playlist::del}, {"skip", Playlist::skip},     {"import", Playlist::importFrom},
+    {"export", Playlist::exportTo}, {"smart", Playlist::smart}, {"union", Playlist::unite},
+    {"intersect", Playlist::intersect}, {"diff", Playlist::diff},
 };
 
 const CommandDefinition Playlist::commandHelp{
@@ -33,9 +45,26 @@ const CommandDefinition Playlist::commandHelp{
 Loads the songs in <filename> into the current playlist.
 Playlists are stored in ~/music/playlists by default.)"},
     {"save", R"(Usage: playlist save [filename]
-Saves the current playlist to the file chosen. Note that it automatically adds the csv
-extension, so you don't need to specify one yourself. If no filename is given, it defaults
-to the current playlist.)"},
+Saves the current playlist to the file chosen. Note that it automatically adds the extension,
+so you don't need to specify one yourself. If no filename is given, it defaults to the current
+playlist, as long as it was loaded or saved under a name (the result of `playlist union` and the
+like isn't). New playlists are saved as .cpl files, which load quickly and remember how long each
+song is. Playlists that were saved as .csv files stay that way.)"},
+    {"smart", R"(Usage: playlist smart [name] [filters]
+Creates a smart playlist, which holds every song matching all the filters and keeps up as songs are
+added, removed or retagged, even while it's the current playlist. It takes the same filters as `list`,
+as well as length, which can be compared like year using seconds or m:ss, and dir, which matches any part
+of the directory the song is in. Songs whose length isn't known yet don't match a length filter.
+With just a name, shows its filters, and with nothing, lists every smart playlist. For example:
+playlist smart short-bach artist:bach length:<3:00
+Load it like any other playlist, and delete it with `playlist delete`.)"},
+    {"import", R"(Usage: playlist import <file>
+Loads a playlist from anywhere, rather than from the playlist directory. It can be a .cpl, .csv,
+.m3u or .m3u8 file. Songs in an M3U playlist have to be in one of your music directories.
+Use `playlist save` to keep it.)"},
+    {"export", R"(Usage: playlist export <file>
+Writes the current playlist to <file>, in the format its extension asks for: .cpl, .csv,
+.m3u or .m3u8. M3U playlists list each song's full path, so other players can use them.)"},
     {"play", R"(Starts playing the playlist and advances the song index by 1.
 This means calling `playlist play` again skips to the next song, unless the current song
 is the last song, in which case it will loop to the beginning.)"},
@@ -59,134 +88,188 @@ If nothing is given, it defaults to the current song being played.)"},
 Removes each song from the current playlist. To make this change permanent, use `playlist save`.)"},
     {"delete", R"(Usage: playlist delete <playlists>
 For each playlist given, attempts to delete the playlist. This action cannot be undone.)"},
+    {"union", R"(Usage: playlist union <a> <b> [-> name]
+Combines two playlists: the songs in <a>, followed by the songs in <b> that aren't in <a>. The result
+becomes the current playlist, or with `-> name`, is saved as playlist <name> instead. Smart playlists
+can be combined too, as they are now. See also `playlist intersect` and `playlist diff`.)"},
+    {"intersect", R"(Usage: playlist intersect <a> <b> [-> name]
+The songs in both <a> and <b>, in the order they're in in <a>. The result becomes the current
+playlist, or with `-> name`, is saved as playlist <name> instead.)"},
+    {"diff", R"(Usage: playlist diff <a> <b> [-> name]
+The songs in <a> that aren't in <b>, e.g. `playlist diff party heard -> unheard`. The result becomes
+the current playlist, or with `-> name`, is saved as playlist <name> instead.)"},
     {"skip", R"(Usage: playlist skip <numSongs>
 Skips forward in the playlist by the desired amount, or backward if the value is negative. Restrictions on the
 `next` and `previous` commands apply here.)"}};
 
-static void playSong(const fs::path& songPath) {
-    if (fs::exists(songPath)) {
-        if (Music::music.openFromFile(songPath)) {
-            Music::curSong = songPath.filename().stem();
+static void playSong(const std::string& song) {
+    fs::path path{songPath(song)};
+    if (fs::exists(path)) {
+        applyNormalization(song);
+        PlayStats::interrupted();
+        if (Music::music.openFromFile(path)) {
+            Music::curSong = stem(song);
             Music::music.play();
+            PlayStats::started(song);
         } else {
-            std::println("File is in an unsupported format.");
+            printError("File is in an unsupported format.");
         }
     } else {
-        std::println("Song not found.");
+        printError("Song not found.");
     }
     // We need to print the prompt here otherwise the output will get messed up
     std::flush(std::cout);
 }
 
-// Reads csv file into playlist. Assumes csv was created by cleo and that it only has 1 line.
-static void parsePlaylist(const fs::path& path) {
-    std::ifstream file{path};
-    std::string curItem{};
-    std::vector<std::string> playlist{};
-    sf::Music load{};
-    while (std::getline(file, curItem, ',')) {
-        if (file.eof()) {
-            // Account for dos and unix line endings. This is mainly for compatibility with smp.
-            if (curItem.ends_with("\r\n")) {
-                curItem.erase(curItem.length() - 2, 2);
-            } else if (curItem.ends_with("\n")) {
-                curItem.erase(curItem.length() - 1, 1);
-            } else {
-                std::println("Unknown line ending encountered when parsing playlist.");
-                return;
+static std::optional<std::vector<std::string>> readPlaylist(const fs::path& path) {
+    return SmartPlaylists::isSmart(path) ? SmartPlaylists::songs(path) : PlaylistFile::load(path);
+}
+
+// Makes songs the current playlist, leaving out songs that aren't there anymore. Runs as part of a slow
+// command, so the state is only locked once the files have been looked at.
+static void usePlaylist(std::vector<std::string>& songs, const std::string& name) {
+    std::vector<fs::path> songFiles{};
+    songFiles.reserve(songs.size());
+    for (const auto& song : songs) {
+        songFiles.push_back(songPath(song));
+    }
+    // All at once, since on a network share checking each song is a round trip
+    std::vector<PathType> types{BatchStat::check(songFiles)};
+    std::vector<std::size_t> unknown{}; // songs we don't know the length of yet
+    {
+        StateLock lock{};
+        for (std::size_t i{0}; i < songs.size(); ++i) {
+            if (types[i] != PathType::Missing && !Music::songDurations.contains(songs[i])) {
+                unknown.push_back(i);
             }
         }
-        if (!Music::songDurations.contains(curItem)) {
-            if (load.openFromFile(Music::musicDir / curItem)) {
-                Music::songDurations.insert({curItem, load.getDuration().asSeconds()});
-            }
+    }
+    std::vector<std::pair<std::size_t, int>> durations{};
+    sf::Music load{};
+    for (std::size_t i : unknown) {
+        if (load.openFromFile(songFiles[i])) {
+            durations.emplace_back(i, (int)load.getDuration().asSeconds());
         }
-        if (!fs::exists(Music::musicDir / curItem)) {
-            std::println("Song not found: {}", (Music::musicDir / curItem).string());
-        } else {
-            playlist.push_back(curItem);
+    }
+    std::vector<std::string> playlist{};
+    StateLock lock{};
+    for (const auto& [i, duration] : durations) {
+        Music::songDurations.insert({songs[i], duration});
+    }
+    for (std::size_t i{0}; i < songs.size(); ++i) {
+        if (types[i] == PathType::Missing) {
+            std::println(Threads::output, "Song not found: {}", songFiles[i].string());
+            continue;
         }
+        playlist.push_back(std::move(songs[i]));
     }
     Music::shuffledPlaylist = Music::curPlaylist = playlist;
-    Music::playlistCurName = path.stem();
+    Music::playlistCurName = name;
     Music::isShuffled = false;
     Music::playlistIdx = 0;
 }
 
-void Playlist::load(Command& cmd) {
-    if (cmd.argCount() == 0) {
-        std::vector<std::string> basePlaylistNames{transformStem(Music::playlists)};
-        std::println("Available playlists:\n{}", join(basePlaylistNames, "\n"));
-        return;
-    }
-    if (cmd.argCount() != 1) {
-        findHelp(Playlist::commandHelp, "load");
+// Makes the playlist at path the current one
+static void parsePlaylist(const fs::path& path) {
+    std::optional<std::vector<std::string>> songs{readPlaylist(path)};
+    if (!songs) {
         return;
     }
-    std::string playlist{cmd.nextArg()};
-    if (fs::exists(Music::playlistDir / playlist)) {
-        parsePlaylist(Music::playlistDir / playlist);
-        return;
+    usePlaylist(*songs, path.stem());
+    SmartPlaylists::follow(SmartPlaylists::isSmart(path) ? path.stem().string() : "");
+}
+
+// The playlist in the playlist directory called name, or the only one whose name starts with it
+static std::optional<fs::path> findPlaylist(const std::string& name) {
+    StateLock lock{};
+    if (fs::exists(Music::playlistDir / name)) {
+        return Music::playlistDir / name;
     }
-    AutoMatch match{Music::playlists, playlist};
-    fs::path playlistPath{};
+    AutoMatch match{Music::playlists, name};
     switch (match.matchType) {
         case Match::NoMatch:
-            std::println("Playlist not found.");
+            printError("Playlist not found.");
             break;
         case Match::ExactMatch:
-            playlistPath = Music::playlistDir / match.exactMatch();
-            parsePlaylist(playlistPath);
-            break;
+            return Music::playlistDir / match.exactMatch();
         case Match::MultipleMatch:
             std::vector<std::string> basePlaylistNames{transformStem(match.matches)};
-            std::println("Multiple matches found, could be one of {}.", join(basePlaylistNames, ", "));
+            printError("Multiple matches found, could be one of {}.", join(basePlaylistNames, ", "));
             break;
     }
+    return std::nullopt;
+}
+
+void Playlist::load(Command& cmd) {
+    if (cmd.argCount() == 0) {
+        std::vector<std::string> basePlaylistNames{transformStem(Music::playlists)};
+        std::println(Threads::output, "Available playlists:\n{}", join(basePlaylistNames, "\n"));
+        return;
+    }
+    if (cmd.argCount() != 1) {
+        showUsage(Playlist::commandHelp, "load");
+        return;
+    }
+    if (std::optional<fs::path> path{findPlaylist(cmd.nextArg())}) {
+        parsePlaylist(*path);
+    }
+}
+
+static void prefetchUpcoming(const std::vector<std::string>& playlist) {
+    std::vector<fs::path> upcoming{};
+    for (std::size_t offset{0}; offset < std::min(songsToPrefetch, playlist.size() - 1); ++offset) {
+        std::size_t idx{Music::playlistIdx + offset};
+        if (idx >= playlist.size()) {
+            if (!Music::isPlaylistLooping) {
+                break;
+            }
+            idx -= playlist.size();
+        }
+        upcoming.push_back(songPath(playlist[idx]));
+    }
+    ReadAhead::prefetch(std::move(upcoming));
 }
 
 void Playlist::play(Command&) {
     const std::vector<std::string>& playlist{getPlaylist()};
     if (playlist.empty()) {
-        std::println("Playlist is empty.");
+        printError("Playlist is empty.");
         return;
     }
-    if (Music::playlistIdx == playlist.size()) {
+    if (Music::playlistIdx >= playlist.size()) {
         Music::playlistIdx = 0;
     }
     Music::inPlaylistMode = true;
-    Music::repeats = 0;
-    playSong(Music::musicDir / playlist.at(Music::playlistIdx));
+    playSong(playlist.at(Music::playlistIdx));
     // We use this instead of Cleo::play since we don't have an instance of Command
     ++Music::playlistIdx;
+    prefetchUpcoming(playlist);
 }
 
 static void addSong(std::string_view song) {
-    AutoMatch match{Music::songs, song};
-    fs::path songPath{};
+    AutoMatch match{matchSong(song)};
     const std::vector<std::string>& playlist{getPlaylist()};
     switch (match.matchType) {
         case Match::NoMatch:
-            std::println("Song not found.");
+            printError("Song not found.");
             break;
         case Match::ExactMatch:
-            songPath = Music::musicDir / match.exactMatch();
-            if (std::find(playlist.cbegin(), playlist.cend(), songPath.filename()) != playlist.cend()) {
-                std::println("Song is already in playlist.");
+            if (std::find(playlist.cbegin(), playlist.cend(), match.exactMatch()) != playlist.cend()) {
+                std::println(Threads::output, "Song is already in playlist.");
                 break;
             }
-            Music::curPlaylist.push_back(songPath.filename());
-            Music::shuffledPlaylist.push_back(songPath.filename());
+            Music::curPlaylist.push_back(match.exactMatch());
+            Music::shuffledPlaylist.push_back(match.exactMatch());
             break;
         case Match::MultipleMatch:
-            std::println("Multiple matches found, could be one of {}.", join(match.matches, ", "));
+            printError("Multiple matches found, could be one of {}.", join(match.matches, ", "));
             break;
     }
 }
 
 void Playlist::add(Command& cmd) {
     if (cmd.argCount() == 0) {
-        findHelp(Playlist::commandHelp, "add");
+        showUsage(Playlist::commandHelp, "add");
         return;
     }
     while (cmd.argCount() > 0) {
@@ -194,45 +277,300 @@ void Playlist::add(Command& cmd) {
     }
 }
 
+// Playlists that were saved as CSV before stay that way, so other players reading them keep working
+static fs::path playlistFile(std::string_view name) {
+    fs::path csv{Music::playlistDir / std::format("{}.csv", name)};
+    if (fs::exists(csv)) {
+        return csv;
+    }
+    return Music::playlistDir / std::format("{}{}", name, PlaylistFile::extension);
+}
+
+static void writePlaylist(const fs::path& path) {
+    if (PlaylistFile::save(path, Music::curPlaylist)) {
+        std::println(Threads::output, "Playlist saved.");
+    } else {
+        printError("Could not write to {}.", path.string());
+    }
+}
+
 void Playlist::save(Command& cmd) {
-    std::ofstream output;
+    if (cmd.argCount() == 0 && !Music::curPlaylist.empty() && Music::playlistCurName.empty()) {
+        printError("The current playlist hasn't been saved before. Give it a name with "
+                   "`playlist save <filename>`.");
+        return;
+    }
     if (cmd.argCount() == 0 && !Music::curPlaylist.empty() && !Music::playlistCurName.empty()) {
-        std::string confirm{};
-        std::print("Overwrite current playlist? [Y/n] ");
-        std::getline(std::cin, confirm);
-        if (!(confirm == "n" || confirm == "N")) {
-            output.open(Music::playlistDir / (Music::playlistCurName + ".csv"));
-            output << join(Music::curPlaylist, ",") << '\n';
-            std::println("Playlist saved.");
+        if (!SmartPlaylists::following().empty()) {
+            printError("Smart playlists keep themselves up to date. To keep the songs as they are now, use "
+                       "`playlist save <filename>`.");
+            return;
+        }
+        if (confirm("Overwrite current playlist?", true)) {
+            writePlaylist(playlistFile(Music::playlistCurName));
         }
         return;
     }
     if (cmd.argCount() != 1) {
-        findHelp(Playlist::commandHelp, "save");
+        showUsage(Playlist::commandHelp, "save");
         return;
     }
-    std::string playlistName{cmd.nextArg()};
-    fs::path destination{Music::playlistDir / (playlistName + ".csv")};
-    // Don't make the user enter an extension themselves, although technically they still can
+    fs::path destination{playlistFile(cmd.nextArg())};
+    // Don't make the user enter an extension themselves
     if (fs::exists(destination)) {
-        std::string choice{};
-        std::print("Playlist already exists, do you want to overwrite it? [y/N] ");
-        std::getline(std::cin, choice);
-        if (choice == "y" || choice == "Y") {
-            output.open(destination);
-            output << join(Music::curPlaylist, ",") << '\n';
-            // Make sure to save with LF line ending since this is what the load function
-            // expects
-            std::println("Playlist saved.");
+        if (confirm("Playlist already exists, do you want to overwrite it?", false)) {
+            writePlaylist(destination);
+        }
+    } else {
+        writePlaylist(destination);
+        // Don't wait for the directory monitor, which isn't running in batch mode
+        Music::playlists.push_back(destination.filename());
+    }
+}
+
+static void listSmartPlaylists() {
+    bool found{false};
+    for (const auto& playlist : Music::playlists) {
+        if (!SmartPlaylists::isSmart(playlist)) {
+            continue;
+        }
+        std::optional<std::vector<std::string>> filters{
+            SmartPlaylists::filters(Music::playlistDir / playlist)};
+        std::println(Threads::output, "{}: {}", stem(playlist),
+                     filters ? join(*filters, " ") : "(could not be read)");
+        found = true;
+    }
+    if (!found) {
+        std::println(Threads::output, "No smart playlists yet.");
+    }
+}
+
+void Playlist::smart(Command& cmd) {
+    if (cmd.argCount() == 0) {
+        listSmartPlaylists();
+        return;
+    }
+    std::string name{cmd.nextArg()};
+    std::string filename{std::format("{}{}", name, SmartPlaylists::extension)};
+    if (cmd.argCount() == 0) {
+        std::optional<std::vector<std::string>> filters{
+            SmartPlaylists::filters(Music::playlistDir / filename)};
+        if (!filters) {
+            printError("Smart playlist {} not found.", name);
+        } else {
+            std::println(Threads::output, "{}: {}", name, join(*filters, " "));
         }
+        return;
+    }
+    if (fs::exists(Music::playlistDir / filename) &&
+        !confirm("Smart playlist already exists, do you want to replace it?", false)) {
+        return;
+    }
+    if (!SmartPlaylists::define(name, cmd.arguments())) {
+        return;
+    }
+    if (std::ranges::find(Music::playlists, filename) == Music::playlists.end()) {
+        Music::playlists.push_back(filename); // the directory monitor isn't running in batch mode
+    }
+    std::optional<std::vector<std::string>> songs{SmartPlaylists::songs(Music::playlistDir / filename)};
+    std::println(Threads::output, "Smart playlist {} has {} songs.", name, songs ? songs->size() : 0);
+}
+
+void Playlist::importFrom(Command& cmd) {
+    if (cmd.argCount() != 1) {
+        showUsage(Playlist::commandHelp, "import");
+        return;
+    }
+    fs::path path{tilde_expand(cmd.nextArg().data())};
+    if (!fs::is_regular_file(path)) {
+        printError("{} is not a file.", path.string());
+        return;
+    }
+    parsePlaylist(path);
+}
+
+void Playlist::exportTo(Command& cmd) {
+    if (cmd.argCount() != 1) {
+        showUsage(Playlist::commandHelp, "export");
+        return;
+    }
+    fs::path path{tilde_expand(cmd.nextArg().data())};
+    std::string extension{path.extension()};
+    if (extension != ".csv" && extension != ".m3u" && extension != ".m3u8" &&
+        extension != PlaylistFile::extension) {
+        printError("Playlists can be exported as .cpl, .csv, .m3u or .m3u8 files.");
+        return;
+    }
+    if (fs::exists(path) && !confirm("File already exists, do you want to overwrite it?", false)) {
+        return;
+    }
+    if (PlaylistFile::save(path, Music::curPlaylist)) {
+        std::println(Threads::output, "Exported {} songs to {}.", Music::curPlaylist.size(), path.string());
     } else {
-        output.open(destination);
-        output << join(Music::curPlaylist, ",") << '\n';
-        std::println("Playlist saved.");
+        printError("Could not write to {}.", path.string());
     }
-    output.close();
 }
 
+enum class SetOperation { Union, Intersection, Difference };
+
+// A song's position in a playlist, and a hash of it to sort and compare by, which saves comparing names
+// except for songs that are the same or whose hashes collide
+struct SongId {
+    std::size_t hash{};
+    std::size_t position{};
+};
+
+// Sorted by hash, then by name, so that copies of a song are next to each other with the first one first.
+// A radix sort, a byte of the hash at a time, since comparing is most of the time std::sort would take.
+static std::vector<SongId> sortedIds(const std::vector<std::string>& songs) {
+    std::vector<SongId> ids(songs.size());
+    for (std::size_t i{0}; i < songs.size(); ++i) {
+        ids[i] = {std::hash<std::string>{}(songs[i]), i};
+    }
+    std::vector<SongId> sorted(ids.size());
+    for (std::size_t shift{0}; shift < sizeof(std::size_t) * 8; shift += 8) {
+        std::array<std::size_t, 257> starts{};
+        for (const SongId& id : ids) {
+            ++starts[((id.hash >> shift) & 0xff) + 1];
+        }
+        if (starts[((ids.empty() ? 0 : ids[0].hash >> shift) & 0xff) + 1] == ids.size()) {
+            continue; // every hash has the same byte here
+        }
+        std::partial_sum(starts.begin(), starts.end(), starts.begin());
+        for (const SongId& id : ids) {
+            sorted[starts[(id.hash >> shift) & 0xff]++] = id;
+        }
+        ids.swap(sorted);
+    }
+    // It's stable, so each song's copies are already in order, but songs whose hashes collide may not be
+    for (auto run{ids.begin()}; run != ids.end();) {
+        auto end{std::find_if(run, ids.end(), [run](const SongId& id) { return id.hash != run->hash; })};
+        if (end - run > 1) {
+            std::stable_sort(run, end, [&songs](const SongId& a, const SongId& b) {
+                return songs[a.position] < songs[b.position];
+            });
+        }
+        run = end;
+    }
+    return ids;
+}
+
+// Combines a and b, keeping songs in the order they're in with a's first. Each is sorted once and the two
+// walked side by side, rather than searching one playlist for each song of the other like `playlist add`
+// does. Songs in either more than once only come out once.
+static std::vector<std::string> combine(std::vector<std::string>& a, std::vector<std::string>& b,
+                                        SetOperation operation) {
+    enum Mark : unsigned char { Unique, InOther, Repeat };
+    std::vector<SongId> idsA{sortedIds(a)};
+    std::vector<SongId> idsB{sortedIds(b)};
+    std::vector<unsigned char> marksA(a.size(), Unique);
+    std::vector<unsigned char> marksB(b.size(), Unique);
+    auto markRepeats{[](const std::vector<std::string>& songs, const std::vector<SongId>& ids,
+                        std::vector<unsigned char>& marks) {
+        for (std::size_t i{1}; i < ids.size(); ++i) {
+            if (ids[i].hash == ids[i - 1].hash && songs[ids[i].position] == songs[ids[i - 1].position]) {
+                marks[ids[i].position] = Repeat;
+            }
+        }
+    }};
+    markRepeats(a, idsA, marksA);
+    markRepeats(b, idsB, marksB);
+    auto next{[](const std::vector<SongId>& ids, const std::vector<unsigned char>& marks, std::size_t at) {
+        while (at < ids.size() && marks[ids[at].position] == Repeat) {
+            ++at;
+        }
+        return at;
+    }};
+    // Left scalar: which side moves on depends on the last comparison, and the hash comparisons are only a
+    // few ms of it for 150k songs a side. Most of the time goes on comparing the names of matching songs,
+    // which are scattered in memory.
+    std::size_t i{next(idsA, marksA, 0)};
+    std::size_t j{next(idsB, marksB, 0)};
+    while (i < idsA.size() && j < idsB.size()) {
+        const SongId& fromA{idsA[i]};
+        const SongId& fromB{idsB[j]};
+        int order{fromA.hash < fromB.hash ? -1 : fromA.hash > fromB.hash ? 1 : 0};
+        if (order == 0) {
+            order = a[fromA.position].compare(b[fromB.position]);
+        }
+        if (order == 0) {
+            marksA[fromA.position] = InOther;
+            marksB[fromB.position] = InOther;
+        }
+        if (order <= 0) {
+            i = next(idsA, marksA, i + 1);
+        }
+        if (order >= 0) {
+            j = next(idsB, marksB, j + 1);
+        }
+    }
+    std::vector<std::string> result{};
+    for (std::size_t k{0}; k < a.size(); ++k) {
+        bool inB{marksA[k] == InOther};
+        bool keep{operation == SetOperation::Union || inB == (operation == SetOperation::Intersection)};
+        if (marksA[k] != Repeat && keep) {
+            result.push_back(std::move(a[k]));
+        }
+    }
+    for (std::size_t k{0}; operation == SetOperation::Union && k < b.size(); ++k) {
+        if (marksB[k] == Unique) {
+            result.push_back(std::move(b[k]));
+        }
+    }
+    return result;
+}
+
+// playlist union|intersect|diff <a> <b> [-> name]
+static void combinePlaylists(Command& cmd, SetOperation operation, const std::string& subcommand) {
+    const std::vector<std::string>& args{cmd.arguments()};
+    if (args.size() != 2 && (args.size() != 4 || args[2] != "->")) {
+        showUsage(Playlist::commandHelp, subcommand);
+        return;
+    }
+    std::optional<fs::path> pathA{findPlaylist(args[0])};
+    std::optional<fs::path> pathB{pathA ? findPlaylist(args[1]) : std::nullopt};
+    if (!pathB) {
+        return;
+    }
+    std::optional<std::vector<std::string>> a{readPlaylist(*pathA)};
+    std::optional<std::vector<std::string>> b{a ? readPlaylist(*pathB) : std::nullopt};
+    if (!b) {
+        return;
+    }
+    std::vector<std::string> result{combine(*a, *b, operation)};
+    if (args.size() == 2) {
+        // Not saved anywhere yet, so `playlist save` needs a name
+        usePlaylist(result, "");
+        SmartPlaylists::follow("");
+        StateLock lock{};
+        std::println(Threads::output, "Current playlist has {} song{}.", Music::curPlaylist.size(),
+                     Music::curPlaylist.size() == 1 ? "" : "s");
+        return;
+    }
+    StateLock lock{}; // the playlist is written with the durations we know of
+    fs::path destination{playlistFile(args[3])};
+    bool exists{fs::exists(destination)};
+    if (exists && !confirm("Playlist already exists, do you want to overwrite it?", false)) {
+        return;
+    }
+    if (!PlaylistFile::save(destination, result)) {
+        printError("Could not write to {}.", destination.string());
+        return;
+    }
+    if (!exists) {
+        // Don't wait for the directory monitor, which isn't running in batch mode
+        Music::playlists.push_back(destination.filename());
+    }
+    std::println(Threads::output, "Saved {} song{} to {}.", result.size(), result.size() == 1 ? "" : "s",
+                 args[3]);
+}
+
+void Playlist::unite(Command& cmd) { combinePlaylists(cmd, SetOperation::Union, "union"); }
+
+void Playlist::intersect(Command& cmd) { combinePlaylists(cmd, SetOperation::Intersection, "intersect"); }
+
+void Playlist::diff(Command& cmd) { combinePlaylists(cmd, SetOperation::Difference, "diff"); }
+
 static void printPreviousNextSong() {
     std::string prevSong{"N/A"};
     std::string nextSong{"N/A"};
@@ -243,48 +581,59 @@ static void printPreviousNextSong() {
     if (Music::playlistIdx < playlist.size()) {
         nextSong = stem(playlist[Music::playlistIdx]);
     }
-    std::println("Previous song: {}, next song: {}", prevSong, nextSong);
+    std::println(Threads::output, "Previous song: {}, next song: {}", prevSong, nextSong);
 }
 
 void Playlist::status(Command&) {
     if (!Music::inPlaylistMode) {
-        std::println("Not playing a playlist.");
+        std::println(Threads::output, "Not playing a playlist.");
         return;
     }
     int totalTime{0};
     int timeElapsed{0};
-    int thisDuration{};
+    std::size_t unknown{0}; // songs whose length couldn't be read, left out of the totals
     const std::vector<std::string>& playlist{getPlaylist()};
     for (std::size_t i{0}; i < playlist.size(); ++i) {
-        thisDuration = Music::songDurations.at(playlist[i]);
-        totalTime += thisDuration;
-        if (i < Music::playlistIdx - 1) {
-            timeElapsed += thisDuration;
+        auto duration{Music::songDurations.find(playlist[i])};
+        if (duration == Music::songDurations.end()) {
+            ++unknown;
+            continue;
+        }
+        totalTime += duration->second;
+        if (i + 1 < Music::playlistIdx) {
+            timeElapsed += duration->second;
         }
     }
     timeElapsed += (int)Music::music.getPlayingOffset().asSeconds();
-    std::println("Playlist selected: {}", Music::playlistCurName);
+    std::println(Threads::output, "Playlist selected: {}", Music::playlistCurName);
     printPreviousNextSong();
-    std::println("Currently playing {} ({}/{})", Music::curSong, Music::playlistIdx, playlist.size());
-    std::println("Total length of playlist: {}", numAsTimestamp(totalTime));
-    std::println("Total time elapsed: {} ({:.1f}%)", numAsTimestamp(timeElapsed),
-                 ((float)timeElapsed / (float)totalTime) * 100);
+    std::println(Threads::output, "Currently playing {} ({}/{})", Music::curSong, Music::playlistIdx,
+                 playlist.size());
+    if (unknown == 0) {
+        std::println(Threads::output, "Total length of playlist: {}", numAsTimestamp(totalTime));
+    } else {
+        std::println(Threads::output,
+                     "Total length of playlist: {} (not counting {} song{} of unknown length)",
+                     numAsTimestamp(totalTime), unknown, unknown == 1 ? "" : "s");
+    }
+    std::println(Threads::output, "Total time elapsed: {} ({:.1f}%)", numAsTimestamp(timeElapsed),
+                 totalTime > 0 ? ((float)timeElapsed / (float)totalTime) * 100 : 0.0f);
 }
 
 void Playlist::shuffle(Command&) {
     if (Music::curPlaylist.empty()) {
-        std::println("Empty playlist cannot be shuffled.");
+        printError("Empty playlist cannot be shuffled.");
         return;
     }
     if (Music::curPlaylist.size() == 1) {
-        std::println("Cannot shuffle playlist with only one song.");
+        printError("Cannot shuffle playlist with only one song.");
         return;
     }
     Music::isShuffled = !Music::isShuffled;
     if (Music::isShuffled) {
         std::ranges::shuffle(Music::shuffledPlaylist, rng);
     }
-    std::println("Shuffle: {}.", Music::isShuffled ? "on" : "off");
+    std::println(Threads::output, "Shuffle: {}.", Music::isShuffled ? "on" : "off");
 }
 
 static std::string numAsPosition(long num) {
@@ -318,21 +667,21 @@ static void filterAndPrintSongs(const std::vector<std::string>& playlist,
     auto target = std::find(songs.begin(), songs.end(), song);
     std::transform(songs.cbegin(), songs.cend(), songs.begin(), stem);
     *target = std::format("\x1b[4m\x1b[1m{}\x1b[0m", *target); // bold and underline
-    std::print("{} is {} in the playlist, ", stem(song), numAsPosition(distFromStart + 1));
+    std::print(Threads::output, "{} is {} in the playlist, ", stem(song), numAsPosition(distFromStart + 1));
     if (distFromStart == 0) {
         std::string before{stem(*(target + 1))};
-        std::println("before {}", before);
+        std::println(Threads::output, "before {}", before);
     } else if (distFromEnd == 0) {
         std::string after{stem(*(target - 1))};
-        std::println("after {}", after);
+        std::println(Threads::output, "after {}", after);
     } else {
         std::string before{stem(*(target + 1))};
         std::string after{stem(*(target - 1))};
         // Note we can't define these before the condition otherwise we could get a segfault if we are at the
         // beginning or end of a playlist
-        std::println("before {}, and after {}", before, after);
+        std::println(Threads::output, "before {}, and after {}", before, after);
     }
-    std::println("\n...{}...", join(songs, ", "));
+    std::println(Threads::output, "\n...{}...", join(songs, ", "));
 }
 
 static bool isDigit(std::string_view num) { return num.find_first_not_of("0123456789") == std::string::npos; }
@@ -344,25 +693,25 @@ static void findSong(const std::vector<std::string>& playlist, std::string song)
         if (0 < index && index < playlist.size() + 1) {
             song = playlist.at(index - 1);
         } else {
-            std::println("Please enter a valid position between 1-{}.", playlist.size());
+            printError("Please enter a valid position between 1-{}.", playlist.size());
             return;
         }
     } else {
         AutoMatch match{playlist, song};
         switch (match.matchType) {
             case Match::NoMatch:
-                std::println("Song not found in playlist.");
+                printError("Song not found in playlist.");
                 return;
             case Match::ExactMatch:
                 song = match.exactMatch();
                 break;
             case Match::MultipleMatch:
-                std::println("Multiple matches found, could be one of {}.", join(match.matches, ", "));
+                printError("Multiple matches found, could be one of {}.", join(match.matches, ", "));
                 return;
         }
     }
     if (playlist.size() == 1) {
-        std::println("{} is 1st in the playlist.", song);
+        std::println(Threads::output, "{} is 1st in the playlist.", song);
         return;
     }
     auto posIter{std::find(playlist.begin(), playlist.end(), song)};
@@ -372,16 +721,16 @@ static void findSong(const std::vector<std::string>& playlist, std::string song)
 void Playlist::find(Command& cmd) {
     const std::vector<std::string>& playlist{getPlaylist()};
     if (playlist.empty()) {
-        std::println("Not currently playing a playlist.");
+        std::println(Threads::output, "Not currently playing a playlist.");
         return;
     }
     std::string song{};
     if (cmd.argCount() == 0) {
-        if (Music::inPlaylistMode) {
+        if (Music::inPlaylistMode && Music::playlistIdx > 0) {
             song = playlist[Music::playlistIdx - 1];
             findSong(playlist, song);
         } else {
-            std::println("Cannot get current song because there is no playlist playing.");
+            std::println(Threads::output, "Cannot get current song because there is no playlist playing.");
         }
     } else {
         while (cmd.argCount() > 0) {
@@ -392,12 +741,12 @@ void Playlist::find(Command& cmd) {
 
 void Playlist::next(Command& _) {
     if (!Music::inPlaylistMode) {
-        std::println("Not currently playing a playlist.");
+        std::println(Threads::output, "Not currently playing a playlist.");
         return;
     }
     if (Music::playlistIdx >= Music::curPlaylist.size() && !Music::isPlaylistLooping) {
         // Allow user to go forward if playlist is set to loop, which will send them back to the start
-        std::println("End of playlist reached.");
+        std::println(Threads::output, "End of playlist reached.");
         return;
     }
     play(_);
@@ -405,7 +754,7 @@ void Playlist::next(Command& _) {
 
 void Playlist::previous(Command& _) {
     if (!Music::inPlaylistMode) {
-        std::println("Not currently playing a playlist.");
+        std::println(Threads::output, "Not currently playing a playlist.");
         return;
     }
     if (Music::playlistIdx > 1) {
@@ -413,45 +762,46 @@ void Playlist::previous(Command& _) {
         Music::playlistIdx -= 2;
         play(_);
     } else {
-        std::println("Can't go back any further.");
+        std::println(Threads::output, "Can't go back any further.");
     }
 }
 
 void Playlist::loop(Command&) {
     Music::isPlaylistLooping = !Music::isPlaylistLooping;
-    std::println("Playlist loop: {}.", Music::isPlaylistLooping ? "enabled" : "disabled");
+    std::println(Threads::output, "Playlist loop: {}.", Music::isPlaylistLooping ? "enabled" : "disabled");
 }
 
 void Playlist::clear(Command&) {
+    SmartPlaylists::follow("");
     Music::curPlaylist.clear();
     Music::playlistCurName.clear();
     Music::shuffledPlaylist.clear();
     Music::inPlaylistMode = false;
     Music::playlistIdx = 0;
-    std::println("Playlist cleared.");
+    std::println(Threads::output, "Playlist cleared.");
 }
 
 static void removeSong(std::string&& song) {
     AutoMatch match{Music::curPlaylist, song};
     switch (match.matchType) {
         case Match::NoMatch:
-            std::println("Song not found in playlist.");
+            printError("Song not found in playlist.");
             return;
         case Match::ExactMatch:
             song = match.exactMatch();
             break;
         case Match::MultipleMatch:
-            std::println("Multiple matches found, could be one of {}.", join(match.matches, ", "));
+            printError("Multiple matches found, could be one of {}.", join(match.matches, ", "));
             return;
     }
     Music::curPlaylist.erase(std::remove(Music::curPlaylist.begin(), Music::curPlaylist.end(), song),
                              Music::curPlaylist.end());
-    std::println("Song removed.");
+    std::println(Threads::output, "Song removed.");
 }
 
 void Playlist::remove(Command& cmd) {
     if (cmd.argCount() == 0) {
-        findHelp(Playlist::commandHelp, "remove");
+        showUsage(Playlist::commandHelp, "remove");
         return;
     }
     while (cmd.argCount() > 0) {
@@ -464,22 +814,26 @@ static void deletePlaylist(std::string_view playlist) {
     std::string filename{};
     switch (match.matchType) {
         case Match::NoMatch:
-            std::println("Playlist {} not found.", playlist);
+            printError("Playlist {} not found.", playlist);
             return;
         case Match::ExactMatch:
             filename = Music::playlistDir / match.exactMatch();
             break;
         case Match::MultipleMatch:
-            std::println("Multiple matches found, could be one of {}.", join(match.matches, ", "));
+            printError("Multiple matches found, could be one of {}.", join(match.matches, ", "));
             return;
     }
     fs::remove(filename);
-    std::println("Deleted playlist {}.", stem(match.exactMatch()));
+    if (SmartPlaylists::isSmart(filename)) {
+        SmartPlaylists::forget(stem(match.exactMatch()));
+    }
+    std::erase(Music::playlists, match.exactMatch());
+    std::println(Threads::output, "Deleted playlist {}.", stem(match.exactMatch()));
 }
 
 void Playlist::del(Command& cmd) {
     if (cmd.argCount() == 0) {
-        findHelp(Playlist::commandHelp, "delete");
+        showUsage(Playlist::commandHelp, "delete");
         return;
     }
     while (cmd.argCount() > 0) {
@@ -489,7 +843,7 @@ void Playlist::del(Command& cmd) {
 
 void Playlist::skip(Command& cmd) {
     if (cmd.argCount() == 0) {
-        findHelp(Playlist::commandHelp, "skip");
+        showUsage(Playlist::commandHelp, "skip");
         return;
     }
     std::string arg{cmd.nextArg()};
@@ -502,21 +856,21 @@ void Playlist::skip(Command& cmd) {
         int newIdx{(int)Music::playlistIdx + numSongsToSkip - 1}; // need int because this might be negative
         if (newIdx >= (int)Music::curPlaylist.size()) {
             if (!Music::isPlaylistLooping) {
-                std::println("Cannot go beyond end of playlist when not looping.");
+                printError("Cannot go beyond end of playlist when not looping.");
                 return;
             } else {
                 newIdx %= Music::curPlaylist.size();
             }
         }
         if (newIdx < 0) {
-            std::println("Cannot go that far back.");
+            printError("Cannot go that far back.");
         } else {
             Music::playlistIdx = (size_t)newIdx;
             Command _;
             play(_);
         }
     } catch (const std::exception& e) {
-        std::println("Number of songs to skip must be a number.");
+        printError("Number of songs to skip must be a number.");
         return;
     }
 }
@@ -17,6 +17,12 @@ namespace Cleo::Playlist {
     void remove(Command&);
     void del(Command&);
     void skip(Command&);
+    void importFrom(Command&);
+    void exportTo(Command&);
+    void smart(Command&);
+    void unite(Command&);
+    void intersect(Command&);
+    void diff(Command&);
     const extern std::flat_map<std::string, std::function<void(Command&)>> commands;
     const extern std::flat_map<std::string, std::string> commandHelp;
     const extern std::vector<std::string> commandList;
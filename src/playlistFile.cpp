@@ -0,0 +1,421 @@
+#include "playlistFile.hpp"
+#include "defaultCommands.hpp"
+#include "dupes.hpp"
+#include "music.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <fcntl.h>
+#include <format>
+#include <fstream>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_set>
+
+namespace fs = std::filesystem;
+
+static constexpr std::string_view magic{"CLEOPLST"};
+static constexpr std::uint32_t version{1};
+static constexpr std::size_t minCompactRecords{32}; // below this the journal is never worth rewriting for
+
+struct Header {
+    char magic[8]{};
+    std::uint32_t version{};
+    std::uint32_t count{};
+    std::uint64_t namesSize{};
+    std::uint64_t checksum{}; // of the entry table and the names
+};
+
+struct Entry {
+    std::uint32_t offset{}; // into the names
+    std::uint32_t length{};
+    std::int32_t duration{};
+    std::uint32_t reserved{};
+};
+
+enum class JournalOp : std::uint8_t { Append = 1, Remove = 2, Rename = 3 };
+
+// Followed by the song's name, then the new name for a rename
+struct Record {
+    std::uint8_t op{};
+    std::uint8_t reserved{};
+    std::uint16_t nameLength{};
+    std::uint16_t newNameLength{};
+    std::uint16_t reserved2{};
+    std::int32_t duration{};
+    std::uint32_t checksum{}; // of everything else in the record, so a partly written one can be spotted
+};
+
+static_assert(sizeof(Header) == 32 && sizeof(Entry) == 16 && sizeof(Record) == 16);
+
+static std::uint32_t recordChecksum(const unsigned char* record, std::size_t size) {
+    std::uint64_t seed{xxh64(record, offsetof(Record, checksum))};
+    return (std::uint32_t)xxh64(record + sizeof(Record), size - sizeof(Record), seed);
+}
+
+static int durationOf(std::string_view song) {
+    auto duration{Music::songDurations.find(song)};
+    return duration == Music::songDurations.end() ? -1 : duration->second;
+}
+
+bool MappedPlaylist::open(const fs::path& path) {
+    mEntries.clear();
+    mRecords = 0;
+    mValidSize = 0;
+    if (!mStream.open(path)) {
+        return false;
+    }
+    std::shared_ptr<MappedFile> file{mStream.file()};
+    const unsigned char* data{file->data};
+    std::size_t size{file->size};
+    Header header{};
+    if (size < sizeof(header)) {
+        return false;
+    }
+    std::memcpy(&header, data, sizeof(header));
+    if (std::string_view{header.magic, sizeof(header.magic)} != magic || header.version != version) {
+        return false;
+    }
+    std::size_t namesStart{sizeof(Header) + (std::size_t)header.count * sizeof(Entry)};
+    if (namesStart > size || header.namesSize > size - namesStart) {
+        return false;
+    }
+    std::size_t journalStart{namesStart + header.namesSize};
+    if (xxh64(data + sizeof(Header), journalStart - sizeof(Header)) != header.checksum) {
+        return false;
+    }
+    auto names{(const char*)data + namesStart};
+    mEntries.reserve(header.count);
+    for (std::size_t i{0}; i < header.count; ++i) {
+        Entry entry{};
+        std::memcpy(&entry, data + sizeof(Header) + i * sizeof(Entry), sizeof(entry));
+        if (entry.offset > header.namesSize || entry.length > header.namesSize - entry.offset) {
+            return false;
+        }
+        mEntries.push_back({{names + entry.offset, entry.length}, entry.duration});
+    }
+    std::size_t position{journalStart};
+    while (size - position >= sizeof(Record)) {
+        Record record{};
+        std::memcpy(&record, data + position, sizeof(record));
+        std::size_t recordSize{sizeof(Record) + record.nameLength + record.newNameLength};
+        if (recordSize > size - position || recordChecksum(data + position, recordSize) != record.checksum) {
+            break;
+        }
+        std::string_view name{(const char*)data + position + sizeof(Record), record.nameLength};
+        std::string_view newName{name.data() + name.size(), record.newNameLength};
+        auto found{std::ranges::find(mEntries, name, &PlaylistEntry::song)};
+        switch ((JournalOp)record.op) {
+            case JournalOp::Append:
+                mEntries.push_back({name, record.duration});
+                break;
+            case JournalOp::Remove:
+                if (found != mEntries.end()) {
+                    mEntries.erase(found);
+                }
+                break;
+            case JournalOp::Rename:
+                if (found != mEntries.end()) {
+                    *found = {newName, record.duration};
+                }
+                break;
+        }
+        position += recordSize;
+        ++mRecords;
+    }
+    mValidSize = position;
+    return true;
+}
+
+// Writes to a temporary file first, so a crash partway through leaves the old playlist as it was. The name is
+// made unique by mkstemp, so two instances, or two jobs in one, saving the same playlist can't write into
+// each other's and rename it into place half done.
+static bool replaceFile(const fs::path& path, std::string_view contents) {
+    std::string temporary{path.string() + ".XXXXXX"};
+    int fd{mkstemp(temporary.data())};
+    if (fd == -1) {
+        return false;
+    }
+    // mkstemp only lets the owner read it, so keep the playlist's permissions, or the usual ones if it's new
+    struct stat info{};
+    fchmod(fd, stat(path.c_str(), &info) == 0 ? info.st_mode & 07777 : 0644);
+    bool written{true};
+    for (std::size_t done{0}; written && done < contents.size();) {
+        ssize_t count{::write(fd, contents.data() + done, contents.size() - done)};
+        if (count == -1 && errno == EINTR) {
+            continue;
+        }
+        written = count > 0;
+        done += written ? (std::size_t)count : 0;
+    }
+    written = close(fd) == 0 && written;
+    std::error_code err{};
+    if (written) {
+        fs::rename(temporary, path, err);
+    }
+    if (!written || err) {
+        fs::remove(temporary, err);
+        return false;
+    }
+    return true;
+}
+
+static bool writeBinary(const fs::path& path, const std::vector<std::string>& songs) {
+    std::vector<Entry> entries(songs.size());
+    std::string names{};
+    for (std::size_t i{0}; i < songs.size(); ++i) {
+        entries[i] = {(std::uint32_t)names.size(), (std::uint32_t)songs[i].size(), durationOf(songs[i]), 0};
+        names.append(songs[i]);
+    }
+    std::string contents(sizeof(Header), '\0');
+    contents.append((const char*)entries.data(), entries.size() * sizeof(Entry));
+    contents.append(names);
+    Header header{};
+    std::memcpy(header.magic, magic.data(), magic.size());
+    header.version = version;
+    header.count = (std::uint32_t)songs.size();
+    header.namesSize = names.size();
+    header.checksum =
+        xxh64((const unsigned char*)contents.data() + sizeof(Header), contents.size() - sizeof(Header));
+    std::memcpy(contents.data(), &header, sizeof(header));
+    return replaceFile(path, contents);
+}
+
+static void addRecord(std::string& journal, JournalOp op, std::string_view name,
+                      std::string_view newName = {}) {
+    Record record{};
+    record.op = (std::uint8_t)op;
+    record.nameLength = (std::uint16_t)name.size();
+    record.newNameLength = (std::uint16_t)newName.size();
+    record.duration = durationOf(op == JournalOp::Rename ? newName : name);
+    std::size_t start{journal.size()};
+    journal.append((const char*)&record, sizeof(record));
+    journal.append(name);
+    journal.append(newName);
+    record.checksum = recordChecksum((const unsigned char*)journal.data() + start, journal.size() - start);
+    std::memcpy(journal.data() + start + offsetof(Record, checksum), &record.checksum,
+                sizeof(record.checksum));
+}
+
+// Anything after validSize is a change that was only partly written, which the new records replace
+static bool appendJournal(const fs::path& path, std::size_t validSize, std::string_view journal) {
+    int fd{::open(path.c_str(), O_WRONLY | O_CLOEXEC)};
+    if (fd == -1) {
+        return false;
+    }
+    bool written{ftruncate(fd, (off_t)validSize) == 0 &&
+                 pwrite(fd, journal.data(), journal.size(), (off_t)validSize) == (ssize_t)journal.size()};
+    ::close(fd);
+    return written;
+}
+
+static std::vector<std::string> songsOf(const MappedPlaylist& playlist) {
+    std::vector<std::string> songs{};
+    songs.reserve(playlist.entries().size());
+    for (const auto& entry : playlist.entries()) {
+        songs.emplace_back(entry.song);
+    }
+    return songs;
+}
+
+// Once the journal is as long as the playlist, reading it costs more than writing the whole thing out again
+static bool shouldCompact(const MappedPlaylist& playlist, std::size_t newRecords) {
+    return playlist.journalRecords() + newRecords > std::max(minCompactRecords, playlist.entries().size());
+}
+
+static std::optional<std::vector<std::string>> readCsv(const fs::path& path) {
+    std::ifstream file{path};
+    if (!file) {
+        printError("Could not open {}.", path.string());
+        return std::nullopt;
+    }
+    std::vector<std::string> songs{};
+    std::string song{};
+    while (std::getline(file, song, ',')) {
+        if (file.eof()) {
+            // Account for dos and unix line endings. This is mainly for compatibility with smp.
+            if (song.ends_with("\r\n")) {
+                song.erase(song.length() - 2, 2);
+            } else if (song.ends_with("\n")) {
+                song.erase(song.length() - 1, 1);
+            } else {
+                printError("Unknown line ending encountered when parsing playlist.");
+                return std::nullopt;
+            }
+        }
+        if (!song.empty()) {
+            songs.push_back(song);
+        }
+    }
+    return songs;
+}
+
+static bool writeCsv(const fs::path& path, const std::vector<std::string>& songs) {
+    return replaceFile(path, join(songs, ",") + '\n');
+}
+
+// Paths in the playlist can be relative to where it is. Songs outside the library are left out.
+static std::optional<std::vector<std::string>> readM3u(const fs::path& path) {
+    std::ifstream file{path};
+    if (!file) {
+        printError("Could not open {}.", path.string());
+        return std::nullopt;
+    }
+    std::vector<std::string> songs{};
+    std::string line{};
+    while (std::getline(file, line)) {
+        if (line.ends_with('\r')) {
+            line.pop_back();
+        }
+        if (line.empty() || line.starts_with('#')) {
+            continue;
+        }
+        fs::path songFile{line};
+        if (songFile.is_relative()) {
+            songFile = path.parent_path() / songFile;
+        }
+        StateLock lock{};
+        if (std::optional<std::string> song{songAtPath(songFile)}) {
+            songs.push_back(std::move(*song));
+        } else {
+            std::println(Threads::output, "Song not in the library: {}", line);
+        }
+    }
+    return songs;
+}
+
+static bool writeM3u(const fs::path& path, const std::vector<std::string>& songs) {
+    std::string contents{"#EXTM3U\n"};
+    for (const auto& song : songs) {
+        contents += std::format("#EXTINF:{},{}\n{}\n", durationOf(song), displayName(song),
+                                songPath(song).string());
+    }
+    return replaceFile(path, contents);
+}
+
+static bool isM3u(const fs::path& path) { return path.extension() == ".m3u" || path.extension() == ".m3u8"; }
+
+namespace PlaylistFile {
+    bool isPlaylist(const fs::path& path) {
+        return path.extension() == extension || path.extension() == ".csv";
+    }
+
+    std::optional<std::vector<std::string>> load(const fs::path& path) {
+        if (path.extension() == ".csv") {
+            return readCsv(path);
+        } else if (isM3u(path)) {
+            return readM3u(path);
+        } else if (path.extension() != extension) {
+            printError("Playlists have to be .cpl, .csv or .m3u files.");
+            return std::nullopt;
+        }
+        MappedPlaylist playlist{};
+        if (!playlist.open(path)) {
+            printError("Could not read {}, it's either damaged or not a playlist.", path.string());
+            return std::nullopt;
+        }
+        std::vector<std::string> songs{};
+        songs.reserve(playlist.entries().size());
+        StateLock lock{}; // for the durations, when it's loaded by a slow command
+        for (const auto& [song, duration] : playlist.entries()) {
+            songs.emplace_back(song);
+            if (duration >= 0) {
+                Music::songDurations.try_emplace(songs.back(), duration);
+            }
+        }
+        return songs;
+    }
+
+    bool save(const fs::path& path, const std::vector<std::string>& songs) {
+        if (path.extension() == ".csv") {
+            return writeCsv(path, songs);
+        } else if (isM3u(path)) {
+            return writeM3u(path, songs);
+        }
+        MappedPlaylist current{};
+        if (!current.open(path)) {
+            return writeBinary(path, songs);
+        }
+        // Songs are only ever added to the end of a playlist or taken out of it, which the journal can
+        // record. Anything else, like saving the shuffled order, means writing it out again.
+        std::unordered_set<std::string_view> wanted{songs.begin(), songs.end()};
+        std::unordered_set<std::string_view> had{};
+        std::string journal{};
+        std::size_t records{0};
+        std::size_t kept{0};
+        for (const auto& entry : current.entries()) {
+            had.insert(entry.song);
+            if (entry.duration < 0 && durationOf(entry.song) >= 0) {
+                return writeBinary(path, songs); // fill in durations found since, so they're there next time
+            } else if (!wanted.contains(entry.song)) {
+                addRecord(journal, JournalOp::Remove, entry.song);
+                ++records;
+            } else if (kept < songs.size() && songs[kept] == entry.song) {
+                ++kept;
+            } else {
+                return writeBinary(path, songs);
+            }
+        }
+        for (std::size_t i{kept}; i < songs.size(); ++i) {
+            if (had.contains(songs[i])) {
+                return writeBinary(path, songs);
+            }
+            addRecord(journal, JournalOp::Append, songs[i]);
+            ++records;
+        }
+        if (records == 0) {
+            return true;
+        } else if (shouldCompact(current, records)) {
+            return writeBinary(path, songs);
+        }
+        return appendJournal(path, current.validSize(), journal);
+    }
+
+    bool renameSong(const fs::path& path, std::string_view song, std::string_view newName) {
+        if (path.extension() == extension) {
+            MappedPlaylist playlist{};
+            if (!playlist.open(path) || std::ranges::find(playlist.entries(), song, &PlaylistEntry::song) ==
+                                            playlist.entries().end()) {
+                return false;
+            }
+            if (shouldCompact(playlist, 1)) {
+                std::vector<std::string> songs{songsOf(playlist)};
+                std::ranges::replace(songs, song, newName);
+                return writeBinary(path, songs);
+            }
+            std::string journal{};
+            addRecord(journal, JournalOp::Rename, song, newName);
+            return appendJournal(path, playlist.validSize(), journal);
+        }
+        std::optional<std::vector<std::string>> songs{readCsv(path)};
+        if (!songs || std::ranges::find(*songs, song) == songs->end()) {
+            return false;
+        }
+        std::ranges::replace(*songs, song, newName);
+        return writeCsv(path, *songs);
+    }
+
+    bool removeSong(const fs::path& path, std::string_view song) {
+        if (path.extension() == extension) {
+            MappedPlaylist playlist{};
+            if (!playlist.open(path) || std::ranges::find(playlist.entries(), song, &PlaylistEntry::song) ==
+                                            playlist.entries().end()) {
+                return false;
+            }
+            if (shouldCompact(playlist, 1)) {
+                std::vector<std::string> songs{songsOf(playlist)};
+                std::erase(songs, song);
+                return writeBinary(path, songs);
+            }
+            std::string journal{};
+            addRecord(journal, JournalOp::Remove, song);
+            return appendJournal(path, playlist.validSize(), journal);
+        }
+        std::optional<std::vector<std::string>> songs{readCsv(path)};
+        if (!songs || std::erase(*songs, song) == 0) {
+            return false;
+        }
+        return writeCsv(path, *songs);
+    }
+} // namespace PlaylistFile
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "readAhead.hpp"
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Playlists are stored in Cleo's own format (.cpl), which loads without parsing anything and remembers how
+// long each song is. The old single-line CSV format still works, and CSV and M3U can be imported and
+// exported so other players can use them.
+struct PlaylistEntry {
+    std::string_view song{};
+    int duration{-1}; // in seconds, -1 if it wasn't known when the song was added
+};
+
+// A .cpl playlist mapped into memory. It starts with a header, a table of entries and their names, followed
+// by a journal of songs added, removed or renamed since, so small changes don't rewrite the whole file.
+// Entries point straight into the mapping, so loading one allocates nothing per song.
+class MappedPlaylist {
+public:
+    // false if the file can't be read or isn't a playlist in this format. A journal that was only partly
+    // written, e.g. because Cleo was killed, is read up to the last complete change.
+    bool open(const std::filesystem::path& path);
+    const std::vector<PlaylistEntry>& entries() const { return mEntries; }
+    std::size_t journalRecords() const { return mRecords; }
+    std::size_t validSize() const { return mValidSize; } // where the next journal record goes
+
+private:
+    MappedFileStream mStream{};
+    std::vector<PlaylistEntry> mEntries{};
+    std::size_t mRecords{0};
+    std::size_t mValidSize{0};
+};
+
+namespace PlaylistFile {
+    inline constexpr std::string_view extension{".cpl"};
+    // Whether Cleo can keep this playlist in the playlist directory, .cpl or .csv
+    bool isPlaylist(const std::filesystem::path& path);
+    // Reads a playlist in any of the formats, going by its extension. Prints why and returns nullopt if it
+    // can't. Durations stored in the playlist are added to Music::songDurations.
+    std::optional<std::vector<std::string>> load(const std::filesystem::path& path);
+    // Writes a playlist in the format its extension asks for. A .cpl playlist that only had songs added to
+    // the end or taken out since it was last written just has the changes appended.
+    bool save(const std::filesystem::path& path, const std::vector<std::string>& songs);
+    // For rename and delete, which change every playlist with the song in it. false if it wasn't there.
+    bool renameSong(const std::filesystem::path& path, std::string_view song, std::string_view newName);
+    bool removeSong(const std::filesystem::path& path, std::string_view song);
+} // namespace PlaylistFile
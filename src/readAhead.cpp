@@ -0,0 +1,268 @@
+#include "readAhead.hpp"
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_set>
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+static const std::size_t pageSize{(std::size_t)sysconf(_SC_PAGESIZE)};
+static constexpr std::size_t touchChunk{1 << 20}; // bytes brought in between checks for a new song
+static constexpr auto pollInterval{std::chrono::milliseconds{100}};
+
+MappedFile::MappedFile(const unsigned char* data, std::size_t size) : data{data}, size{size} {}
+
+MappedFile::~MappedFile() {
+    if (data != nullptr) {
+        munmap((void*)data, size);
+    }
+}
+
+bool MappedFileStream::open(const fs::path& path) {
+    close();
+    int fd{::open(path.c_str(), O_RDONLY | O_CLOEXEC)};
+    if (fd == -1) {
+        return false;
+    }
+    struct stat info{};
+    if (fstat(fd, &info) == -1) {
+        ::close(fd);
+        return false;
+    }
+    auto size{(std::size_t)info.st_size};
+    void* data{size == 0 ? nullptr : mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0)};
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    mFile = std::make_shared<MappedFile>((const unsigned char*)data, size);
+    return true;
+}
+
+void MappedFileStream::close() { mFile.reset(); }
+
+std::shared_ptr<MappedFile> MappedFileStream::file() const { return mFile; }
+
+// Whether reading the range would fault in pages from disk
+static bool isResident(const unsigned char* data, std::size_t offset, std::size_t size) {
+    std::size_t start{offset / pageSize * pageSize};
+    std::size_t end{offset + size};
+    unsigned char resident[64];
+    while (start < end) {
+        std::size_t length{std::min(end - start, sizeof(resident) * pageSize)};
+        if (mincore((void*)(data + start), length, resident) == -1) {
+            return true; // can't tell, so don't count it
+        }
+        for (std::size_t page{0}; page < (length + pageSize - 1) / pageSize; ++page) {
+            if ((resident[page] & 1) == 0) {
+                return false;
+            }
+        }
+        start += length;
+    }
+    return true;
+}
+
+std::optional<std::size_t> MappedFileStream::read(void* data, std::size_t size) {
+    if (mFile == nullptr) {
+        return std::nullopt;
+    }
+    std::size_t position{mFile->position.load(std::memory_order_relaxed)};
+    std::size_t count{std::min(size, mFile->size - position)};
+    if (count == 0) {
+        return 0;
+    }
+    if (isResident(mFile->data, position, count)) {
+        std::memcpy(data, mFile->data + position, count);
+    } else {
+        Clock::time_point start{Clock::now()};
+        std::memcpy(data, mFile->data + position, count);
+        ReadAhead::recordStall(Clock::now() - start);
+    }
+    mFile->position.store(position + count, std::memory_order_relaxed);
+    return count;
+}
+
+std::optional<std::size_t> MappedFileStream::seek(std::size_t position) {
+    if (mFile == nullptr) {
+        return std::nullopt;
+    }
+    position = std::min(position, mFile->size);
+    mFile->position.store(position, std::memory_order_relaxed);
+    return position;
+}
+
+std::optional<std::size_t> MappedFileStream::tell() {
+    if (mFile == nullptr) {
+        return std::nullopt;
+    }
+    return mFile->position.load(std::memory_order_relaxed);
+}
+
+std::optional<std::size_t> MappedFileStream::getSize() {
+    if (mFile == nullptr) {
+        return std::nullopt;
+    }
+    return mFile->size;
+}
+
+static std::thread reader{};
+static std::mutex readerMutex{};
+static std::condition_variable wakeReader{};
+static bool stopping{false};
+static std::shared_ptr<MappedFile> current{};
+static std::vector<fs::path> upcoming{};
+static std::atomic<std::size_t> budget{128 << 20};
+static std::atomic<std::size_t> bytesAhead{0};
+static std::atomic<std::int64_t> blockedNs{0};
+static std::atomic<std::size_t> stalls{0};
+static std::atomic<std::int64_t> longestStallNs{0};
+
+// Faults in pages of the current song so the decoder finds them in memory. Returns false if it should
+// stop early because there's a new song or we're shutting down.
+static bool touch(const MappedFile& file, std::size_t from, std::size_t to) {
+    std::size_t start{from / pageSize * pageSize};
+    madvise((void*)(file.data + start), to - start, MADV_WILLNEED); // lets the kernel issue reads in parallel
+    volatile unsigned char sink{};
+    for (std::size_t chunk{start}; chunk < to; chunk += touchChunk) {
+        for (std::size_t page{chunk}; page < std::min(to, chunk + touchChunk); page += pageSize) {
+            sink = file.data[page];
+        }
+        std::lock_guard lock{readerMutex};
+        if (stopping || current.get() != &file) {
+            return false;
+        }
+    }
+    (void)sink;
+    return true;
+}
+
+static void warm(const fs::path& path, std::size_t maxBytes) {
+    int fd{open(path.c_str(), O_RDONLY | O_CLOEXEC)};
+    if (fd == -1) {
+        return;
+    }
+    posix_fadvise(fd, 0, (off_t)maxBytes, POSIX_FADV_WILLNEED);
+    close(fd);
+}
+
+static void readAhead() {
+    std::shared_ptr<MappedFile> file{};
+    std::size_t loadedUpTo{0};
+    std::unordered_set<std::string> warmed{};
+    std::unique_lock lock{readerMutex};
+    while (!stopping) {
+        if (file != current) {
+            file = current;
+            loadedUpTo = 0;
+        }
+        std::vector<fs::path> next{upcoming};
+        lock.unlock();
+        std::size_t remainingBudget{budget};
+        if (file != nullptr) {
+            std::size_t position{file->position.load(std::memory_order_relaxed)};
+            if (loadedUpTo < position) {
+                loadedUpTo = position; // seeked forward past what we had
+            }
+            std::size_t target{std::min(file->size, position + remainingBudget / 2)};
+            if (loadedUpTo < target && touch(*file, loadedUpTo, target)) {
+                loadedUpTo = target;
+            }
+            bytesAhead = loadedUpTo > position ? loadedUpTo - position : 0;
+            remainingBudget -= target - position;
+        }
+        for (const auto& path : next) {
+            std::error_code err{};
+            std::size_t size{(std::size_t)fs::file_size(path, err)};
+            if (err || remainingBudget == 0) {
+                break;
+            }
+            std::size_t bytes{std::min(size, remainingBudget)};
+            if (!warmed.contains(path.string())) {
+                warm(path, bytes);
+                if (bytes == size) {
+                    warmed.insert(path.string()); // partially warmed songs get another go later
+                }
+            }
+            remainingBudget -= bytes;
+        }
+        lock.lock();
+        if (upcoming != next) {
+            warmed.clear();
+            continue;
+        }
+        wakeReader.wait_for(lock, pollInterval);
+    }
+}
+
+namespace ReadAhead {
+    void start() {
+        std::lock_guard lock{readerMutex};
+        if (reader.joinable()) {
+            return;
+        }
+        stopping = false;
+        reader = std::thread{readAhead};
+    }
+
+    void stop() {
+        {
+            std::lock_guard lock{readerMutex};
+            stopping = true;
+            current.reset();
+        }
+        wakeReader.notify_all();
+        if (reader.joinable()) {
+            reader.join();
+        }
+    }
+
+    void follow(std::shared_ptr<MappedFile> file) {
+        {
+            std::lock_guard lock{readerMutex};
+            current = std::move(file);
+        }
+        bytesAhead = 0;
+        wakeReader.notify_all();
+    }
+
+    void prefetch(std::vector<fs::path> songs) {
+        {
+            std::lock_guard lock{readerMutex};
+            upcoming = std::move(songs);
+        }
+        wakeReader.notify_all();
+    }
+
+    void setBudget(std::size_t bytes) {
+        budget = bytes;
+        wakeReader.notify_all();
+    }
+
+    std::size_t getBudget() { return budget; }
+
+    IoStats getStats() {
+        return {
+            std::chrono::nanoseconds{blockedNs.load()},
+            stalls.load(),
+            std::chrono::nanoseconds{longestStallNs.load()},
+            bytesAhead.load(),
+        };
+    }
+
+    void recordStall(std::chrono::nanoseconds duration) {
+        blockedNs += duration.count();
+        ++stalls;
+        std::int64_t longest{longestStallNs.load()};
+        while (duration.count() > longest &&
+               !longestStallNs.compare_exchange_weak(longest, duration.count())) {
+        }
+    }
+} // namespace ReadAhead
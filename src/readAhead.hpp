@@ -0,0 +1,58 @@
+#pragma once
+
+#include <SFML/System/InputStream.hpp>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <memory>
+#include <vector>
+
+// A file mapped into memory. Shared between the stream decoding it and the read-ahead thread, so the mapping
+// stays valid for whichever of them lets go last.
+struct MappedFile {
+    MappedFile(const unsigned char* data, std::size_t size);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const unsigned char* const data;
+    const std::size_t size;
+    std::atomic<std::size_t> position{0}; // how far the decoder has read
+};
+
+// Reads a song through mmap instead of read(), so pages the read-ahead thread already brought in are free.
+// Reads that still have to wait for the disk or network are timed.
+class MappedFileStream : public sf::InputStream {
+public:
+    [[nodiscard]] bool open(const std::filesystem::path& path);
+    void close();
+    std::shared_ptr<MappedFile> file() const;
+
+    std::optional<std::size_t> read(void* data, std::size_t size) override;
+    std::optional<std::size_t> seek(std::size_t position) override;
+    std::optional<std::size_t> tell() override;
+    std::optional<std::size_t> getSize() override;
+
+private:
+    std::shared_ptr<MappedFile> mFile{};
+};
+
+struct IoStats {
+    std::chrono::nanoseconds blocked{}; // total time the decoder spent waiting on I/O
+    std::size_t stalls{};               // reads that had to wait
+    std::chrono::nanoseconds longestStall{};
+    std::size_t bytesAhead{}; // of the current song, already in memory past the decoder
+};
+
+namespace ReadAhead {
+    void start();
+    void stop();
+    // Keeps the current song loaded well ahead of the decoder
+    void follow(std::shared_ptr<MappedFile> file);
+    // Warms the page cache with the songs that will play next, in order, as far as the budget allows
+    void prefetch(std::vector<std::filesystem::path> upcoming);
+    void setBudget(std::size_t bytes);
+    std::size_t getBudget();
+    IoStats getStats();
+    void recordStall(std::chrono::nanoseconds duration);
+} // namespace ReadAhead
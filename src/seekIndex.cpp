@@ -0,0 +1,424 @@
+#include "seekIndex.hpp"
+#include "dupes.hpp"
+#include "jobs.hpp"
+#include "threadPool.hpp"
+#include <SFML/Audio/InputSoundFile.hpp>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <deque>
+#include <fcntl.h>
+#include <format>
+#include <fstream>
+#include <mutex>
+#include <random>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+static constexpr std::string_view cacheMagic{"CLEOSEEK"};
+static constexpr std::uint32_t cacheVersion{1};
+static constexpr std::size_t maxTables{16};        // tables kept in memory, for the songs played last
+static constexpr std::size_t checkInterval{1 << 20}; // bytes scanned between checks for shutdown
+static const std::size_t pageSize{(std::size_t)sysconf(_SC_PAGESIZE)};
+
+std::pair<std::size_t, std::size_t> SeekTable::byteRange(std::uint64_t from, std::uint64_t to,
+                                                         std::size_t fileSize) const {
+    auto bySample{[](const SeekPoint& point, std::uint64_t sample) { return point.sample < sample; }};
+    auto first{std::lower_bound(points.begin(), points.end(), from + 1, bySample)};
+    auto last{std::lower_bound(points.begin(), points.end(), to, bySample)};
+    std::size_t begin{first == points.begin() ? 0 : (std::size_t)std::prev(first)->byte};
+    std::size_t end{last == points.end() ? fileSize : (std::size_t)last->byte};
+    return {std::min(begin, fileSize), std::min(std::max(begin, end), fileSize)};
+}
+
+static std::atomic<bool> stopping{false};
+
+struct FrameHeader {
+    std::size_t length{};
+    unsigned int samples{};
+    unsigned int sampleRate{};
+    std::size_t sideInfo{}; // bytes between the header and the main data, where a Xing header would start
+};
+
+// Free format streams don't say how long their frames are, and are rare enough not to bother with
+static std::optional<FrameHeader> mp3Header(const unsigned char* p) {
+    // kbps, indexed by the bitrate field
+    static constexpr std::array<std::array<unsigned int, 15>, 5> bitrates{{
+        {0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448}, // MPEG-1 layer I
+        {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384},    // MPEG-1 layer II
+        {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320},     // MPEG-1 layer III
+        {0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256},    // MPEG-2/2.5 layer I
+        {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},         // MPEG-2/2.5 layers II, III
+    }};
+    static constexpr std::array<unsigned int, 3> sampleRates{44100, 48000, 32000};
+    if (p[0] != 0xff || (p[1] & 0xe0) != 0xe0) {
+        return std::nullopt;
+    }
+    unsigned int version{(p[1] >> 3) & 3u}; // 0 is MPEG-2.5, 2 is MPEG-2, 3 is MPEG-1
+    unsigned int layer{(p[1] >> 1) & 3u};   // 1 is layer III, 3 is layer I
+    unsigned int bitrateIndex{(p[2] >> 4) & 15u};
+    unsigned int rateIndex{(p[2] >> 2) & 3u};
+    unsigned int padding{(p[2] >> 1) & 1u};
+    if (version == 1 || layer == 0 || bitrateIndex == 0 || bitrateIndex == 15 || rateIndex == 3) {
+        return std::nullopt;
+    }
+    bool mpeg1{version == 3};
+    bool mono{(p[3] >> 6) == 3};
+    std::size_t table{mpeg1 ? 3 - layer : layer == 3 ? 3u : 4u};
+    std::size_t bitrate{bitrates[table][bitrateIndex] * 1000};
+    FrameHeader header{};
+    header.sampleRate = sampleRates[rateIndex] >> (mpeg1 ? 0 : version == 2 ? 1 : 2);
+    if (layer == 3) {
+        header.samples = 384;
+        header.length = (12 * bitrate / header.sampleRate + padding) * 4;
+    } else {
+        header.samples = layer == 1 && !mpeg1 ? 576 : 1152;
+        header.length = header.samples / 8 * bitrate / header.sampleRate + padding;
+    }
+    header.sideInfo = mpeg1 ? (mono ? 17 : 32) : (mono ? 9 : 17);
+    return header;
+}
+
+// A frame header only counts if another one follows it, otherwise any 0xFFE in the audio would do
+static std::size_t findMp3Frame(const unsigned char* data, std::size_t size, std::size_t pos) {
+    for (; pos + 4 <= size; ++pos) {
+        std::optional<FrameHeader> header{mp3Header(data + pos)};
+        if (!header || pos + header->length + 4 > size) {
+            continue;
+        }
+        std::optional<FrameHeader> next{mp3Header(data + pos + header->length)};
+        if (next && next->sampleRate == header->sampleRate) {
+            return pos;
+        }
+    }
+    return size;
+}
+
+static bool isVbrHeader(const unsigned char* frame, const FrameHeader& header) {
+    std::string_view xing{(const char*)frame + 4 + header.sideInfo, std::min<std::size_t>(4, header.length)};
+    std::string_view vbri{(const char*)frame + 36, std::min<std::size_t>(4, header.length)};
+    return header.length >= 40 && (xing == "Xing" || xing == "Info" || vbri == "VBRI");
+}
+
+// The Xing TOC would only give us a byte offset for each percent of the song, so walk every frame instead.
+// Sample numbers include the encoder delay the decoder trims off, which is under a frame and a half and
+// doesn't matter for knowing which bytes to load.
+static std::optional<SeekTable> scanMp3(const unsigned char* data, std::size_t size, std::size_t pos) {
+    pos = findMp3Frame(data, size, pos);
+    if (pos == size) {
+        return std::nullopt;
+    }
+    SeekTable table{};
+    table.sampleRate = mp3Header(data + pos)->sampleRate;
+    std::uint64_t interval{table.sampleRate / 2};
+    std::uint64_t sample{0};
+    std::uint64_t nextPoint{0};
+    std::size_t nextCheck{pos + checkInterval};
+    bool firstFrame{true};
+    while (pos + 4 <= size) {
+        if (pos >= nextCheck) {
+            if (stopping) {
+                return std::nullopt;
+            }
+            nextCheck = pos + checkInterval;
+        }
+        std::optional<FrameHeader> header{mp3Header(data + pos)};
+        if (!header || header->sampleRate != table.sampleRate) {
+            pos = findMp3Frame(data, size, pos + 1);
+            continue;
+        }
+        if (pos + header->length > size) {
+            break;
+        }
+        if (firstFrame && isVbrHeader(data + pos, *header)) {
+            firstFrame = false;
+            pos += header->length;
+            continue; // decoded as silence and skipped, so it has no samples
+        }
+        firstFrame = false;
+        if (sample >= nextPoint) {
+            table.points.push_back({sample, pos});
+            nextPoint += interval;
+        }
+        sample += header->samples;
+        pos += header->length;
+    }
+    return table;
+}
+
+static std::uint64_t be64(const unsigned char* p) {
+    std::uint64_t value{0};
+    for (int i{0}; i < 8; ++i) {
+        value = value << 8 | p[i];
+    }
+    return value;
+}
+
+// libFLAC already seeks with the SEEKTABLE block if the file has one, we only use it to know where it'll read
+static std::optional<SeekTable> readFlacSeekTable(const unsigned char* data, std::size_t size,
+                                                  std::size_t start) {
+    static constexpr std::uint64_t placeholder{~0ull};
+    SeekTable table{};
+    std::vector<SeekPoint> points{};
+    std::size_t pos{start + 4};
+    while (pos + 4 <= size) {
+        bool isLast{(data[pos] & 0x80) != 0};
+        int type{data[pos] & 0x7f};
+        std::size_t length{(std::size_t)data[pos + 1] << 16 | (std::size_t)data[pos + 2] << 8 |
+                           data[pos + 3]};
+        pos += 4;
+        if (length > size - pos) {
+            return std::nullopt;
+        }
+        if (type == 0 && length >= 13) {
+            table.sampleRate =
+                (unsigned int)data[pos + 10] << 12 | (unsigned int)data[pos + 11] << 4 | data[pos + 12] >> 4;
+        } else if (type == 3) {
+            for (std::size_t point{pos}; point + 18 <= pos + length; point += 18) {
+                if (be64(&data[point]) != placeholder) {
+                    points.push_back({be64(&data[point]), be64(&data[point + 8])});
+                }
+            }
+        }
+        pos += length;
+        if (isLast) {
+            break;
+        }
+    }
+    if (points.empty() || table.sampleRate == 0) {
+        return std::nullopt; // libFLAC bisects the file, and there's no telling where it'll land
+    }
+    for (auto& point : points) {
+        point.byte += pos; // seek point offsets count from the first frame
+    }
+    table.points = std::move(points);
+    return table;
+}
+
+static std::optional<SeekTable> buildTable(const fs::path& path) {
+    int fd{open(path.c_str(), O_RDONLY | O_CLOEXEC)};
+    if (fd == -1) {
+        return std::nullopt;
+    }
+    struct stat info{};
+    if (fstat(fd, &info) == -1 || info.st_size < 10) {
+        close(fd);
+        return std::nullopt;
+    }
+    auto size{(std::size_t)info.st_size};
+    void* map{mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0)};
+    close(fd);
+    if (map == MAP_FAILED) {
+        return std::nullopt;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+    const auto* data{(const unsigned char*)map};
+    std::size_t start{0};
+    if (std::string_view{(const char*)data, 3} == "ID3") {
+        std::size_t tagSize{(std::size_t)(data[6] & 0x7f) << 21 | (std::size_t)(data[7] & 0x7f) << 14 |
+                            (std::size_t)(data[8] & 0x7f) << 7 | (data[9] & 0x7f)};
+        start = std::min(size, 10 + tagSize + ((data[5] & 0x10) != 0 ? 10 : 0));
+    }
+    std::string_view magic{(const char*)data + start, std::min<std::size_t>(4, size - start)};
+    std::optional<SeekTable> table{};
+    if (magic == "fLaC") {
+        table = readFlacSeekTable(data, size, start);
+    } else if (magic != "OggS" && magic != "RIFF") {
+        // Ogg pages carry their own positions and WAV is trivial to seek, so only MPEG audio needs scanning
+        table = scanMp3(data, size, start);
+    }
+    munmap(map, size);
+    return table;
+}
+
+static fs::path cacheDir{};
+static std::mutex tablesMutex{};
+static std::unordered_map<std::string, std::shared_ptr<const SeekTable>> tables{}; // null if there's no table
+static std::deque<std::string> loadOrder{};
+static std::unique_ptr<ThreadPool> pool{};
+
+static fs::path cachePathFor(const fs::path& path) {
+    std::string name{path.string()};
+    return cacheDir / std::format("{:016x}", xxh64((const unsigned char*)name.data(), name.size()));
+}
+
+static std::optional<SeekTable> readCachedTable(const fs::path& path, std::uint64_t size,
+                                                std::int64_t modified) {
+    std::ifstream inp{cachePathFor(path), std::ios::binary};
+    std::string magic(cacheMagic.size(), '\0');
+    std::uint32_t version{};
+    std::uint64_t cachedSize{};
+    std::int64_t cachedModified{};
+    std::uint64_t numPoints{};
+    SeekTable table{};
+    if (!inp.read(magic.data(), (std::streamsize)magic.size()) || magic != cacheMagic ||
+        !inp.read((char*)&version, sizeof(version)) || version != cacheVersion ||
+        !inp.read((char*)&cachedSize, sizeof(cachedSize)) || cachedSize != size ||
+        !inp.read((char*)&cachedModified, sizeof(cachedModified)) || cachedModified != modified ||
+        !inp.read((char*)&table.sampleRate, sizeof(table.sampleRate)) ||
+        !inp.read((char*)&numPoints, sizeof(numPoints)) || numPoints > size) {
+        return std::nullopt;
+    }
+    table.points.resize(numPoints);
+    if (!inp.read((char*)table.points.data(), (std::streamsize)(numPoints * sizeof(SeekPoint)))) {
+        return std::nullopt;
+    }
+    return table;
+}
+
+static void writeCachedTable(const fs::path& path, std::uint64_t size, std::int64_t modified,
+                             const SeekTable& table) {
+    std::error_code err{};
+    fs::create_directories(cacheDir, err);
+    std::ofstream out{cachePathFor(path), std::ios::binary};
+    auto numPoints{(std::uint64_t)table.points.size()};
+    out.write(cacheMagic.data(), (std::streamsize)cacheMagic.size());
+    out.write((const char*)&cacheVersion, sizeof(cacheVersion));
+    out.write((const char*)&size, sizeof(size));
+    out.write((const char*)&modified, sizeof(modified));
+    out.write((const char*)&table.sampleRate, sizeof(table.sampleRate));
+    out.write((const char*)&numPoints, sizeof(numPoints));
+    out.write((const char*)table.points.data(), (std::streamsize)(numPoints * sizeof(SeekPoint)));
+}
+
+// From the cache if the song hasn't changed since, otherwise by reading through it
+static std::shared_ptr<const SeekTable> loadTable(const fs::path& path) {
+    std::error_code err{};
+    std::uint64_t size{fs::file_size(path, err)};
+    std::int64_t modified{fs::last_write_time(path, err).time_since_epoch().count()};
+    if (err) {
+        return nullptr;
+    }
+    std::optional<SeekTable> table{readCachedTable(path, size, modified)};
+    if (!table) {
+        table = buildTable(path);
+        if (table && !stopping) {
+            writeCachedTable(path, size, modified, *table);
+        }
+    }
+    return table ? std::make_shared<const SeekTable>(std::move(*table)) : nullptr;
+}
+
+static void store(const std::string& key, std::shared_ptr<const SeekTable> table) {
+    std::lock_guard lock{tablesMutex};
+    tables[key] = std::move(table);
+    std::erase(loadOrder, key);
+    loadOrder.push_back(key);
+    while (loadOrder.size() > maxTables) {
+        tables.erase(loadOrder.front());
+        loadOrder.pop_front();
+    }
+}
+
+// Drops the song from memory, so the next read has to go to the disk
+static void evict(const MappedFile& file, const fs::path& path) {
+    madvise((void*)file.data, file.size, MADV_DONTNEED); // pages we still map can't be dropped
+    int fd{open(path.c_str(), O_RDONLY | O_CLOEXEC)};
+    if (fd != -1) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+namespace SeekIndex {
+    void setCacheDir(const fs::path& path) { cacheDir = path; }
+
+    void prepare(const fs::path& path) {
+        std::error_code err{};
+        std::size_t size{(std::size_t)fs::file_size(path, err)};
+        if (err || size <= ReadAhead::getBudget() / 2) {
+            return;
+        }
+        std::lock_guard lock{tablesMutex};
+        if (tables.contains(path.string()) || stopping) {
+            return;
+        }
+        tables[path.string()] = nullptr; // so a second play while we're still building doesn't queue it again
+        if (pool == nullptr) {
+            pool = std::make_unique<ThreadPool>(1, true);
+        }
+        pool->submit([path] { store(path.string(), loadTable(path)); });
+    }
+
+    std::shared_ptr<const SeekTable> get(const fs::path& path) {
+        std::lock_guard lock{tablesMutex};
+        auto found{tables.find(path.string())};
+        return found == tables.end() ? nullptr : found->second;
+    }
+
+    void prefetch(const MappedFile& file, const SeekTable& table, sf::Time offset) {
+        // Decoders start a little before the target to fill the bit reservoir, then decode ahead of it
+        std::uint64_t preroll{table.sampleRate};
+        std::uint64_t ahead{2ull * table.sampleRate};
+        auto micros{(std::uint64_t)std::max<std::int64_t>(0, offset.asMicroseconds())};
+        std::uint64_t target{micros * table.sampleRate / 1'000'000};
+        std::uint64_t from{target > preroll ? target - preroll : 0};
+        auto [begin, end]{table.byteRange(from, target + ahead, file.size)};
+        begin = begin / pageSize * pageSize;
+        if (begin >= end) {
+            return;
+        }
+        // One batch of reads instead of a fault per page
+        madvise((void*)(file.data + begin), end - begin, MADV_WILLNEED);
+        volatile unsigned char sink{};
+        for (std::size_t page{begin}; page < end; page += pageSize) {
+            sink = file.data[page];
+        }
+        (void)sink;
+    }
+
+    void stop() {
+        stopping = true;
+        std::unique_ptr<ThreadPool> stopped{};
+        {
+            std::lock_guard lock{tablesMutex};
+            stopped = std::move(pool);
+        }
+        if (stopped != nullptr) {
+            stopped->cancel();
+        }
+    }
+
+    std::optional<SeekBenchmark> benchmark(const fs::path& path, std::size_t seeks) {
+        std::shared_ptr<const SeekTable> table{get(path)};
+        if (table == nullptr) {
+            table = loadTable(path);
+            if (table == nullptr) {
+                return std::nullopt;
+            }
+            store(path.string(), table);
+        }
+        MappedFileStream stream{};
+        sf::InputSoundFile file{};
+        if (!stream.open(path) || !file.openFromStream(stream)) {
+            return std::nullopt;
+        }
+        std::vector<std::int16_t> block((file.getSampleRate() / 20) * file.getChannelCount()); // 50 ms
+        float duration{file.getDuration().asSeconds()};
+        std::mt19937 engine{std::random_device{}()};
+        std::uniform_real_distribution<float> offsets{0, std::max(0.f, duration - 1)};
+        SeekBenchmark result{};
+        for (std::size_t i{0}; i < seeks && !Jobs::cancelled(); ++i) {
+            Jobs::reportProgress(i, seeks);
+            sf::Time offset{sf::seconds(offsets(engine))};
+            for (bool withIndex : {i % 2 == 0, i % 2 != 0}) { // alternate which goes first
+                evict(*stream.file(), path);
+                Clock::time_point start{Clock::now()};
+                if (withIndex) {
+                    prefetch(*stream.file(), *table, offset);
+                }
+                file.seek(offset);
+                (void)file.read(block.data(), block.size());
+                (withIndex ? result.prefetched : result.cold).push_back(Clock::now() - start);
+            }
+        }
+        Jobs::reportProgress(seeks, seeks);
+        return result;
+    }
+} // namespace SeekIndex
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "readAhead.hpp"
+#include <SFML/System/Time.hpp>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <utility>
+#include <vector>
+
+struct SeekPoint {
+    std::uint64_t sample{}; // per channel, counted from the start of the song
+    std::uint64_t byte{};   // where the frame containing that sample starts
+};
+
+// Where the frames of a song start, at roughly fixed time intervals
+struct SeekTable {
+    unsigned int sampleRate{};
+    std::vector<SeekPoint> points{};
+    // The bytes the decoder has to read to produce samples [from, to)
+    std::pair<std::size_t, std::size_t> byteRange(std::uint64_t from, std::uint64_t to,
+                                                  std::size_t fileSize) const;
+};
+
+struct SeekBenchmark {
+    std::vector<std::chrono::nanoseconds> cold{};       // the decoder faulted in the landing point itself
+    std::vector<std::chrono::nanoseconds> prefetched{}; // the landing point was requested in one go first
+};
+
+namespace SeekIndex {
+    void setCacheDir(const std::filesystem::path& path);
+    // Loads or builds the table for a song in the background. Songs small enough for the read-ahead thread
+    // to keep entirely in memory don't get one.
+    void prepare(const std::filesystem::path& path);
+    // nullptr until prepare has finished, or if the song has no table
+    std::shared_ptr<const SeekTable> get(const std::filesystem::path& path);
+    // Brings in what the decoder will read after seeking to offset, instead of faulting it in page by page
+    void prefetch(const MappedFile& file, const SeekTable& table, sf::Time offset);
+    void stop();
+    // Times seeks to random offsets with the song dropped from memory before each one. nullopt if the song
+    // can't be opened or has no table.
+    std::optional<SeekBenchmark> benchmark(const std::filesystem::path& path, std::size_t seeks);
+} // namespace SeekIndex
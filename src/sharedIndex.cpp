@@ -0,0 +1,245 @@
+#include "sharedIndex.hpp"
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstring>
+#include <fcntl.h>
+#include <format>
+#include <map>
+#include <mutex>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+static constexpr std::uint64_t segmentMagic{0x315844494f454c43}; // "CLEOIDX1" in memory
+static constexpr std::size_t minSegmentSize{1 << 16};
+static constexpr int maxAttempts{100}; // reads that overlap a publish before giving up and scanning
+
+// The start of each segment, followed by count + 1 offsets into the file names, then the names themselves.
+// The header is atomic since other processes read it while it's written; the rest is copied out and only
+// trusted if the generation is the same afterwards.
+struct Header {
+    std::atomic<std::uint64_t> magic;
+    std::atomic<std::uint64_t> generation; // odd while a publish is in progress, 0 before the first
+    std::atomic<std::int64_t> version;     // the directory's modification time when it was scanned
+    std::atomic<std::uint64_t> count;
+    std::atomic<std::uint64_t> bytes;
+};
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free, "the header is shared between processes");
+
+struct Segment {
+    int fd{-1};
+    bool writable{false};
+    bool leading{false};
+    unsigned char* data{nullptr};
+    std::size_t length{0};
+};
+
+static std::mutex segmentsMutex{};
+static std::map<fs::path, Segment> segments{}; // by directory, kept open until exit so the lock is held
+static SharedIndexStats totals{};
+
+// Named after a hash of the directory's canonical path, so every instance finds the same segment
+static std::string segmentName(const fs::path& dir) {
+    std::error_code err{};
+    fs::path canonical{fs::weakly_canonical(dir, err)};
+    std::uint64_t hash{0xcbf29ce484222325};
+    for (char c : (err ? dir : canonical).string()) {
+        hash = (hash ^ (unsigned char)c) * 0x100000001b3;
+    }
+    return std::format("/cleo-index-{:016x}", hash);
+}
+
+static Segment& openSegment(const fs::path& dir) {
+    auto [it, inserted]{segments.try_emplace(dir)};
+    Segment& segment{it->second};
+    if (!inserted) {
+        return segment;
+    }
+    std::string name{segmentName(dir)};
+    segment.fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    segment.writable = segment.fd != -1;
+    if (segment.fd == -1) {
+        // Root's, which we can still read
+        segment.fd = shm_open(name.c_str(), O_RDONLY | O_CLOEXEC, 0);
+    }
+    // Anyone can create a segment under the name first, so only ours or root's are believed
+    struct stat info{};
+    bool trusted{fstat(segment.fd, &info) == 0 && (info.st_uid == geteuid() || info.st_uid == 0)};
+    if (segment.fd != -1 && !trusted) {
+        close(segment.fd);
+        segment.fd = -1;
+        segment.writable = false;
+    }
+    return segment;
+}
+
+// Maps all of the segment, which may have grown since it was last mapped
+static bool remap(Segment& segment) {
+    struct stat info{};
+    if (fstat(segment.fd, &info) == -1) {
+        return false;
+    }
+    auto size{(std::size_t)info.st_size};
+    if (size == segment.length) {
+        return segment.data != nullptr;
+    }
+    if (segment.data != nullptr) {
+        munmap(segment.data, segment.length);
+        segment.data = nullptr;
+        segment.length = 0;
+    }
+    if (size < sizeof(Header)) {
+        return false;
+    }
+    int protection{segment.writable ? PROT_READ | PROT_WRITE : PROT_READ};
+    void* data{mmap(nullptr, size, protection, MAP_SHARED, segment.fd, 0)};
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    segment.data = (unsigned char*)data;
+    segment.length = size;
+    return true;
+}
+
+static Header& header(const Segment& segment) { return *(Header*)segment.data; }
+
+// The lock is held until exit, so when the instance building the index goes, the next to look takes over
+static void tryToLead(Segment& segment) {
+    if (segment.leading || flock(segment.fd, LOCK_EX | LOCK_NB) == -1) {
+        return;
+    }
+    if (!segment.writable) {
+        flock(segment.fd, LOCK_UN); // we couldn't publish anyway, so leave it for an instance that can
+        return;
+    }
+    segment.leading = true;
+}
+
+static std::optional<std::vector<std::string>> readListing(Segment& segment, std::int64_t version) {
+    for (int attempt{0}; attempt < maxAttempts; ++attempt) {
+        if (!remap(segment)) {
+            return std::nullopt;
+        }
+        Header& head{header(segment)};
+        std::uint64_t generation{head.generation.load(std::memory_order_acquire)};
+        if (generation == 0 || head.magic.load(std::memory_order_relaxed) != segmentMagic) {
+            return std::nullopt;
+        }
+        if (generation % 2 != 0) {
+            std::this_thread::yield();
+            continue;
+        }
+        if (head.version.load(std::memory_order_relaxed) != version) {
+            return std::nullopt;
+        }
+        std::uint64_t count{head.count.load(std::memory_order_relaxed)};
+        std::uint64_t bytes{head.bytes.load(std::memory_order_relaxed)};
+        std::vector<std::uint64_t> offsets{};
+        std::string names{};
+        std::size_t room{segment.length - sizeof(Header)};
+        if (count < room / sizeof(std::uint64_t) && bytes <= room - (count + 1) * sizeof(std::uint64_t)) {
+            offsets.resize(count + 1);
+            names.resize(bytes);
+            const unsigned char* from{segment.data + sizeof(Header)};
+            std::memcpy(offsets.data(), from, offsets.size() * sizeof(std::uint64_t));
+            std::memcpy(names.data(), from + offsets.size() * sizeof(std::uint64_t), bytes);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (head.generation.load(std::memory_order_relaxed) != generation) {
+            continue;
+        }
+        if (offsets.empty()) {
+            return std::nullopt; // published with a size that doesn't fit, so not by this version of Cleo
+        }
+        std::vector<std::string> files{};
+        files.reserve(count);
+        for (std::size_t i{0}; i < count; ++i) {
+            if (offsets[i] > offsets[i + 1] || offsets[i + 1] > bytes) {
+                return std::nullopt;
+            }
+            files.emplace_back(names, offsets[i], offsets[i + 1] - offsets[i]);
+        }
+        return files;
+    }
+    return std::nullopt;
+}
+
+SharedLookup SharedIndex::lookup(const fs::path& dir) {
+    SharedLookup result{};
+    struct stat info{};
+    if (stat(dir.c_str(), &info) == -1) {
+        return result; // offline, which the scan will find out
+    }
+    result.version = (std::int64_t)info.st_mtim.tv_sec * 1'000'000'000 + info.st_mtim.tv_nsec;
+    std::lock_guard lock{segmentsMutex};
+    Segment& segment{openSegment(dir)};
+    if (segment.fd == -1) {
+        return result;
+    }
+    tryToLead(segment);
+    result.leading = segment.leading;
+    result.files = readListing(segment, result.version);
+    ++(result.files ? totals.hits : totals.misses);
+    return result;
+}
+
+void SharedIndex::publish(const fs::path& dir, std::int64_t version, const std::vector<std::string>& songs,
+                          std::size_t prefixLength) {
+    std::lock_guard lock{segmentsMutex};
+    Segment& segment{openSegment(dir)};
+    if (!segment.leading) {
+        return;
+    }
+    std::uint64_t bytes{0};
+    for (const auto& song : songs) {
+        bytes += song.size() - prefixLength;
+    }
+    std::size_t needed{sizeof(Header) + (songs.size() + 1) * sizeof(std::uint64_t) + bytes};
+    if (segment.length < needed || segment.data == nullptr) {
+        // Growing leaves readers' mappings valid, they remap when they see it's bigger
+        std::size_t size{std::bit_ceil(std::max(needed, minSegmentSize))};
+        if (ftruncate(segment.fd, (off_t)size) == -1 || !remap(segment)) {
+            return;
+        }
+    }
+    Header& head{header(segment)};
+    std::uint64_t generation{head.generation.load(std::memory_order_relaxed)};
+    generation += generation % 2; // the last instance to build it may have exited partway through
+    head.generation.store(generation + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    head.magic.store(segmentMagic, std::memory_order_relaxed);
+    head.version.store(version, std::memory_order_relaxed);
+    head.count.store(songs.size(), std::memory_order_relaxed);
+    head.bytes.store(bytes, std::memory_order_relaxed);
+    auto* offsets{(std::uint64_t*)(segment.data + sizeof(Header))};
+    char* names{(char*)(offsets + songs.size() + 1)};
+    std::uint64_t offset{0};
+    for (std::size_t i{0}; i < songs.size(); ++i) {
+        std::size_t length{songs[i].size() - prefixLength};
+        offsets[i] = offset;
+        std::memcpy(names + offset, songs[i].data() + prefixLength, length);
+        offset += length;
+    }
+    offsets[songs.size()] = offset;
+    head.generation.store(generation + 2, std::memory_order_release);
+}
+
+SharedIndexStats SharedIndex::stats() {
+    std::lock_guard lock{segmentsMutex};
+    SharedIndexStats current{totals};
+    current.leading = 0;
+    current.mapped = 0;
+    for (const auto& [dir, segment] : segments) {
+        if (segment.leading) {
+            ++current.leading;
+        } else if (segment.data != nullptr) {
+            ++current.mapped;
+        }
+    }
+    return current;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <vector>
+
+// What the shared index says about a directory that's about to be scanned
+struct SharedLookup {
+    std::optional<std::vector<std::string>> files{}; // sorted, set when the index is up to date
+    bool leading{false};       // this instance builds the index, so hand the scan to publish
+    std::int64_t version{};    // the directory's modification time, taken before scanning it
+};
+
+struct SharedIndexStats {
+    std::size_t leading{}; // directories this instance builds the index for
+    std::size_t mapped{};  // directories whose index another instance builds
+    std::size_t hits{};    // scans the index saved
+    std::size_t misses{};  // scans that had to read the directory anyway
+};
+
+// An index of the songs in each music directory in shared memory (/dev/shm), so several instances of Cleo on
+// the same host only have to scan a library once. Only segments created by the same user or root are used,
+// and the names read from them are checked like a scan's own. Whichever instance holds the lock on a
+// directory's segment rescans it and publishes the result, and the rest map it read-only, taking over if that
+// instance exits. Each publish is bracketed by a generation counter that's odd while it's being written, and
+// carries the directory's modification time, so a reader falls back to scanning for itself rather than use a
+// listing that's torn or out of date.
+namespace SharedIndex {
+    SharedLookup lookup(const std::filesystem::path& dir);
+    // songs are the sorted file names with prefixLength characters of root name in front of each
+    void publish(const std::filesystem::path& dir, std::int64_t version,
+                 const std::vector<std::string>& songs, std::size_t prefixLength);
+    SharedIndexStats stats();
+} // namespace SharedIndex
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+// Four floats at a time with the compiler's vector extensions, which it lowers to SSE or NEON as available
+using Vec4 = float __attribute__((vector_size(16)));
+using Mask4 = std::int32_t __attribute__((vector_size(16)));
+inline constexpr std::size_t lanes{4};
+
+// Through memcpy since the buffers are only float aligned
+inline Vec4 load(const float* from) {
+    Vec4 v{};
+    std::memcpy(&v, from, sizeof(v));
+    return v;
+}
+
+inline void store(float* to, Vec4 v) { std::memcpy(to, &v, sizeof(v)); }
+
+inline Vec4 vecAbs(Vec4 x) { return (Vec4)((Mask4)x & 0x7fffffff); }
+
+inline Vec4 vecMin(Vec4 a, Vec4 b) {
+    Mask4 less{a < b};
+    return (Vec4)(((Mask4)a & less) | ((Mask4)b & ~less));
+}
+
+inline Vec4 vecMax(Vec4 a, Vec4 b) {
+    Mask4 greater{a > b};
+    return (Vec4)(((Mask4)a & greater) | ((Mask4)b & ~greater));
+}
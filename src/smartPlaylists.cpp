@@ -0,0 +1,322 @@
+#include "smartPlaylists.hpp"
+#include "defaultCommands.hpp"
+#include "metadata.hpp"
+#include "music.hpp"
+#include "threads.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <fstream>
+#include <map>
+#include <set>
+
+namespace fs = std::filesystem;
+
+enum class Field { Name, Artist, Album, Title, Genre, Track, Year, Length, Dir };
+enum class Compare { Less, LessEqual, Greater, GreaterEqual, Equal };
+
+struct Rule {
+    Field field{};
+    std::string text{}; // lowercase, for the fields matched as text
+    Compare compare{};
+    int number{};
+};
+
+struct SmartPlaylist {
+    std::vector<std::string> filters{};
+    std::vector<Rule> rules{};
+    std::set<std::string, std::less<>> songs{};
+};
+
+static const std::map<std::string_view, Field> fields{
+    {"artist", Field::Artist}, {"album", Field::Album}, {"title", Field::Title},   {"genre", Field::Genre},
+    {"track", Field::Track},   {"year", Field::Year},   {"length", Field::Length}, {"dir", Field::Dir},
+};
+
+// Held under StateLock, since both commands and the directory monitor change them
+static std::map<std::string, SmartPlaylist, std::less<>> loaded{};
+static std::atomic<bool> tracking{false};
+static std::string followed{};
+
+static std::string toLower(std::string_view text) {
+    std::string lower{text};
+    std::ranges::transform(lower, lower.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+    return lower;
+}
+
+static bool containsIgnoreCase(std::string_view text, std::string_view lowerNeedle) {
+    auto match{std::ranges::search(text, lowerNeedle, [](char a, char b) {
+        return std::tolower((unsigned char)a) == b;
+    })};
+    return !match.empty() || lowerNeedle.empty();
+}
+
+static bool parseNumber(std::string_view text, int& number) {
+    auto [end, err]{std::from_chars(text.data(), text.data() + text.size(), number)};
+    return err == std::errc{} && end == text.data() + text.size();
+}
+
+// Lengths can be given in seconds or as m:ss
+static bool parseLength(std::string_view text, int& seconds) {
+    std::size_t colon{text.find(':')};
+    if (colon == std::string_view::npos) {
+        return parseNumber(text, seconds);
+    }
+    int minutes{};
+    if (!parseNumber(text.substr(0, colon), minutes) || !parseNumber(text.substr(colon + 1), seconds) ||
+        seconds >= 60) {
+        return false;
+    }
+    seconds += minutes * 60;
+    return true;
+}
+
+static std::optional<Rule> parseRule(std::string_view filter) {
+    std::size_t colon{filter.find(':')};
+    Rule rule{};
+    if (colon == std::string_view::npos) {
+        rule.text = toLower(filter); // no field, so match anywhere in the file name
+        return rule;
+    }
+    std::string field{toLower(filter.substr(0, colon))};
+    std::string_view value{filter.substr(colon + 1)};
+    auto known{fields.find(field)};
+    if (known == fields.end()) {
+        printError("Unknown field `{}`, expected artist, album, title, genre, track, year, length or dir.",
+                   field);
+        return std::nullopt;
+    }
+    rule.field = known->second;
+    if (rule.field != Field::Track && rule.field != Field::Year && rule.field != Field::Length) {
+        rule.text = toLower(value);
+        return rule;
+    }
+    rule.compare = Compare::Equal;
+    for (auto [op, compare] : {std::pair{"<=", Compare::LessEqual}, {">=", Compare::GreaterEqual},
+                               {"<", Compare::Less}, {">", Compare::Greater}, {"=", Compare::Equal}}) {
+        if (value.starts_with(op)) {
+            rule.compare = compare;
+            value.remove_prefix(std::string_view{op}.size());
+            break;
+        }
+    }
+    bool valid{rule.field == Field::Length ? parseLength(value, rule.number)
+                                           : parseNumber(value, rule.number)};
+    if (!valid) {
+        printError("The {} must be {}, optionally after <, >, <=, >= or =.", field,
+                   rule.field == Field::Length ? "a number of seconds or m:ss" : "a whole number");
+        return std::nullopt;
+    }
+    return rule;
+}
+
+static bool compareNumber(const Rule& rule, int number) {
+    switch (rule.compare) {
+        case Compare::Less:
+            return number < rule.number;
+        case Compare::LessEqual:
+            return number <= rule.number;
+        case Compare::Greater:
+            return number > rule.number;
+        case Compare::GreaterEqual:
+            return number >= rule.number;
+        case Compare::Equal:
+            return number == rule.number;
+    }
+    return false;
+}
+
+// Tags and lengths that aren't known never match
+static bool matches(const std::vector<Rule>& rules, const std::string& song) {
+    std::optional<SongTags> tags{};
+    bool tagsRead{false};
+    for (const auto& rule : rules) {
+        bool needsTags{rule.field != Field::Name && rule.field != Field::Length && rule.field != Field::Dir};
+        if (needsTags && !tagsRead) {
+            tags = Metadata::get(song);
+            tagsRead = true;
+        }
+        bool match{false};
+        switch (rule.field) {
+            case Field::Name:
+                match = containsIgnoreCase(song, rule.text);
+                break;
+            case Field::Artist:
+                match = tags && !tags->artist.empty() && containsIgnoreCase(tags->artist, rule.text);
+                break;
+            case Field::Album:
+                match = tags && !tags->album.empty() && containsIgnoreCase(tags->album, rule.text);
+                break;
+            case Field::Title:
+                match = tags && !tags->title.empty() && containsIgnoreCase(tags->title, rule.text);
+                break;
+            case Field::Genre:
+                match = tags && !tags->genre.empty() && containsIgnoreCase(tags->genre, rule.text);
+                break;
+            case Field::Track:
+                match = tags && tags->track != 0 && compareNumber(rule, tags->track);
+                break;
+            case Field::Year:
+                match = tags && tags->year != 0 && compareNumber(rule, tags->year);
+                break;
+            case Field::Length: {
+                auto duration{Music::songDurations.find(song)};
+                match = duration != Music::songDurations.end() && compareNumber(rule, duration->second);
+                break;
+            }
+            case Field::Dir:
+                match = containsIgnoreCase(songPath(song).parent_path().string(), rule.text);
+                break;
+        }
+        if (!match) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The only time a smart playlist looks at the whole library
+static std::optional<SmartPlaylist> build(const std::vector<std::string>& filters) {
+    SmartPlaylist playlist{};
+    playlist.filters = filters;
+    for (const auto& filter : filters) {
+        std::optional<Rule> rule{parseRule(filter)};
+        if (!rule) {
+            return std::nullopt;
+        }
+        playlist.rules.push_back(std::move(*rule));
+    }
+    std::string song{};
+    for (std::string_view candidate : Music::songs) {
+        song = candidate;
+        if (matches(playlist.rules, song)) {
+            playlist.songs.emplace_hint(playlist.songs.end(), song); // the library is already sorted
+        }
+    }
+    return playlist;
+}
+
+static void updateFollowed(const std::vector<std::string>& joined, const std::vector<std::string>& left) {
+    removeFromPlaylist(left);
+    Music::curPlaylist.insert(Music::curPlaylist.end(), joined.begin(), joined.end());
+    Music::shuffledPlaylist.insert(Music::shuffledPlaylist.end(), joined.begin(), joined.end());
+}
+
+namespace SmartPlaylists {
+    bool isSmart(const fs::path& path) { return path.extension() == extension; }
+
+    bool define(std::string_view name, const std::vector<std::string>& filters) {
+        StateLock lock{};
+        std::optional<SmartPlaylist> playlist{build(filters)};
+        if (!playlist) {
+            return false;
+        }
+        fs::path path{Music::playlistDir / std::format("{}{}", name, extension)};
+        std::ofstream file{path};
+        for (const auto& filter : filters) {
+            file << filter << '\n';
+        }
+        if (!file.flush()) {
+            printError("Could not write to {}.", path.string());
+            return false;
+        }
+        loaded.insert_or_assign(std::string{name}, std::move(*playlist));
+        tracking = true;
+        return true;
+    }
+
+    std::optional<std::vector<std::string>> filters(const fs::path& path) {
+        std::ifstream file{path};
+        if (!file) {
+            return std::nullopt;
+        }
+        std::vector<std::string> lines{};
+        std::string line{};
+        while (std::getline(file, line)) {
+            if (line.ends_with('\r')) {
+                line.pop_back();
+            }
+            if (!line.empty()) {
+                lines.push_back(line);
+            }
+        }
+        return lines;
+    }
+
+    std::optional<std::vector<std::string>> songs(const fs::path& path) {
+        std::optional<std::vector<std::string>> current{filters(path)};
+        if (!current) {
+            printError("Could not open {}.", path.string());
+            return std::nullopt;
+        }
+        StateLock lock{};
+        std::string name{path.stem()};
+        auto playlist{loaded.find(name)};
+        // The file may have been edited by hand since it was loaded
+        if (playlist == loaded.end() || playlist->second.filters != *current) {
+            std::optional<SmartPlaylist> built{build(*current)};
+            if (!built) {
+                return std::nullopt;
+            }
+            playlist = loaded.insert_or_assign(name, std::move(*built)).first;
+            tracking = true;
+        }
+        return std::vector<std::string>(playlist->second.songs.begin(), playlist->second.songs.end());
+    }
+
+    void forget(std::string_view name) {
+        StateLock lock{};
+        auto playlist{loaded.find(name)};
+        if (playlist != loaded.end()) {
+            loaded.erase(playlist);
+        }
+        if (followed == name) {
+            followed.clear();
+        }
+        tracking = !loaded.empty();
+    }
+
+    void follow(std::string_view name) {
+        StateLock lock{};
+        followed = name;
+    }
+
+    std::string_view following() { return followed; }
+
+    bool isTracking() { return tracking; }
+
+    void apply(const LibraryDelta& delta) {
+        StateLock lock{};
+        for (auto& [name, playlist] : loaded) {
+            std::vector<std::string> joined{};
+            std::vector<std::string> left{};
+            for (const auto& song : delta.removed) {
+                auto member{playlist.songs.find(song)};
+                if (member != playlist.songs.end()) {
+                    playlist.songs.erase(member);
+                    left.push_back(song);
+                }
+            }
+            for (const auto* changed : {&delta.added, &delta.retagged}) {
+                for (const auto& song : *changed) {
+                    auto member{playlist.songs.find(song)};
+                    bool isMember{member != playlist.songs.end()};
+                    if (matches(playlist.rules, song) == isMember) {
+                        continue;
+                    }
+                    if (isMember) {
+                        playlist.songs.erase(member);
+                        left.push_back(song);
+                    } else {
+                        playlist.songs.insert(song);
+                        joined.push_back(song);
+                    }
+                }
+            }
+            if (name == followed && name == Music::playlistCurName) {
+                updateFollowed(joined, left);
+            }
+        }
+    }
+} // namespace SmartPlaylists
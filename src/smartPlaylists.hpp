@@ -0,0 +1,36 @@
+#pragma once
+
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// What changed in the library since it was last scanned
+struct LibraryDelta {
+    std::vector<std::string> added{};
+    std::vector<std::string> removed{};
+    std::vector<std::string> retagged{}; // songs whose tags were read again because the file changed
+};
+
+// Smart playlists are saved as a list of filters, one per line, in a .smart file in the playlist directory.
+// Their songs are worked out from the whole library once, when they're first loaded, and after that only
+// the songs that change are checked against them.
+namespace SmartPlaylists {
+    inline constexpr std::string_view extension{".smart"};
+    bool isSmart(const std::filesystem::path& path);
+    // Creates or replaces a smart playlist. Prints why and returns false if a filter doesn't make sense.
+    bool define(std::string_view name, const std::vector<std::string>& filters);
+    // The filters a smart playlist was defined with, or nullopt if it can't be read
+    std::optional<std::vector<std::string>> filters(const std::filesystem::path& path);
+    // The songs that match right now, in library order
+    std::optional<std::vector<std::string>> songs(const std::filesystem::path& path);
+    void forget(std::string_view name);
+    // Keeps the current playlist in step with a smart playlist as the library changes, or stops for ""
+    void follow(std::string_view name);
+    std::string_view following();
+    // Whether any smart playlist has been loaded, so nothing works out deltas that nobody reads
+    bool isTracking();
+    // Only the songs in the delta are checked, however big the library is
+    void apply(const LibraryDelta& delta);
+} // namespace SmartPlaylists
@@ -0,0 +1,69 @@
+#include "songList.hpp"
+#include <algorithm>
+#include <atomic>
+
+static std::atomic<std::uint64_t> nextVersion{1};
+
+std::string_view displayName(std::string_view song) {
+    std::size_t start{song.rfind('/')};
+    start = start == std::string_view::npos ? 0 : start + 1;
+    std::size_t dot{song.rfind('.')};
+    if (dot == std::string_view::npos || dot <= start) {
+        return song; // no extension, or a hidden file like .song
+    }
+    return song.substr(0, dot);
+}
+
+void SongList::reserve(std::size_t songs, std::size_t bytes) {
+    mEntries.reserve(songs);
+    mNames.reserve(bytes);
+}
+
+void SongList::append(std::string_view song) {
+    mEntries.push_back({(std::uint32_t)mNames.size(), (std::uint16_t)song.size(),
+                        (std::uint16_t)displayName(song).size()});
+    mNames.append(song);
+    mVersion = nextVersion++;
+}
+
+void SongList::insert(std::string_view song) {
+    Iterator at{std::upper_bound(begin(), end(), song)};
+    Entry entry{(std::uint32_t)mNames.size(), (std::uint16_t)song.size(),
+                (std::uint16_t)displayName(song).size()};
+    mEntries.insert(mEntries.begin() + (std::ptrdiff_t)at.index(), entry);
+    mNames.append(song);
+    mVersion = nextVersion++;
+}
+
+bool SongList::erase(std::string_view song) {
+    Iterator at{std::lower_bound(begin(), end(), song)};
+    if (at == end() || *at != song) {
+        return false;
+    }
+    mErasedBytes += song.size();
+    mEntries.erase(mEntries.begin() + (std::ptrdiff_t)at.index());
+    mVersion = nextVersion++;
+    if (mErasedBytes > mNames.size() / 2) {
+        compact();
+    }
+    return true;
+}
+
+bool SongList::contains(std::string_view song) const { return std::binary_search(begin(), end(), song); }
+
+std::pair<SongList::Iterator, SongList::Iterator> SongList::withPrefix(std::string_view prefix) const {
+    Iterator first{std::lower_bound(begin(), end(), prefix)};
+    Iterator last{std::partition_point(first, end(), [prefix](std::string_view song) {
+        return song.starts_with(prefix);
+    })};
+    return {first, last};
+}
+
+void SongList::compact() {
+    SongList compacted{};
+    compacted.reserve(size(), bytes());
+    for (std::string_view song : *this) {
+        compacted.append(song);
+    }
+    *this = std::move(compacted);
+}
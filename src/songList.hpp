@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// The name a song is shown with: its ID without the extension, e.g. nas/song.mp3 -> nas/song
+std::string_view displayName(std::string_view song);
+
+// The library's songs in sorted order. Every name lives in one buffer with the offset of its extension
+// worked out up front, so there's no allocation per song and display names come for free.
+class SongList {
+public:
+    class Iterator {
+    public:
+        using iterator_category = std::random_access_iterator_tag;
+        using value_type = std::string_view;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = std::string_view;
+
+        Iterator() = default;
+        Iterator(const SongList* list, std::size_t index) : mList{list}, mIndex{index} {}
+        std::string_view operator*() const { return (*mList)[mIndex]; }
+        std::string_view operator[](difference_type n) const { return (*mList)[mIndex + (std::size_t)n]; }
+        Iterator& operator++() { return *this += 1; }
+        Iterator operator++(int) { return std::exchange(*this, *this + 1); }
+        Iterator& operator--() { return *this -= 1; }
+        Iterator operator--(int) { return std::exchange(*this, *this - 1); }
+        Iterator& operator+=(difference_type n) {
+            mIndex = (std::size_t)((difference_type)mIndex + n);
+            return *this;
+        }
+        Iterator& operator-=(difference_type n) { return *this += -n; }
+        Iterator operator+(difference_type n) const { return Iterator{*this} += n; }
+        friend Iterator operator+(difference_type n, const Iterator& it) { return it + n; }
+        Iterator operator-(difference_type n) const { return Iterator{*this} -= n; }
+        difference_type operator-(const Iterator& other) const {
+            return (difference_type)mIndex - (difference_type)other.mIndex;
+        }
+        bool operator==(const Iterator& other) const { return mIndex == other.mIndex; }
+        auto operator<=>(const Iterator& other) const { return mIndex <=> other.mIndex; }
+        std::size_t index() const { return mIndex; }
+
+    private:
+        const SongList* mList{nullptr};
+        std::size_t mIndex{0};
+    };
+
+    void reserve(std::size_t songs, std::size_t bytes);
+    // Songs have to be appended in sorted order
+    void append(std::string_view song);
+    // Keeps the list sorted, for the odd song that changes between scans
+    void insert(std::string_view song);
+    bool erase(std::string_view song);
+
+    std::size_t size() const { return mEntries.size(); }
+    bool empty() const { return mEntries.empty(); }
+    std::string_view operator[](std::size_t index) const {
+        const Entry& entry{mEntries[index]};
+        return {mNames.data() + entry.offset, entry.length};
+    }
+    std::string_view displayNameAt(std::size_t index) const {
+        const Entry& entry{mEntries[index]};
+        return {mNames.data() + entry.offset, entry.stemLength};
+    }
+    std::string_view extensionAt(std::size_t index) const {
+        const Entry& entry{mEntries[index]};
+        return {mNames.data() + entry.offset + entry.stemLength,
+                (std::size_t)(entry.length - entry.stemLength)};
+    }
+    Iterator begin() const { return {this, 0}; }
+    Iterator end() const { return {this, size()}; }
+    bool contains(std::string_view song) const;
+    // The songs starting with prefix, which are next to each other since the list is sorted
+    std::pair<Iterator, Iterator> withPrefix(std::string_view prefix) const;
+    std::vector<std::string> toVector() const { return std::vector<std::string>(begin(), end()); }
+    std::size_t bytes() const { return mNames.size() - mErasedBytes; }
+    // Changes whenever the songs do, and no two lists share one, so indices cached against it can be trusted
+    std::uint64_t version() const { return mVersion; }
+
+private:
+    void compact();
+
+    struct Entry {
+        std::uint32_t offset{};
+        std::uint16_t length{};
+        std::uint16_t stemLength{};
+    };
+    std::string mNames{};
+    std::vector<Entry> mEntries{};
+    std::size_t mErasedBytes{0}; // the names of erased songs stay in mNames until it's next rebuilt
+    std::uint64_t mVersion{0};
+};
@@ -1,9 +1,17 @@
+#include "loudness.hpp"
 #include "music.hpp"
 #include "threads.hpp"
+#include <algorithm>
+#include <map>
 #include <print>
+#include <set>
 #include <sys/inotify.h>
 #include <thread>
 
+static constexpr int retryEvery{33}; // polls, about once a second
+
+static bool sameRoot(const MusicRoot& a, const MusicRoot& b) { return a.name == b.name && a.path == b.path; }
+
 void monitorChanges() {
     using namespace std::chrono_literals;
     int fd{inotify_init1(IN_NONBLOCK)};
@@ -14,31 +22,63 @@ void monitorChanges() {
             "the music directory.");
         return;
     }
-    int wdMusic{};
     int wdPlaylist{};
-    std::uint32_t musicEvents{IN_CREATE | IN_DELETE | IN_MOVE};
+    std::uint32_t musicEvents{IN_CREATE | IN_DELETE | IN_MOVE | IN_UNMOUNT | IN_DELETE_SELF | IN_MOVE_SELF};
     std::uint32_t playlistEvents{IN_CREATE | IN_DELETE};
-    std::filesystem::path musicDir{Music::musicDir};
+    std::vector<MusicRoot> roots{};
+    std::map<int, MusicRoot> rootWatches{}; // one watch per root, so a change only rescans that root
+    std::vector<MusicRoot> unwatched{};     // offline, or couldn't be watched for some other reason
     std::filesystem::path playlistDir{Music::playlistDir};
-    if ((wdMusic = inotify_add_watch(fd, Music::musicDir.c_str(), musicEvents)) == -1) {
-        std::println("ERROR: Could not track music directory. Songs will not be updated.");
-    }
     if ((wdPlaylist = inotify_add_watch(fd, Music::playlistDir.c_str(), playlistEvents)) == -1) {
         std::println("ERROR: Could not track playlist directory. Playlists will not be updated.");
     }
     char buf[sizeof(inotify_event) + NAME_MAX + 1];
     inotify_event* event{};
     ssize_t size{};
+    int polls{0};
     while (true) {
         if (!Threads::running) [[unlikely]] {
-            return;
+            break;
         }
         std::this_thread::sleep_for(30ms);
-        if (musicDir != Music::musicDir) {
-            // Music directory can change during the course of the program, so we need to keep track
-            inotify_rm_watch(fd, wdMusic);
-            wdMusic = inotify_add_watch(fd, Music::musicDir.c_str(), musicEvents);
-            musicDir = Music::musicDir;
+        std::vector<MusicRoot> currentRoots{};
+        {
+            // Roots can be added, removed or changed while the program runs, so we need to keep track
+            StateLock lock{};
+            currentRoots.push_back({"", Music::musicDir});
+            currentRoots.insert(currentRoots.end(), Music::extraRoots.begin(), Music::extraRoots.end());
+        }
+        if (!std::ranges::equal(roots, currentRoots, sameRoot)) {
+            for (const auto& [wd, root] : rootWatches) {
+                inotify_rm_watch(fd, wd);
+            }
+            rootWatches.clear();
+            unwatched.clear();
+            for (const auto& root : currentRoots) {
+                int wd{inotify_add_watch(fd, root.path.c_str(), musicEvents)};
+                if (wd == -1) {
+                    std::println("ERROR: Could not track music directory {}. Songs will be updated once it's "
+                                 "available.",
+                                 root.path.string());
+                    unwatched.push_back(root);
+                } else {
+                    rootWatches[wd] = root;
+                }
+            }
+            roots = std::move(currentRoots);
+        }
+        if (++polls % retryEvery == 0) {
+            // A root that comes back, e.g. a network share mounted again, has to be rescanned as a whole
+            std::erase_if(unwatched, [&](const MusicRoot& root) {
+                int wd{inotify_add_watch(fd, root.path.c_str(), musicEvents)};
+                if (wd == -1) {
+                    return false;
+                }
+                rootWatches[wd] = root;
+                updateSongs(root);
+                analyseLibrary();
+                return true;
+            });
         }
         if (playlistDir != Music::playlistDir) {
             inotify_rm_watch(fd, wdPlaylist);
@@ -49,19 +89,36 @@ void monitorChanges() {
         if (size <= 0) {
             continue;
         }
+        std::set<int> changed{};
+        std::set<int> gone{};
         for (char* ptr = buf; ptr < buf + size; ptr += sizeof(inotify_event) + event->len) {
             event = (inotify_event*)ptr;
-            if (event->mask & musicEvents) {
-                if (event->wd == wdMusic) {
-                    updateSongs();
-                } else if (event->wd == wdPlaylist) {
+            if (event->wd == wdPlaylist) {
+                if (event->mask & playlistEvents) {
                     updatePlaylists();
-                } else {
-                    assert(0 && "Watch descriptor did not match music or playlist directory.");
+                }
+            } else if (rootWatches.contains(event->wd)) {
+                if (event->mask & IN_IGNORED) {
+                    gone.insert(event->wd); // unmounted or deleted, the kernel has dropped the watch
+                }
+                if (event->mask & (musicEvents | IN_IGNORED)) {
+                    changed.insert(event->wd);
                 }
             }
         }
+        for (int wd : changed) {
+            updateSongs(rootWatches.at(wd)); // a root that's gone is marked offline, keeping its cache
+        }
+        for (int wd : gone) {
+            unwatched.push_back(rootWatches.at(wd));
+            rootWatches.erase(wd);
+        }
+        if (!changed.empty()) {
+            analyseLibrary();
+        }
+    }
+    for (const auto& [wd, root] : rootWatches) {
+        inotify_rm_watch(fd, wd);
     }
-    inotify_rm_watch(fd, wdMusic);
     inotify_rm_watch(fd, wdPlaylist);
 }
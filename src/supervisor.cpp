@@ -0,0 +1,97 @@
+#include "supervisor.hpp"
+#include "command.hpp"
+#include "music.hpp"
+#include "playStats.hpp"
+#include "playlistCommands.hpp"
+#include "threads.hpp"
+#include <SFML/Audio/Music.hpp>
+#include <cmath>
+#include <ctime>
+#include <mutex>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+using Clock = std::chrono::steady_clock;
+
+static int stopEvent{eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)};
+static std::mutex statsMutex{};
+static SupervisorStats stats{};
+static double delaySum{};     // in milliseconds, so the squares don't overflow
+static double delaySquares{};
+
+static bool shouldAdvance() {
+    if (Music::playlistIdx == 0 || !Music::inPlaylistMode ||
+        Music::music.getStatus() != sf::Music::Status::Stopped) {
+        return false;
+    } else if (Music::playlistIdx < Music::curPlaylist.size() || Music::isPlaylistLooping) {
+        return true;
+    } else {
+        Music::inPlaylistMode = false;
+        return false;
+    }
+}
+
+static void recordTransition(Clock::duration delay) {
+    std::lock_guard lock{statsMutex};
+    double ms{std::chrono::duration<double, std::milli>{delay}.count()};
+    ++stats.transitions;
+    delaySum += ms;
+    delaySquares += ms * ms;
+    stats.maxDelay = std::max(stats.maxDelay, std::chrono::duration_cast<std::chrono::nanoseconds>(delay));
+}
+
+static void advance() {
+    StateLock lock{};
+    Command _;
+    // Songs that fail to open end straight away, so skip past them, but only try each song once
+    std::size_t tries{0};
+    bool advanced{false};
+    while (tries++ < Music::curPlaylist.size() && shouldAdvance()) {
+        Cleo::Playlist::play(_);
+        advanced = true;
+    }
+    if (advanced && Music::music.getStatus() == sf::Music::Status::Playing) {
+        recordTransition(Clock::now() - Music::music.getEndTime());
+    }
+}
+
+void supervisorThread() {
+    int endEvent{Music::music.getEndEvent()};
+    pollfd fds[2]{{endEvent, POLLIN, 0}, {stopEvent, POLLIN, 0}};
+    eventfd_t count{};
+    while (Threads::running) {
+        if (poll(fds, 2, stopEvent == -1 ? 100 : -1) <= 0) {
+            continue;
+        }
+        if (fds[1].revents != 0) {
+            eventfd_read(stopEvent, &count);
+            continue;
+        }
+        eventfd_read(endEvent, &count); // the player counts as stopped from here on, see getStatus
+        PlayStats::ended();
+        advance();
+        eventfd_read(endEvent, &count); // anything that failed to open along the way
+        timespec cpu{};
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+        std::lock_guard lock{statsMutex};
+        ++stats.wakeups;
+        stats.cpuTime = std::chrono::seconds{cpu.tv_sec} + std::chrono::nanoseconds{cpu.tv_nsec};
+    }
+}
+
+void stopSupervisor() { eventfd_write(stopEvent, 1); }
+
+SupervisorStats supervisorStats() {
+    std::lock_guard lock{statsMutex};
+    SupervisorStats result{stats};
+    if (stats.transitions > 0) {
+        double n{(double)stats.transitions};
+        double mean{delaySum / n};
+        double variance{std::max(0.0, delaySquares / n - mean * mean)};
+        result.meanDelay = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::duration<double, std::milli>{mean});
+        result.jitter = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::duration<double, std::milli>{std::sqrt(variance)});
+    }
+    return result;
+}
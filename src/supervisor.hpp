@@ -0,0 +1,20 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+
+struct SupervisorStats {
+    std::size_t transitions{};            // songs the playlist moved on to by itself
+    std::chrono::nanoseconds meanDelay{}; // from one song running out to the next one starting
+    std::chrono::nanoseconds jitter{};    // standard deviation of the delay
+    std::chrono::nanoseconds maxDelay{};
+    std::size_t wakeups{};
+    std::chrono::nanoseconds cpuTime{};
+};
+
+// Moves the playlist on when a song ends. Sleeps until BufferedMusic says a song has ended, so it doesn't
+// wake up at all while one is playing. Repeats and loops don't need it, BufferedMusic goes round by itself.
+void supervisorThread();
+// Wakes supervisorThread up so it sees Threads::running is false
+void stopSupervisor();
+SupervisorStats supervisorStats();
@@ -0,0 +1,477 @@
+#include "tags.hpp"
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <charconv>
+#include <cstdint>
+#include <fcntl.h>
+#include <span>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace fs = std::filesystem;
+using Bytes = std::span<const unsigned char>;
+
+enum class Field { Artist, Album, Title, Genre, Track, Year };
+
+// ID3v1 genres, which ID3v2 genre frames can also refer to by number
+static constexpr std::array<std::string_view, 80> id3Genres{
+    "Blues",       "Classic Rock",      "Country",           "Dance",        "Disco",
+    "Funk",        "Grunge",            "Hip-Hop",           "Jazz",         "Metal",
+    "New Age",     "Oldies",            "Other",             "Pop",          "R&B",
+    "Rap",         "Reggae",            "Rock",              "Techno",       "Industrial",
+    "Alternative", "Ska",               "Death Metal",       "Pranks",       "Soundtrack",
+    "Euro-Techno", "Ambient",           "Trip-Hop",          "Vocal",        "Jazz+Funk",
+    "Fusion",      "Trance",            "Classical",         "Instrumental", "Acid",
+    "House",       "Game",              "Sound Clip",        "Gospel",       "Noise",
+    "AlternRock",  "Bass",              "Soul",              "Punk",         "Space",
+    "Meditative",  "Instrumental Pop",  "Instrumental Rock", "Ethnic",       "Gothic",
+    "Darkwave",    "Techno-Industrial", "Electronic",        "Pop-Folk",     "Eurodance",
+    "Dream",       "Southern Rock",     "Comedy",            "Cult",         "Gangsta",
+    "Top 40",      "Christian Rap",     "Pop/Funk",          "Jungle",       "Native American",
+    "Cabaret",     "New Wave",          "Psychadelic",       "Rave",         "Showtunes",
+    "Trailer",     "Lo-Fi",             "Tribal",            "Acid Punk",    "Acid Jazz",
+    "Polka",       "Retro",             "Musical",           "Rock & Roll",  "Hard Rock",
+};
+
+static bool startsWith(Bytes data, std::string_view prefix) {
+    return data.size() >= prefix.size() &&
+           std::equal(prefix.begin(), prefix.end(), data.begin(),
+                      [](char a, unsigned char b) { return (unsigned char)a == b; });
+}
+
+static std::string_view asText(Bytes data) { return {(const char*)data.data(), data.size()}; }
+
+static std::uint32_t be32(const unsigned char* p) {
+    return (std::uint32_t)p[0] << 24 | (std::uint32_t)p[1] << 16 | (std::uint32_t)p[2] << 8 | p[3];
+}
+
+static std::uint32_t le32(const unsigned char* p) {
+    return (std::uint32_t)p[3] << 24 | (std::uint32_t)p[2] << 16 | (std::uint32_t)p[1] << 8 | p[0];
+}
+
+// ID3v2 sizes only use the low 7 bits of each byte
+static std::uint32_t synchsafe(const unsigned char* p) {
+    return (std::uint32_t)(p[0] & 0x7f) << 21 | (std::uint32_t)(p[1] & 0x7f) << 14 |
+           (std::uint32_t)(p[2] & 0x7f) << 7 | (p[3] & 0x7f);
+}
+
+static void appendUtf8(std::string& out, std::uint32_t codepoint) {
+    if (codepoint < 0x80) {
+        out += (char)codepoint;
+    } else if (codepoint < 0x800) {
+        out += (char)(0xc0 | codepoint >> 6);
+        out += (char)(0x80 | (codepoint & 0x3f));
+    } else if (codepoint < 0x10000) {
+        out += (char)(0xe0 | codepoint >> 12);
+        out += (char)(0x80 | (codepoint >> 6 & 0x3f));
+        out += (char)(0x80 | (codepoint & 0x3f));
+    } else {
+        out += (char)(0xf0 | codepoint >> 18);
+        out += (char)(0x80 | (codepoint >> 12 & 0x3f));
+        out += (char)(0x80 | (codepoint >> 6 & 0x3f));
+        out += (char)(0x80 | (codepoint & 0x3f));
+    }
+}
+
+static std::string fromLatin1(Bytes data) {
+    std::string text{};
+    for (unsigned char c : data) {
+        if (c == 0) {
+            break;
+        }
+        appendUtf8(text, c);
+    }
+    return text;
+}
+
+static std::string fromUtf8(Bytes data) {
+    std::string_view text{asText(data)};
+    return std::string{text.substr(0, text.find('\0'))};
+}
+
+static std::string fromUtf16(Bytes data, bool bigEndian) {
+    std::string text{};
+    for (std::size_t i{0}; i + 1 < data.size(); i += 2) {
+        std::uint32_t unit{bigEndian ? (std::uint32_t)(data[i] << 8 | data[i + 1])
+                                     : (std::uint32_t)(data[i + 1] << 8 | data[i])};
+        if (unit == 0) {
+            break;
+        }
+        if (unit >= 0xd800 && unit < 0xdc00 && i + 3 < data.size()) {
+            std::uint32_t low{bigEndian ? (std::uint32_t)(data[i + 2] << 8 | data[i + 3])
+                                        : (std::uint32_t)(data[i + 3] << 8 | data[i + 2])};
+            unit = 0x10000 + ((unit - 0xd800) << 10) + (low - 0xdc00);
+            i += 2;
+        }
+        appendUtf8(text, unit);
+    }
+    return text;
+}
+
+static int leadingNumber(std::string_view text) {
+    int number{0};
+    std::from_chars(text.data(), text.data() + text.size(), number);
+    return number;
+}
+
+static void setField(SongTags& tags, Field field, std::string value) {
+    std::size_t end{value.find_last_not_of(" \t\r\n")};
+    value.erase(end == std::string::npos ? 0 : end + 1);
+    value.erase(0, value.find_first_not_of(" \t"));
+    if (value.empty()) {
+        return;
+    }
+    // Formats are read most detailed first, so the first value found for a field wins
+    switch (field) {
+        case Field::Artist:
+            if (tags.artist.empty()) {
+                tags.artist = std::move(value);
+            }
+            break;
+        case Field::Album:
+            if (tags.album.empty()) {
+                tags.album = std::move(value);
+            }
+            break;
+        case Field::Title:
+            if (tags.title.empty()) {
+                tags.title = std::move(value);
+            }
+            break;
+        case Field::Genre:
+            if (tags.genre.empty()) {
+                tags.genre = std::move(value);
+            }
+            break;
+        case Field::Track:
+            if (tags.track == 0) {
+                tags.track = leadingNumber(value);
+            }
+            break;
+        case Field::Year:
+            if (tags.year == 0) {
+                tags.year = leadingNumber(value);
+            }
+            break;
+    }
+}
+
+static std::optional<Field> id3Field(std::string_view id) {
+    if (id == "TPE1" || id == "TP1") {
+        return Field::Artist;
+    } else if (id == "TALB" || id == "TAL") {
+        return Field::Album;
+    } else if (id == "TIT2" || id == "TT2") {
+        return Field::Title;
+    } else if (id == "TCON" || id == "TCO") {
+        return Field::Genre;
+    } else if (id == "TRCK" || id == "TRK") {
+        return Field::Track;
+    } else if (id == "TYER" || id == "TYE" || id == "TDRC") {
+        return Field::Year;
+    }
+    return std::nullopt;
+}
+
+static std::string id3Text(Bytes frame) {
+    Bytes text{frame.subspan(1)};
+    switch (frame[0]) {
+        case 0:
+            return fromLatin1(text);
+        case 1:
+            if (startsWith(text, "\xfe\xff")) {
+                return fromUtf16(text.subspan(2), true);
+            } else if (startsWith(text, "\xff\xfe")) {
+                return fromUtf16(text.subspan(2), false);
+            }
+            return fromUtf16(text, false);
+        case 2:
+            return fromUtf16(text, true);
+        default:
+            return fromUtf8(text);
+    }
+}
+
+// Genres can be written as "(17)", "(17)Refinement" or "17" instead of by name
+static std::string id3Genre(std::string genre) {
+    std::string_view number{genre};
+    if (genre.starts_with('(')) {
+        std::size_t close{genre.find(')')};
+        if (close == std::string::npos) {
+            return genre;
+        }
+        if (close + 1 < genre.size()) {
+            return genre.substr(close + 1);
+        }
+        number = number.substr(1, close - 1);
+    }
+    if (number.empty() || number.find_first_not_of("0123456789") != std::string_view::npos) {
+        return genre;
+    }
+    auto index{(std::size_t)leadingNumber(number)};
+    return index < id3Genres.size() ? std::string{id3Genres[index]} : genre;
+}
+
+// Returns how many bytes the tag takes up, so the caller can look for the audio after it
+static std::size_t parseId3v2(Bytes data, SongTags& tags) {
+    if (data.size() < 10 || !startsWith(data, "ID3")) {
+        return 0;
+    }
+    int version{data[3]};
+    unsigned int flags{data[5]};
+    std::size_t size{synchsafe(&data[6])};
+    std::size_t end{std::min(data.size(), 10 + size)};
+    std::size_t total{10 + size + ((flags & 0x10) != 0 ? 10 : 0)}; // tags in 2.4 can have a footer
+    if (version < 2 || version > 4) {
+        return total;
+    }
+    std::size_t pos{10};
+    if ((flags & 0x40) != 0 && version >= 3 && pos + 4 <= end) {
+        pos += version == 3 ? 4 + be32(&data[pos]) : synchsafe(&data[pos]); // skip the extended header
+    }
+    std::size_t headerSize{version == 2 ? 6u : 10u};
+    while (pos + headerSize <= end && data[pos] != 0) {
+        std::string_view id{asText(data.subspan(pos, version == 2 ? 3 : 4))};
+        std::size_t frameSize{};
+        unsigned int frameFlags{0};
+        if (version == 2) {
+            frameSize = (std::size_t)data[pos + 3] << 16 | (std::size_t)data[pos + 4] << 8 | data[pos + 5];
+        } else {
+            frameSize = version == 4 ? synchsafe(&data[pos + 4]) : be32(&data[pos + 4]);
+            frameFlags = (unsigned int)data[pos + 8] << 8 | data[pos + 9];
+        }
+        pos += headerSize;
+        if (frameSize > end - pos) {
+            break;
+        }
+        Bytes frame{data.subspan(pos, frameSize)};
+        pos += frameSize;
+        bool unreadable{(version == 3 && (frameFlags & 0x00c0) != 0) ||
+                        (version == 4 && (frameFlags & 0x000c) != 0)};
+        if (unreadable) {
+            continue; // compressed or encrypted
+        }
+        if (version == 4 && (frameFlags & 0x0001) != 0) {
+            frame = frame.size() >= 4 ? frame.subspan(4) : Bytes{}; // data length indicator
+        }
+        std::optional<Field> field{id3Field(id)};
+        if (!field || frame.size() < 2) {
+            continue;
+        }
+        std::string text{id3Text(frame)};
+        setField(tags, *field, *field == Field::Genre ? id3Genre(std::move(text)) : std::move(text));
+    }
+    return total;
+}
+
+static void parseId3v1(Bytes data, SongTags& tags) {
+    if (data.size() < 128) {
+        return;
+    }
+    Bytes tag{data.last(128)};
+    if (!startsWith(tag, "TAG")) {
+        return;
+    }
+    setField(tags, Field::Title, fromLatin1(tag.subspan(3, 30)));
+    setField(tags, Field::Artist, fromLatin1(tag.subspan(33, 30)));
+    setField(tags, Field::Album, fromLatin1(tag.subspan(63, 30)));
+    setField(tags, Field::Year, fromLatin1(tag.subspan(93, 4)));
+    if (tag[125] == 0 && tag[126] != 0) {
+        setField(tags, Field::Track, std::to_string(tag[126])); // ID3v1.1 keeps the track in the comment
+    }
+    if (tag[127] < id3Genres.size()) {
+        setField(tags, Field::Genre, std::string{id3Genres[tag[127]]});
+    }
+}
+
+static void parseVorbisComment(Bytes data, SongTags& tags) {
+    if (data.size() < 8) {
+        return;
+    }
+    std::size_t pos{4 + (std::size_t)le32(&data[0])}; // skip the vendor string
+    if (pos + 4 > data.size()) {
+        return;
+    }
+    std::uint32_t count{le32(&data[pos])};
+    pos += 4;
+    for (; count > 0 && pos + 4 <= data.size(); --count) {
+        std::size_t length{le32(&data[pos])};
+        pos += 4;
+        if (length > data.size() - pos) {
+            return;
+        }
+        std::string_view comment{asText(data.subspan(pos, length))};
+        pos += length;
+        std::size_t equals{comment.find('=')};
+        if (equals == std::string_view::npos) {
+            continue;
+        }
+        std::string key{comment.substr(0, equals)};
+        std::ranges::transform(key, key.begin(), [](unsigned char c) { return (char)std::toupper(c); });
+        std::string value{comment.substr(equals + 1)};
+        if (key == "ARTIST") {
+            setField(tags, Field::Artist, std::move(value));
+        } else if (key == "ALBUM") {
+            setField(tags, Field::Album, std::move(value));
+        } else if (key == "TITLE") {
+            setField(tags, Field::Title, std::move(value));
+        } else if (key == "GENRE") {
+            setField(tags, Field::Genre, std::move(value));
+        } else if (key == "TRACKNUMBER") {
+            setField(tags, Field::Track, std::move(value));
+        } else if (key == "DATE" || key == "YEAR") {
+            setField(tags, Field::Year, std::move(value));
+        }
+    }
+}
+
+static void parseFlac(Bytes data, SongTags& tags) {
+    std::size_t pos{4};
+    while (pos + 4 <= data.size()) {
+        bool isLast{(data[pos] & 0x80) != 0};
+        int type{data[pos] & 0x7f};
+        std::size_t length{(std::size_t)data[pos + 1] << 16 | (std::size_t)data[pos + 2] << 8 |
+                           data[pos + 3]};
+        pos += 4;
+        if (length > data.size() - pos) {
+            return;
+        }
+        if (type == 4) {
+            parseVorbisComment(data.subspan(pos, length), tags);
+            return;
+        }
+        if (isLast) {
+            return;
+        }
+        pos += length;
+    }
+}
+
+// The comments are the second packet of the first logical stream, which may span several pages
+static void parseOgg(Bytes data, SongTags& tags) {
+    std::vector<unsigned char> packet{};
+    std::size_t packetIndex{0};
+    std::optional<std::uint32_t> serial{};
+    std::size_t pos{0};
+    while (pos + 27 <= data.size() && startsWith(data.subspan(pos), "OggS")) {
+        std::uint32_t pageSerial{le32(&data[pos + 14])};
+        std::size_t numSegments{data[pos + 26]};
+        std::size_t body{pos + 27 + numSegments};
+        if (body > data.size()) {
+            return;
+        }
+        Bytes segments{data.subspan(pos + 27, numSegments)};
+        std::size_t bodySize{0};
+        for (unsigned char segment : segments) {
+            bodySize += segment;
+        }
+        if (bodySize > data.size() - body) {
+            return;
+        }
+        if (!serial) {
+            serial = pageSerial;
+        }
+        if (pageSerial == *serial) {
+            std::size_t offset{body};
+            for (unsigned char segment : segments) {
+                if (packetIndex == 1) {
+                    packet.insert(packet.end(), data.begin() + (std::ptrdiff_t)offset,
+                                  data.begin() + (std::ptrdiff_t)(offset + segment));
+                }
+                offset += segment;
+                if (segment < 255) {
+                    if (packetIndex == 1) {
+                        if (startsWith(packet, "\x03vorbis")) {
+                            parseVorbisComment(Bytes{packet}.subspan(7), tags);
+                        } else if (startsWith(packet, "OpusTags")) {
+                            parseVorbisComment(Bytes{packet}.subspan(8), tags);
+                        }
+                        return;
+                    }
+                    ++packetIndex;
+                }
+            }
+        }
+        pos = body + bodySize;
+    }
+}
+
+static void parseRiffInfo(Bytes data, SongTags& tags) {
+    std::size_t pos{0};
+    while (pos + 8 <= data.size()) {
+        std::string_view id{asText(data.subspan(pos, 4))};
+        std::size_t length{std::min<std::size_t>(le32(&data[pos + 4]), data.size() - pos - 8)};
+        std::string value{fromUtf8(data.subspan(pos + 8, length))};
+        pos += 8 + length + (length & 1);
+        if (id == "IART") {
+            setField(tags, Field::Artist, std::move(value));
+        } else if (id == "IPRD") {
+            setField(tags, Field::Album, std::move(value));
+        } else if (id == "INAM") {
+            setField(tags, Field::Title, std::move(value));
+        } else if (id == "IGNR") {
+            setField(tags, Field::Genre, std::move(value));
+        } else if (id == "ITRK" || id == "IPRT") {
+            setField(tags, Field::Track, std::move(value));
+        } else if (id == "ICRD") {
+            setField(tags, Field::Year, std::move(value));
+        }
+    }
+}
+
+static void parseRiff(Bytes data, SongTags& tags) {
+    std::size_t pos{12};
+    while (pos + 8 <= data.size()) {
+        std::string_view id{asText(data.subspan(pos, 4))};
+        std::size_t length{std::min<std::size_t>(le32(&data[pos + 4]), data.size() - pos - 8)};
+        Bytes chunk{data.subspan(pos + 8, length)};
+        pos += 8 + length + (length & 1);
+        if (id == "id3 " || id == "ID3 ") {
+            parseId3v2(chunk, tags);
+        } else if (id == "LIST" && startsWith(chunk, "INFO")) {
+            parseRiffInfo(chunk.subspan(4), tags);
+        }
+    }
+}
+
+std::optional<SongTags> parseTags(const fs::path& path) {
+    int fd{open(path.c_str(), O_RDONLY | O_CLOEXEC)};
+    if (fd == -1) {
+        return std::nullopt;
+    }
+    struct stat info{};
+    if (fstat(fd, &info) == -1) {
+        close(fd);
+        return std::nullopt;
+    }
+    auto size{(std::size_t)info.st_size};
+    if (size == 0) {
+        close(fd);
+        return SongTags{};
+    }
+    void* map{mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0)};
+    close(fd);
+    if (map == MAP_FAILED) {
+        return std::nullopt;
+    }
+    // Tags sit at either end of the file, so don't let the kernel read ahead into the audio
+    madvise(map, size, MADV_RANDOM);
+    Bytes data{(const unsigned char*)map, size};
+    SongTags tags{};
+    std::size_t audioStart{std::min(parseId3v2(data, tags), size)};
+    Bytes audio{data.subspan(audioStart)};
+    if (startsWith(audio, "fLaC")) {
+        parseFlac(audio, tags);
+    } else if (startsWith(audio, "OggS")) {
+        parseOgg(audio, tags);
+    } else if (startsWith(audio, "RIFF") && audio.size() >= 12 && asText(audio.subspan(8, 4)) == "WAVE") {
+        parseRiff(audio, tags);
+    }
+    parseId3v1(data, tags);
+    munmap(map, size);
+    return tags;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <filesystem>
+#include <optional>
+#include <string>
+
+struct SongTags {
+    std::string artist{};
+    std::string album{};
+    std::string title{};
+    std::string genre{};
+    int track{0}; // 0 when unknown
+    int year{0};
+};
+
+// Reads ID3v2, ID3v1, FLAC and Ogg Vorbis comments, and RIFF INFO chunks. Returns nullopt if the file can't
+// be read, and empty tags if it has none we understand.
+std::optional<SongTags> parseTags(const std::filesystem::path& path);
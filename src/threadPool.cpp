@@ -0,0 +1,74 @@
+#include "threadPool.hpp"
+#include <pthread.h>
+#include <sys/resource.h>
+
+ThreadPool::ThreadPool(std::size_t numThreads, bool background) {
+    for (std::size_t i{0}; i < numThreads; ++i) {
+        mWorkers.emplace_back(&ThreadPool::work, this, background);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard lock{mMutex};
+        mStopping = true;
+        mJobs.clear();
+    }
+    mJobAvailable.notify_all();
+    for (auto& worker : mWorkers) {
+        worker.join();
+    }
+}
+
+void ThreadPool::submit(std::function<void()> job) {
+    {
+        std::lock_guard lock{mMutex};
+        mJobs.push_back(std::move(job));
+    }
+    mJobAvailable.notify_one();
+}
+
+void ThreadPool::cancel() {
+    std::lock_guard lock{mMutex};
+    mJobs.clear();
+    if (mRunning == 0) {
+        mIdle.notify_all();
+    }
+}
+
+void ThreadPool::wait() {
+    std::unique_lock lock{mMutex};
+    mIdle.wait(lock, [this] { return mJobs.empty() && mRunning == 0; });
+}
+
+std::size_t ThreadPool::pending() const {
+    std::lock_guard lock{mMutex};
+    return mJobs.size() + mRunning;
+}
+
+std::size_t ThreadPool::size() const { return mWorkers.size(); }
+
+void ThreadPool::work(bool background) {
+    if (background) {
+        sched_param param{};
+        pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+        setpriority(PRIO_PROCESS, 0, 19); // in case SCHED_IDLE isn't allowed, on Linux this is per thread
+    }
+    std::unique_lock lock{mMutex};
+    while (true) {
+        mJobAvailable.wait(lock, [this] { return mStopping || !mJobs.empty(); });
+        if (mStopping) {
+            return;
+        }
+        std::function<void()> job{std::move(mJobs.front())};
+        mJobs.pop_front();
+        ++mRunning;
+        lock.unlock();
+        job();
+        lock.lock();
+        --mRunning;
+        if (mRunning == 0 && mJobs.empty()) {
+            mIdle.notify_all();
+        }
+    }
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs jobs on a fixed set of threads. Background pools run at idle priority so they only get CPU time
+// nothing else wants, which keeps them from starving the decode and audio threads.
+class ThreadPool {
+public:
+    explicit ThreadPool(std::size_t numThreads, bool background = false);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    void submit(std::function<void()> job);
+    // Drops jobs that haven't started yet
+    void cancel();
+    // Blocks until every submitted job has finished
+    void wait();
+    std::size_t pending() const;
+    std::size_t size() const;
+
+private:
+    void work(bool background);
+
+    std::vector<std::thread> mWorkers{};
+    std::deque<std::function<void()>> mJobs{};
+    mutable std::mutex mMutex{};
+    std::condition_variable mJobAvailable{};
+    std::condition_variable mIdle{};
+    std::size_t mRunning{0};
+    bool mStopping{false};
+};
@@ -1,6 +1,11 @@
 #include "threads.hpp"
+#include "history.hpp"
 #include "input.hpp"
+#include "jobs.hpp"
 #include "statMusic.hpp"
+#include "supervisor.hpp"
+#include <algorithm>
+#include <mutex>
 #include <string>
 #include <thread>
 
@@ -9,14 +14,57 @@ namespace Threads {
     bool running{true};
     bool readyForInput{true};
     bool helpMode{false};
+    Answer autoAnswer{Answer::Ask};
+    std::atomic<int> errorCount{0};
+    thread_local FILE* output{stdout};
 } // namespace Threads
 
+static std::mutex stateMutex{};
+static thread_local int lockDepth{0};
+
+StateLock::StateLock() {
+    if (lockDepth++ == 0) {
+        stateMutex.lock();
+    }
+}
+
+StateLock::~StateLock() {
+    if (--lockDepth == 0) {
+        stateMutex.unlock();
+    }
+}
+
+StateUnlock::StateUnlock() : mDepth{lockDepth} {
+    if (mDepth > 0) {
+        lockDepth = 0;
+        stateMutex.unlock();
+    }
+}
+
+StateUnlock::~StateUnlock() {
+    if (mDepth > 0) {
+        stateMutex.lock();
+        lockDepth = mDepth;
+    }
+}
+
 void runThreads() {
+    // Leave a core for playback, slow commands mostly wait on the disk anyway
+    Jobs::start(std::max(2u, std::thread::hardware_concurrency()) - 1);
+    Jobs::catchInterrupts();
+    History::load();
     std::thread statThreadObj{monitorChanges};
+    std::thread supervisorThreadObj{supervisorThread};
+    std::thread interruptThreadObj{Jobs::watchInterrupts};
     std::thread backgroundThreadObj{backgroundThread};
     std::thread inputThreadObj{inputThread};
 
     statThreadObj.join();
     inputThreadObj.join();
     backgroundThreadObj.join();
+    stopSupervisor();
+    supervisorThreadObj.join();
+    interruptThreadObj.join();
+    Jobs::stop();
+    History::stop();
 }
@@ -1,12 +1,43 @@
 #pragma once
 
 #include <SFML/Audio/Music.hpp>
+#include <atomic>
+#include <cstdio>
 #include <string>
+enum class Answer { Ask, Yes, No, Default };
 namespace Threads {
     extern std::string userInput;
     extern bool running;
     extern bool readyForInput;
     extern bool helpMode;
+    extern Answer autoAnswer;
+    extern std::atomic<int> errorCount; // printError can be called from any thread
+    // Where commands print to. A daemon client or a JSON batch line gets a buffer of its own on the thread
+    // that runs it, so nothing the other threads print at the same time can end up in the response.
+    extern thread_local FILE* output;
 } // namespace Threads
 
+// Held while anything reads or changes what's playing, so commands and playback supervision take turns.
+// Nests, since commands can run other commands.
+class StateLock {
+public:
+    StateLock();
+    ~StateLock();
+    StateLock(const StateLock&) = delete;
+    StateLock& operator=(const StateLock&) = delete;
+};
+
+// Lets go of the state for a while if this thread holds it, e.g. so the playlist keeps advancing while a
+// command waits for the user to answer
+class StateUnlock {
+public:
+    StateUnlock();
+    ~StateUnlock();
+    StateUnlock(const StateUnlock&) = delete;
+    StateUnlock& operator=(const StateUnlock&) = delete;
+
+private:
+    int mDepth{0};
+};
+
 void runThreads();
@@ -0,0 +1,174 @@
+#include "timeStretch.hpp"
+#include "simd.hpp"
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <limits>
+#include <numbers>
+
+static constexpr unsigned int windowsPerSecond{40}; // so each is about 25 ms, whatever the sample rate
+static constexpr std::size_t compactAfter{8};       // windows of stale input kept before dropping them
+
+// Two sums so each addition doesn't have to wait for the one before
+static float dot(const float* a, const float* b, std::size_t count) {
+    Vec4 even{};
+    Vec4 odd{};
+    std::size_t i{0};
+    for (; i + 2 * lanes <= count; i += 2 * lanes) {
+        even += load(a + i) * load(b + i);
+        odd += load(a + i + lanes) * load(b + i + lanes);
+    }
+    for (; i + lanes <= count; i += lanes) {
+        even += load(a + i) * load(b + i);
+    }
+    Vec4 sum{even + odd};
+    float total{sum[0] + sum[1] + sum[2] + sum[3]};
+    for (; i < count; ++i) {
+        total += a[i] * b[i];
+    }
+    return total;
+}
+
+void TimeStretcher::reset(unsigned int channels, unsigned int sampleRate, double speed,
+                          std::uint64_t trackFrame) {
+    mChannels = std::max(1u, channels);
+    mWindow = std::max<std::size_t>(64, std::bit_floor(std::max(1u, sampleRate / windowsPerSecond)));
+    mHop = mWindow / 2;
+    mSearch = mWindow / 4;
+    mSpeed = speed;
+    mShape.resize(mWindow);
+    for (std::size_t n{0}; n < mWindow; ++n) {
+        mShape[n] = (float)(0.5 - 0.5 * std::cos(2 * std::numbers::pi * (double)n / (double)mWindow));
+    }
+    restart(trackFrame);
+}
+
+void TimeStretcher::restart(std::uint64_t trackFrame) {
+    mInput.clear();
+    mMono.clear();
+    mOverlap.assign(mWindow * mChannels, 0);
+    mReady.clear();
+    mReadyPos = 0;
+    mInputStart = trackFrame;
+    mStart = trackFrame;
+    mWindows = 0;
+    mPrevious = trackFrame;
+    mPulled = 0;
+    mFinished = false;
+    mDrained = false;
+}
+
+std::uint64_t TimeStretcher::trackFrame() const {
+    return mStart + (std::uint64_t)std::llround((double)mPulled * mSpeed);
+}
+
+void TimeStretcher::push(const std::int16_t* samples, std::size_t frames) {
+    for (std::size_t frame{0}; frame < frames; ++frame) {
+        float sum{0};
+        for (unsigned int c{0}; c < mChannels; ++c) {
+            float sample{(float)samples[frame * mChannels + c] / 32768};
+            mInput.push_back(sample);
+            sum += sample;
+        }
+        mMono.push_back(sum / (float)mChannels);
+    }
+}
+
+void TimeStretcher::finish() { mFinished = true; }
+
+std::size_t TimeStretcher::pull(std::int16_t* out, std::size_t maxFrames) {
+    std::size_t done{0};
+    while (done < maxFrames) {
+        if (mReadyPos == mReady.size()) {
+            mReady.clear();
+            mReadyPos = 0;
+            if (mDrained || !step()) {
+                break;
+            }
+            continue;
+        }
+        std::size_t frames{std::min(maxFrames - done, (mReady.size() - mReadyPos) / mChannels)};
+        for (std::size_t i{0}; i < frames * mChannels; ++i) {
+            out[done * mChannels + i] =
+                (std::int16_t)std::clamp(std::lround(mReady[mReadyPos + i] * 32768), -32768l, 32767l);
+        }
+        mReadyPos += frames * mChannels;
+        done += frames;
+    }
+    mPulled += done;
+    return done;
+}
+
+// The window near ideal whose start looks most like target, where the last window would have carried on.
+// Scored by correlation over the part that overlaps, scaled by the candidate's energy so loud passages
+// don't win just for being loud.
+std::uint64_t TimeStretcher::bestStart(std::uint64_t ideal, std::uint64_t target) const {
+    std::uint64_t end{inputEnd()};
+    if (target < mInputStart || target + mHop > end) {
+        return ideal;
+    }
+    std::uint64_t first{std::max(ideal > mSearch ? ideal - mSearch : 0, mInputStart)};
+    std::uint64_t last{std::min(ideal + mSearch, end - mHop)};
+    if (first > last) {
+        return ideal;
+    }
+    const float* wanted{&mMono[target - mInputStart]};
+    const float* candidate{&mMono[first - mInputStart]};
+    float energy{dot(candidate, candidate, mHop)};
+    std::uint64_t best{ideal};
+    float bestScore{-std::numeric_limits<float>::infinity()};
+    for (std::uint64_t start{first}; start <= last; ++start, ++candidate) {
+        float score{dot(candidate, wanted, mHop) / std::sqrt(energy + 1e-9f)};
+        if (score > bestScore) {
+            bestScore = score;
+            best = start;
+        }
+        if (start < last) {
+            energy = std::max(0.0f, energy + candidate[mHop] * candidate[mHop] - candidate[0] * candidate[0]);
+        }
+    }
+    return best;
+}
+
+// Adds one more window to the output, false if that needs more input first
+bool TimeStretcher::step() {
+    auto idealAt{[this](std::uint64_t window) {
+        return mStart + (std::uint64_t)std::llround((double)(window * mHop) * mSpeed);
+    }};
+    std::uint64_t ideal{idealAt(mWindows)};
+    if (mFinished && ideal >= inputEnd()) {
+        // There's nothing left to take windows from, so let the last one fade out
+        mReady.assign(mOverlap.begin(), mOverlap.begin() + (std::ptrdiff_t)(mHop * mChannels));
+        mDrained = true;
+        return true;
+    }
+    std::uint64_t target{mPrevious + mHop};
+    if (!mFinished && inputEnd() < std::max(ideal + mSearch + mWindow, target + mHop)) {
+        return false;
+    }
+    std::uint64_t start{mWindows == 0 ? ideal : bestStart(ideal, target)};
+    std::uint64_t end{inputEnd()};
+    std::size_t available{(std::size_t)std::min<std::uint64_t>(mWindow, end - std::min(start, end))};
+    const float* in{mInput.data() + (start - mInputStart) * mChannels};
+    for (std::size_t frame{0}; frame < available; ++frame) {
+        for (unsigned int c{0}; c < mChannels; ++c) {
+            mOverlap[frame * mChannels + c] += in[frame * mChannels + c] * mShape[frame];
+        }
+    }
+    auto hopSamples{(std::ptrdiff_t)(mHop * mChannels)};
+    mReady.assign(mOverlap.begin(), mOverlap.begin() + hopSamples);
+    std::copy(mOverlap.begin() + hopSamples, mOverlap.end(), mOverlap.begin());
+    std::fill(mOverlap.end() - hopSamples, mOverlap.end(), 0.0f);
+    mPrevious = start;
+    ++mWindows;
+    // Drop the input nothing will look at again, a few windows at a time
+    std::uint64_t next{idealAt(mWindows)};
+    std::uint64_t keepFrom{std::min(next > mSearch ? next - mSearch : 0, mPrevious + mHop)};
+    if (keepFrom > mInputStart + compactAfter * mWindow) {
+        std::size_t drop{(std::size_t)std::min<std::uint64_t>(keepFrom - mInputStart, mMono.size())};
+        mMono.erase(mMono.begin(), mMono.begin() + (std::ptrdiff_t)drop);
+        mInput.erase(mInput.begin(), mInput.begin() + (std::ptrdiff_t)(drop * mChannels));
+        mInputStart += drop;
+    }
+    return true;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Changes tempo without changing pitch using WSOLA: overlapping windows of the input are added back together
+// at a different spacing, each one taken from wherever near its ideal position lines up best with the end of
+// the window before it, so the waveform carries on smoothly. Used by the decode thread, one song at a time.
+class TimeStretcher {
+public:
+    // Forgets any input and output, and starts again from trackFrame
+    void reset(unsigned int channels, unsigned int sampleRate, double speed, std::uint64_t trackFrame);
+    void restart(std::uint64_t trackFrame);
+    bool isStretching() const { return mSpeed != 1; }
+    double speed() const { return mSpeed; }
+    // Where in the song the next frame pulled comes from
+    std::uint64_t trackFrame() const;
+    void push(const std::int16_t* samples, std::size_t frames);
+    // There's no more input, so the rest is played out against silence
+    void finish();
+    // Up to maxFrames frames, 0 if it needs more input or is drained
+    std::size_t pull(std::int16_t* out, std::size_t maxFrames);
+    bool drained() const { return mDrained && mReadyPos == mReady.size(); }
+
+private:
+    bool step();
+    std::uint64_t bestStart(std::uint64_t ideal, std::uint64_t target) const;
+    std::uint64_t inputEnd() const { return mInputStart + mMono.size(); }
+
+    unsigned int mChannels{2};
+    std::size_t mWindow{1024};
+    std::size_t mHop{512};    // frames of output per window, half of it so the windows add up to 1
+    std::size_t mSearch{256}; // how far either side of its ideal position a window can be taken from
+    double mSpeed{1};
+    std::vector<float> mShape{};   // Hann
+    std::vector<float> mInput{};   // interleaved, from mInputStart on
+    std::vector<float> mMono{};    // what windows are lined up with
+    std::vector<float> mOverlap{}; // interleaved, the output still being added to
+    std::vector<float> mReady{};   // interleaved, finished output
+    std::size_t mReadyPos{0};
+    std::uint64_t mInputStart{0};
+    std::uint64_t mStart{0};
+    std::uint64_t mWindows{0};   // added since the restart
+    std::uint64_t mPrevious{0};  // where the last window was taken from
+    std::uint64_t mPulled{0};    // frames since the restart
+    bool mFinished{false};
+    bool mDrained{false};
+};
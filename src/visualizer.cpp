@@ -0,0 +1,479 @@
+#include "visualizer.hpp"
+#include "dspChain.hpp"
+#include "music.hpp"
+#include "simd.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <format>
+#include <mutex>
+#include <numbers>
+#include <string>
+#include <string_view>
+#include <sys/ioctl.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+static constexpr std::size_t fftSize{2048};         // real samples, about 46 ms at 44.1 kHz
+static constexpr std::size_t halfSize{fftSize / 2}; // complex points the FFT actually runs on
+static constexpr std::size_t ringFrames{16384};     // a power of two, so the index wraps cheaply
+static constexpr auto frameInterval{std::chrono::microseconds{1'000'000 / 30}};
+static constexpr std::size_t spectrumRows{2};
+static constexpr std::size_t rows{spectrumRows + 1}; // the peak meters go underneath
+static constexpr std::size_t levelsPerRow{8};
+static constexpr double lowestFrequency{40};
+static constexpr double highestFrequency{16'000};
+static constexpr float spectrumFloor{-72}; // dB relative to a full scale sine
+static constexpr float meterFloor{-48};    // dBFS
+static constexpr float levelFall{0.6f};    // per frame, so bars fall smoothly rather than flickering
+static constexpr float peakFall{0.4f};     // dB per frame
+static constexpr std::size_t meterLabelWidth{2};
+static constexpr std::size_t meterTextWidth{8};
+
+static constexpr std::array<std::string_view, levelsPerRow + 1> verticalBlocks{
+    " ", "▁", "▂", "▃", "▄", "▅", "▆", "▇", "█"};
+static constexpr std::array<std::string_view, levelsPerRow + 1> horizontalBlocks{
+    " ", "▏", "▎", "▍", "▌", "▋", "▊", "▉", "█"};
+static const std::array<char, 128> asciiCells{[] {
+    std::array<char, 128> cells{};
+    for (std::size_t c{0}; c < cells.size(); ++c) {
+        cells[c] = (char)c;
+    }
+    return cells;
+}()};
+
+// Frames go in from the audio thread and out to the visualizer thread, always as two channels. The writer
+// never waits: it overwrites the oldest frames, and says which ones it's about to overwrite first, so the
+// reader can tell afterwards whether anything it copied changed underneath it.
+class SampleRing {
+public:
+    void push(const float* frames, unsigned int count, unsigned int channels) {
+        std::uint64_t start{mWritten.load(std::memory_order_relaxed)};
+        mWriting.store(start + count, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        unsigned int right{channels > 1 ? 1u : 0u};
+        for (unsigned int i{0}; i < count; ++i) {
+            std::size_t slot{(std::size_t)((start + i) & (ringFrames - 1)) * 2};
+            std::atomic_ref{mSamples[slot]}.store(frames[i * channels], std::memory_order_relaxed);
+            std::atomic_ref{mSamples[slot + 1]}.store(frames[i * channels + right],
+                                                      std::memory_order_relaxed);
+        }
+        mWritten.store(start + count, std::memory_order_release);
+    }
+    std::uint64_t written() const { return mWritten.load(std::memory_order_acquire); }
+    // The count frames before end, false if they're not all there any more
+    bool copy(std::uint64_t end, std::size_t count, float* out) {
+        if (end < count) {
+            return false;
+        }
+        for (std::size_t i{0}; i < count; ++i) {
+            std::size_t slot{(std::size_t)((end - count + i) & (ringFrames - 1)) * 2};
+            out[2 * i] = std::atomic_ref{mSamples[slot]}.load(std::memory_order_relaxed);
+            out[2 * i + 1] = std::atomic_ref{mSamples[slot + 1]}.load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return mWriting.load(std::memory_order_relaxed) - (end - count) <= ringFrames;
+    }
+
+private:
+    std::array<float, ringFrames * 2> mSamples{};
+    alignas(64) std::atomic<std::uint64_t> mWritten{0};
+    alignas(64) std::atomic<std::uint64_t> mWriting{0};
+};
+
+struct FftTables {
+    std::array<float, fftSize> window{};
+    std::array<std::uint16_t, halfSize> bitReversed{};
+    // For the stage combining transforms of size h, the twiddles are at [h, 2h)
+    alignas(16) std::array<float, halfSize> twiddleRe{};
+    alignas(16) std::array<float, halfSize> twiddleIm{};
+    // Turn the half size complex transform back into the spectrum of the real signal
+    std::array<float, halfSize> splitRe{};
+    std::array<float, halfSize> splitIm{};
+};
+
+static const FftTables tables{[] {
+    FftTables t{};
+    for (std::size_t n{0}; n < fftSize; ++n) {
+        t.window[n] = (float)(0.5 - 0.5 * std::cos(2 * std::numbers::pi * (double)n / fftSize));
+    }
+    std::size_t bits{(std::size_t)std::countr_zero(halfSize)};
+    for (std::size_t n{0}; n < halfSize; ++n) {
+        std::size_t reversed{0};
+        for (std::size_t b{0}; b < bits; ++b) {
+            reversed |= ((n >> b) & 1) << (bits - 1 - b);
+        }
+        t.bitReversed[n] = (std::uint16_t)reversed;
+    }
+    for (std::size_t half{1}; half < halfSize; half *= 2) {
+        for (std::size_t j{0}; j < half; ++j) {
+            double angle{-std::numbers::pi * (double)j / (double)half};
+            t.twiddleRe[half + j] = (float)std::cos(angle);
+            t.twiddleIm[half + j] = (float)std::sin(angle);
+        }
+    }
+    for (std::size_t k{0}; k < halfSize; ++k) {
+        double angle{-2 * std::numbers::pi * (double)k / fftSize};
+        t.splitRe[k] = (float)std::cos(angle);
+        t.splitIm[k] = (float)std::sin(angle);
+    }
+    return t;
+}()};
+
+// Everything below up to the thread's own state is only touched by the visualizer thread
+static SampleRing ring{};
+alignas(16) static std::array<float, fftSize * 2> frames{};
+alignas(16) static std::array<float, halfSize> fftRe{};
+alignas(16) static std::array<float, halfSize> fftIm{};
+alignas(16) static std::array<float, halfSize> spectrumRe{};
+alignas(16) static std::array<float, halfSize> spectrumIm{};
+alignas(16) static std::array<float, halfSize> power{};
+static std::vector<std::pair<std::size_t, std::size_t>> bandBins{};
+static unsigned int bandRate{0};
+static std::vector<float> levels{}; // per column, 0 to spectrumRows * levelsPerRow
+static std::array<float, 2> peaks{meterFloor, meterFloor};
+static std::uint64_t lastWritten{0};
+static std::vector<std::string_view> cells{};
+static std::vector<std::string_view> shown{}; // what's on screen, empty views for cells that need drawing
+static std::size_t screenWidth{0};
+static std::size_t screenHeight{0};
+
+static std::mutex wakeMutex{};
+static std::condition_variable wake{};
+static bool stopping{false}; // guarded by wakeMutex
+static std::thread thread{};
+static std::atomic<bool> running{false};
+
+static std::mutex statsMutex{};
+static VisualizerStats totals{};
+static Clock::time_point startedAt{};
+
+// Radix 2 decimation in time over input that's already in bit reversed order
+static void transform(float* re, float* im) {
+    // The first two stages only multiply by 1 and -i, and are too narrow to fill a vector, so they're done
+    // together
+    for (std::size_t k{0}; k < halfSize; k += 4) {
+        float sumRe0{re[k] + re[k + 1]}, sumIm0{im[k] + im[k + 1]};
+        float diffRe0{re[k] - re[k + 1]}, diffIm0{im[k] - im[k + 1]};
+        float sumRe1{re[k + 2] + re[k + 3]}, sumIm1{im[k + 2] + im[k + 3]};
+        float diffRe1{re[k + 2] - re[k + 3]}, diffIm1{im[k + 2] - im[k + 3]};
+        re[k] = sumRe0 + sumRe1;
+        im[k] = sumIm0 + sumIm1;
+        re[k + 2] = sumRe0 - sumRe1;
+        im[k + 2] = sumIm0 - sumIm1;
+        re[k + 1] = diffRe0 + diffIm1;
+        im[k + 1] = diffIm0 - diffRe1;
+        re[k + 3] = diffRe0 - diffIm1;
+        im[k + 3] = diffIm0 + diffRe1;
+    }
+    for (std::size_t half{4}; half < halfSize; half *= 2) {
+        for (std::size_t base{0}; base < halfSize; base += 2 * half) {
+            for (std::size_t j{0}; j < half; j += lanes) {
+                Vec4 wRe{load(&tables.twiddleRe[half + j])};
+                Vec4 wIm{load(&tables.twiddleIm[half + j])};
+                float* topRe{re + base + j};
+                float* topIm{im + base + j};
+                Vec4 bRe{load(topRe + half)};
+                Vec4 bIm{load(topIm + half)};
+                Vec4 tRe{bRe * wRe - bIm * wIm};
+                Vec4 tIm{bRe * wIm + bIm * wRe};
+                Vec4 aRe{load(topRe)};
+                Vec4 aIm{load(topIm)};
+                store(topRe, aRe + tRe);
+                store(topIm, aIm + tIm);
+                store(topRe + half, aRe - tRe);
+                store(topIm + half, aIm - tIm);
+            }
+        }
+    }
+}
+
+// Log spaced, one per column, each covering at least one bin
+static void layOutBands(std::size_t count, unsigned int rate) {
+    bandBins.resize(count);
+    double top{std::min(highestFrequency, rate / 2.0)};
+    double binWidth{(double)rate / fftSize};
+    for (std::size_t band{0}; band < count; ++band) {
+        double low{lowestFrequency * std::pow(top / lowestFrequency, (double)band / (double)count)};
+        double high{lowestFrequency * std::pow(top / lowestFrequency, (double)(band + 1) / (double)count)};
+        auto first{std::clamp<std::size_t>((std::size_t)(low / binWidth), 1, halfSize - 1)};
+        auto last{std::clamp<std::size_t>((std::size_t)(high / binWidth), first + 1, halfSize)};
+        bandBins[band] = {first, last};
+    }
+    bandRate = rate;
+}
+
+// false if the audio couldn't be copied out in one piece
+static bool analyse(std::uint64_t written, unsigned int rate) {
+    if (!ring.copy(written, fftSize, frames.data())) {
+        return false;
+    }
+    // Peaks of the frames that arrived since the last frame, two frames per vector
+    std::size_t fresh{(std::size_t)std::min<std::uint64_t>(written - lastWritten, fftSize)};
+    Vec4 peak{};
+    for (std::size_t i{(fftSize - fresh) / 2 * 4}; i < frames.size(); i += lanes) {
+        peak = vecMax(peak, vecAbs(load(&frames[i])));
+    }
+    for (std::size_t c{0}; c < peaks.size(); ++c) {
+        float newPeak{std::max(peak[c], peak[c + 2])};
+        float db{newPeak > 0 ? 20 * std::log10(newPeak) : meterFloor};
+        peaks[c] = std::max(db, peaks[c] - peakFall);
+    }
+    // Even samples go in the real part and odd ones in the imaginary part, so a real signal only needs a
+    // transform half its size
+    for (std::size_t n{0}; n < halfSize; ++n) {
+        std::size_t to{tables.bitReversed[n]};
+        fftRe[to] = (frames[4 * n] + frames[4 * n + 1]) * 0.5f * tables.window[2 * n];
+        fftIm[to] = (frames[4 * n + 2] + frames[4 * n + 3]) * 0.5f * tables.window[2 * n + 1];
+    }
+    transform(fftRe.data(), fftIm.data());
+    for (std::size_t k{0}; k < halfSize; ++k) {
+        std::size_t mirror{(halfSize - k) & (halfSize - 1)};
+        float evenRe{(fftRe[k] + fftRe[mirror]) * 0.5f};
+        float evenIm{(fftIm[k] - fftIm[mirror]) * 0.5f};
+        float oddRe{(fftIm[k] + fftIm[mirror]) * 0.5f};
+        float oddIm{(fftRe[mirror] - fftRe[k]) * 0.5f};
+        spectrumRe[k] = evenRe + oddRe * tables.splitRe[k] - oddIm * tables.splitIm[k];
+        spectrumIm[k] = evenIm + oddRe * tables.splitIm[k] + oddIm * tables.splitRe[k];
+    }
+    // A full scale sine comes out at a quarter of the transform size, after the window
+    float scale{16.0f / (float)(fftSize * fftSize)};
+    for (std::size_t k{0}; k < halfSize; k += lanes) {
+        Vec4 re{load(&spectrumRe[k])};
+        Vec4 im{load(&spectrumIm[k])};
+        store(&power[k], (re * re + im * im) * scale);
+    }
+    if (bandRate != rate) {
+        layOutBands(levels.size(), rate);
+    }
+    auto top{(float)(spectrumRows * levelsPerRow)};
+    for (std::size_t band{0}; band < levels.size(); ++band) {
+        auto [first, last]{bandBins[band]};
+        float loudest{*std::max_element(&power[first], &power[last - 1] + 1)};
+        float db{loudest > 0 ? 10 * std::log10(loudest) : spectrumFloor};
+        float level{std::clamp((db - spectrumFloor) / -spectrumFloor * top, 0.0f, top)};
+        levels[band] = std::max(level, levels[band] - levelFall);
+    }
+    return true;
+}
+
+static void settle() {
+    for (float& level : levels) {
+        level = std::max(0.0f, level - levelFall);
+    }
+    for (float& peak : peaks) {
+        peak = std::max(meterFloor, peak - peakFall);
+    }
+}
+
+static std::string_view ascii(char c) { return {&asciiCells[(unsigned char)c & 0x7f], 1}; }
+
+static void drawMeter(std::size_t column, std::size_t width, char label, float db) {
+    if (width < meterLabelWidth + meterTextWidth + 1) {
+        return;
+    }
+    std::string_view* row{&cells[(rows - 1) * screenWidth + column]};
+    row[0] = ascii(label);
+    row[1] = ascii(' ');
+    std::size_t barWidth{width - meterLabelWidth - meterTextWidth - 1};
+    float filled{std::clamp((db - meterFloor) / -meterFloor, 0.0f, 1.0f) * (float)barWidth};
+    for (std::size_t i{0}; i < barWidth; ++i) {
+        float eighths{std::clamp((filled - (float)i) * (float)levelsPerRow, 0.0f, (float)levelsPerRow)};
+        row[meterLabelWidth + i] = horizontalBlocks[(std::size_t)eighths];
+    }
+    std::string text{db <= meterFloor ? std::format(" {:>4} dB", "--") : std::format(" {:>4.0f} dB", db)};
+    for (std::size_t i{0}; i < meterTextWidth && i < text.size(); ++i) {
+        row[meterLabelWidth + barWidth + i] = ascii(text[i]);
+    }
+}
+
+static void render() {
+    std::ranges::fill(cells, ascii(' '));
+    for (std::size_t column{0}; column < levels.size(); ++column) {
+        auto level{(std::size_t)levels[column]};
+        for (std::size_t row{0}; row < spectrumRows; ++row) {
+            std::size_t below{(spectrumRows - 1 - row) * levelsPerRow};
+            std::size_t fill{std::clamp(level, below, below + levelsPerRow) - below};
+            cells[row * screenWidth + column] = verticalBlocks[fill];
+        }
+    }
+    drawMeter(0, screenWidth / 2, 'L', peaks[0]);
+    drawMeter(screenWidth / 2, screenWidth - screenWidth / 2, 'R', peaks[1]);
+}
+
+static void writeOut(const std::string& text) {
+    std::size_t done{0};
+    while (done < text.size()) {
+        ssize_t count{::write(STDOUT_FILENO, text.data() + done, text.size() - done)};
+        if (count <= 0) {
+            break;
+        }
+        done += (std::size_t)count;
+    }
+    std::lock_guard lock{statsMutex};
+    totals.bytesWritten += done;
+}
+
+// Only the runs of cells that changed, each preceded by a jump to where it starts. The cursor is put back
+// where it was afterwards, so whatever's being typed at the prompt carries on.
+static void drawChanges() {
+    std::string out{};
+    for (std::size_t row{0}; row < rows; ++row) {
+        bool inRun{false};
+        for (std::size_t column{0}; column < screenWidth; ++column) {
+            std::size_t i{row * screenWidth + column};
+            if (cells[i] == shown[i]) {
+                inRun = false;
+                continue;
+            }
+            if (!inRun) {
+                out += std::format("\033[{};{}H", row + 1, column + 1);
+                inRun = true;
+            }
+            out += cells[i];
+            shown[i] = cells[i];
+        }
+    }
+    if (out.empty()) {
+        return;
+    }
+    writeOut("\0337" + out + "\0338");
+    std::lock_guard lock{statsMutex};
+    ++totals.frames;
+}
+
+static std::string clearRows() {
+    std::string out{};
+    for (std::size_t row{1}; row <= rows; ++row) {
+        out += std::format("\033[{};1H\033[2K", row);
+    }
+    return out;
+}
+
+// Keeps the scrolling region below the rows we draw on, and starts drawing again from scratch
+static void resize(std::size_t width, std::size_t height) {
+    screenWidth = width;
+    screenHeight = height;
+    cells.assign(rows * width, ascii(' '));
+    shown.assign(rows * width, {});
+    levels.assign(width, 0);
+    bandRate = 0;
+    writeOut(std::format("\0337\033[{};{}r{}\0338", rows + 1, height, clearRows()));
+}
+
+static std::pair<std::size_t, std::size_t> terminalSize() {
+    winsize size{};
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == -1) {
+        return {0, 0};
+    }
+    return {size.ws_col, size.ws_row};
+}
+
+static void drawFrame() {
+    auto [width, height]{terminalSize()};
+    if (height <= rows || width == 0) {
+        return;
+    }
+    if (width != screenWidth || height != screenHeight) {
+        resize(width, height);
+    }
+    std::uint64_t written{ring.written()};
+    unsigned int rate{Music::music.getStreamRate()};
+    if (written == lastWritten || rate == 0 || !analyse(written, rate)) {
+        settle(); // paused or stopped, so everything drops back down and then nothing more gets drawn
+    }
+    lastWritten = written;
+    render();
+    drawChanges();
+}
+
+static void visualizerThread() {
+    Clock::time_point next{Clock::now()};
+    std::unique_lock lock{wakeMutex};
+    while (!stopping) {
+        lock.unlock();
+        drawFrame();
+        timespec cpu{};
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+        {
+            std::lock_guard statsLock{statsMutex};
+            totals.cpuTime = std::chrono::seconds{cpu.tv_sec} + std::chrono::nanoseconds{cpu.tv_nsec};
+        }
+        lock.lock();
+        // After a stall, carry on from now rather than drawing frames back to back to catch up
+        next = std::max(next + frameInterval, Clock::now());
+        wake.wait_until(lock, next, [] { return stopping; });
+    }
+}
+
+// Runs on the audio thread, so it mustn't lock or allocate
+static void tap(const float* frames, unsigned int frameCount, unsigned int channels) {
+    if (channels > 0) {
+        ring.push(frames, frameCount, channels);
+    }
+}
+
+namespace Visualizer {
+    bool start() {
+        if (running) {
+            return true;
+        }
+        auto [width, height]{terminalSize()};
+        if (!isatty(STDOUT_FILENO) || height <= rows + 1 || width == 0) {
+            return false;
+        }
+        std::fflush(stdout);
+        // Scroll whatever's on the top rows up out of the way first, from the bottom so nothing's lost
+        writeOut(std::format("\033[{};1H{}", height, std::string(rows, '\n')));
+        screenWidth = 0;
+        screenHeight = 0;
+        lastWritten = ring.written();
+        std::ranges::fill(peaks, meterFloor);
+        {
+            std::lock_guard lock{statsMutex};
+            totals = {};
+            startedAt = Clock::now();
+        }
+        stopping = false;
+        DspChain::setTap(tap);
+        thread = std::thread{visualizerThread};
+        running = true;
+        return true;
+    }
+
+    void stop() {
+        if (!running) {
+            return;
+        }
+        DspChain::setTap(nullptr);
+        {
+            std::lock_guard lock{wakeMutex};
+            stopping = true;
+        }
+        wake.notify_one();
+        thread.join();
+        running = false;
+        std::fflush(stdout);
+        writeOut(std::format("\0337\033[r{}\0338", clearRows()));
+    }
+
+    bool isRunning() { return running; }
+
+    std::size_t reservedRows() { return running ? rows : 0; }
+
+    VisualizerStats stats() {
+        std::lock_guard lock{statsMutex};
+        VisualizerStats current{totals};
+        current.running = running ? Clock::now() - startedAt : std::chrono::nanoseconds{};
+        return current;
+    }
+} // namespace Visualizer
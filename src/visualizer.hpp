@@ -0,0 +1,25 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+
+struct VisualizerStats {
+    std::size_t frames{};       // frames that changed something on screen
+    std::size_t bytesWritten{}; // to the terminal, escape sequences included
+    std::chrono::nanoseconds cpuTime{};
+    std::chrono::nanoseconds running{};
+};
+
+// Draws a spectrum and peak meters for whatever's playing on the top lines of the terminal, which are taken
+// out of the scrolling region so the prompt and anything commands print carry on underneath. The audio is
+// copied from the end of the DSP chain into a ring that never blocks the audio thread, and everything else
+// happens on a thread of its own, which only writes the cells that changed.
+namespace Visualizer {
+    // false if there's no terminal to draw on
+    bool start();
+    void stop();
+    bool isRunning();
+    // How many lines at the top of the terminal it's using, 0 while it's off
+    std::size_t reservedRows();
+    VisualizerStats stats();
+} // namespace Visualizer
@@ -0,0 +1,120 @@
+#include "weightedSampler.hpp"
+#include <algorithm>
+#include <cmath>
+
+static constexpr std::size_t minBlockSize{64};
+static constexpr std::size_t rangesKept{8};
+
+// Vose's construction, which is linear and doesn't lose accuracy to repeated subtraction
+void WeightedSampler::AliasTable::build(const double* weights, std::size_t count) {
+    mProbability.assign(count, 1);
+    mAlias.resize(count);
+    mTotal = 0;
+    for (std::size_t i{0}; i < count; ++i) {
+        mTotal += weights[i];
+        mAlias[i] = (std::uint32_t)i;
+    }
+    if (mTotal <= 0) {
+        return; // nothing has any weight, so every index is as likely as any other
+    }
+    std::vector<double> scaled(count);
+    std::vector<std::uint32_t> small{};
+    std::vector<std::uint32_t> large{};
+    for (std::size_t i{0}; i < count; ++i) {
+        scaled[i] = weights[i] * (double)count / mTotal;
+        (scaled[i] < 1 ? small : large).push_back((std::uint32_t)i);
+    }
+    while (!small.empty() && !large.empty()) {
+        std::uint32_t less{small.back()};
+        std::uint32_t more{large.back()};
+        small.pop_back();
+        mProbability[less] = (float)scaled[less];
+        mAlias[less] = more;
+        scaled[more] -= 1 - scaled[less];
+        if (scaled[more] < 1) {
+            large.pop_back();
+            small.push_back(more);
+        }
+    }
+    // Whatever's left over is 1 give or take rounding error
+}
+
+// One random number picks both the column and which of its two indices to use
+std::size_t WeightedSampler::AliasTable::sample(std::mt19937& engine) const {
+    double position{std::uniform_real_distribution<double>{0, (double)mAlias.size()}(engine)};
+    auto column{std::min((std::size_t)position, mAlias.size() - 1)};
+    return position - (double)column < mProbability[column] ? column : mAlias[column];
+}
+
+void WeightedSampler::assign(std::vector<double> weights) {
+    mWeights = std::move(weights);
+    mBlockSize = std::max(minBlockSize, (std::size_t)std::sqrt((double)mWeights.size()));
+    mBlocks.assign((mWeights.size() + mBlockSize - 1) / mBlockSize, {});
+    for (std::size_t block{0}; block < mBlocks.size(); ++block) {
+        std::size_t start{block * mBlockSize};
+        mBlocks[block].build(mWeights.data() + start, std::min(mBlockSize, mWeights.size() - start));
+    }
+    mRanges.clear();
+}
+
+void WeightedSampler::setWeight(std::size_t index, double weight) {
+    mWeights[index] = weight;
+    std::size_t block{index / mBlockSize};
+    std::size_t start{block * mBlockSize};
+    mBlocks[block].build(mWeights.data() + start, std::min(mBlockSize, mWeights.size() - start));
+    std::erase_if(mRanges, [index](const RangeTable& range) {
+        return range.first <= index && index < range.last;
+    });
+}
+
+const WeightedSampler::RangeTable& WeightedSampler::rangeTable(std::size_t first, std::size_t last) {
+    auto cached{std::ranges::find_if(mRanges, [first, last](const RangeTable& range) {
+        return range.first == first && range.last == last;
+    })};
+    if (cached != mRanges.end()) {
+        std::rotate(cached, cached + 1, mRanges.end());
+        return mRanges.back();
+    }
+    if (mRanges.size() == rangesKept) {
+        mRanges.erase(mRanges.begin());
+    }
+    RangeTable& range{mRanges.emplace_back()};
+    range.first = first;
+    range.last = last;
+    range.firstBlock = (first + mBlockSize - 1) / mBlockSize;
+    std::size_t endBlock{last / mBlockSize};
+    if (range.firstBlock >= endBlock) {
+        // It's within one block, or straddles two without covering either
+        range.firstBlock = endBlock;
+        range.partBounds.emplace_back(first, last);
+    } else {
+        range.wholeBlocks = endBlock - range.firstBlock;
+        if (first < range.firstBlock * mBlockSize) {
+            range.partBounds.emplace_back(first, range.firstBlock * mBlockSize);
+        }
+        if (endBlock * mBlockSize < last) {
+            range.partBounds.emplace_back(endBlock * mBlockSize, last);
+        }
+    }
+    std::vector<double> segmentWeights{};
+    for (std::size_t block{range.firstBlock}; block < range.firstBlock + range.wholeBlocks; ++block) {
+        segmentWeights.push_back(mBlocks[block].total());
+    }
+    for (auto [start, end] : range.partBounds) {
+        range.parts.emplace_back().build(mWeights.data() + start, end - start);
+        segmentWeights.push_back(range.parts.back().total());
+    }
+    range.segments.build(segmentWeights.data(), segmentWeights.size());
+    return range;
+}
+
+std::size_t WeightedSampler::sample(std::size_t first, std::size_t last, std::mt19937& engine) {
+    const RangeTable& range{rangeTable(first, last)};
+    std::size_t segment{range.segments.sample(engine)};
+    if (segment < range.wholeBlocks) {
+        std::size_t block{range.firstBlock + segment};
+        return block * mBlockSize + mBlocks[block].sample(engine);
+    }
+    std::size_t part{segment - range.wholeBlocks};
+    return range.partBounds[part].first + range.parts[part].sample(engine);
+}
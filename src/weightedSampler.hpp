@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <utility>
+#include <vector>
+
+// Picks indices with probability proportional to their weights in constant time, using Walker's alias
+// method. The indices are split into blocks of about sqrt(n), each with its own table, so changing a weight
+// only rebuilds its block, and drawing from a range only needs a table over the blocks in that range. Those
+// are kept for the ranges used most recently.
+class WeightedSampler {
+public:
+    void assign(std::vector<double> weights);
+    void setWeight(std::size_t index, double weight);
+    std::size_t size() const { return mWeights.size(); }
+    // An index in [first, last), which mustn't be empty
+    std::size_t sample(std::size_t first, std::size_t last, std::mt19937& engine);
+
+private:
+    class AliasTable {
+    public:
+        void build(const double* weights, std::size_t count);
+        std::size_t sample(std::mt19937& engine) const;
+        double total() const { return mTotal; }
+
+    private:
+        std::vector<float> mProbability{};
+        std::vector<std::uint32_t> mAlias{};
+        double mTotal{0};
+    };
+
+    // Chooses between the whole blocks in the range and the parts of blocks at either end
+    struct RangeTable {
+        std::size_t first{};
+        std::size_t last{};
+        std::size_t firstBlock{};
+        std::size_t wholeBlocks{};
+        std::vector<std::pair<std::size_t, std::size_t>> partBounds{};
+        std::vector<AliasTable> parts{};
+        AliasTable segments{};
+    };
+
+    const RangeTable& rangeTable(std::size_t first, std::size_t last);
+
+    std::vector<double> mWeights{};
+    std::size_t mBlockSize{1};
+    std::vector<AliasTable> mBlocks{};
+    std::vector<RangeTable> mRanges{}; // most recently used last
+};
@@ -0,0 +1,90 @@
+#!/bin/sh
+# Plays a playlist of generated silent tracks through the null audio output, stopping every half second of
+# its virtual clock to check that the clock is exactly where the waits put it and that the playlist moved
+# on to the right song at each transition.
+# Usage: tests/null-audio.sh [path to cleo], run by `make check`
+set -eu
+
+cleo=$(realpath "${1:-./cleo}")
+lengths="1 2 3" # seconds, different so each song can be told apart by when it plays
+rate=8000
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+mkdir -p "$work/Music" "$work/.config/cleo" "$work/.cache/cleo"
+touch "$work/.cache/cleo/no-wizard"
+
+# Little endian integers for the WAV header
+le16() { printf "$(printf '\\%03o\\%03o' $(($1 & 255)) $(($1 >> 8 & 255)))"; }
+le32() { le16 $(($1 & 65535)); le16 $(($1 >> 16 & 65535)); }
+
+# Mono 16 bit PCM of silence
+silence() {
+    bytes=$(($2 * rate * 2))
+    {
+        printf 'RIFF'; le32 $((36 + bytes)); printf 'WAVEfmt '
+        le32 16; le16 1; le16 1; le32 $rate; le32 $((rate * 2)); le16 2; le16 16
+        printf 'data'; le32 $bytes
+        head -c $bytes /dev/zero
+    } > "$1"
+}
+
+songs=""
+count=0
+for length in $lengths; do
+    count=$((count + 1))
+    silence "$work/Music/track$count.wav" "$length"
+    songs="$songs track$count"
+done
+
+# Starting a quarter of a second in keeps every stop clear of a transition, where the song could be either
+set -- -c "playlist add$songs" -c "playlist play" -c "wait 0.25" -c "buffer" -c "playlist status"
+steps=1
+total=0
+for length in $lengths; do
+    total=$((total + length))
+done
+while [ $((steps * 500 + 250)) -lt $((total * 1000)) ]; do
+    set -- "$@" -c "wait 0.5" -c "buffer" -c "playlist status"
+    steps=$((steps + 1))
+done
+set -- "$@" -c "wait" -c "buffer" -c "time"
+
+output=$(HOME="$work" "$cleo" --null-audio --batch "$@" 2>&1)
+
+expected=""
+step=0
+while [ $step -lt $steps ]; do
+    ms=$((step * 500 + 250))
+    end=0
+    n=0
+    for length in $lengths; do
+        n=$((n + 1))
+        end=$((end + length * 1000))
+        if [ $ms -lt $end ]; then
+            break
+        fi
+    done
+    expected="$expected$(printf '0:%02d.%03d track%d' $((ms / 1000)) $((ms % 1000)) $n)
+"
+    step=$((step + 1))
+done
+expected="${expected}$(printf '0:%02d.000 -' $total)"
+
+actual=$(printf '%s\n' "$output" | awk '
+    /its clock is at/ { clock = $NF; sub(/\.$/, "", clock) }
+    /^Currently playing/ { print clock, $3; clock = "" }
+    /^Nothing playing/ { print clock, "-" }
+')
+
+if [ "$actual" != "$expected" ]; then
+    echo "null audio: clock or song transitions are off"
+    echo "expected:"
+    echo "$expected"
+    echo "got:"
+    echo "$actual"
+    echo "full output:"
+    echo "$output"
+    exit 1
+fi
+echo "null audio: $steps stops across $count songs, all on time"